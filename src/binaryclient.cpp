@@ -0,0 +1,318 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "binaryclient.h"
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cstring>
+#include <cstdio>
+
+BinaryClient::BinaryClient() : fd_m(-1), tag_m(0), inStart_m(0)
+{}
+
+BinaryClient::~BinaryClient()
+{
+    disconnect();
+}
+
+void BinaryClient::disconnect()
+{
+    if (fd_m != -1)
+        close(fd_m);
+    fd_m = -1;
+    inbuf_m.clear();
+    inStart_m = 0;
+    changes_m.clear();
+}
+
+bool BinaryClient::fail(const std::string& error)
+{
+    error_m = error;
+    return false;
+}
+
+bool BinaryClient::connectFd(int fd, const struct sockaddr* addr, int len)
+{
+    disconnect();
+    if (fd == -1)
+        return fail(std::string("Unable to create socket: ") + strerror(errno));
+    if (connect(fd, addr, len) == -1)
+    {
+        error_m = std::string("Unable to connect: ") + strerror(errno);
+        close(fd);
+        return false;
+    }
+    fd_m = fd;
+    return true;
+}
+
+bool BinaryClient::connectUnix(const std::string& path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    if (path.size() >= sizeof(addr.sun_path))
+        return fail("Socket path is too long");
+    strcpy(addr.sun_path, path.c_str());
+    return connectFd(socket(AF_LOCAL, SOCK_STREAM, 0), (struct sockaddr*)&addr, sizeof(addr));
+}
+
+bool BinaryClient::connectInet(const std::string& host, int port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host.c_str(), service, &hints, &res) != 0)
+        return fail("Unable to resolve host " + host);
+    bool ret = connectFd(socket(res->ai_family, res->ai_socktype, res->ai_protocol), res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (ret)
+    {
+        // Requests are small and wait for their reply
+        int nodelay = 1;
+        setsockopt(fd_m, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    return ret;
+}
+
+bool BinaryClient::readFrame(std::string& frame, int timeoutMs)
+{
+    char buf[4096];
+    while (true)
+    {
+        int ret = BinaryReader::extractFrame(inbuf_m, &inStart_m, frame);
+        if (ret == 1)
+        {
+            if (inStart_m == inbuf_m.size())
+            {
+                inbuf_m.clear();
+                inStart_m = 0;
+            }
+            return true;
+        }
+        if (ret == -1)
+        {
+            disconnect();
+            return fail("Invalid frame received");
+        }
+        if (timeoutMs >= 0)
+        {
+            struct pollfd pfd;
+            pfd.fd = fd_m;
+            pfd.events = POLLIN;
+            int ready = poll(&pfd, 1, timeoutMs);
+            if (ready == 0)
+                return fail("Timeout");
+            if (ready == -1 && errno != EINTR)
+                return fail(std::string("Poll error: ") + strerror(errno));
+            if (ready == -1)
+                continue;
+        }
+        ssize_t len = ::read(fd_m, buf, sizeof(buf));
+        if (len > 0)
+        {
+            if (inStart_m > 0)
+            {
+                inbuf_m.erase(0, inStart_m);
+                inStart_m = 0;
+            }
+            inbuf_m.append(buf, len);
+        }
+        else if (len == -1 && errno == EINTR)
+            continue;
+        else
+        {
+            disconnect();
+            return fail(len == 0 ? "Connection closed by server" : std::string("Read error: ") + strerror(errno));
+        }
+    }
+}
+
+bool BinaryClient::queueChange(BinaryReader& reader)
+{
+    Change change;
+    change.handle = reader.getInt(4);
+    change.value = reader.getValue();
+    if (reader.hasError())
+        return fail("Malformed change notification");
+    changes_m.push_back(change);
+    return true;
+}
+
+bool BinaryClient::request(uint8_t opcode, const std::string& payload, std::string& reply)
+{
+    if (fd_m == -1)
+        return fail("Not connected");
+    // Tag 0 is used by the change notifications
+    if (++tag_m == 0)
+        tag_m = 1;
+    std::string out;
+    BinaryWriter writer(out);
+    writer.beginFrame(opcode, tag_m);
+    out.append(payload);
+    writer.endFrame();
+
+    std::string::size_type pos = 0;
+    while (pos < out.size())
+    {
+        ssize_t len = send(fd_m, out.data() + pos, out.size() - pos, MSG_NOSIGNAL);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+        {
+            std::string error = std::string("Write error: ") + strerror(errno);
+            disconnect();
+            return fail(error);
+        }
+        pos += len;
+    }
+
+    std::string frame;
+    while (readFrame(frame, -1))
+    {
+        BinaryReader reader(frame.data(), frame.size());
+        uint8_t replyOpcode = reader.getInt(1);
+        uint32_t tag = reader.getInt(4);
+        if (replyOpcode == BinaryProtocol::Change)
+        {
+            if (!queueChange(reader))
+                return false;
+            continue;
+        }
+        if (tag != tag_m)
+            return fail("Unexpected reply");
+        if (replyOpcode == BinaryProtocol::Error)
+            return fail(reader.getString());
+        if (replyOpcode != (opcode | BinaryProtocol::Reply))
+            return fail("Unexpected reply");
+        reply.assign(frame, BinaryProtocol::HeaderSize, std::string::npos);
+        return true;
+    }
+    return false;
+}
+
+bool BinaryClient::resolve(const std::vector<std::string>& ids, std::vector<uint32_t>& handles,
+                           std::vector<BinaryValue::Type>* types)
+{
+    std::string payload, reply;
+    BinaryWriter writer(payload);
+    writer.putInt(ids.size(), 2);
+    for (std::vector<std::string>::const_iterator it = ids.begin(); it != ids.end(); it++)
+        writer.putString(*it);
+    if (!request(BinaryProtocol::Resolve, payload, reply))
+        return false;
+
+    BinaryReader reader(reply.data(), reply.size());
+    int count = reader.getInt(2);
+    handles.clear();
+    if (types)
+        types->clear();
+    for (int i = 0; i < count; i++)
+    {
+        handles.push_back(reader.getInt(4));
+        BinaryValue::Type type = (BinaryValue::Type)reader.getInt(1);
+        if (types)
+            types->push_back(type);
+    }
+    if (reader.hasError() || count != (int)ids.size())
+        return fail("Malformed reply");
+    return true;
+}
+
+bool BinaryClient::sendHandles(uint8_t opcode, const std::vector<uint32_t>& handles, std::string& reply)
+{
+    std::string payload;
+    BinaryWriter writer(payload);
+    writer.putInt(handles.size(), 2);
+    for (std::vector<uint32_t>::const_iterator it = handles.begin(); it != handles.end(); it++)
+        writer.putInt(*it, 4);
+    return request(opcode, payload, reply);
+}
+
+bool BinaryClient::read(const std::vector<uint32_t>& handles, std::vector<BinaryValue>& values)
+{
+    std::string reply;
+    if (!sendHandles(BinaryProtocol::Read, handles, reply))
+        return false;
+    BinaryReader reader(reply.data(), reply.size());
+    int count = reader.getInt(2);
+    values.clear();
+    for (int i = 0; i < count; i++)
+        values.push_back(reader.getValue());
+    if (reader.hasError() || count != (int)handles.size())
+        return fail("Malformed reply");
+    return true;
+}
+
+bool BinaryClient::write(const std::vector<uint32_t>& handles, const std::vector<BinaryValue>& values)
+{
+    if (handles.size() != values.size())
+        return fail("Handle and value counts differ");
+    std::string payload, reply;
+    BinaryWriter writer(payload);
+    writer.putInt(handles.size(), 2);
+    for (unsigned i = 0; i < handles.size(); i++)
+    {
+        writer.putInt(handles[i], 4);
+        writer.putValue(values[i]);
+    }
+    return request(BinaryProtocol::Write, payload, reply);
+}
+
+bool BinaryClient::subscribe(const std::vector<uint32_t>& handles)
+{
+    std::string reply;
+    return sendHandles(BinaryProtocol::Subscribe, handles, reply);
+}
+
+bool BinaryClient::unsubscribe(const std::vector<uint32_t>& handles)
+{
+    std::string reply;
+    return sendHandles(BinaryProtocol::Unsubscribe, handles, reply);
+}
+
+bool BinaryClient::waitChange(Change* change, int timeoutMs)
+{
+    if (changes_m.empty())
+    {
+        if (fd_m == -1)
+            return fail("Not connected");
+        std::string frame;
+        if (!readFrame(frame, timeoutMs))
+            return false;
+        BinaryReader reader(frame.data(), frame.size());
+        if (reader.getInt(1) != BinaryProtocol::Change)
+            return fail("Unexpected reply");
+        reader.getInt(4);
+        if (!queueChange(reader))
+            return false;
+    }
+    *change = changes_m.front();
+    changes_m.pop_front();
+    return true;
+}
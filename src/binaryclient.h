@@ -0,0 +1,85 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef BINARYCLIENT_H
+#define BINARYCLIENT_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "binaryprotocol.h"
+
+/** Client library for the binary protocol of linknx. It uses blocking
+ * sockets and does not depend on pth, so that other programs can link it
+ * (liblinknxclient.a).
+ *
+ * Every request waits for its reply. Changes of subscribed objects that
+ * arrive meanwhile are kept until waitChange returns them. The methods
+ * return false on error, getError then tells why. */
+class BinaryClient
+{
+public:
+    struct Change
+    {
+        uint32_t handle;
+        BinaryValue value;
+    };
+
+    BinaryClient();
+    ~BinaryClient();
+
+    bool connectUnix(const std::string& path);
+    bool connectInet(const std::string& host, int port);
+    void disconnect();
+    bool isConnected() { return fd_m != -1; };
+
+    /** Gets the handles of the objects ids, 0 for an unknown id, and the
+     * type of their values if types is not null */
+    bool resolve(const std::vector<std::string>& ids, std::vector<uint32_t>& handles,
+                 std::vector<BinaryValue::Type>* types = 0);
+    bool read(const std::vector<uint32_t>& handles, std::vector<BinaryValue>& values);
+    bool write(const std::vector<uint32_t>& handles, const std::vector<BinaryValue>& values);
+    bool subscribe(const std::vector<uint32_t>& handles);
+    bool unsubscribe(const std::vector<uint32_t>& handles);
+
+    /** Waits at most timeoutMs for a change of a subscribed object.
+     * Returns false on timeout or error. */
+    bool waitChange(Change* change, int timeoutMs);
+
+    const std::string& getError() { return error_m; };
+private:
+    int fd_m;
+    uint32_t tag_m;
+    std::string inbuf_m;
+    std::string::size_type inStart_m;
+    std::deque<Change> changes_m;
+    std::string error_m;
+
+    bool connectFd(int fd, const struct sockaddr* addr, int len);
+    /** Sends the request and returns the payload of its reply */
+    bool request(uint8_t opcode, const std::string& payload, std::string& reply);
+    bool sendHandles(uint8_t opcode, const std::vector<uint32_t>& handles, std::string& reply);
+    /** Reads the next frame, waiting at most timeoutMs if not negative */
+    bool readFrame(std::string& frame, int timeoutMs);
+    /** Keeps a Change frame for waitChange */
+    bool queueChange(BinaryReader& reader);
+    bool fail(const std::string& error);
+};
+
+#endif
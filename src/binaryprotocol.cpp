@@ -0,0 +1,209 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "binaryprotocol.h"
+#include <cstring>
+
+BinaryValue BinaryValue::fromBool(bool value)
+{
+    BinaryValue val;
+    val.type = Bool;
+    val.boolValue = value;
+    return val;
+}
+
+BinaryValue BinaryValue::fromInt(int64_t value)
+{
+    BinaryValue val;
+    val.type = Int;
+    val.intValue = value;
+    return val;
+}
+
+BinaryValue BinaryValue::fromFloat(double value)
+{
+    BinaryValue val;
+    val.type = Float;
+    val.floatValue = value;
+    return val;
+}
+
+BinaryValue BinaryValue::fromString(const std::string& value)
+{
+    BinaryValue val;
+    val.stringValue = value;
+    return val;
+}
+
+bool BinaryValue::operator==(const BinaryValue& value) const
+{
+    if (type != value.type)
+        return false;
+    switch (type)
+    {
+    case Bool:
+        return boolValue == value.boolValue;
+    case Int:
+        return intValue == value.intValue;
+    case Float:
+        return floatValue == value.floatValue;
+    default:
+        return stringValue == value.stringValue;
+    }
+}
+
+void BinaryWriter::beginFrame(uint8_t opcode, uint32_t tag)
+{
+    frameStart_m = out_m.size();
+    putInt(0, 4);
+    putInt(opcode, 1);
+    putInt(tag, 4);
+}
+
+void BinaryWriter::endFrame()
+{
+    uint32_t len = out_m.size() - frameStart_m - 4;
+    for (int i = 0; i < 4; i++)
+        out_m[frameStart_m + i] = (char)((len >> (i * 8)) & 0xff);
+    frameStart_m = std::string::npos;
+}
+
+void BinaryWriter::putInt(uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++)
+        out_m.push_back((char)((value >> (i * 8)) & 0xff));
+}
+
+void BinaryWriter::putDouble(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putInt(bits, 8);
+}
+
+void BinaryWriter::putString(const std::string& value)
+{
+    std::string::size_type len = value.size();
+    if (len > BinaryProtocol::MaxStringSize)
+        len = BinaryProtocol::MaxStringSize;
+    putInt(len, 2);
+    out_m.append(value, 0, len);
+}
+
+void BinaryWriter::putValue(const BinaryValue& value)
+{
+    putInt(value.type, 1);
+    switch (value.type)
+    {
+    case BinaryValue::Bool:
+        putInt(value.boolValue ? 1 : 0, 1);
+        break;
+    case BinaryValue::Int:
+        putInt(value.intValue, 8);
+        break;
+    case BinaryValue::Float:
+        putDouble(value.floatValue);
+        break;
+    default:
+        putString(value.stringValue);
+        break;
+    }
+}
+
+int BinaryReader::extractFrame(const std::string& buf, std::string::size_type* start, std::string& frame)
+{
+    if (buf.size() - *start < 4)
+        return 0;
+    uint32_t len = 0;
+    for (int i = 0; i < 4; i++)
+        len |= (uint32_t)(unsigned char)buf[*start + i] << (i * 8);
+    if (len < BinaryProtocol::HeaderSize || len > BinaryProtocol::MaxFrameSize)
+        return -1;
+    if (buf.size() - *start - 4 < len)
+        return 0;
+    frame.assign(buf, *start + 4, len);
+    *start += 4 + len;
+    return 1;
+}
+
+bool BinaryReader::check(std::string::size_type size)
+{
+    if (error_m || (std::string::size_type)(end_m - pos_m) < size)
+    {
+        error_m = true;
+        return false;
+    }
+    return true;
+}
+
+uint64_t BinaryReader::getInt(int size)
+{
+    if (!check(size))
+        return 0;
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++)
+        value |= (uint64_t)(unsigned char)pos_m[i] << (i * 8);
+    pos_m += size;
+    return value;
+}
+
+double BinaryReader::getDouble()
+{
+    uint64_t bits = getInt(8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+std::string BinaryReader::getString()
+{
+    std::string::size_type len = getInt(2);
+    if (!check(len))
+        return "";
+    std::string value(pos_m, len);
+    pos_m += len;
+    return value;
+}
+
+BinaryValue BinaryReader::getValue()
+{
+    BinaryValue value;
+    switch (getInt(1))
+    {
+    case BinaryValue::String:
+        value.stringValue = getString();
+        break;
+    case BinaryValue::Bool:
+        value.type = BinaryValue::Bool;
+        value.boolValue = getInt(1) != 0;
+        break;
+    case BinaryValue::Int:
+        value.type = BinaryValue::Int;
+        value.intValue = (int64_t)getInt(8);
+        break;
+    case BinaryValue::Float:
+        value.type = BinaryValue::Float;
+        value.floatValue = getDouble();
+        break;
+    default:
+        error_m = true;
+        break;
+    }
+    return value;
+}
@@ -0,0 +1,146 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef BINARYPROTOCOL_H
+#define BINARYPROTOCOL_H
+
+#include <stdint.h>
+#include <string>
+
+/** Wire format of the binary client protocol, shared by the server and
+ * the client library. It does not depend on the rest of linknx.
+ *
+ * Every frame is a 4 bytes length (of what follows it), a 1 byte opcode
+ * and a 4 bytes tag, followed by the payload. Integers are little-endian.
+ * The server echoes the tag of a request in its reply, whose opcode is the
+ * request opcode with the Reply bit set, or Error with a message. Changes
+ * of subscribed objects are pushed with the Change opcode and tag 0.
+ *
+ * Objects are addressed by the handles that Resolve returns for their
+ * ids. Handles are valid for the lifetime of the connection.
+ *
+ *   Resolve      u16 count, count x string id  ->  u16 count, count x (u32 handle, u8 type)
+ *                an unknown id gets handle 0
+ *   Read         u16 count, count x u32 handle ->  u16 count, count x value
+ *   Write        u16 count, count x (u32 handle, value)  ->  empty
+ *   Subscribe    u16 count, count x u32 handle ->  empty
+ *   Unsubscribe  u16 count, count x u32 handle ->  empty
+ *   Change       u32 handle, value (pushed by the server)
+ *   Error        string message
+ *
+ * A string is a u16 length and the bytes, a value is a u8 type and its
+ * data: u8 for Bool, i64 for Int, IEEE 754 double for Float and a string
+ * for String. */
+class BinaryProtocol
+{
+public:
+    enum Opcode
+    {
+        Resolve = 0x01,
+        Read = 0x02,
+        Write = 0x03,
+        Subscribe = 0x04,
+        Unsubscribe = 0x05,
+        Reply = 0x80,
+        Change = 0x90,
+        Error = 0xFF
+    };
+
+    /** Bytes after the length field, before the payload */
+    static const uint32_t HeaderSize = 5;
+    static const uint32_t MaxFrameSize = 1048576;
+    static const uint32_t MaxStringSize = 65535;
+};
+
+/** Typed value of an object. Objects that are not switches, integers or
+ * floats are carried as strings. */
+struct BinaryValue
+{
+    enum Type
+    {
+        String = 0,
+        Bool = 1,
+        Int = 2,
+        Float = 3
+    };
+
+    BinaryValue() : type(String), boolValue(false), intValue(0), floatValue(0) {};
+    static BinaryValue fromBool(bool value);
+    static BinaryValue fromInt(int64_t value);
+    static BinaryValue fromFloat(double value);
+    static BinaryValue fromString(const std::string& value);
+
+    bool operator==(const BinaryValue& value) const;
+
+    Type type;
+    bool boolValue;
+    int64_t intValue;
+    double floatValue;
+    std::string stringValue;
+};
+
+/** Appends frames to a buffer */
+class BinaryWriter
+{
+public:
+    BinaryWriter(std::string& out) : out_m(out), frameStart_m(std::string::npos) {};
+
+    /** Starts a frame, endFrame fills in its length */
+    void beginFrame(uint8_t opcode, uint32_t tag);
+    void endFrame();
+
+    void putInt(uint64_t value, int size);
+    void putDouble(double value);
+    /** Strings longer than MaxStringSize are truncated */
+    void putString(const std::string& value);
+    void putValue(const BinaryValue& value);
+private:
+    std::string& out_m;
+    std::string::size_type frameStart_m;
+};
+
+/** Decodes the payload of a frame. Reading past its end sets the error
+ * flag and returns zero values instead of throwing, so that a request is
+ * checked once it is entirely decoded. */
+class BinaryReader
+{
+public:
+    BinaryReader(const char* data, std::string::size_type size) : pos_m(data), end_m(data + size), error_m(false) {};
+
+    /** Extracts the next frame from buf at *start, advancing it. Returns 1
+     * and the frame without its length in frame, 0 if the frame is not
+     * complete and -1 if its length is invalid. */
+    static int extractFrame(const std::string& buf, std::string::size_type* start, std::string& frame);
+
+    uint64_t getInt(int size);
+    double getDouble();
+    std::string getString();
+    BinaryValue getValue();
+
+    bool atEnd() { return pos_m == end_m; };
+    bool hasError() { return error_m; };
+private:
+    const char* pos_m;
+    const char* end_m;
+    bool error_m;
+
+    bool check(std::string::size_type size);
+};
+
+#endif
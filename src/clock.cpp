@@ -0,0 +1,128 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "clock.h"
+#include <sys/time.h>
+
+Clock* Clock::instance_m;
+Logger& VirtualClock::logger_m(Logger::getInstance("VirtualClock"));
+
+Clock* Clock::instance()
+{
+    if (instance_m == 0)
+        instance_m = new WallClock();
+    return instance_m;
+}
+
+void Clock::set(Clock* clock)
+{
+    if (instance_m)
+        delete instance_m;
+    instance_m = clock;
+}
+
+Clock::~Clock()
+{}
+
+int64_t WallClock::getTimeMs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void WallClock::wait(int64_t delayMs, pth_event_t ev)
+{
+    struct timeval tv;
+    tv.tv_sec = delayMs / 1000;
+    tv.tv_usec = (delayMs % 1000) * 1000;
+    pth_select_ev(0, NULL, NULL, NULL, &tv, ev);
+}
+
+VirtualClock::VirtualClock(int64_t startMs) : now_m(startMs), waking_m(0)
+{}
+
+VirtualClock::~VirtualClock()
+{
+    if (!waiters_m.empty())
+        logger_m.errorStream() << waiters_m.size() << " threads still waiting on the virtual clock" << endlog;
+}
+
+void VirtualClock::wait(int64_t delayMs, pth_event_t ev)
+{
+    if (delayMs <= 0)
+    {
+        pth_yield(NULL);
+        return;
+    }
+    Waiter waiter;
+    pth_sem_init(&waiter.wake);
+    WaiterMap_t::iterator it = waiters_m.insert(WaiterMap_t::value_type(now_m + delayMs, &waiter));
+    pth_event_t wake = pth_event(PTH_EVENT_SEM, &waiter.wake);
+    if (ev)
+        pth_event_concat(wake, ev, NULL);
+    pth_wait(wake);
+    if (ev)
+        pth_event_isolate(wake);
+    pth_event_free(wake, PTH_FREE_THIS);
+
+    unsigned int woken;
+    pth_sem_get_value(&waiter.wake, &woken);
+    if (woken)
+        waking_m--;
+    else
+        waiters_m.erase(it);
+}
+
+void VirtualClock::advance(int64_t ms)
+{
+    advanceTo(now_m + ms);
+}
+
+void VirtualClock::advanceTo(int64_t timeMs)
+{
+    settle();
+    while (!waiters_m.empty() && waiters_m.begin()->first <= timeMs)
+    {
+        if (waiters_m.begin()->first > now_m)
+            now_m = waiters_m.begin()->first;
+        // Wakes all the waiters of this deadline, new ones may be added
+        // meanwhile by the threads woken
+        while (!waiters_m.empty() && waiters_m.begin()->first <= now_m)
+        {
+            pth_sem_inc(&waiters_m.begin()->second->wake, FALSE);
+            waiters_m.erase(waiters_m.begin());
+            waking_m++;
+        }
+        settle();
+    }
+    if (timeMs > now_m)
+        now_m = timeMs;
+}
+
+void VirtualClock::settle()
+{
+    for (int i = 0; i < MaxSettleYields; i++)
+    {
+        if (waking_m == 0 && pth_ctrl(PTH_CTRL_GETTHREADS_NEW | PTH_CTRL_GETTHREADS_READY) == 0)
+            return;
+        pth_yield(NULL);
+    }
+    logger_m.warnStream() << "Threads still running after " << MaxSettleYields << " yields" << endlog;
+}
@@ -0,0 +1,103 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <map>
+#include <ctime>
+#include <stdint.h>
+#include <pthsem.h>
+#include "logger.h"
+
+/** Time source of the timers, rules and logs. The wall clock is used by
+ * default. A VirtualClock can replace it to run days of schedules in a few
+ * seconds, e.g. in simulations. */
+class Clock
+{
+public:
+    static Clock* instance();
+    /** Replaces the current clock, which is deleted. Takes ownership of
+     * clock, 0 restores the wall clock. Must be called before any thread
+     * starts waiting on the clock. */
+    static void set(Clock* clock);
+    static void reset() { set(0); };
+
+    virtual ~Clock();
+
+    /** Current time in milliseconds since the epoch */
+    virtual int64_t getTimeMs() = 0;
+    /** Waits delayMs milliseconds of this clock, or until ev occurs if ev
+     * is not 0. The caller checks the status of its events. */
+    virtual void wait(int64_t delayMs, pth_event_t ev) = 0;
+
+    static time_t now() { return instance()->getTimeMs() / 1000; };
+    static int64_t nowMs() { return instance()->getTimeMs(); };
+    static void sleep(int64_t delayMs, pth_event_t ev) { instance()->wait(delayMs, ev); };
+
+private:
+    static Clock* instance_m;
+};
+
+class WallClock : public Clock
+{
+public:
+    virtual int64_t getTimeMs();
+    virtual void wait(int64_t delayMs, pth_event_t ev);
+};
+
+/** Clock only moving forward when advance() is called. The threads waiting
+ * on it are woken in deadline order, each deadline being reached in turn,
+ * and are given the chance to run before the clock moves on. */
+class VirtualClock : public Clock
+{
+public:
+    VirtualClock(int64_t startMs);
+    virtual ~VirtualClock();
+
+    virtual int64_t getTimeMs() { return now_m; };
+    virtual void wait(int64_t delayMs, pth_event_t ev);
+
+    /** Moves the clock forward by ms, stopping at every wait deadline on
+     * the way. Returns once the woken threads are waiting again. */
+    void advance(int64_t ms);
+    /** Moves the clock forward to timeMs (never backward) */
+    void advanceTo(int64_t timeMs);
+    /** Lets the ready threads run until they all wait again */
+    void settle();
+
+    int getWaitingCount() { return waiters_m.size(); };
+
+    /** Bound on the yields of settle(), for threads that never wait */
+    static const int MaxSettleYields = 10000;
+
+private:
+    struct Waiter
+    {
+        pth_sem_t wake;
+    };
+    typedef std::multimap<int64_t, Waiter*> WaiterMap_t;
+
+    int64_t now_m;
+    WaiterMap_t waiters_m;
+    int waking_m;
+    static Logger& logger_m;
+};
+
+#endif
@@ -21,6 +21,16 @@
 #define COLLECTIONS_H
 
 #include <list>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if __cplusplus >= 201103L
+#include <unordered_map>
+#define HASHMAP_BASE std::unordered_map
+#else
+#include <tr1/unordered_map>
+#define HASHMAP_BASE std::tr1::unordered_map
+#endif
 
 template <class T, bool owns=true> class List : public std::list<T>
 {
@@ -44,4 +54,23 @@ template <class T, bool owns> class List<T*, owns> : public std::list<T*>
 		}
 };
 
+// Hashed map used for the ID indexes (objects, rules). Iteration order is
+// unspecified, use getSortedValues() where a stable order is needed.
+template <class K, class V> class HashMap : public HASHMAP_BASE<K, V>
+{
+	public:
+		void getSortedValues(std::vector<V>& values) const
+		{
+			std::vector<K> keys;
+			keys.reserve(this->size());
+			for (typename HASHMAP_BASE<K, V>::const_iterator it = this->begin(); it != this->end(); ++it)
+				keys.push_back(it->first);
+			std::sort(keys.begin(), keys.end());
+			values.clear();
+			values.reserve(keys.size());
+			for (typename std::vector<K>::iterator it = keys.begin(); it != keys.end(); ++it)
+				values.push_back(this->find(*it)->second);
+		}
+};
+
 #endif
@@ -0,0 +1,330 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "configcache.h"
+#include "objectcontroller.h"
+#include "ruleserver.h"
+#include "services.h"
+#include "logger.h"
+#include "offloadpool.h"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+ConfigCache* ConfigCache::instance_m;
+
+ConfigCache* ConfigCache::instance()
+{
+    if (instance_m == 0)
+        instance_m = new ConfigCache();
+    return instance_m;
+}
+
+ConfigCache::ConfigCache()
+{
+    for (int i = 0; i < SectionCount; i++)
+        valid_m[i] = false;
+}
+
+const char* ConfigCache::getName(Section section)
+{
+    static const char* names[SectionCount] = { "objects", "rules", "services", "logging" };
+    return names[section];
+}
+
+bool ConfigCache::getSection(const std::string& name, Section* section)
+{
+    for (int i = 0; i < SectionCount; i++)
+    {
+        if (name == getName((Section)i))
+        {
+            *section = (Section)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const std::string& ConfigCache::get(Section section)
+{
+    if (!valid_m[section])
+    {
+        ticpp::Document doc;
+        ticpp::Element pSection(getName(section));
+        switch (section)
+        {
+        case ObjectsSection:
+            ObjectController::instance()->exportXml(&pSection);
+            break;
+        case RulesSection:
+            RuleServer::instance()->exportXml(&pSection);
+            break;
+        case ServicesSection:
+            Services::instance()->exportXml(&pSection);
+            break;
+        default:
+            Logging::instance()->exportXml(&pSection);
+            break;
+        }
+        doc.LinkEndChild(&pSection);
+        text_m[section] = doc.GetAsString();
+        valid_m[section] = true;
+    }
+    return text_m[section];
+}
+
+void ConfigCache::append(std::string& out, Section section, int depth)
+{
+    static const std::string cdataStart("<![CDATA["), cdataEnd("]]>");
+    const std::string& text = get(section);
+    std::string::size_type pos = 0;
+    std::string::size_type cdata = text.find(cdataStart);
+    bool indent = true;
+    while (pos < text.size())
+    {
+        if (indent)
+            out.append(depth, '\t');
+        indent = true;
+        std::string::size_type eol = text.find('\n', pos);
+        // Skip the line breaks inside CDATA sections. TinyXML does not
+        // indent the end tag that follows a CDATA section either.
+        while (cdata != std::string::npos && cdata < eol)
+        {
+            indent = false;
+            std::string::size_type end = text.find(cdataEnd, cdata);
+            if (end == std::string::npos)
+                end = text.size();
+            eol = text.find('\n', end);
+            cdata = text.find(cdataStart, end);
+        }
+        if (eol == std::string::npos)
+            eol = text.size() - 1;
+        out.append(text, pos, eol + 1 - pos);
+        pos = eol + 1;
+    }
+}
+
+namespace
+{
+    // Writes the file in a native thread, see OffloadTask::run
+    class ConfigWrite : public OffloadTask
+    {
+    public:
+        ConfigWrite(const std::string& filename, const std::string& text)
+            : filename_m(filename), text_m(text), errno_m(0), step_m(0) {};
+
+        virtual void run()
+        {
+            std::string tmpPath = filename_m + ".tmp";
+            // Keep the permissions of the previous file
+            mode_t mode = 0644;
+            struct stat st;
+            if (stat(filename_m.c_str(), &st) == 0)
+                mode = st.st_mode & 07777;
+            step_m = "open";
+            int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+            if (fd == -1)
+            {
+                errno_m = errno;
+                return;
+            }
+            step_m = "write";
+            std::string::size_type pos = 0;
+            while (pos < text_m.size())
+            {
+                ssize_t len = write(fd, text_m.data() + pos, text_m.size() - pos);
+                if (len == -1 && errno == EINTR)
+                    continue;
+                if (len <= 0)
+                    break;
+                pos += len;
+            }
+            bool ok = (pos == text_m.size());
+            if (ok)
+                step_m = "sync";
+            ok = ok && fsync(fd) == 0;
+            if (!ok)
+                errno_m = errno;
+            if (close(fd) != 0 && ok)
+            {
+                errno_m = errno;
+                ok = false;
+            }
+            if (ok)
+            {
+                step_m = "rename";
+                if (rename(tmpPath.c_str(), filename_m.c_str()) != 0)
+                {
+                    errno_m = errno;
+                    ok = false;
+                }
+            }
+            if (!ok)
+            {
+                unlink(tmpPath.c_str());
+                return;
+            }
+            step_m = 0;
+            // Make the rename durable too
+            std::string::size_type slash = filename_m.rfind('/');
+            std::string dir = (slash == std::string::npos) ? "." : filename_m.substr(0, slash + 1);
+            int dirFd = open(dir.c_str(), O_RDONLY);
+            if (dirFd != -1)
+            {
+                fsync(dirFd);
+                close(dirFd);
+            }
+        }
+
+        virtual void finish()
+        {
+            std::string error;
+            if (step_m)
+            {
+                error = std::string("Unable to ") + step_m + " " + filename_m + ".tmp: " + strerror(errno_m);
+                logger_m.errorStream() << error << endlog;
+            }
+            else
+                logger_m.infoStream() << "Saved config to " << filename_m << endlog;
+            ConfigSaver::instance()->onWritten(filename_m, error);
+        }
+
+    private:
+        std::string filename_m;
+        std::string text_m;
+        int errno_m;
+        // Failed step, null on success
+        const char* step_m;
+
+        static Logger& logger_m;
+    };
+}
+
+Logger& ConfigWrite::logger_m(Logger::getInstance("ConfigSaver"));
+
+ConfigSaver* ConfigSaver::instance_m;
+
+ConfigSaver* ConfigSaver::instance()
+{
+    if (instance_m == 0)
+        instance_m = new ConfigSaver();
+    return instance_m;
+}
+
+std::string ConfigSaver::snapshot()
+{
+    // Same layout as a document printed by TinyXML
+    ConfigCache* cache = ConfigCache::instance();
+    std::string text = "<?xml version=\"1.0\" ?>\n<config>\n";
+    cache->append(text, ConfigCache::ServicesSection, 1);
+    cache->append(text, ConfigCache::ObjectsSection, 1);
+    cache->append(text, ConfigCache::RulesSection, 1);
+    cache->append(text, ConfigCache::LoggingSection, 1);
+    text.append("</config>\n");
+    return text;
+}
+
+void ConfigSaver::save(const std::string& filename, Listener* listener, int id)
+{
+    Waiter waiter;
+    waiter.listener = listener;
+    waiter.id = id;
+    FileMap_t::iterator it = files_m.find(filename);
+    if (it != files_m.end())
+    {
+        it->second.pending = true;
+        if (listener)
+            it->second.next.push_back(waiter);
+        return;
+    }
+    // Fails before anything is queued if the config cannot be exported
+    std::string text = snapshot();
+    FileState& state = files_m[filename];
+    if (listener)
+        state.current.push_back(waiter);
+    OffloadPool::instance()->post(new ConfigWrite(filename, text), this);
+}
+
+void ConfigSaver::start(const std::string& filename)
+{
+    OffloadPool::instance()->post(new ConfigWrite(filename, snapshot()), this);
+}
+
+void ConfigSaver::onWritten(const std::string& filename, const std::string& error)
+{
+    FileMap_t::iterator it = files_m.find(filename);
+    if (it == files_m.end())
+        return;
+    if (error == "")
+        writeCount_m++;
+    WaiterList_t done;
+    done.swap(it->second.current);
+    if (it->second.pending)
+    {
+        FileState& state = it->second;
+        state.pending = false;
+        state.current.swap(state.next);
+        try
+        {
+            start(filename);
+        }
+        catch (ticpp::Exception& ex)
+        {
+            logger_m.errorStream() << "Unable to export config: " << ex.m_details << endlog;
+            WaiterList_t failed;
+            failed.swap(state.current);
+            files_m.erase(it);
+            notify(failed, "Unable to export config");
+        }
+    }
+    else
+        files_m.erase(it);
+    // Listeners may request another save
+    notify(done, error);
+}
+
+void ConfigSaver::notify(WaiterList_t& waiters, const std::string& error)
+{
+    for (WaiterList_t::iterator it = waiters.begin(); it != waiters.end(); it++)
+        it->listener->onConfigSaved(it->id, error);
+}
+
+void ConfigSaver::removeListener(Listener* listener)
+{
+    for (FileMap_t::iterator it = files_m.begin(); it != files_m.end(); it++)
+    {
+        WaiterList_t* lists[2] = { &it->second.current, &it->second.next };
+        for (int i = 0; i < 2; i++)
+        {
+            WaiterList_t::iterator waiter = lists[i]->begin();
+            while (waiter != lists[i]->end())
+            {
+                if (waiter->listener == listener)
+                    waiter = lists[i]->erase(waiter);
+                else
+                    waiter++;
+            }
+        }
+    }
+}
+
+Logger& ConfigSaver::logger_m(Logger::getInstance("ConfigSaver"));
@@ -0,0 +1,148 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef CONFIGCACHE_H
+#define CONFIGCACHE_H
+
+#include <string>
+#include <list>
+#include <map>
+#include "logger.h"
+
+/** Serialized configuration of each section, as exportXml builds it.
+ * Building the DOM of a large configuration takes hundreds of
+ * milliseconds, so <read><config/> and <admin><save/> reuse the text of
+ * the sections that did not change. A section is invalidated by the
+ * importXml of its owner and by the few other places that change what it
+ * exports. */
+class ConfigCache
+{
+public:
+    enum Section
+    {
+        ObjectsSection,
+        RulesSection,
+        ServicesSection,
+        LoggingSection,
+        SectionCount
+    };
+
+    static ConfigCache* instance();
+    static void reset()
+    {
+        if (instance_m)
+            delete instance_m;
+        instance_m = 0;
+    };
+
+    static const char* getName(Section section);
+    /** Returns false if name is not a section */
+    static bool getSection(const std::string& name, Section* section);
+
+    void invalidate(Section section) { valid_m[section] = false; };
+    bool isValid(Section section) { return valid_m[section]; };
+    /** Appends the section as it is printed at depth in a document. The
+     * cached text is built at depth 0 and only its lines are indented,
+     * the content of CDATA sections is kept as is. */
+    void append(std::string& out, Section section, int depth);
+
+private:
+    ConfigCache();
+
+    static ConfigCache* instance_m;
+    std::string text_m[SectionCount];
+    bool valid_m[SectionCount];
+
+    const std::string& get(Section section);
+};
+
+/** Saves the configuration file without blocking the server. The text is
+ * taken from the ConfigCache at once, so it is a consistent snapshot, and
+ * written by the offload pool to a temporary file that is synced and then
+ * renamed over the previous one. A crash during the save leaves either the
+ * old or the new file.
+ *
+ * Saves of a file requested while one is being written are coalesced: a
+ * single save with the latest configuration follows the running one. */
+class ConfigSaver
+{
+public:
+    class Listener
+    {
+    public:
+        virtual ~Listener() {};
+        /** Called once the file of save request id is written, error is
+         * empty on success */
+        virtual void onConfigSaved(int id, const std::string& error) = 0;
+    };
+
+    static ConfigSaver* instance();
+    static void reset()
+    {
+        if (instance_m)
+            delete instance_m;
+        instance_m = 0;
+    };
+
+    /** Starts saving the configuration to filename and returns. listener,
+     * if not null, is told with id when the file is written. Throws if
+     * the configuration cannot be exported. */
+    void save(const std::string& filename, Listener* listener = 0, int id = 0);
+    /** Forgets the requests of listener, e.g. when it is deleted */
+    void removeListener(Listener* listener);
+    bool isSaving() { return !files_m.empty(); };
+    /** Number of times a file was written */
+    int getWriteCount() { return writeCount_m; };
+
+    /** Text of the configuration file */
+    static std::string snapshot();
+    /** Called by the offload task once the file is written */
+    void onWritten(const std::string& filename, const std::string& error);
+
+private:
+    ConfigSaver() : writeCount_m(0) {};
+
+    struct Waiter
+    {
+        Listener* listener;
+        int id;
+    };
+    typedef std::list<Waiter> WaiterList_t;
+    struct FileState
+    {
+        FileState() : pending(false) {};
+        // Requests of the save being written
+        WaiterList_t current;
+        // Another save follows, for the requests received meanwhile
+        bool pending;
+        WaiterList_t next;
+    };
+    typedef std::map<std::string, FileState> FileMap_t;
+
+    static ConfigSaver* instance_m;
+    FileMap_t files_m;
+    int writeCount_m;
+
+    void start(const std::string& filename);
+    static void notify(WaiterList_t& waiters, const std::string& error);
+    static Logger& logger_m;
+};
+
+#endif
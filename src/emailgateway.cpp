@@ -18,9 +18,11 @@
 */
 
 #include "emailgateway.h"
+#include "offloadpool.h"
 #include <iostream>
 #include <sstream>
 #ifdef HAVE_LIBESMTP
+#include <auth-client.h>
 #include <libesmtp.h>
 #include <signal.h>
 #define BUFFERSIZE 100
@@ -82,40 +84,6 @@ void EmailGateway::exportXml(ticpp::Element* pConfig)
     }
 }
 
-const char *EmailGateway::callback(void **buf, int *len, void *arg)
-{
-    MessageBody* body = static_cast<MessageBody*>(arg);
-    const char *tmp = body->getData(len);
-    logger_m.infoStream() << "EmailGateway: callback " << (tmp ? tmp : "") << " len=";
-   	if (len != NULL)
-	{
-		logger_m.infoStream() << *len;
-	}
-	else
-	{
-		logger_m.infoStream() << "NONE";
-	}
-	logger_m.infoStream() << endlog;
-    return tmp;
-}
-
-#ifdef HAVE_LIBESMTP
-int EmailGateway::authCallback(auth_client_request_t request, char **result, int fields, void *arg)
-{
-    int i;
-    EmailGateway* gw = static_cast<EmailGateway*>(arg);
-
-    for (i = 0; i < fields; i++)
-    {
-        if (request[i].flags & AUTH_PASS)
-            result[i] = const_cast<char*>(gw->pass_m.c_str());
-        else
-            result[i] = const_cast<char*>(gw->login_m.c_str());
-    }
-    return 1;
-}
-#endif
-
 MessageBody::MessageBody(std::string& text) : status_m(0)
 {
     std::stringstream msg;
@@ -161,103 +129,177 @@ const char *MessageBody::getData(int *len)
     return NULL;
 }
 
-void EmailGateway::sendEmail(std::string &to, std::string &subject, std::string &text)
+#ifdef HAVE_LIBESMTP
+namespace
 {
-    if (type_m == SMTP)
+    // SMTP session run by the offload pool, libesmtp blocks on the network.
+    // The session works on its own copy of the settings and keeps the
+    // outcome for finish() as it can't log from the worker thread.
+    class SmtpSession : public OffloadTask
     {
-#ifdef HAVE_LIBESMTP
-        smtp_session_t session;
-        smtp_message_t message;
-        smtp_recipient_t recipient;
-        auth_context_t authctx;
-        const smtp_status_t *status;
-        struct sigaction sa;
-        sa.sa_handler = SIG_IGN;
-        sigemptyset (&sa.sa_mask);
-        sa.sa_flags = 0;
-        sigaction (SIGPIPE, &sa, NULL);
-
-        MessageBody body(text);
-
-        session = smtp_create_session ();
-        message = smtp_add_message (session);
-
-        /* Set the host running the SMTP server.  LibESMTP has a default port
-           number of 587, however this is not widely deployed so the port
-           is specified as 25 along with the default MTA host. */
-        smtp_set_server (session, host_m.c_str());
-
-        authctx = auth_create_context ();
-        // auth_set_mechanism_flags (authctx, AUTH_PLUGIN_EXTERNAL, 0);
-        auth_set_interact_cb (authctx, EmailGateway::authCallback, this);
-        
-        //  smtp_set_eventcb(session, event_cb, NULL);
-        
-        smtp_auth_set_context (session, authctx);
-
-        /* Set the reverse path for the mail envelope.  (NULL is ok)
-         */
-        smtp_set_reverse_path (message, from_m.c_str());
-
-        /* RFC 2822 doesn't require recipient headers but a To: header would
-           be nice to have if not present. */
-        smtp_set_header (message, "To", NULL, NULL);
-
-        /* Set the Subject: header.  For no reason, we want the supplied subject
-           to override any subject line in the message headers. */
-        if (subject != "")
-        {
-			/* Encode subject in base64 to support non-ASCII characters.
-			 */
-			std::istringstream rawSubjectStream(subject);
-			std::ostringstream encodedSubjectStream;
-			const int maxLength=2048;
-			base64::encoder encoder(maxLength);
-			encoder.encode(rawSubjectStream, encodedSubjectStream);
-			std::string encodedSubject = encodedSubjectStream.str();
-
-			/* Get rid of the trailing \n added by encode().
-			 */
-			encodedSubject.erase(encodedSubject.end() - 1);
-
-			/* Build Subject line header with the standard syntax that embeds
-			 * the encoding used. */
-			std::ostringstream subjectLine;
-			subjectLine << "=?utf-8?B?" << encodedSubject << "?=";
-            smtp_set_header (message, "Subject", subjectLine.str().c_str());
-            smtp_set_header_option (message, "Subject", Hdr_OVERRIDE, 1);
-        }
-
-        /* Open the message file and set the callback to read it.
+    public:
+        SmtpSession(const std::string& host, const std::string& from, const std::string& login,
+                    const std::string& pass, const std::string& to, const std::string& subject, std::string& text)
+            : host_m(host), from_m(from), login_m(login), pass_m(pass), to_m(to), subject_m(subject),
+              body_m(text), ok_m(false), code_m(0) {};
+
+        virtual void run();
+        virtual void finish();
+
+    private:
+        static const char *callback(void **buf, int *len, void *arg);
+        static int authCallback(auth_client_request_t request, char **result, int fields, void *arg);
+
+        std::string host_m;
+        std::string from_m;
+        std::string login_m;
+        std::string pass_m;
+        std::string to_m;
+        std::string subject_m;
+        MessageBody body_m;
+
+        bool ok_m;
+        int code_m;
+        std::string status_m;
+
+        static Logger& logger_m;
+    };
+}
+
+Logger& SmtpSession::logger_m(Logger::getInstance("EmailGateway"));
+
+const char *SmtpSession::callback(void **buf, int *len, void *arg)
+{
+    MessageBody* body = static_cast<MessageBody*>(arg);
+    return body->getData(len);
+}
+
+int SmtpSession::authCallback(auth_client_request_t request, char **result, int fields, void *arg)
+{
+    int i;
+    SmtpSession* session = static_cast<SmtpSession*>(arg);
+
+    for (i = 0; i < fields; i++)
+    {
+        if (request[i].flags & AUTH_PASS)
+            result[i] = const_cast<char*>(session->pass_m.c_str());
+        else
+            result[i] = const_cast<char*>(session->login_m.c_str());
+    }
+    return 1;
+}
+
+void SmtpSession::run()
+{
+    smtp_session_t session;
+    smtp_message_t message;
+    smtp_recipient_t recipient;
+    auth_context_t authctx;
+    const smtp_status_t *status;
+    struct sigaction sa;
+    sa.sa_handler = SIG_IGN;
+    sigemptyset (&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction (SIGPIPE, &sa, NULL);
+
+    session = smtp_create_session ();
+    message = smtp_add_message (session);
+
+    /* Set the host running the SMTP server.  LibESMTP has a default port
+       number of 587, however this is not widely deployed so the port
+       is specified as 25 along with the default MTA host. */
+    smtp_set_server (session, host_m.c_str());
+
+    authctx = auth_create_context ();
+    // auth_set_mechanism_flags (authctx, AUTH_PLUGIN_EXTERNAL, 0);
+    auth_set_interact_cb (authctx, SmtpSession::authCallback, this);
+    
+    //  smtp_set_eventcb(session, event_cb, NULL);
+    
+    smtp_auth_set_context (session, authctx);
+
+    /* Set the reverse path for the mail envelope.  (NULL is ok)
+     */
+    smtp_set_reverse_path (message, from_m.c_str());
+
+    /* RFC 2822 doesn't require recipient headers but a To: header would
+       be nice to have if not present. */
+    smtp_set_header (message, "To", NULL, NULL);
+
+    /* Set the Subject: header.  For no reason, we want the supplied subject
+       to override any subject line in the message headers. */
+    if (subject_m != "")
+    {
+        /* Encode subject in base64 to support non-ASCII characters.
          */
-        smtp_set_messagecb(message, EmailGateway::callback, &body);
+        std::istringstream rawSubjectStream(subject_m);
+        std::ostringstream encodedSubjectStream;
+        const int maxLength=2048;
+        base64::encoder encoder(maxLength);
+        encoder.encode(rawSubjectStream, encodedSubjectStream);
+        std::string encodedSubject = encodedSubjectStream.str();
 
-        /* Add remaining program arguments as message recipients.
+        /* Get rid of the trailing \n added by encode().
          */
-        recipient = smtp_add_recipient (message, to.c_str());
-
-        /* Initiate a connection to the SMTP server and transfer the
-           message. */
-        if (!smtp_start_session (session))
-        {
-            char buf[128];
-            logger_m.errorStream() << "EmailGateway: SMTP server problem "
-            << smtp_strerror (smtp_errno (), buf, sizeof buf) << endlog;
-        }
-        else
-        {
-            /* Report on the success or otherwise of the mail transfer.
-             */
-            status = smtp_message_transfer_status (message);
-            logger_m.infoStream() << "EmailGateway: Done " << status->code
-            << " => " << (status->text? status->text : "") << endlog;
-        }
-
-        /* Free resources consumed by the program.
+        encodedSubject.erase(encodedSubject.end() - 1);
+
+        /* Build Subject line header with the standard syntax that embeds
+         * the encoding used. */
+        std::ostringstream subjectLine;
+        subjectLine << "=?utf-8?B?" << encodedSubject << "?=";
+        smtp_set_header (message, "Subject", subjectLine.str().c_str());
+        smtp_set_header_option (message, "Subject", Hdr_OVERRIDE, 1);
+    }
+
+    /* Open the message file and set the callback to read it.
+     */
+    smtp_set_messagecb(message, SmtpSession::callback, &body_m);
+
+    /* Add remaining program arguments as message recipients.
+     */
+    recipient = smtp_add_recipient (message, to_m.c_str());
+
+    /* Initiate a connection to the SMTP server and transfer the
+       message. */
+    if (!smtp_start_session (session))
+    {
+        char buf[128];
+        status_m = smtp_strerror (smtp_errno (), buf, sizeof buf);
+    }
+    else
+    {
+        /* Keep the success or otherwise of the mail transfer.
          */
-        smtp_destroy_session (session);
-        auth_destroy_context (authctx);
-        auth_client_exit ();
+        status = smtp_message_transfer_status (message);
+        ok_m = true;
+        code_m = status->code;
+        status_m = status->text ? status->text : "";
+    }
+
+    /* Free resources consumed by the program.
+     */
+    smtp_destroy_session (session);
+    auth_destroy_context (authctx);
+    auth_client_exit ();
+}
+
+void SmtpSession::finish()
+{
+    if (ok_m)
+        logger_m.infoStream() << "EmailGateway: Done " << code_m << " => " << status_m << endlog;
+    else
+        logger_m.errorStream() << "EmailGateway: SMTP server problem " << status_m << endlog;
+}
+#endif
+
+void EmailGateway::sendEmail(std::string &to, std::string &subject, std::string &text)
+{
+    if (type_m == SMTP)
+    {
+#ifdef HAVE_LIBESMTP
+        // Sessions are serialized, libesmtp isn't necessarily thread-safe
+        SmtpSession session(host_m, from_m, login_m, pass_m, to, subject, text);
+        OffloadPool::instance()->execute(&session, this);
 #endif
     }
     else
@@ -25,10 +25,6 @@
 #include "logger.h"
 #include "ticpp.h"
 
-#ifdef HAVE_LIBESMTP
-#include <auth-client.h>
-#endif
-
 class MessageBody
 {
 public:
@@ -51,8 +47,6 @@ public:
     void sendEmail(std::string &to, std::string &subject, std::string &text);
 
 private:
-    static const char *callback(void **buf, int *len, void *arg);
-
     enum EmailGatewayType
     {
         SMTP,
@@ -66,10 +60,6 @@ private:
     std::string login_m;
     std::string pass_m;
 
-#ifdef HAVE_LIBESMTP
-    static int authCallback(auth_client_request_t request, char **result, int fields, void *arg);
-#endif
-
     static Logger& logger_m;
 };
 
@@ -18,6 +18,9 @@
 */
 
 #include "logger.h"
+#include "configcache.h"
+#include <pthread.h>
+#include <iostream>
 
 Logging* Logging::instance_m;
 
@@ -33,6 +36,7 @@ Logging* Logging::instance_m;
 
 void Logging::importXml(ticpp::Element* pConfig)
 {
+    ConfigCache::instance()->invalidate(ConfigCache::LoggingSection);
     if (!pConfig) {
         log4cpp::BasicConfigurator::configure();
     }
@@ -125,6 +129,7 @@ std::ostream Logger::nullStream_m(&Logger::nullStreamBuf_m);
 
 void Logging::importXml(ticpp::Element* pConfig)
 {
+    ConfigCache::instance()->invalidate(ConfigCache::LoggingSection);
     if (!pConfig) {
         Logger::level_m = 20;
         Logger::timestamp_m = true;
@@ -183,17 +188,20 @@ Logger::Logger(const char* cat) : cat_m(cat) {
 }
 
 std::ostream& Logger::addPrefix(std::ostream &s, const char* level) {
+    // Conditions may log from the rule shard workers
+    LogBuffer* logBuffer = LogBuffer::current();
+    std::ostream& out = logBuffer ? (&s == &std::cerr ? logBuffer->err_m : logBuffer->out_m) : s;
     if (timestamp_m) {
         time_t now;
-        struct tm * timeinfo;
+        struct tm timeinfo;
         char buffer [32];
 
         time ( &now );
-        timeinfo = localtime ( &now );
-        strftime (buffer,sizeof(buffer),"%Y-%m-%d %X ",timeinfo);
-        s << buffer;
+        localtime_r ( &now, &timeinfo );
+        strftime (buffer,sizeof(buffer),"%Y-%m-%d %X ",&timeinfo);
+        out << buffer;
     }
-    return s << level << cat_m << ": ";
+    return out << level << cat_m << ": ";
 }
 
 ErrStream Logger::errorStream() {
@@ -250,6 +258,40 @@ bool Logger::isDebugEnabled() {
 
 #endif
 
+static pthread_key_t logBufferKey;
+static pthread_once_t logBufferOnce = PTHREAD_ONCE_INIT;
+
+static void createLogBufferKey()
+{
+    pthread_key_create(&logBufferKey, 0);
+}
+
+void LogBuffer::attach(LogBuffer* buffer)
+{
+    pthread_once(&logBufferOnce, createLogBufferKey);
+    pthread_setspecific(logBufferKey, buffer);
+}
+
+LogBuffer* LogBuffer::current()
+{
+    pthread_once(&logBufferOnce, createLogBufferKey);
+    return static_cast<LogBuffer*>(pthread_getspecific(logBufferKey));
+}
+
+void LogBuffer::flush()
+{
+    if (out_m.tellp() > 0)
+    {
+        std::cout << out_m.str() << std::flush;
+        out_m.str("");
+    }
+    if (err_m.tellp() > 0)
+    {
+        std::cerr << err_m.str() << std::flush;
+        err_m.str("");
+    }
+}
+
 ErrStream errorStream(const char* cat) { return Logger::getInstance(cat).errorStream(); };
 WarnStream warnStream(const char* cat) { return Logger::getInstance(cat).warnStream(); };
 LogStream infoStream(const char* cat) { return Logger::getInstance(cat).infoStream(); };
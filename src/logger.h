@@ -22,6 +22,7 @@
 
 #include "config.h"
 #include "ticpp.h"
+#include <sstream>
 
 class Logging
 {
@@ -143,6 +144,23 @@ private:
 };
 #endif
 
+/** Keeps the logs of a native worker thread until the pth thread writes
+ * them out with flush(), the output streams are not shared with the
+ * workers. Unused with log4cpp, whose appenders are serialized. */
+class LogBuffer
+{
+public:
+    /** Sends the logs of the calling thread to buffer, 0 to stop */
+    static void attach(LogBuffer* buffer);
+    static LogBuffer* current();
+    void flush();
+
+private:
+    friend class Logger;
+    std::stringstream out_m;
+    std::stringstream err_m;
+};
+
 ErrStream errorStream(const char* cat);
 WarnStream warnStream(const char* cat);
 LogStream infoStream(const char* cat);
@@ -30,6 +30,7 @@ extern "C"
 #include <ctime>
 #include "services.h"
 #include "ioport.h"
+#include "clock.h"
 
 LuaMain* LuaMain::instance_m;
 
@@ -63,7 +64,7 @@ void LuaMain::unlock()
     pth_mutex_release(&instance()->mutex_m);
 }
 
-LuaCondition::LuaCondition(ChangeListener* cl) : cl_m(cl), l_m(0)
+LuaCondition::LuaCondition(ChangeListener* cl) : cl_m(cl), reorderable_m(false), l_m(0)
 {
     l_m = luaL_newstate();  
     /* stop collector during initialisation
@@ -98,6 +99,7 @@ bool LuaCondition::evaluate()
 void LuaCondition::importXml(ticpp::Element* pConfig)
 {
     code_m = pConfig->GetText();
+    reorderable_m = (pConfig->GetAttribute("reorderable") == "true");
 
     infoStream("LuaCondition") << "LuaCondition: Configured code=" << code_m << endlog;
 }
@@ -105,6 +107,8 @@ void LuaCondition::importXml(ticpp::Element* pConfig)
 void LuaCondition::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "script");
+    if (reorderable_m)
+        pConfig->SetAttribute("reorderable", "true");
     if (code_m.length())
     {
         ticpp::Text pText(code_m);
@@ -147,7 +151,7 @@ int LuaCondition::isException(lua_State *L)
     time_t ts;
     if (lua_gettop(L) == 0)
     {
-        ts = time(0);
+        ts = Clock::now();
     }
     else if (lua_gettop(L) != 1 || !lua_isnumber(L, 1))
     {
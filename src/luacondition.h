@@ -59,12 +59,16 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    // Scripts may have side effects, they are only moved if the
+    // configuration says so with reorderable="true"
+    virtual bool isReorderable() { return reorderable_m; };
     static int obj(lua_State *L);
     static int isException(lua_State *L);
 private:
 //    Condition* condition_m;
     ChangeListener* cl_m;
     std::string code_m;
+    bool reorderable_m;
     lua_State *l_m;
 };
 
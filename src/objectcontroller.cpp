@@ -20,16 +20,19 @@
 #include "objectcontroller.h"
 #include "persistentstorage.h"
 #include "services.h"
+#include "clock.h"
+#include "configcache.h"
 #include <cmath>
 #include <cassert>
 #include <iomanip>
 #include <iconv.h>
+#include <fnmatch.h>
 
 ObjectController* ObjectController::instance_m;
 
 Logger& Object::logger_m(Logger::getInstance("Object"));
 
-Object::Object() : init_m(false), flags_m(Default), refCount_m(0), gad_m(0), readRequestGad_m(0), persist_m(false), writeLog_m(false), readPending_m(false)
+Object::Object() : init_m(false), flags_m(Default), refCount_m(0), changeSeq_m(0), fanOutGeneration_m(0), gad_m(0), readRequestGad_m(0), persist_m(false), writeLog_m(false), readPending_m(false)
 {}
 
 Object::~Object()
@@ -464,6 +467,8 @@ void Object::onUpdate()
 {
     init_m = true;
     logger_m.infoStream() << "New value " << getValue() << " for object " << getID() << " (type: " << getType() << ")" << endlog;
+    ObjectController* controller = ObjectController::instance();
+    controller->onObjectChange(this);
     
     ListenerList_t::iterator it;
     for (it = listenerList_m.begin(); it != listenerList_m.end(); it++)
@@ -471,6 +476,11 @@ void Object::onUpdate()
         logger_m.debugStream() << "Calling onChange on listener for " << id_m << endlog;
         (*it)->onChange(this);
     }
+    // Subscribed clients only queue the notification, the fan-out cannot
+    // change while it is delivered
+    const SubscriptionIndex::FanOut_t& fanOut = controller->getSubscriptions()->getFanOut(this);
+    for (SubscriptionIndex::FanOut_t::const_iterator it2 = fanOut.begin(); it2 != fanOut.end(); it2++)
+        (*it2)->onChange(this);
     if (persist_m || writeLog_m)
     {
         PersistentStorage *persistence = Services::instance()->getPersistentStorage();
@@ -1167,14 +1177,16 @@ void TimeObjectValue::getTimeValue(int *wday, int *hour, int *min, int *sec)
 {
     if (hour_m == -1)
     {
-        time_t t = time(0);
-        struct tm * timeinfo = localtime(&t);
-        *wday = timeinfo->tm_wday;
+        // Also read by the rule shard workers
+        time_t t = Clock::now();
+        struct tm timeinfo;
+        localtime_r(&t, &timeinfo);
+        *wday = timeinfo.tm_wday;
         if (*wday == 0)
             *wday = 7;
-        *hour = timeinfo->tm_hour;
-        *min = timeinfo->tm_min;
-        *sec = timeinfo->tm_sec;
+        *hour = timeinfo.tm_hour;
+        *min = timeinfo.tm_min;
+        *sec = timeinfo.tm_sec;
     }
     else
     {
@@ -1387,11 +1399,13 @@ void DateObjectValue::getDateValue(int *day, int *month, int *year)
 {
     if (day_m == -1)
     {
-        time_t t = time(0);
-        struct tm * timeinfo = localtime(&t);
-        *day = timeinfo->tm_mday;
-        *month = timeinfo->tm_mon+1;
-        *year = timeinfo->tm_year;
+        // Also read by the rule shard workers
+        time_t t = Clock::now();
+        struct tm timeinfo;
+        localtime_r(&t, &timeinfo);
+        *day = timeinfo.tm_mday;
+        *month = timeinfo.tm_mon+1;
+        *year = timeinfo.tm_year;
     }
     else
     {
@@ -3073,8 +3087,10 @@ void String14AsciiObject::setStringValue(const std::string& value)
 
 Logger& ObjectController::logger_m(Logger::getInstance("ObjectController"));
 
-ObjectController::ObjectController()
-{}
+ObjectController::ObjectController() : changeSeq_m(0), epoch_m(Clock::nowMs()), tombstoneFloor_m(0)
+{
+    ConfigCache::instance()->invalidate(ConfigCache::ObjectsSection);
+}
 
 ObjectController::~ObjectController()
 {
@@ -3144,14 +3160,58 @@ Object* ObjectController::getObject(const std::string& id)
 
 void ObjectController::addObject(Object* object)
 {
+    ConfigCache::instance()->invalidate(ConfigCache::ObjectsSection);
     if (!objectIdMap_m.insert(ObjectIdPair_t(object->getID(), object)).second)
         throw ticpp::Exception("Object ID already exists");
+    sortedObjects_m.insert(ObjectIdPair_t(object->getID(), object));
     if (object->getGad())
         objectMap_m.insert(ObjectPair_t(object->getGad(), object));
     std::list<eibaddr_t>::iterator it2, it_end;
     it_end = object->getListenerGadEnd();
     for (it2=object->getListenerGad(); it2!=it_end; it2++)
         objectMap_m.insert(ObjectPair_t((*it2), object));
+    // A new object is a change for the clients reading deltas
+    clearTombstone(object->getID());
+    logChange(object);
+}
+
+void ObjectController::onObjectChange(Object* object)
+{
+    // Objects that are not (or no longer) registered are not logged
+    ObjectIdMap_t::iterator it = objectIdMap_m.find(object->getID());
+    if (it != objectIdMap_m.end() && it->second == object)
+        logChange(object);
+}
+
+void ObjectController::logChange(Object* object)
+{
+    changeLog_m.erase(object->getChangeSeq());
+    object->setChangeSeq(++changeSeq_m);
+    changeLog_m.insert(changeLog_m.end(), std::make_pair(changeSeq_m, object));
+}
+
+void ObjectController::logDeletion(Object* object)
+{
+    changeLog_m.erase(object->getChangeSeq());
+    tombstones_m.insert(tombstones_m.end(), std::make_pair(++changeSeq_m, object->getID()));
+    tombstoneIds_m[object->getID()] = changeSeq_m;
+    if (tombstones_m.size() > MaxTombstones)
+    {
+        tombstoneFloor_m = tombstones_m.begin()->first;
+        tombstoneIds_m.erase(tombstones_m.begin()->second);
+        tombstones_m.erase(tombstones_m.begin());
+    }
+}
+
+void ObjectController::clearTombstone(const std::string& id)
+{
+    // A new object reusing the ID is reported as a change instead
+    TombstoneIdMap_t::iterator it = tombstoneIds_m.find(id);
+    if (it != tombstoneIds_m.end())
+    {
+        tombstones_m.erase(it->second);
+        tombstoneIds_m.erase(it);
+    }
 }
 
 void ObjectController::removeObjectFromAddressMap(eibaddr_t gad, Object* object)
@@ -3171,6 +3231,7 @@ void ObjectController::removeObjectFromAddressMap(eibaddr_t gad, Object* object)
 
 void ObjectController::removeObject(Object* object)
 {
+    ConfigCache::instance()->invalidate(ConfigCache::ObjectsSection);
     ObjectIdMap_t::iterator it = objectIdMap_m.find(object->getID());
     if (it != objectIdMap_m.end())
     {
@@ -3184,12 +3245,44 @@ void ObjectController::removeObject(Object* object)
 
         if (it->second->inUse())
             throw ticpp::Exception("Delete failed! Object still in use.");
+        logDeletion(object);
+        sortedObjects_m.erase(object->getID());
         delete it->second;
         objectIdMap_m.erase(it);
     }
 }
 
 void ObjectController::importXml(ticpp::Element* pConfig)
+{
+    ConfigCache::instance()->invalidate(ConfigCache::ObjectsSection);
+    ticpp::Iterator< ticpp::Element > child("object");
+
+    // Restore the persisted values at once rather than one read each
+    PersistentStorage *persistence = Services::instance()->getPersistentStorage();
+    int persisted = 0;
+    if (persistence)
+    {
+        for ( child = pConfig->FirstChildElement("object", false); child != child.end(); child++ )
+            if (child->GetAttribute("init") == "persist")
+                persisted++;
+        if (persisted > 1)
+            persistence->beginRestore();
+    }
+    try
+    {
+        importObjects(pConfig);
+    }
+    catch (...)
+    {
+        if (persisted > 1)
+            persistence->endRestore();
+        throw;
+    }
+    if (persisted > 1)
+        persistence->endRestore();
+}
+
+void ObjectController::importObjects(ticpp::Element* pConfig)
 {
     ticpp::Iterator< ticpp::Element > child("object");
     for ( child = pConfig->FirstChildElement("object", false); child != child.end(); child++ )
@@ -3211,6 +3304,8 @@ void ObjectController::importXml(ticpp::Element* pConfig)
             {
                 if (object->inUse())
                     throw ticpp::Exception("Delete failed! Object still in use.");
+                logDeletion(object);
+                sortedObjects_m.erase(id);
                 delete object;
                 objectIdMap_m.erase(it);
             }
@@ -3238,43 +3333,225 @@ void ObjectController::importXml(ticpp::Element* pConfig)
             for (it2=object->getListenerGad(); it2!=it_end; it2++)
                 objectMap_m.insert(ObjectPair_t((*it2), object));
             objectIdMap_m.insert(ObjectIdPair_t(id, object));
+            sortedObjects_m.insert(ObjectIdPair_t(id, object));
+            clearTombstone(id);
+            logChange(object);
         }
     }
-
 }
 
 void ObjectController::exportXml(ticpp::Element* pConfig)
 {
-    ObjectIdMap_t::iterator it;
-    for (it = objectIdMap_m.begin(); it != objectIdMap_m.end(); it++)
+    SortedObjectMap_t::iterator it;
+    for (it = sortedObjects_m.begin(); it != sortedObjects_m.end(); it++)
     {
         ticpp::Element pElem("object");
-        (*it).second->exportXml(&pElem);
+        it->second->exportXml(&pElem);
         pConfig->LinkEndChild(&pElem);
     }
 }
 
 void ObjectController::exportObjectValues(ticpp::Element* pObjects)
 {
-    ObjectIdMap_t::iterator it;
-    for (it = objectIdMap_m.begin(); it != objectIdMap_m.end(); it++)
+    SortedObjectMap_t::iterator it;
+    for (it = sortedObjects_m.begin(); it != sortedObjects_m.end(); it++)
+    {
+        ticpp::Element pElem("object");
+        pElem.SetAttribute("id", it->second->getID());
+        pElem.SetAttribute("value", it->second->getValue());
+        pObjects->LinkEndChild(&pElem);
+    }
+}
+
+void ObjectController::exportChangedValues(ticpp::Element* pObjects, uint64_t since, uint64_t epoch)
+{
+    std::vector<Object*> objects;
+    std::vector<std::string> deleted;
+    bool full;
+    pObjects->SetAttribute("seq", getChangedObjects(since, epoch, objects, deleted, full));
+    pObjects->SetAttribute("epoch", epoch_m);
+    if (full)
+        pObjects->SetAttribute("full", "true");
+    std::vector<Object*>::iterator it;
+    for (it = objects.begin(); it != objects.end(); it++)
     {
         ticpp::Element pElem("object");
-        pElem.SetAttribute("id", (*it).second->getID());
-        pElem.SetAttribute("value", (*it).second->getValue());
+        pElem.SetAttribute("id", (*it)->getID());
+        pElem.SetAttribute("value", (*it)->getValue());
         pObjects->LinkEndChild(&pElem);
     }
+    std::vector<std::string>::iterator it2;
+    for (it2 = deleted.begin(); it2 != deleted.end(); it2++)
+    {
+        ticpp::Element pElem("object");
+        pElem.SetAttribute("id", *it2);
+        pElem.SetAttribute("deleted", "true");
+        pObjects->LinkEndChild(&pElem);
+    }
+}
+
+uint64_t ObjectController::getChangedObjects(uint64_t since, uint64_t epoch, std::vector<Object*>& objects,
+                                             std::vector<std::string>& deleted, bool& full)
+{
+    full = since == 0 || epoch != epoch_m || since > changeSeq_m || since < tombstoneFloor_m;
+    if (full)
+        since = 0;
+    ChangeLog_t::iterator it;
+    for (it = changeLog_m.upper_bound(since); it != changeLog_m.end(); it++)
+        objects.push_back(it->second);
+    if (!full)
+    {
+        Tombstones_t::iterator it2;
+        for (it2 = tombstones_m.upper_bound(since); it2 != tombstones_m.end(); it2++)
+            deleted.push_back(it2->second);
+    }
+    return changeSeq_m;
+}
+
+void SubscriptionFilter::importXml(ticpp::Element* pConfig)
+{
+    id_m = pConfig->GetAttribute("id");
+    pattern_m = pConfig->GetAttribute("pattern");
+    type_m = pConfig->GetAttribute("type");
+    std::string gadFrom = pConfig->GetAttribute("gad-from");
+    std::string gadTo = pConfig->GetAttribute("gad-to");
+    if ((gadFrom == "") != (gadTo == ""))
+        throw ticpp::Exception("Both gad-from and gad-to are needed");
+    if (gadFrom != "")
+    {
+        gadFrom_m = Object::ReadGroupAddr(gadFrom);
+        gadTo_m = Object::ReadGroupAddr(gadTo);
+        if (gadTo_m == 0 || gadFrom_m > gadTo_m)
+            throw ticpp::Exception("Invalid group address range");
+    }
+}
+
+bool SubscriptionFilter::matches(Object* object) const
+{
+    if (id_m != "" && id_m != object->getID())
+        return false;
+    if (pattern_m != "" && fnmatch(pattern_m.c_str(), object->getID(), 0) != 0)
+        return false;
+    if (type_m != "" && fnmatch(type_m.c_str(), object->getType().c_str(), 0) != 0)
+        return false;
+    if (gadTo_m != 0 && (object->getGad() < gadFrom_m || object->getGad() > gadTo_m))
+        return false;
+    return true;
+}
+
+bool SubscriptionFilter::operator==(const SubscriptionFilter& filter) const
+{
+    return id_m == filter.id_m && pattern_m == filter.pattern_m && type_m == filter.type_m &&
+        gadFrom_m == filter.gadFrom_m && gadTo_m == filter.gadTo_m;
+}
+
+unsigned SubscriptionIndex::generation_m = 0;
+
+SubscriptionIndex::~SubscriptionIndex()
+{
+    ListenerMap_t::iterator it;
+    for (it = byListener_m.begin(); it != byListener_m.end(); it++)
+    {
+        SubscriptionList_t::iterator sub;
+        for (sub = it->second.begin(); sub != it->second.end(); sub++)
+            delete *sub;
+    }
+}
+
+SubscriptionIndex::Subscription* SubscriptionIndex::subscribe(ChangeListener* listener, const SubscriptionFilter& filter)
+{
+    Subscription* subscription = new Subscription();
+    subscription->listener = listener;
+    subscription->filter = filter;
+    SubscriptionList_t& list = (filter.getId() != "") ? byId_m[filter.getId()] : patterns_m;
+    subscription->pos = list.insert(list.end(), subscription);
+    SubscriptionList_t& listenerList = byListener_m[listener];
+    subscription->listenerPos = listenerList.insert(listenerList.end(), subscription);
+    count_m++;
+    generation_m++;
+    return subscription;
+}
+
+void SubscriptionIndex::unsubscribe(Subscription* subscription)
+{
+    if (subscription->filter.getId() != "")
+    {
+        IdMap_t::iterator it = byId_m.find(subscription->filter.getId());
+        it->second.erase(subscription->pos);
+        if (it->second.empty())
+            byId_m.erase(it);
+    }
+    else
+        patterns_m.erase(subscription->pos);
+    ListenerMap_t::iterator it = byListener_m.find(subscription->listener);
+    it->second.erase(subscription->listenerPos);
+    if (it->second.empty())
+        byListener_m.erase(it);
+    delete subscription;
+    count_m--;
+    generation_m++;
+}
+
+void SubscriptionIndex::unsubscribe(ChangeListener* listener, const SubscriptionFilter& filter)
+{
+    ListenerMap_t::iterator it = byListener_m.find(listener);
+    if (it == byListener_m.end())
+        return;
+    std::vector<Subscription*> matching;
+    SubscriptionList_t::iterator sub;
+    for (sub = it->second.begin(); sub != it->second.end(); sub++)
+    {
+        if ((*sub)->filter == filter)
+            matching.push_back(*sub);
+    }
+    for (std::vector<Subscription*>::iterator it2 = matching.begin(); it2 != matching.end(); it2++)
+        unsubscribe(*it2);
+}
+
+void SubscriptionIndex::unsubscribeAll(ChangeListener* listener)
+{
+    ListenerMap_t::iterator it = byListener_m.find(listener);
+    if (it == byListener_m.end())
+        return;
+    std::vector<Subscription*> all(it->second.begin(), it->second.end());
+    for (std::vector<Subscription*>::iterator it2 = all.begin(); it2 != all.end(); it2++)
+        unsubscribe(*it2);
+}
+
+const SubscriptionIndex::FanOut_t& SubscriptionIndex::getFanOut(Object* object)
+{
+    if (object->fanOutGeneration_m == generation_m)
+        return object->fanOut_m;
+    FanOut_t& fanOut = object->fanOut_m;
+    fanOut.clear();
+    SubscriptionList_t::iterator sub;
+    IdMap_t::iterator it = byId_m.find(object->getID());
+    if (it != byId_m.end())
+    {
+        for (sub = it->second.begin(); sub != it->second.end(); sub++)
+        {
+            if ((*sub)->filter.matches(object) && std::find(fanOut.begin(), fanOut.end(), (*sub)->listener) == fanOut.end())
+                fanOut.push_back((*sub)->listener);
+        }
+    }
+    for (sub = patterns_m.begin(); sub != patterns_m.end(); sub++)
+    {
+        if ((*sub)->filter.matches(object) && std::find(fanOut.begin(), fanOut.end(), (*sub)->listener) == fanOut.end())
+            fanOut.push_back((*sub)->listener);
+    }
+    object->fanOutGeneration_m = generation_m;
+    return fanOut;
 }
 
-// Delivers all objects
+// Delivers all objects, sorted by ID
 std::list<Object*> ObjectController::getObjects()
 {
     std::list<Object*> objects;
-    ObjectIdMap_t::iterator it;
-    for (it = objectIdMap_m.begin(); it != objectIdMap_m.end(); it++)
+    SortedObjectMap_t::iterator it;
+    for (it = sortedObjects_m.begin(); it != sortedObjects_m.end(); it++)
     {
       it->second->incRefCount();
-      objects.push_back((*it).second);
+      objects.push_back(it->second);
     }
     return objects;
 }
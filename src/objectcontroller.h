@@ -23,12 +23,14 @@
 #include <list>
 #include <string>
 #include <map>
+#include <vector>
 #include <cfloat>
 #include <stdint.h>
 #include "config.h"
 #include "logger.h"
 #include "ticpp.h"
 #include "knxconnection.h"
+#include "collections.h"
 
 class Object;
 
@@ -40,6 +42,76 @@ public:
     virtual const char* getID() { return "?"; };
 };
 
+/** Selects the objects of a notification subscription. Each field that is
+ * set must match, an empty filter matches every object. */
+class SubscriptionFilter
+{
+public:
+    SubscriptionFilter() : gadFrom_m(0), gadTo_m(0) {};
+
+    /** Reads the id, pattern (glob on the id), type (glob on the DPT)
+     * and gad-from/gad-to (range of the main group address) attributes */
+    void importXml(ticpp::Element* pConfig);
+    bool matches(Object* object) const;
+    bool operator==(const SubscriptionFilter& filter) const;
+
+    void setId(const std::string& id) { id_m = id; };
+    const std::string& getId() const { return id_m; };
+private:
+    std::string id_m;
+    std::string pattern_m;
+    std::string type_m;
+    eibaddr_t gadFrom_m;
+    eibaddr_t gadTo_m;
+};
+
+/** Notification subscriptions of all the clients. Rather than adding each
+ * client to the listener list of every object it follows, the index
+ * computes once the set of listeners of an object, and recomputes it only
+ * when the object is updated after the subscriptions have changed.
+ * Subscribing and unsubscribing are O(1). */
+class SubscriptionIndex
+{
+public:
+    struct Subscription;
+    typedef std::vector<ChangeListener*> FanOut_t;
+
+    SubscriptionIndex() : count_m(0) { generation_m++; };
+    ~SubscriptionIndex();
+
+    Subscription* subscribe(ChangeListener* listener, const SubscriptionFilter& filter);
+    void unsubscribe(Subscription* subscription);
+    /** Removes the subscriptions of listener with the same filter */
+    void unsubscribe(ChangeListener* listener, const SubscriptionFilter& filter);
+    void unsubscribeAll(ChangeListener* listener);
+
+    /** Listeners subscribed to object, each one once */
+    const FanOut_t& getFanOut(Object* object);
+    int getSubscriptionCount() { return count_m; };
+
+    struct Subscription
+    {
+        ChangeListener* listener;
+        SubscriptionFilter filter;
+        std::list<Subscription*>::iterator pos;
+        std::list<Subscription*>::iterator listenerPos;
+    };
+private:
+    typedef std::list<Subscription*> SubscriptionList_t;
+    typedef HashMap<std::string, SubscriptionList_t> IdMap_t;
+    typedef HashMap<ChangeListener*, SubscriptionList_t> ListenerMap_t;
+
+    // Subscriptions to a single id are only checked for that object
+    IdMap_t byId_m;
+    SubscriptionList_t patterns_m;
+    ListenerMap_t byListener_m;
+    int count_m;
+    // Bumped on each change, the fan-out of an object is valid if it
+    // was computed in the current generation. It is shared by all the
+    // indexes so that a new index never reuses a generation.
+    static unsigned generation_m;
+};
+
 class ObjectValue
 {
 public:
@@ -128,6 +200,8 @@ public:
     virtual void onUpdate();
     void onInternalUpdate();
     bool forceUpdate() { return (!init_m || (flags_m & Stateless)); };
+    /** Whether get() returns without reading the bus */
+    bool isInitialized() { return init_m; };
     void addChangeListener(ChangeListener* listener);
     void removeChangeListener(ChangeListener* listener);
     void onWrite(const uint8_t* buf, int len, eibaddr_t src);
@@ -141,6 +215,10 @@ public:
         return --refCount_m; };
     bool inUse() { return refCount_m > 0; };
 
+    /** Sequence number of the last change, see ObjectController */
+    uint64_t getChangeSeq() { return changeSeq_m; };
+    void setChangeSeq(uint64_t seq) { changeSeq_m = seq; };
+
     static eibaddr_t ReadGroupAddr(const std::string& addr);
     static eibaddr_t ReadAddr(const std::string& addr);
     static std::string WriteGroupAddr(eibaddr_t addr);
@@ -169,6 +247,11 @@ private:
     std::string initValue_m;
     std::string descr_m;
     int refCount_m;
+    uint64_t changeSeq_m;
+    // Cached by SubscriptionIndex
+    std::vector<ChangeListener*> fanOut_m;
+    unsigned fanOutGeneration_m;
+    friend class SubscriptionIndex;
     eibaddr_t gad_m;
     eibaddr_t readRequestGad_m;
     eibaddr_t lastTx_m;
@@ -1339,6 +1422,26 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
     virtual void exportObjectValues(ticpp::Element* pObjects);
+    /** Adds the objects changed after the sequence number since and the
+     * objects deleted since then (deleted="true"), and sets the seq and
+     * epoch attributes of pObjects. full="true" is set when all objects
+     * are listed, see getChangedObjects(). */
+    void exportChangedValues(ticpp::Element* pObjects, uint64_t since, uint64_t epoch);
+    /** Gets the objects changed after since, in the order of their last
+     * change, and the IDs of the objects deleted after since, without
+     * taking references on the objects. If since can't be served (0,
+     * another epoch, ahead of the current sequence number or older than
+     * the oldest tombstone kept), all objects are returned, deleted stays
+     * empty and full is set: the client must drop the objects it doesn't
+     * get. Returns the current sequence number. */
+    uint64_t getChangedObjects(uint64_t since, uint64_t epoch, std::vector<Object*>& objects,
+                               std::vector<std::string>& deleted, bool& full);
+    uint64_t getChangeSeq() { return changeSeq_m; };
+    /** Identifies this run, sequence numbers restart at 0 with each one */
+    uint64_t getEpoch() { return epoch_m; };
+    /** Stamps object with the next sequence number, called on each update */
+    void onObjectChange(Object* object);
+    SubscriptionIndex* getSubscriptions() { return &subscriptions_m; };
 
     virtual void onWrite(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
     virtual void onRead(eibaddr_t src, eibaddr_t dest, const uint8_t* buf, int len);
@@ -1350,13 +1453,38 @@ private:
     virtual ~ObjectController();
 
     void removeObjectFromAddressMap(eibaddr_t gad, Object* object);
+    void logChange(Object* object);
+    void logDeletion(Object* object);
+    void clearTombstone(const std::string& id);
+    /** Creates, updates or deletes the objects of the config */
+    void importObjects(ticpp::Element* pConfig);
 
     typedef std::pair<eibaddr_t ,Object*> ObjectPair_t;
     typedef std::multimap<eibaddr_t ,Object*> ObjectMap_t;
     typedef std::pair<std::string ,Object*> ObjectIdPair_t;
-    typedef std::map<std::string ,Object*> ObjectIdMap_t;
+    typedef HashMap<std::string ,Object*> ObjectIdMap_t;
     ObjectMap_t objectMap_m;
     ObjectIdMap_t objectIdMap_m;
+    // Same objects ordered by ID, kept along with objectIdMap_m so that
+    // the listings don't sort them on each request
+    typedef std::map<std::string, Object*> SortedObjectMap_t;
+    SortedObjectMap_t sortedObjects_m;
+    // Last change of each object, indexed by its sequence number. Each
+    // object has a single entry, so a delta read is O(changes).
+    typedef std::map<uint64_t, Object*> ChangeLog_t;
+    ChangeLog_t changeLog_m;
+    uint64_t changeSeq_m;
+    uint64_t epoch_m;
+    // IDs of the deleted objects, indexed by the sequence number of the
+    // deletion. Beyond MaxTombstones the oldest are dropped and a delta
+    // read from before tombstoneFloor_m becomes a full one.
+    typedef std::map<uint64_t, std::string> Tombstones_t;
+    typedef HashMap<std::string, uint64_t> TombstoneIdMap_t;
+    Tombstones_t tombstones_m;
+    TombstoneIdMap_t tombstoneIds_m;
+    uint64_t tombstoneFloor_m;
+    static const unsigned int MaxTombstones = 10000;
+    SubscriptionIndex subscriptions_m;
     static ObjectController* instance_m;
     static Logger& logger_m;
 };
@@ -0,0 +1,222 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "offloadpool.h"
+#include "ticpp.h"
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+OffloadPool* OffloadPool::instance_m;
+Logger& OffloadPool::logger_m(Logger::getInstance("OffloadPool"));
+
+namespace
+{
+    class NoopTask : public OffloadTask
+    {
+    public:
+        virtual void run() {};
+    };
+}
+
+OffloadPool::OffloadPool() : idle_m(0), stopping_m(false)
+{
+    if (pipe(pipe_m) != 0)
+        throw ticpp::Exception("OffloadPool: unable to create completion pipe");
+    // The read end stays blocking, pth_read only waits on blocking fds
+    fcntl(pipe_m[1], F_SETFL, fcntl(pipe_m[1], F_GETFL) | O_NONBLOCK);
+    fcntl(pipe_m[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipe_m[1], F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&mutex_m, 0);
+    pthread_cond_init(&cond_m, 0);
+    Start();
+}
+
+OffloadPool::~OffloadPool()
+{
+    // Let the workers drain the queue, this waits for the calls in progress
+    pthread_mutex_lock(&mutex_m);
+    stopping_m = true;
+    pthread_cond_broadcast(&cond_m);
+    pthread_mutex_unlock(&mutex_m);
+    for (std::vector<pthread_t>::iterator it = workers_m.begin(); it != workers_m.end(); it++)
+        pthread_join(*it, 0);
+
+    Stop();
+    complete();
+    close(pipe_m[0]);
+    close(pipe_m[1]);
+    pthread_cond_destroy(&cond_m);
+    pthread_mutex_destroy(&mutex_m);
+}
+
+OffloadPool* OffloadPool::instance()
+{
+    if (instance_m == 0)
+        instance_m = new OffloadPool();
+    return instance_m;
+}
+
+void OffloadPool::execute(OffloadTask* task, const void* serialKey)
+{
+    pth_sem_t done;
+    pth_sem_init(&done);
+    Job job;
+    job.task = task;
+    job.serialKey = serialKey;
+    job.done = &done;
+    submit(job);
+    pth_sem_dec(&done);
+}
+
+void OffloadPool::post(OffloadTask* task, const void* serialKey)
+{
+    Job job;
+    job.task = task;
+    job.serialKey = serialKey;
+    job.done = 0;
+    submit(job);
+}
+
+void OffloadPool::sync(const void* serialKey)
+{
+    NoopTask task;
+    execute(&task, serialKey);
+}
+
+int OffloadPool::getPendingCount()
+{
+    pthread_mutex_lock(&mutex_m);
+    int count = pending_m.size() + running_m.size() + finished_m.size();
+    pthread_mutex_unlock(&mutex_m);
+    return count;
+}
+
+void OffloadPool::submit(const Job& job)
+{
+    pthread_mutex_lock(&mutex_m);
+    pending_m.push_back(job);
+    if (idle_m == 0 && workers_m.size() < (size_t)MaxWorkers)
+    {
+        // Workers must not catch the signals handled by the pth main thread
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_t tid;
+        if (pthread_create(&tid, 0, &OffloadPool::workerEntry, this) == 0)
+            workers_m.push_back(tid);
+        pthread_sigmask(SIG_SETMASK, &old, 0);
+        logger_m.debugStream() << "Started worker " << workers_m.size() << endlog;
+    }
+    else
+        pthread_cond_broadcast(&cond_m);
+    pthread_mutex_unlock(&mutex_m);
+}
+
+// Called with mutex_m locked. Picks the oldest job whose serial key is
+// neither running nor held by an older pending job.
+bool OffloadPool::nextJob(Job& job)
+{
+    std::vector<const void*> skipped;
+    for (JobList_t::iterator it = pending_m.begin(); it != pending_m.end(); it++)
+    {
+        const void* key = it->serialKey;
+        if (key)
+        {
+            if (std::find(running_m.begin(), running_m.end(), key) != running_m.end() ||
+                std::find(skipped.begin(), skipped.end(), key) != skipped.end())
+            {
+                skipped.push_back(key);
+                continue;
+            }
+        }
+        job = *it;
+        pending_m.erase(it);
+        running_m.push_back(key);
+        return true;
+    }
+    return false;
+}
+
+void* OffloadPool::workerEntry(void* arg)
+{
+    static_cast<OffloadPool*>(arg)->worker();
+    return 0;
+}
+
+void OffloadPool::worker()
+{
+    pthread_mutex_lock(&mutex_m);
+    while (true)
+    {
+        Job job;
+        if (nextJob(job))
+        {
+            pthread_mutex_unlock(&mutex_m);
+            job.task->run();
+            pthread_mutex_lock(&mutex_m);
+            running_m.erase(std::find(running_m.begin(), running_m.end(), job.serialKey));
+            finished_m.push_back(job);
+            // A full pipe already has a wake-up pending for the dispatcher
+            char c = 0;
+            if (write(pipe_m[1], &c, 1) < 0) {}
+            if (job.serialKey)
+                pthread_cond_broadcast(&cond_m);
+            continue;
+        }
+        if (stopping_m && pending_m.empty())
+            break;
+        idle_m++;
+        pthread_cond_wait(&cond_m, &mutex_m);
+        idle_m--;
+    }
+    pthread_mutex_unlock(&mutex_m);
+}
+
+void OffloadPool::complete()
+{
+    JobList_t done;
+    pthread_mutex_lock(&mutex_m);
+    done.swap(finished_m);
+    pthread_mutex_unlock(&mutex_m);
+
+    for (JobList_t::iterator it = done.begin(); it != done.end(); it++)
+    {
+        it->task->finish();
+        if (it->done)
+            pth_sem_inc(it->done, FALSE);
+        else
+            delete it->task;
+    }
+}
+
+void OffloadPool::Run (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    logger_m.debugStream() << "Starting OffloadPool dispatcher." << endlog;
+    char buf[64];
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        if (pth_read_ev(pipe_m[0], buf, sizeof(buf), stop) > 0)
+            complete();
+    }
+    logger_m.debugStream() << "Out of OffloadPool dispatcher." << endlog;
+    pth_event_free (stop, PTH_FREE_THIS);
+}
@@ -0,0 +1,110 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef OFFLOADPOOL_H
+#define OFFLOADPOOL_H
+
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include "threads.h"
+#include "logger.h"
+
+/** Blocking call handed over to the offload pool. */
+class OffloadTask
+{
+public:
+    virtual ~OffloadTask() {};
+
+    /** Performs the blocking call in a native worker thread. This runs
+     * concurrently with the pth scheduler: it must neither log nor touch
+     * objects, rules or any pth primitive, only its own members. */
+    virtual void run() = 0;
+    /** Called back in the pth scheduler once run() has returned, e.g. to
+     * log the outcome. */
+    virtual void finish() {};
+};
+
+/** Small pool of native threads executing the blocking library calls
+ * (database queries, HTTP/SMTP sessions, file writes) that would otherwise
+ * freeze every pth thread. Completions are reported to the pth scheduler
+ * through a pipe watched by the dispatcher thread. */
+class OffloadPool : protected Thread
+{
+public:
+    static OffloadPool* instance();
+    static void reset()
+    {
+        if (instance_m)
+            delete instance_m;
+        instance_m = 0;
+    };
+
+    /** Runs the task and suspends the calling pth thread until it is
+     * finished, the other pth threads keep running meanwhile. The task
+     * remains owned by the caller. */
+    void execute(OffloadTask* task, const void* serialKey = 0);
+    /** Queues the task and returns immediately. The pool deletes it once
+     * finished. */
+    void post(OffloadTask* task, const void* serialKey = 0);
+    /** Waits until all the tasks queued with serialKey are finished. */
+    void sync(const void* serialKey);
+
+    int getPendingCount();
+
+    static const int MaxWorkers = 4;
+
+private:
+    OffloadPool();
+    virtual ~OffloadPool();
+
+    /** Tasks sharing a non-null serial key never run concurrently and are
+     * started in submission order. */
+    struct Job
+    {
+        OffloadTask* task;
+        const void* serialKey;
+        pth_sem_t* done;
+    };
+    typedef std::list<Job> JobList_t;
+
+    void submit(const Job& job);
+    bool nextJob(Job& job);
+    void complete();
+    void Run (pth_sem_t * stop);
+
+    static void* workerEntry(void* arg);
+    void worker();
+
+    pthread_mutex_t mutex_m;
+    pthread_cond_t cond_m;
+    JobList_t pending_m;
+    JobList_t finished_m;
+    /** Serial keys of the jobs being run, null for the unkeyed ones */
+    std::list<const void*> running_m;
+    std::vector<pthread_t> workers_m;
+    int idle_m;
+    bool stopping_m;
+    int pipe_m[2];
+
+    static OffloadPool* instance_m;
+    static Logger& logger_m;
+};
+
+#endif
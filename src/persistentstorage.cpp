@@ -18,29 +18,271 @@
 */
 
 #include "persistentstorage.h"
+#include "offloadpool.h"
+#include "clock.h"
 #include <iostream>
+#include <algorithm>
 #include <fstream>
 #include <ctime>
-#include <iomanip>
+#include <cstdio>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+namespace
+{
+    // Records of the lsm files and of the restore snapshot: a 4 bytes
+    // length of the body, the CRC-32 of the body and the body, which is a
+    // 2 bytes id length, the id and the value. Integers are little-endian.
+    const char SnapshotMagic[] = "LINKNXS1";
+    const char RestoreMagic[] = "LINKNXR1";
+    const std::string::size_type RecordHeaderSize = 8;
+
+    uint32_t crc32(const char* data, std::string::size_type len)
+    {
+        uint32_t crc = 0xffffffff;
+        for (std::string::size_type i = 0; i < len; i++)
+        {
+            crc ^= (unsigned char)data[i];
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+        return ~crc;
+    }
+
+    void putInt(std::string& out, uint32_t value, int size)
+    {
+        for (int i = 0; i < size; i++)
+            out.push_back((char)((value >> (i * 8)) & 0xff));
+    }
+
+    uint32_t getInt(const char* data, int size)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < size; i++)
+            value |= (uint32_t)(unsigned char)data[i] << (i * 8);
+        return value;
+    }
+
+    void putRecord(std::string& out, const std::string& id, const std::string& value)
+    {
+        std::string::size_type start = out.size();
+        putInt(out, 2 + id.size() + value.size(), 4);
+        putInt(out, 0, 4);
+        putInt(out, id.size(), 2);
+        out.append(id).append(value);
+        uint32_t crc = crc32(out.data() + start + RecordHeaderSize, out.size() - start - RecordHeaderSize);
+        for (int i = 0; i < 4; i++)
+            out[start + 4 + i] = (char)((crc >> (i * 8)) & 0xff);
+    }
+
+    // Decodes the record at *pos of data, advancing it. Returns false if
+    // the record is truncated or corrupt.
+    bool getRecord(const char* data, std::string::size_type size, std::string::size_type* pos,
+                   std::string& id, std::string& value)
+    {
+        if (size - *pos < RecordHeaderSize)
+            return false;
+        uint32_t len = getInt(data + *pos, 4);
+        std::string::size_type body = *pos + RecordHeaderSize;
+        if (len < 2 || size - body < len)
+            return false;
+        if (getInt(data + *pos + 4, 4) != crc32(data + body, len))
+            return false;
+        uint32_t idLen = getInt(data + body, 2);
+        if (idLen > len - 2)
+            return false;
+        id.assign(data + body + 2, idLen);
+        value.assign(data + body + 2 + idLen, len - 2 - idLen);
+        *pos = body + len;
+        return true;
+    }
+
+    bool loadFile(const std::string& filename, std::string& data)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+        char buf[65536];
+        ssize_t len;
+        while ((len = ::read(fd, buf, sizeof(buf))) > 0 || (len == -1 && errno == EINTR))
+        {
+            if (len > 0)
+                data.append(buf, len);
+        }
+        close(fd);
+        return len == 0;
+    }
+
+    bool writeAll(int fd, const std::string& data)
+    {
+        std::string::size_type pos = 0;
+        while (pos < data.size())
+        {
+            ssize_t len = ::write(fd, data.data() + pos, data.size() - pos);
+            if (len == -1 && errno == EINTR)
+                continue;
+            if (len <= 0)
+                return false;
+            pos += len;
+        }
+        return true;
+    }
+
+    std::string errorText(const std::string& what, const std::string& filename)
+    {
+        return what + " '" + filename + "': " + strerror(errno);
+    }
+
+    int64_t monotonicMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+}
+
+Logger& PersistentStorage::logger_m(Logger::getInstance("PersistentStorage"));
+
+// Batch handed over to the offload pool. The batches of a storage are
+// serialized so that they are stored in the order they were queued.
+class PersistentStorage::FlushTask : public OffloadTask
+{
+public:
+    FlushTask(PersistentStorage* storage, Batch* batch)
+        : storage_m(storage), batch_m(batch), staleSnapshot_m(storage->takeStaleSnapshot(batch)) {};
+    virtual ~FlushTask() { delete batch_m; };
+
+    virtual void run()
+    {
+        if (staleSnapshot_m != "")
+            unlink(staleSnapshot_m.c_str());
+        storage_m->writeBatch(*batch_m);
+    };
+    virtual void finish() { storage_m->onFlushed(batch_m); };
+
+private:
+    PersistentStorage* storage_m;
+    Batch* batch_m;
+    std::string staleSnapshot_m;
+};
+
+// Writes the restore snapshot: the magic, a record with an empty id and
+// the source of the values, then a record per value.
+class PersistentStorage::SnapshotTask : public OffloadTask
+{
+public:
+    SnapshotTask(PersistentStorage* storage, const std::string& filename, const std::string& source, const ValueMap_t& values)
+        : storage_m(storage), filename_m(filename), source_m(source), values_m(values) {};
+
+    virtual void run()
+    {
+        std::string data(RestoreMagic);
+        putRecord(data, "", source_m);
+        for (ValueMap_t::iterator it = values_m.begin(); it != values_m.end(); it++)
+            putRecord(data, it->first, it->second);
+
+        std::string tmpFile = filename_m + ".tmp";
+        int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            error_m = errorText("Unable to create", tmpFile);
+            return;
+        }
+        bool ok = writeAll(fd, data) && fsync(fd) == 0;
+        if (close(fd) != 0 || !ok || rename(tmpFile.c_str(), filename_m.c_str()) != 0)
+        {
+            error_m = errorText("Unable to write", filename_m);
+            unlink(tmpFile.c_str());
+        }
+    }
+
+    virtual void finish()
+    {
+        if (error_m != "")
+        {
+            storage_m->errors_m++;
+            logger_m.errorStream() << error_m << endlog;
+            return;
+        }
+        storage_m->snapshots_m++;
+        logger_m.infoStream() << "Saved " << values_m.size() << " values to snapshot '" << filename_m << "'" << endlog;
+    }
+
+private:
+    PersistentStorage* storage_m;
+    std::string filename_m;
+    std::string source_m;
+    ValueMap_t values_m;
+    std::string error_m;
+};
+
+// Syncs the batches already stored, run after them
+class PersistentStorage::SyncTask : public OffloadTask
+{
+public:
+    SyncTask(PersistentStorage* storage) : storage_m(storage) {};
+
+    virtual void run() { error_m = storage_m->syncIdle(); };
+    virtual void finish()
+    {
+        if (error_m != "")
+        {
+            storage_m->errors_m++;
+            logger_m.errorStream() << error_m << endlog;
+        }
+    }
+
+private:
+    PersistentStorage* storage_m;
+    std::string error_m;
+};
+
+PersistentStorage::PersistentStorage()
+    : flushDelay_m(DefaultFlushDelay), stopped_m(false), retryDelay_m(0), snapshotInterval_m(DefaultSnapshotInterval),
+      snapshotCurrent_m(false), snapshotDirty_m(false), lastSnapshot_m(0), restoring_m(false),
+      restoredComplete_m(false), maxQueued_m(0), coalesced_m(0), batches_m(0), writtenValues_m(0),
+      writtenSamples_m(0), errors_m(0), retries_m(0), droppedSamples_m(0), snapshots_m(0)
+{
+    pth_sem_init(&wakeUp_m);
+}
+
+PersistentStorage::~PersistentStorage()
+{}
 
 PersistentStorage* PersistentStorage::create(ticpp::Element* pConfig)
 {
+    PersistentStorage* storage;
     std::string type = pConfig->GetAttribute("type");
     if (type == "file")
     {
         std::string path = pConfig->GetAttributeOrDefault("path", "/var/lib/linknx/persist");
         std::string logPath = pConfig->GetAttribute("logpath");
-        return new FilePersistentStorage(path, logPath);
+        storage = new FilePersistentStorage(path, logPath);
+    }
+    else if (type == "lsm")
+    {
+        storage = new LsmPersistentStorage(pConfig);
     }
 #ifdef HAVE_MYSQL
     else if (type == "mysql")
     {
-        return new MysqlPersistentStorage(pConfig);
+        storage = new MysqlPersistentStorage(pConfig);
     }
 #endif // HAVE_MYSQL
+#ifdef HAVE_SQLITE
+    else if (type == "sqlite")
+    {
+        storage = new SqlitePersistentStorage(pConfig);
+    }
+#endif // HAVE_SQLITE
     else if (type == "")
     {
         return 0;
@@ -51,210 +293,1606 @@ PersistentStorage* PersistentStorage::create(ticpp::Element* pConfig)
         msg << "PersistentStorage: storage type not supported: '" << type << "'" << std::endl;
         throw ticpp::Exception(msg.str());
     }
+    storage->importQueueXml(pConfig);
+    return storage;
 }
 
-Logger& FilePersistentStorage::logger_m(Logger::getInstance("FilePersistentStorage"));
+void PersistentStorage::importQueueXml(ticpp::Element* pConfig)
+{
+    pConfig->GetAttributeOrDefault("flush-delay", &flushDelay_m, DefaultFlushDelay);
+    if (flushDelay_m < 0)
+        throw ticpp::Exception("PersistentStorage: flush-delay must not be negative");
+    snapshotFile_m = pConfig->GetAttribute("snapshot");
+    pConfig->GetAttributeOrDefault("snapshot-interval", &snapshotInterval_m, DefaultSnapshotInterval);
+    if (snapshotInterval_m <= 0)
+        throw ticpp::Exception("PersistentStorage: snapshot-interval must be positive");
+    // Whatever snapshot is there goes away with the first stored value
+    snapshotCurrent_m = snapshotFile_m != "";
+    lastSnapshot_m = Clock::nowMs();
+}
 
-FilePersistentStorage::FilePersistentStorage(std::string &path, std::string &logPath) : path_m(path), logPath_m(logPath)
+void PersistentStorage::exportQueueXml(ticpp::Element* pConfig)
 {
-    int  len = path_m.size();
-    if (len > 0 && path_m[len-1] != '/')
-        path_m.push_back('/');
-    if (!opendir(path_m.c_str()))
-    {
-        std::stringstream msg;
-        msg << "FilePersistentStorage: error opening path: '" << path_m << "'" << std::endl;
-        throw ticpp::Exception(msg.str());
-    }
-    len = logPath_m.size();
-    if (len == 0)
-        logPath_m = path_m;
-    if (len > 0 && logPath_m[len-1] != '/')
-        logPath_m.push_back('/');
-    if (!opendir(logPath_m.c_str()))
+    if (flushDelay_m != DefaultFlushDelay)
+        pConfig->SetAttribute("flush-delay", flushDelay_m);
+    if (snapshotFile_m != "")
     {
-        std::stringstream msg;
-        msg << "FilePersistentStorage: error opening logpath: '" << logPath_m << "'" << std::endl;
-        throw ticpp::Exception(msg.str());
+        pConfig->SetAttribute("snapshot", snapshotFile_m);
+        if (snapshotInterval_m != DefaultSnapshotInterval)
+            pConfig->SetAttribute("snapshot-interval", snapshotInterval_m);
     }
 }
 
-void FilePersistentStorage::exportXml(ticpp::Element* pConfig)
+void PersistentStorage::write(const std::string& id, const std::string& value)
 {
-    pConfig->SetAttribute("type", "file");
-    pConfig->SetAttribute("path", path_m);
-    if (logPath_m != path_m)
-        pConfig->SetAttribute("logpath", logPath_m);
+    logger_m.debugStream() << "Queuing '" << value << "' for object '" << id << "'" << endlog;
+    std::pair<ValueMap_t::iterator, bool> res = values_m.insert(ValueMap_t::value_type(id, value));
+    if (!res.second)
+    {
+        res.first->second = value;
+        coalesced_m++;
+    }
+    if (snapshotFile_m != "")
+    {
+        known_m[id] = value;
+        snapshotDirty_m = true;
+    }
+    queued();
 }
 
-void FilePersistentStorage::write(const std::string& id, const std::string& value)
+std::string PersistentStorage::read(const std::string& id, const std::string& defval)
 {
-    logger_m.infoStream() << "Writing '" << value << "' for object '" << id << "'" << endlog;
-    std::string filename = path_m+id;
-    std::ofstream fp_out(filename.c_str(), std::ios::out);
-    fp_out << value;
-    fp_out.close(); 
-}
+    ValueMap_t::iterator it = values_m.find(id);
+    if (it != values_m.end())
+    {
+        logger_m.infoStream() << "Reading queued '" << it->second << "' for object '" << id << "'" << endlog;
+        return it->second;
+    }
+    std::list<Batch*>::reverse_iterator batchIt;
+    for (batchIt = flushing_m.rbegin(); batchIt != flushing_m.rend(); batchIt++)
+    {
+        it = (*batchIt)->values.find(id);
+        if (it != (*batchIt)->values.end())
+            return it->second;
+    }
 
-std::string FilePersistentStorage::read(const std::string& id, const std::string& defval)
-{
     std::string value;
-    std::string filename = path_m+id;
-    std::ifstream fp_in(filename.c_str(), std::ios::in);
-    std::getline(fp_in, value, static_cast<char>(-1));
-    if (fp_in.fail())
-        value = defval;
-    fp_in.close();
-    logger_m.infoStream() << "Reading '" << value << "' for object '" << id << "'" << endlog;
+    bool inSnapshot = false;
+    if (restoring_m && (it = restored_m.find(id)) != restored_m.end())
+    {
+        value = it->second;
+        inSnapshot = !restoredComplete_m;
+    }
+    else if (restoring_m && restoredComplete_m)
+        return defval;
+    else
+        value = readValue(id, defval);
+    if (snapshotFile_m != "" && value != defval)
+    {
+        std::pair<ValueMap_t::iterator, bool> res = known_m.insert(ValueMap_t::value_type(id, value));
+        if (res.second && !inSnapshot)
+            snapshotDirty_m = true;
+    }
     return value;
 }
 
-void FilePersistentStorage::writelog(const std::string& id, const std::string& value)
+bool PersistentStorage::readAll(ValueMap_t& values)
 {
-    logger_m.infoStream() << "Writing log'" << value << "' for object '" << id << "'" << endlog;
-    std::string filename = logPath_m+id+".log";
-    std::ofstream fp_out(filename.c_str(), std::ios::app);
-
-    time_t tim = time(0);
-    struct tm * timeinfo = localtime(&tim);
+    if (!readAllValues(values))
+        return false;
+    std::list<Batch*>::iterator batchIt;
+    for (batchIt = flushing_m.begin(); batchIt != flushing_m.end(); batchIt++)
+        for (ValueMap_t::iterator it = (*batchIt)->values.begin(); it != (*batchIt)->values.end(); it++)
+            values[it->first] = it->second;
+    for (ValueMap_t::iterator it = values_m.begin(); it != values_m.end(); it++)
+        values[it->first] = it->second;
+    return true;
+}
 
-    fp_out << timeinfo->tm_year+1900 << "-" << timeinfo->tm_mon+1 << "-" << timeinfo->tm_mday << " ";
-    fp_out << std::setfill('0') << std::setw(2) 
-    << timeinfo->tm_hour << ":" << std::setfill('0') << std::setw(2)
-    << timeinfo->tm_min << ":" << std::setfill('0') << std::setw(2)
-    << timeinfo->tm_sec;
-    fp_out << " > " << value << "\n";
-    fp_out.close(); 
+bool PersistentStorage::readHistory(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit)
+{
+    samples.clear();
+    if (!readHistoryValues(id, start, end, samples, limit))
+        return false;
+    // The samples not stored yet are more recent
+    std::list<Batch*>::iterator batchIt;
+    std::vector<const SampleList_t*> pending;
+    for (batchIt = flushing_m.begin(); batchIt != flushing_m.end(); batchIt++)
+        pending.push_back(&(*batchIt)->samples);
+    pending.push_back(&samples_m);
+    for (unsigned i = 0; i < pending.size(); i++)
+    {
+        for (SampleList_t::const_iterator it = pending[i]->begin(); it != pending[i]->end(); it++)
+        {
+            if (limit > 0 && (int)samples.size() >= limit)
+                return true;
+            if (it->id == id && it->time >= start && it->time <= end)
+                samples.push_back(*it);
+        }
+    }
+    return true;
 }
 
+bool PersistentStorage::readHistoryValues(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit)
+{
+    return false;
+}
 
-#ifdef HAVE_MYSQL
-Logger& MysqlPersistentStorage::logger_m(Logger::getInstance("MysqlPersistentStorage"));
+void PersistentStorage::beginRestore()
+{
+    restored_m.clear();
+    restoredComplete_m = false;
+    if (snapshotFile_m != "" && loadSnapshot(restored_m))
+        restoreSource_m = "snapshot";
+    else if (readAll(restored_m))
+    {
+        restoredComplete_m = true;
+        restoreSource_m = "backend";
+    }
+    else
+    {
+        restored_m.clear();
+        restoreSource_m = "none";
+    }
+    restoring_m = true;
+    logger_m.infoStream() << "Restoring " << restored_m.size() << " values from " << restoreSource_m << endlog;
+}
 
-MysqlPersistentStorage::MysqlPersistentStorage(ticpp::Element* pConfig)
+void PersistentStorage::endRestore()
 {
-    my_bool reconnect = 1;
-    host_m = pConfig->GetAttribute("host");
-    user_m = pConfig->GetAttribute("user");
-    pass_m = pConfig->GetAttribute("pass");
-    db_m = pConfig->GetAttribute("db");
-    table_m = pConfig->GetAttribute("table");
-    logtable_m = pConfig->GetAttribute("logtable");
-    charset_m = pConfig->GetAttribute("charset");
+    restoring_m = false;
+    restored_m.clear();
+}
 
-    if(mysql_init(&con_m)==NULL)
+bool PersistentStorage::loadSnapshot(ValueMap_t& values)
+{
+    int fd = open(snapshotFile_m.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        logger_m.infoStream() << "No snapshot '" << snapshotFile_m << "' to restore from" << endlog;
+        return false;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
     {
-        throw ticpp::Exception("MysqlPersistentStorage: error initializing client");
+        logger_m.warnStream() << "Unable to map snapshot '" << snapshotFile_m << "'" << endlog;
+        return false;
     }
-    mysql_options(&con_m, MYSQL_OPT_RECONNECT, &reconnect);
 
-    if(!charset_m.empty())
+    const char* data = static_cast<const char*>(map);
+    std::string::size_type size = st.st_size;
+    std::string::size_type pos = sizeof(RestoreMagic) - 1;
+    std::string id, value;
+    bool ok = size >= pos && memcmp(data, RestoreMagic, pos) == 0 &&
+              getRecord(data, size, &pos, id, value) && id == "" && value == getSource();
+    while (ok && pos < size)
     {
-        mysql_options(&con_m, MYSQL_SET_CHARSET_NAME, charset_m.c_str());
+        ok = getRecord(data, size, &pos, id, value);
+        if (ok)
+            values[id] = value;
     }
+    munmap(map, st.st_size);
+    if (!ok)
+    {
+        logger_m.warnStream() << "Ignoring invalid snapshot '" << snapshotFile_m << "'" << endlog;
+        values.clear();
+    }
+    return ok;
+}
+
+void PersistentStorage::writelog(const std::string& id, const std::string& value)
+{
+    logger_m.debugStream() << "Queuing log '" << value << "' for object '" << id << "'" << endlog;
+    Sample sample;
+    sample.id = id;
+    sample.value = value;
+    sample.time = Clock::now();
+    samples_m.push_back(sample);
+    queued();
+}
 
-    if (!mysql_real_connect(&con_m, host_m.c_str(), user_m.c_str(), pass_m.c_str(), db_m.c_str(), 0,NULL,0)) 
+void PersistentStorage::queued()
+{
+    int count = getQueuedCount();
+    if (count > maxQueued_m)
+        maxQueued_m = count;
+    if (stopped_m)
+        return;
+    // The flusher only needs to know when the queue stops being empty, and
+    // when it is full enough not to wait for the end of the delay
+    if (count == 1 || count == MaxQueued)
     {
-        std::stringstream msg;
-        msg << "MysqlPersistentStorage: error connecting to '" << db_m << "' on host '" << host_m << "' with user '" << user_m << "', error was '" << mysql_error(&con_m) << "'" <<std::endl;
-        throw ticpp::Exception(msg.str());
+        Start();
+        pth_sem_inc(&wakeUp_m, FALSE);
     }
+}
+
+PersistentStorage::Batch* PersistentStorage::takeBatch()
+{
+    if (values_m.empty() && samples_m.empty())
+        return 0;
+    Batch* batch = new Batch();
+    batch->values.swap(values_m);
+    batch->samples.swap(samples_m);
+    flushing_m.push_back(batch);
+    return batch;
+}
 
-    if(!charset_m.empty())
+void PersistentStorage::requeue(Batch* batch)
+{
+    bool wasEmpty = getQueuedCount() == 0;
+    // The values queued meanwhile are newer
+    for (ValueMap_t::iterator it = batch->values.begin(); it != batch->values.end(); it++)
+        values_m.insert(*it);
+    samples_m.insert(samples_m.begin(), batch->samples.begin(), batch->samples.end());
+    if (samples_m.size() > (SampleList_t::size_type)MaxRetainedSamples)
     {
-        mysql_options(&con_m, MYSQL_SET_CHARSET_NAME, ("set names " + charset_m).c_str());
+        int dropped = samples_m.size() - MaxRetainedSamples;
+        samples_m.erase(samples_m.begin(), samples_m.begin() + dropped);
+        droppedSamples_m += dropped;
+        logger_m.warnStream() << "Dropped the " << dropped << " oldest log samples" << endlog;
+    }
+    int count = getQueuedCount();
+    if (count > maxQueued_m)
+        maxQueued_m = count;
+    if (wasEmpty && count > 0)
+    {
+        Start();
+        pth_sem_inc(&wakeUp_m, FALSE);
     }
 }
 
-MysqlPersistentStorage::~MysqlPersistentStorage()
+std::string PersistentStorage::takeStaleSnapshot(Batch* batch)
 {
-    mysql_close(&con_m);
+    if (!snapshotCurrent_m || batch->values.empty())
+        return "";
+    snapshotCurrent_m = false;
+    return snapshotFile_m;
 }
 
-void MysqlPersistentStorage::exportXml(ticpp::Element* pConfig)
+int64_t PersistentStorage::getSnapshotWait()
 {
-    pConfig->SetAttribute("type", "mysql");
-    pConfig->SetAttribute("host", host_m);
-    pConfig->SetAttribute("user", user_m);
-    pConfig->SetAttribute("pass", pass_m);
-    pConfig->SetAttribute("db", db_m);
-    pConfig->SetAttribute("table", table_m);
-    pConfig->SetAttribute("logtable", logtable_m);
-    if (charset_m != "")
-        pConfig->SetAttribute("charset", charset_m);
+    if (snapshotFile_m == "" || !snapshotDirty_m)
+        return -1;
+    int64_t wait = lastSnapshot_m + snapshotInterval_m - Clock::nowMs();
+    return wait > 0 ? wait : 0;
 }
 
-void MysqlPersistentStorage::write(const std::string& id, const std::string& value)
+int64_t PersistentStorage::getIdleWait()
 {
-    if (table_m == "")
-        return;
-    logger_m.infoStream() << "Writing '" << value << "' for object '" << id << "'" << endlog;
+    int64_t snapshotWait = getSnapshotWait();
+    int64_t syncWait = getSyncWait();
+    if (snapshotWait < 0 || (syncWait >= 0 && syncWait < snapshotWait))
+        return syncWait;
+    return snapshotWait;
+}
 
-    std::stringstream sql;
-    sql << "INSERT INTO `" << table_m << "` (`object`, `value`) VALUES ('" << id << "', '" << value << "') ON DUPLICATE KEY UPDATE `value` = '" << value << "';";
+void PersistentStorage::saveSnapshot(bool sync)
+{
+    // Queued after the batches, so the snapshot never gets ahead of the
+    // stored values, and removed by the next batch
+    SnapshotTask* task = new SnapshotTask(this, snapshotFile_m, getSource(), known_m);
+    snapshotCurrent_m = true;
+    snapshotDirty_m = false;
+    lastSnapshot_m = Clock::nowMs();
+    if (sync)
+    {
+        OffloadPool::instance()->execute(task, this);
+        delete task;
+    }
+    else
+        OffloadPool::instance()->post(task, this);
+}
 
-    if (mysql_real_query(&con_m, sql.str().c_str(), sql.str().length()) != 0)
+void PersistentStorage::flush()
+{
+    Batch* batch = takeBatch();
+    if (batch == 0)
     {
-        logger_m.errorStream() << "Error executing: '" << sql.str() << "' mySQL said: '" << mysql_error(&con_m) << "'" << endlog;
+        // Still wait for the batches handed over by the flusher
+        OffloadPool::instance()->sync(this);
+        return;
     }
+    FlushTask task(this, batch);
+    OffloadPool::instance()->execute(&task, this);
 }
 
-std::string MysqlPersistentStorage::read(const std::string& id, const std::string& defval)
+void PersistentStorage::shutdown()
 {
-    std::string value;
-    
-    if (table_m == "")
+    if (stopped_m)
+        return;
+    stopped_m = true;
+    Stop();
+    // Other threads may queue updates while we wait for the pool
+    do
+        flush();
+    while (getQueuedCount() > 0);
+    if (snapshotFile_m != "" && (snapshotDirty_m || access(snapshotFile_m.c_str(), F_OK) != 0))
+        saveSnapshot(true);
+}
+
+void PersistentStorage::onFlushed(Batch* batch)
+{
+    flushing_m.remove(batch);
+    if (batch->retry && !stopped_m)
+    {
+        retries_m++;
+        retryDelay_m = std::min(std::max(retryDelay_m * 2, (int)MinRetryDelay), (int)MaxRetryDelay);
+        logger_m.errorStream() << batch->error << ", retrying in " << retryDelay_m << " ms" << endlog;
+        requeue(batch);
+        return;
+    }
+    if (batch->retry)
     {
-        value = defval;
+        errors_m++;
+        logger_m.errorStream() << batch->error << ", dropping " << batch->values.size() << " values and "
+                               << batch->samples.size() << " log samples" << endlog;
+        return;
     }
-    else
+    retryDelay_m = 0;
+    // The flusher may have to sync it later
+    if (getSyncWait() >= 0)
+        pth_sem_inc(&wakeUp_m, FALSE);
+    batches_m++;
+    writtenValues_m += batch->values.size();
+    writtenSamples_m += batch->samples.size();
+    if (batch->error != "")
     {
-        std::stringstream sql;
-        sql << "SELECT `value` FROM `" << table_m << "` WHERE `object`='" << id << "';";
+        errors_m++;
+        logger_m.errorStream() << batch->error << endlog;
+    }
+    else
+        logger_m.infoStream() << "Stored " << batch->values.size() << " values and "
+                              << batch->samples.size() << " log samples" << endlog;
+}
 
-        if (mysql_real_query(&con_m, sql.str().c_str(), sql.str().length()) == 0)
+void PersistentStorage::Run (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeUp = pth_event (PTH_EVENT_SEM, &wakeUp_m);
+    pth_event_concat (stop, wakeUp, NULL);
+    logger_m.debugStream() << "Starting PersistentStorage flusher." << endlog;
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        pth_sem_set_value(&wakeUp_m, 0);
+        if (getQueuedCount() == 0)
         {
-            MYSQL_RES *result;
-            MYSQL_ROW row;
-            
-            result = mysql_store_result(&con_m);
-            
-            if (mysql_num_rows(result) > 0)
+            int64_t wait = getIdleWait();
+            if (wait == 0 && getSyncWait() == 0)
             {
-                row = mysql_fetch_row(result);
-                value = row[0];
+                SyncTask task(this);
+                OffloadPool::instance()->execute(&task, this);
             }
+            else if (wait == 0)
+                saveSnapshot(false);
+            else if (wait > 0)
+                Clock::sleep(wait, stop);
             else
-            {
-                value = defval;
-            }
-
-            mysql_free_result(result);
+                pth_wait(stop);
         }
         else
         {
-            value = defval;
-            
-            logger_m.errorStream() << "Error executing: '" << sql.str() << "' mySQL said: '" << mysql_error(&con_m) << "'" << endlog;
+            // Let the updates pile up, a full queue ends the wait earlier
+            // unless the last batch failed
+            if (retryDelay_m > 0)
+                Clock::sleep(std::max(flushDelay_m, retryDelay_m), stop);
+            else if (getQueuedCount() < MaxQueued)
+                Clock::sleep(flushDelay_m, stop);
+            Batch* batch = takeBatch();
+            if (batch)
+                OffloadPool::instance()->post(new FlushTask(this, batch), this);
         }
     }
+    logger_m.debugStream() << "Out of PersistentStorage flusher." << endlog;
+    pth_event_isolate (wakeUp);
+    pth_event_free (wakeUp, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
+}
 
-    logger_m.infoStream() << "Reading '" << value << "' for object '" << id << "'" << endlog;
-    return value;
+void PersistentStorage::statusXml(ticpp::Element* pStatus)
+{
+    pStatus->SetAttribute("queued-values", values_m.size());
+    pStatus->SetAttribute("queued-samples", samples_m.size());
+    pStatus->SetAttribute("max-queued", maxQueued_m);
+    pStatus->SetAttribute("coalesced", coalesced_m);
+    pStatus->SetAttribute("batches", batches_m);
+    pStatus->SetAttribute("written-values", writtenValues_m);
+    pStatus->SetAttribute("written-samples", writtenSamples_m);
+    pStatus->SetAttribute("errors", errors_m);
+    pStatus->SetAttribute("retries", retries_m);
+    pStatus->SetAttribute("dropped-samples", droppedSamples_m);
+    pStatus->SetAttribute("flush-delay", flushDelay_m);
+    if (snapshotFile_m != "")
+        pStatus->SetAttribute("snapshots", snapshots_m);
+    if (restoreSource_m != "")
+        pStatus->SetAttribute("restored-from", restoreSource_m);
 }
 
-void MysqlPersistentStorage::writelog(const std::string& id, const std::string& value)
+Logger& FilePersistentStorage::logger_m(Logger::getInstance("FilePersistentStorage"));
+
+namespace
 {
-    if (logtable_m == "")
-        return;
-    logger_m.infoStream() << "Writing log '" << value << "' for object '" << id << "'" << endlog;
+    class FileRead : public OffloadTask
+    {
+    public:
+        FileRead(const std::string& filename) : filename_m(filename), ok_m(false) {};
 
-    std::stringstream sql;
-    sql << "INSERT INTO `" << logtable_m << "` (ts, object, value) VALUES (NOW(), '" << id << "', '" << value << "');";
+        virtual void run()
+        {
+            std::ifstream fp_in(filename_m.c_str(), std::ios::in);
+            std::getline(fp_in, value_m, static_cast<char>(-1));
+            ok_m = !fp_in.fail();
+            fp_in.close();
+        }
+
+        std::string filename_m;
+        std::string value_m;
+        bool ok_m;
+    };
+
+    // Lists the values of all the objects, one file each
+    class FileReadAll : public OffloadTask
+    {
+    public:
+        FileReadAll(const std::string& path, bool skipLogs, PersistentStorage::ValueMap_t& values)
+            : path_m(path), skipLogs_m(skipLogs), values_m(values), ok_m(false) {};
+
+        virtual void run()
+        {
+            DIR* dir = opendir(path_m.c_str());
+            if (!dir)
+                return;
+            struct dirent* entry;
+            while ((entry = readdir(dir)) != 0)
+            {
+                std::string name = entry->d_name;
+                if (name[0] == '.')
+                    continue;
+                struct stat st;
+                std::string value;
+                if (stat((path_m + name).c_str(), &st) == 0 && S_ISREG(st.st_mode) && loadFile(path_m + name, value))
+                    values_m[name] = value;
+            }
+            closedir(dir);
+            // A log shares the directory with the values, "id.log" is the
+            // log of object "id" if its value is there too
+            if (skipLogs_m)
+            {
+                PersistentStorage::ValueMap_t::iterator it = values_m.begin();
+                while (it != values_m.end())
+                {
+                    const std::string& name = it->first;
+                    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".log") == 0 &&
+                        values_m.find(name.substr(0, name.size() - 4)) != values_m.end())
+                        values_m.erase(it++);
+                    else
+                        it++;
+                }
+            }
+            ok_m = true;
+        }
+
+        std::string path_m;
+        bool skipLogs_m;
+        PersistentStorage::ValueMap_t& values_m;
+        bool ok_m;
+    };
 
-    if (mysql_real_query(&con_m, sql.str().c_str(), sql.str().length()) != 0)
+    void writeFile(const std::string& filename, const std::string& data, std::ios::openmode mode,
+                   PersistentStorage::Batch& batch)
     {
-        logger_m.errorStream() << "Error executing: '" << sql.str() << "' mySQL said: '" << mysql_error(&con_m) << "'" << endlog;
+        std::ofstream fp_out(filename.c_str(), mode);
+        fp_out << data;
+        fp_out.close();
+        if (fp_out.fail() && batch.error == "")
+            batch.error = "Unable to write to '" + filename + "'";
     }
 }
-#endif // HAVE_MYSQL
+
+FilePersistentStorage::FilePersistentStorage(std::string &path, std::string &logPath) : path_m(path), logPath_m(logPath)
+{
+    int  len = path_m.size();
+    if (len > 0 && path_m[len-1] != '/')
+        path_m.push_back('/');
+    if (!opendir(path_m.c_str()))
+    {
+        std::stringstream msg;
+        msg << "FilePersistentStorage: error opening path: '" << path_m << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+    len = logPath_m.size();
+    if (len == 0)
+        logPath_m = path_m;
+    if (len > 0 && logPath_m[len-1] != '/')
+        logPath_m.push_back('/');
+    if (!opendir(logPath_m.c_str()))
+    {
+        std::stringstream msg;
+        msg << "FilePersistentStorage: error opening logpath: '" << logPath_m << "'" << std::endl;
+        throw ticpp::Exception(msg.str());
+    }
+}
+
+FilePersistentStorage::~FilePersistentStorage()
+{
+    shutdown();
+}
+
+void FilePersistentStorage::exportXml(ticpp::Element* pConfig)
+{
+    pConfig->SetAttribute("type", "file");
+    pConfig->SetAttribute("path", path_m);
+    if (logPath_m != path_m)
+        pConfig->SetAttribute("logpath", logPath_m);
+    exportQueueXml(pConfig);
+}
+
+bool FilePersistentStorage::readAllValues(ValueMap_t& values)
+{
+    FileReadAll task(path_m, logPath_m == path_m, values);
+    OffloadPool::instance()->execute(&task, this);
+    return task.ok_m;
+}
+
+std::string FilePersistentStorage::getSource()
+{
+    return "file:" + path_m;
+}
+
+void FilePersistentStorage::writeBatch(Batch& batch)
+{
+    for (ValueMap_t::iterator it = batch.values.begin(); it != batch.values.end(); it++)
+        writeFile(path_m+it->first, it->second, std::ios::out, batch);
+
+    // The samples of an object are appended to its log in a single write
+    std::map<std::string, std::string> logs;
+    for (SampleList_t::iterator it = batch.samples.begin(); it != batch.samples.end(); it++)
+    {
+        struct tm timeinfo;
+        localtime_r(&it->time, &timeinfo);
+        char stamp[32];
+        snprintf(stamp, sizeof(stamp), "%d-%d-%d %02d:%02d:%02d > ",
+                 timeinfo.tm_year+1900, timeinfo.tm_mon+1, timeinfo.tm_mday,
+                 timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+        std::string& log = logs[it->id];
+        log.append(stamp).append(it->value).append("\n");
+    }
+    for (std::map<std::string, std::string>::iterator it = logs.begin(); it != logs.end(); it++)
+        writeFile(logPath_m+it->first+".log", it->second, std::ios::app, batch);
+}
+
+std::string FilePersistentStorage::readValue(const std::string& id, const std::string& defval)
+{
+    FileRead task(path_m+id);
+    OffloadPool::instance()->execute(&task, this);
+    std::string value = task.ok_m ? task.value_m : defval;
+    logger_m.infoStream() << "Reading '" << value << "' for object '" << id << "'" << endlog;
+    return value;
+}
+
+
+Logger& LsmPersistentStorage::logger_m(Logger::getInstance("LsmPersistentStorage"));
+
+LsmPersistentStorage::LsmPersistentStorage(ticpp::Element* pConfig)
+    : logFd_m(-1), historyFd_m(-1), logSize_m(0), snapshotSize_m(0), dirty_m(false),
+      lastSync_m(0), dropped_m(0), compactions_m(0), syncs_m(0)
+{
+    pthread_mutex_init(&indexMutex_m, 0);
+    pthread_mutex_init(&syncMutex_m, 0);
+    path_m = pConfig->GetAttributeOrDefault("path", "/var/lib/linknx/persist");
+    logPath_m = pConfig->GetAttribute("logpath");
+    if (path_m.size() > 0 && path_m[path_m.size()-1] != '/')
+        path_m.push_back('/');
+    if (logPath_m == "")
+        logPath_m = path_m;
+    if (logPath_m[logPath_m.size()-1] != '/')
+        logPath_m.push_back('/');
+
+    std::string sync = pConfig->GetAttributeOrDefault("sync", "batch");
+    if (sync == "batch")
+        sync_m = SyncBatch;
+    else if (sync == "interval")
+        sync_m = SyncInterval;
+    else if (sync == "none")
+        sync_m = SyncNone;
+    else
+        throw ticpp::Exception("LsmPersistentStorage: invalid sync policy '" + sync + "'");
+    pConfig->GetAttributeOrDefault("sync-interval", &syncInterval_m, DefaultSyncInterval);
+    pConfig->GetAttributeOrDefault("compact-size", &compactSize_m, DefaultCompactSize);
+
+    try
+    {
+        load();
+    }
+    catch (...)
+    {
+        if (logFd_m != -1)
+            close(logFd_m);
+        pthread_mutex_destroy(&indexMutex_m);
+        pthread_mutex_destroy(&syncMutex_m);
+        throw;
+    }
+    historyFd_m = open((logPath_m + "history.log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (historyFd_m == -1)
+    {
+        std::string error = errorText("LsmPersistentStorage: error opening", logPath_m + "history.log");
+        close(logFd_m);
+        pthread_mutex_destroy(&indexMutex_m);
+        pthread_mutex_destroy(&syncMutex_m);
+        throw ticpp::Exception(error);
+    }
+    lastSync_m = monotonicMs();
+    logger_m.infoStream() << "Loaded " << index_m.size() << " values from '" << path_m << "'" << endlog;
+}
+
+LsmPersistentStorage::~LsmPersistentStorage()
+{
+    shutdown();
+    if (dirty_m)
+    {
+        fdatasync(logFd_m);
+        fdatasync(historyFd_m);
+    }
+    close(logFd_m);
+    close(historyFd_m);
+    pthread_mutex_destroy(&indexMutex_m);
+    pthread_mutex_destroy(&syncMutex_m);
+}
+
+void LsmPersistentStorage::load()
+{
+    std::string snapshotFile = path_m + "values.snap";
+    std::string logFile = path_m + "values.log";
+    // Left over by a compaction that did not complete, the log still holds its values
+    unlink((snapshotFile + ".tmp").c_str());
+
+    std::string data, id, value;
+    if (loadFile(snapshotFile, data))
+    {
+        // The snapshot is renamed into place once complete, it is never
+        // torn. If it was damaged anyway the values read up to there and
+        // those of the log are kept, the next compaction writes a new one.
+        std::string::size_type pos = sizeof(SnapshotMagic) - 1;
+        bool ok = data.compare(0, pos, SnapshotMagic) == 0;
+        while (ok && pos < data.size())
+        {
+            ok = getRecord(data.data(), data.size(), &pos, id, value);
+            if (ok)
+                index_m[id] = value;
+        }
+        if (ok)
+            snapshotSize_m = data.size();
+        else
+        {
+            logger_m.errorStream() << "Corrupt snapshot '" << snapshotFile << "', kept " << index_m.size()
+                                   << " values, the others are only restored from the log" << endlog;
+            if (rename(snapshotFile.c_str(), (snapshotFile + ".corrupt").c_str()) != 0)
+                throw ticpp::Exception(errorText("LsmPersistentStorage: error renaming", snapshotFile));
+        }
+    }
+    else if (errno != ENOENT)
+        throw ticpp::Exception(errorText("LsmPersistentStorage: error reading", snapshotFile));
+
+    logFd_m = open(logFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (logFd_m == -1)
+        throw ticpp::Exception(errorText("LsmPersistentStorage: error opening", logFile));
+    data.clear();
+    if (!loadFile(logFile, data))
+        throw ticpp::Exception(errorText("LsmPersistentStorage: error reading", logFile));
+    std::string::size_type pos = 0;
+    while (getRecord(data.data(), data.size(), &pos, id, value))
+        index_m[id] = value;
+    if (pos < data.size())
+    {
+        dropped_m = data.size() - pos;
+        logger_m.warnStream() << "Dropping " << dropped_m << " bytes of incomplete records from '" << logFile << "'" << endlog;
+        if (ftruncate(logFd_m, pos) == -1 || fdatasync(logFd_m) == -1)
+            throw ticpp::Exception(errorText("LsmPersistentStorage: error truncating", logFile));
+    }
+    logSize_m = pos;
+}
+
+void LsmPersistentStorage::exportXml(ticpp::Element* pConfig)
+{
+    pConfig->SetAttribute("type", "lsm");
+    pConfig->SetAttribute("path", path_m);
+    if (logPath_m != path_m)
+        pConfig->SetAttribute("logpath", logPath_m);
+    if (sync_m == SyncInterval)
+    {
+        pConfig->SetAttribute("sync", "interval");
+        if (syncInterval_m != DefaultSyncInterval)
+            pConfig->SetAttribute("sync-interval", syncInterval_m);
+    }
+    else if (sync_m == SyncNone)
+        pConfig->SetAttribute("sync", "none");
+    if (compactSize_m != DefaultCompactSize)
+        pConfig->SetAttribute("compact-size", compactSize_m);
+    exportQueueXml(pConfig);
+}
+
+void LsmPersistentStorage::writeBatch(Batch& batch)
+{
+    // Group commit: all the values of the batch go to the log in one write
+    std::string records;
+    for (ValueMap_t::iterator it = batch.values.begin(); it != batch.values.end(); it++)
+        putRecord(records, it->first, it->second);
+    if (!records.empty())
+    {
+        if (!writeAll(logFd_m, records))
+        {
+            batch.error = errorText("Unable to append to", path_m + "values.log");
+            // Do not leave a partial record before the next ones, the
+            // samples are not written either and the batch is stored later
+            if (ftruncate(logFd_m, logSize_m) == -1) {}
+            batch.retry = true;
+            return;
+        }
+        logSize_m += records.size();
+        setDirty();
+        pthread_mutex_lock(&indexMutex_m);
+        for (ValueMap_t::iterator it = batch.values.begin(); it != batch.values.end(); it++)
+            index_m[it->first] = it->second;
+        pthread_mutex_unlock(&indexMutex_m);
+    }
+
+    if (!batch.samples.empty())
+    {
+        std::string lines;
+        for (SampleList_t::iterator it = batch.samples.begin(); it != batch.samples.end(); it++)
+        {
+            struct tm timeinfo;
+            localtime_r(&it->time, &timeinfo);
+            char stamp[32];
+            snprintf(stamp, sizeof(stamp), "%d-%d-%d %02d:%02d:%02d ",
+                     timeinfo.tm_year+1900, timeinfo.tm_mon+1, timeinfo.tm_mday,
+                     timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+            lines.append(stamp).append(it->id).append(" > ").append(it->value).append("\n");
+        }
+        if (!writeAll(historyFd_m, lines) && batch.error == "")
+            batch.error = errorText("Unable to append to", logPath_m + "history.log");
+        setDirty();
+    }
+
+    sync(batch, sync_m == SyncBatch);
+    if (logSize_m > compactSize_m && logSize_m > snapshotSize_m)
+        compact(batch);
+}
+
+void LsmPersistentStorage::setDirty()
+{
+    pthread_mutex_lock(&syncMutex_m);
+    dirty_m = true;
+    pthread_mutex_unlock(&syncMutex_m);
+}
+
+void LsmPersistentStorage::sync(Batch& batch, bool force)
+{
+    // Only this thread sets dirty_m, no need to lock it for reading
+    if (!dirty_m || sync_m == SyncNone)
+        return;
+    int64_t now = monotonicMs();
+    if (!force && now - lastSync_m < syncInterval_m)
+        return;
+    if ((fdatasync(logFd_m) == -1 || fdatasync(historyFd_m) == -1) && batch.error == "")
+        batch.error = errorText("Unable to sync", path_m);
+    pthread_mutex_lock(&syncMutex_m);
+    dirty_m = false;
+    lastSync_m = now;
+    syncs_m++;
+    pthread_mutex_unlock(&syncMutex_m);
+}
+
+int64_t LsmPersistentStorage::getSyncWait()
+{
+    if (sync_m != SyncInterval)
+        return -1;
+    int64_t wait = -1;
+    pthread_mutex_lock(&syncMutex_m);
+    if (dirty_m)
+        wait = std::max(lastSync_m + syncInterval_m - monotonicMs(), (int64_t)0);
+    pthread_mutex_unlock(&syncMutex_m);
+    return wait;
+}
+
+std::string LsmPersistentStorage::syncIdle()
+{
+    Batch batch;
+    sync(batch, false);
+    return batch.error;
+}
+
+void LsmPersistentStorage::compact(Batch& batch)
+{
+    std::string snapshotFile = path_m + "values.snap";
+    std::string tmpFile = snapshotFile + ".tmp";
+    // The index is only changed by this thread, no need to lock it for reading
+    std::string data(SnapshotMagic);
+    for (ValueMap_t::iterator it = index_m.begin(); it != index_m.end(); it++)
+        putRecord(data, it->first, it->second);
+
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        if (batch.error == "")
+            batch.error = errorText("Unable to create", tmpFile);
+        return;
+    }
+    bool ok = writeAll(fd, data) && fsync(fd) == 0;
+    if (close(fd) != 0 || !ok || rename(tmpFile.c_str(), snapshotFile.c_str()) != 0)
+    {
+        if (batch.error == "")
+            batch.error = errorText("Unable to write", snapshotFile);
+        unlink(tmpFile.c_str());
+        return;
+    }
+    int dirFd = open(path_m.c_str(), O_RDONLY);
+    if (dirFd != -1)
+    {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    // Until this point a crash replays the whole log over the new snapshot,
+    // which yields the same values
+    if (ftruncate(logFd_m, 0) == -1 || fdatasync(logFd_m) == -1)
+    {
+        if (batch.error == "")
+            batch.error = errorText("Unable to truncate", path_m + "values.log");
+        return;
+    }
+    logSize_m = 0;
+    snapshotSize_m = data.size();
+    compactions_m++;
+}
+
+std::string LsmPersistentStorage::readValue(const std::string& id, const std::string& defval)
+{
+    std::string value = defval;
+    pthread_mutex_lock(&indexMutex_m);
+    ValueMap_t::iterator it = index_m.find(id);
+    if (it != index_m.end())
+        value = it->second;
+    pthread_mutex_unlock(&indexMutex_m);
+    logger_m.debugStream() << "Reading '" << value << "' for object '" << id << "'" << endlog;
+    return value;
+}
+
+bool LsmPersistentStorage::readAllValues(ValueMap_t& values)
+{
+    pthread_mutex_lock(&indexMutex_m);
+    for (ValueMap_t::iterator it = index_m.begin(); it != index_m.end(); it++)
+        values[it->first] = it->second;
+    pthread_mutex_unlock(&indexMutex_m);
+    return true;
+}
+
+std::string LsmPersistentStorage::getSource()
+{
+    return "lsm:" + path_m;
+}
+
+#ifdef HAVE_MYSQL
+Logger& MysqlPersistentStorage::logger_m(Logger::getInstance("MysqlPersistentStorage"));
+
+namespace
+{
+    void bindString(MYSQL_BIND& bind, unsigned long& length, const std::string& value)
+    {
+        memset(&bind, 0, sizeof(bind));
+        length = value.size();
+        bind.buffer_type = MYSQL_TYPE_STRING;
+        bind.buffer = const_cast<char*>(value.data());
+        bind.buffer_length = length;
+        bind.length = &length;
+    }
+
+    void bindLong(MYSQL_BIND& bind, long long& value)
+    {
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_LONGLONG;
+        bind.buffer = &value;
+    }
+
+    // Thread state of the client library for the duration of a task. The
+    // pool workers also run the tasks of the other backends.
+    class MysqlThread
+    {
+    public:
+        MysqlThread() { mysql_thread_init(); };
+        ~MysqlThread() { mysql_thread_end(); };
+    };
+}
+
+// Read run by the offload pool, serialized with the batches as they share
+// the connection. Reads all the values if values is not null.
+class MysqlPersistentStorage::ReadTask : public OffloadTask
+{
+public:
+    ReadTask(MysqlPersistentStorage* storage, const std::string& id, ValueMap_t* values = 0)
+        : storage_m(storage), id_m(id), values_m(values), ok_m(false), found_m(false) {};
+
+    virtual void run()
+    {
+        MysqlThread thread;
+        if (values_m)
+            ok_m = storage_m->selectAll(*values_m);
+        else
+            ok_m = storage_m->selectValue(id_m, value_m, &found_m);
+        if (!ok_m)
+        {
+            error_m = storage_m->error_m;
+            if (storage_m->isConnectionLost())
+                storage_m->disconnect();
+        }
+    }
+
+    virtual void finish()
+    {
+        if (!ok_m)
+            logger_m.errorStream() << error_m << endlog;
+    }
+
+    MysqlPersistentStorage* storage_m;
+    std::string id_m;
+    ValueMap_t* values_m;
+    bool ok_m;
+    bool found_m;
+    std::string value_m;
+    std::string error_m;
+};
+
+MysqlPersistentStorage::MysqlPersistentStorage(ticpp::Element* pConfig)
+    : connected_m(false), valueInsert_m(0), logInsert_m(0), select_m(0), errno_m(0)
+{
+    host_m = pConfig->GetAttribute("host");
+    user_m = pConfig->GetAttribute("user");
+    pass_m = pConfig->GetAttribute("pass");
+    db_m = pConfig->GetAttribute("db");
+    table_m = pConfig->GetAttribute("table");
+    logtable_m = pConfig->GetAttribute("logtable");
+    charset_m = pConfig->GetAttribute("charset");
+    pConfig->GetAttributeOrDefault("batch-rows", &batchRows_m, DefaultBatchRows);
+    if (batchRows_m <= 0)
+        throw ticpp::Exception("MysqlPersistentStorage: batch-rows must be positive");
+
+    if (!connect())
+        throw ticpp::Exception("MysqlPersistentStorage: " + error_m);
+}
+
+MysqlPersistentStorage::~MysqlPersistentStorage()
+{
+    shutdown();
+    disconnect();
+}
+
+void MysqlPersistentStorage::exportXml(ticpp::Element* pConfig)
+{
+    pConfig->SetAttribute("type", "mysql");
+    pConfig->SetAttribute("host", host_m);
+    pConfig->SetAttribute("user", user_m);
+    pConfig->SetAttribute("pass", pass_m);
+    pConfig->SetAttribute("db", db_m);
+    pConfig->SetAttribute("table", table_m);
+    pConfig->SetAttribute("logtable", logtable_m);
+    if (charset_m != "")
+        pConfig->SetAttribute("charset", charset_m);
+    if (batchRows_m != DefaultBatchRows)
+        pConfig->SetAttribute("batch-rows", batchRows_m);
+    exportQueueXml(pConfig);
+}
+
+bool MysqlPersistentStorage::connect()
+{
+    if (mysql_init(&con_m) == NULL)
+    {
+        error_m = "Error initializing client";
+        errno_m = 0;
+        return false;
+    }
+    // MYSQL_OPT_RECONNECT stays off, the prepared statements would not
+    // survive it. The next batch reconnects instead.
+    if (!charset_m.empty())
+        mysql_options(&con_m, MYSQL_SET_CHARSET_NAME, charset_m.c_str());
+    if (!mysql_real_connect(&con_m, host_m.c_str(), user_m.c_str(), pass_m.c_str(), db_m.c_str(), 0, NULL, 0))
+    {
+        fail("Error connecting to '" + db_m + "' on host '" + host_m + "' with user '" + user_m + "'");
+        mysql_close(&con_m);
+        return false;
+    }
+    connected_m = true;
+    // Each batch is a transaction
+    if (mysql_autocommit(&con_m, 0) != 0)
+    {
+        fail("Error disabling autocommit");
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void MysqlPersistentStorage::disconnect()
+{
+    if (!connected_m)
+        return;
+    if (valueInsert_m)
+        mysql_stmt_close(valueInsert_m);
+    if (logInsert_m)
+        mysql_stmt_close(logInsert_m);
+    if (select_m)
+        mysql_stmt_close(select_m);
+    valueInsert_m = logInsert_m = select_m = 0;
+    mysql_close(&con_m);
+    connected_m = false;
+}
+
+bool MysqlPersistentStorage::fail(const std::string& what, MYSQL_STMT* stmt)
+{
+    errno_m = stmt ? mysql_stmt_errno(stmt) : mysql_errno(&con_m);
+    error_m = what + ", mySQL said: '" + (stmt ? mysql_stmt_error(stmt) : mysql_error(&con_m)) + "'";
+    return false;
+}
+
+bool MysqlPersistentStorage::isConnectionLost()
+{
+    return !connected_m || errno_m == CR_SERVER_GONE_ERROR || errno_m == CR_SERVER_LOST ||
+           errno_m == CR_CONNECTION_ERROR || errno_m == CR_CONN_HOST_ERROR;
+}
+
+MYSQL_STMT* MysqlPersistentStorage::prepareInsert(bool log, int rows)
+{
+    MYSQL_STMT*& cached = log ? logInsert_m : valueInsert_m;
+    if (rows == batchRows_m && cached)
+        return cached;
+
+    std::stringstream sql;
+    if (log)
+    {
+        sql << "INSERT INTO `" << logtable_m << "` (ts, object, value) VALUES ";
+        for (int i = 0; i < rows; i++)
+            sql << (i ? ", " : "") << "(FROM_UNIXTIME(?), ?, ?)";
+    }
+    else
+    {
+        sql << "INSERT INTO `" << table_m << "` (`object`, `value`) VALUES ";
+        for (int i = 0; i < rows; i++)
+            sql << (i ? ", " : "") << "(?, ?)";
+        sql << " ON DUPLICATE KEY UPDATE `value` = VALUES(`value`)";
+    }
+    std::string query = sql.str();
+    MYSQL_STMT* stmt = mysql_stmt_init(&con_m);
+    if (!stmt)
+    {
+        fail("Error preparing insert");
+        return 0;
+    }
+    if (mysql_stmt_prepare(stmt, query.c_str(), query.length()) != 0)
+    {
+        fail("Error preparing insert into '" + std::string(log ? logtable_m : table_m) + "'", stmt);
+        mysql_stmt_close(stmt);
+        return 0;
+    }
+    if (rows == batchRows_m)
+        cached = stmt;
+    return stmt;
+}
+
+bool MysqlPersistentStorage::execute(MYSQL_STMT* stmt, std::vector<MYSQL_BIND>& binds)
+{
+    bool ok = true;
+    if (mysql_stmt_bind_param(stmt, &binds[0]) != 0 || mysql_stmt_execute(stmt) != 0)
+        ok = fail("Error executing insert", stmt);
+    // Only the statements of a full chunk are kept for the next batches
+    if (stmt != valueInsert_m && stmt != logInsert_m)
+        mysql_stmt_close(stmt);
+    return ok;
+}
+
+bool MysqlPersistentStorage::insertValues(const ValueMap_t& values, int* skipped)
+{
+    ValueMap_t::const_iterator it = values.begin();
+    int remaining = values.size();
+    while (remaining > 0)
+    {
+        int rows = std::min(remaining, skipped ? 1 : batchRows_m);
+        std::vector<MYSQL_BIND> binds(rows * 2);
+        std::vector<unsigned long> lengths(rows * 2);
+        for (int i = 0; i < rows; i++, it++)
+        {
+            bindString(binds[i*2], lengths[i*2], it->first);
+            bindString(binds[i*2+1], lengths[i*2+1], it->second);
+        }
+        MYSQL_STMT* stmt = prepareInsert(false, rows);
+        if (!stmt || !execute(stmt, binds))
+        {
+            if (!skipped || isConnectionLost())
+                return false;
+            (*skipped)++;
+        }
+        remaining -= rows;
+    }
+    return true;
+}
+
+bool MysqlPersistentStorage::insertSamples(const SampleList_t& samples, int* skipped)
+{
+    SampleList_t::const_iterator it = samples.begin();
+    int remaining = samples.size();
+    while (remaining > 0)
+    {
+        int rows = std::min(remaining, skipped ? 1 : batchRows_m);
+        std::vector<MYSQL_BIND> binds(rows * 3);
+        std::vector<unsigned long> lengths(rows * 3);
+        std::vector<long long> times(rows);
+        for (int i = 0; i < rows; i++, it++)
+        {
+            // The samples keep the time they were queued at
+            times[i] = it->time;
+            bindLong(binds[i*3], times[i]);
+            bindString(binds[i*3+1], lengths[i*3+1], it->id);
+            bindString(binds[i*3+2], lengths[i*3+2], it->value);
+        }
+        MYSQL_STMT* stmt = prepareInsert(true, rows);
+        if (!stmt || !execute(stmt, binds))
+        {
+            if (!skipped || isConnectionLost())
+                return false;
+            (*skipped)++;
+        }
+        remaining -= rows;
+    }
+    return true;
+}
+
+bool MysqlPersistentStorage::insertBatch(const Batch& batch, int* skipped)
+{
+    if (!connected_m && !connect())
+        return false;
+    if (table_m != "" && !insertValues(batch.values, skipped))
+        return false;
+    if (logtable_m != "" && !insertSamples(batch.samples, skipped))
+        return false;
+    if (mysql_commit(&con_m) != 0)
+        return fail("Error committing");
+    return true;
+}
+
+void MysqlPersistentStorage::writeBatch(Batch& batch)
+{
+    MysqlThread thread;
+    if (insertBatch(batch))
+        return;
+
+    if (!isConnectionLost())
+    {
+        // A single bad row fails its whole multi-row insert: the batch is
+        // stored again row by row, without the failing rows
+        std::string error = error_m;
+        mysql_rollback(&con_m);
+        int skipped = 0;
+        if (insertBatch(batch, &skipped))
+        {
+            if (skipped > 0)
+            {
+                std::stringstream msg;
+                msg << error << ", skipped " << skipped << " rows";
+                batch.error = msg.str();
+            }
+            return;
+        }
+    }
+
+    batch.error = error_m;
+    if (isConnectionLost())
+    {
+        // Nothing was committed, the batch is queued again
+        disconnect();
+        batch.retry = true;
+    }
+    else
+        mysql_rollback(&con_m);
+}
+
+bool MysqlPersistentStorage::selectValue(const std::string& id, std::string& value, bool* found)
+{
+    *found = false;
+    if (!connected_m && !connect())
+        return false;
+    if (!select_m)
+    {
+        std::string query = "SELECT `value` FROM `" + table_m + "` WHERE `object` = ?";
+        select_m = mysql_stmt_init(&con_m);
+        if (!select_m)
+            return fail("Error preparing select");
+        if (mysql_stmt_prepare(select_m, query.c_str(), query.length()) != 0)
+        {
+            fail("Error preparing select from '" + table_m + "'", select_m);
+            mysql_stmt_close(select_m);
+            select_m = 0;
+            return false;
+        }
+    }
+
+    MYSQL_BIND param, result;
+    unsigned long idLength, length = 0;
+    my_bool isNull = 0;
+    char buf[256];
+    bindString(param, idLength, id);
+    memset(&result, 0, sizeof(result));
+    result.buffer_type = MYSQL_TYPE_STRING;
+    result.buffer = buf;
+    result.buffer_length = sizeof(buf);
+    result.length = &length;
+    result.is_null = &isNull;
+    if (mysql_stmt_bind_param(select_m, &param) != 0 || mysql_stmt_execute(select_m) != 0 ||
+        mysql_stmt_bind_result(select_m, &result) != 0 || mysql_stmt_store_result(select_m) != 0)
+        return fail("Error selecting '" + id + "'", select_m);
+
+    bool ok = true;
+    int ret = mysql_stmt_fetch(select_m);
+    if (ret == 0 || ret == MYSQL_DATA_TRUNCATED)
+    {
+        *found = true;
+        if (isNull)
+            value = "";
+        else if (length <= sizeof(buf))
+            value.assign(buf, length);
+        else
+        {
+            std::vector<char> full(length);
+            result.buffer = &full[0];
+            result.buffer_length = length;
+            if (mysql_stmt_fetch_column(select_m, &result, 0, 0) == 0)
+                value.assign(&full[0], length);
+            else
+                ok = fail("Error fetching '" + id + "'", select_m);
+        }
+    }
+    else if (ret != MYSQL_NO_DATA)
+        ok = fail("Error fetching '" + id + "'", select_m);
+    mysql_stmt_free_result(select_m);
+    // Ends the transaction, later reads see the changes of other clients
+    mysql_commit(&con_m);
+    return ok;
+}
+
+bool MysqlPersistentStorage::selectAll(ValueMap_t& values)
+{
+    if (!connected_m && !connect())
+        return false;
+    std::string query = "SELECT `object`, `value` FROM `" + table_m + "`";
+    if (mysql_real_query(&con_m, query.c_str(), query.length()) != 0)
+        return fail("Error selecting from '" + table_m + "'");
+    MYSQL_RES *result = mysql_store_result(&con_m);
+    if (!result)
+        return fail("Error selecting from '" + table_m + "'");
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result)) != 0)
+    {
+        unsigned long *lengths = mysql_fetch_lengths(result);
+        values[std::string(row[0], lengths[0])] = row[1] ? std::string(row[1], lengths[1]) : "";
+    }
+    mysql_free_result(result);
+    mysql_commit(&con_m);
+    return true;
+}
+
+std::string MysqlPersistentStorage::readValue(const std::string& id, const std::string& defval)
+{
+    std::string value = defval;
+    if (table_m != "")
+    {
+        ReadTask task(this, id);
+        OffloadPool::instance()->execute(&task, this);
+        if (task.found_m)
+            value = task.value_m;
+    }
+    logger_m.infoStream() << "Reading '" << value << "' for object '" << id << "'" << endlog;
+    return value;
+}
+
+bool MysqlPersistentStorage::readAllValues(ValueMap_t& values)
+{
+    if (table_m == "")
+        return true;
+    ReadTask task(this, "", &values);
+    OffloadPool::instance()->execute(&task, this);
+    return task.ok_m;
+}
+
+std::string MysqlPersistentStorage::getSource()
+{
+    return "mysql:" + host_m + "/" + db_m + "/" + table_m;
+}
+#endif // HAVE_MYSQL
+
+#ifdef HAVE_SQLITE
+Logger& SqlitePersistentStorage::logger_m(Logger::getInstance("SqlitePersistentStorage"));
+
+// Read run by the offload pool, serialized with the batches as they share
+// the connection
+class SqlitePersistentStorage::ReadTask : public OffloadTask
+{
+public:
+    enum Type
+    {
+        Value,
+        All,
+        History
+    };
+
+    ReadTask(SqlitePersistentStorage* storage, Type type, const std::string& id)
+        : storage_m(storage), type_m(type), id_m(id), values_m(0), samples_m(0),
+          start_m(0), end_m(0), limit_m(0), ok_m(false), found_m(false) {};
+
+    virtual void run()
+    {
+        switch (type_m)
+        {
+        case Value:
+            ok_m = storage_m->selectValue(id_m, value_m, &found_m);
+            break;
+        case All:
+            ok_m = storage_m->selectAll(*values_m);
+            break;
+        case History:
+            ok_m = storage_m->selectHistory(id_m, start_m, end_m, *samples_m, limit_m);
+            break;
+        }
+        if (!ok_m)
+            error_m = storage_m->error_m;
+    }
+
+    virtual void finish()
+    {
+        if (!ok_m)
+            logger_m.errorStream() << error_m << endlog;
+    }
+
+    SqlitePersistentStorage* storage_m;
+    Type type_m;
+    std::string id_m;
+    ValueMap_t* values_m;
+    SampleList_t* samples_m;
+    time_t start_m;
+    time_t end_m;
+    int limit_m;
+    bool ok_m;
+    bool found_m;
+    std::string value_m;
+    std::string error_m;
+};
+
+SqlitePersistentStorage::SqlitePersistentStorage(ticpp::Element* pConfig)
+    : db_m(0), valueInsert_m(0), logInsert_m(0), select_m(0), selectAll_m(0), history_m(0), errcode_m(SQLITE_OK)
+{
+    path_m = pConfig->GetAttributeOrDefault("path", "/var/lib/linknx/persist.db");
+    if (!open())
+    {
+        close();
+        throw ticpp::Exception("SqlitePersistentStorage: " + error_m);
+    }
+}
+
+SqlitePersistentStorage::~SqlitePersistentStorage()
+{
+    shutdown();
+    close();
+}
+
+void SqlitePersistentStorage::exportXml(ticpp::Element* pConfig)
+{
+    pConfig->SetAttribute("type", "sqlite");
+    pConfig->SetAttribute("path", path_m);
+    exportQueueXml(pConfig);
+}
+
+std::string SqlitePersistentStorage::getSource()
+{
+    return "sqlite:" + path_m;
+}
+
+bool SqlitePersistentStorage::open()
+{
+    if (sqlite3_open_v2(path_m.c_str(), &db_m, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+    {
+        if (!db_m)
+        {
+            error_m = "Error opening '" + path_m + "'";
+            return false;
+        }
+        return fail("Error opening '" + path_m + "'");
+    }
+    // Waits for the other programs writing to the database, a batch still
+    // busy afterwards is retried
+    sqlite3_busy_timeout(db_m, 1000);
+
+    sqlite3_stmt* stmt;
+    if (!prepare(&stmt, "PRAGMA journal_mode=WAL"))
+        return false;
+    std::string mode;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0))
+        mode = (const char*)sqlite3_column_text(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (mode != "wal")
+        logger_m.warnStream() << "Unable to use WAL mode for '" << path_m << "', using '" << mode << "'" << endlog;
+
+    // In WAL mode, the last transactions may be lost by a power failure
+    // but the database stays consistent
+    return exec("PRAGMA synchronous=NORMAL") &&
+           exec("CREATE TABLE IF NOT EXISTS persist (object TEXT PRIMARY KEY, value TEXT NOT NULL)") &&
+           exec("CREATE TABLE IF NOT EXISTS history (ts INTEGER NOT NULL, object TEXT NOT NULL, value TEXT NOT NULL)") &&
+           exec("CREATE INDEX IF NOT EXISTS history_object_ts ON history (object, ts)") &&
+           prepare(&valueInsert_m, "INSERT OR REPLACE INTO persist (object, value) VALUES (?, ?)") &&
+           prepare(&logInsert_m, "INSERT INTO history (ts, object, value) VALUES (?, ?, ?)") &&
+           prepare(&select_m, "SELECT value FROM persist WHERE object = ?") &&
+           prepare(&selectAll_m, "SELECT object, value FROM persist") &&
+           prepare(&history_m, "SELECT ts, value FROM history WHERE object = ? AND ts BETWEEN ? AND ? ORDER BY ts, rowid LIMIT ?");
+}
+
+void SqlitePersistentStorage::close()
+{
+    sqlite3_finalize(valueInsert_m);
+    sqlite3_finalize(logInsert_m);
+    sqlite3_finalize(select_m);
+    sqlite3_finalize(selectAll_m);
+    sqlite3_finalize(history_m);
+    valueInsert_m = logInsert_m = select_m = selectAll_m = history_m = 0;
+    sqlite3_close(db_m);
+    db_m = 0;
+}
+
+bool SqlitePersistentStorage::fail(const std::string& what)
+{
+    errcode_m = sqlite3_errcode(db_m);
+    error_m = what + ", SQLite said: '" + sqlite3_errmsg(db_m) + "'";
+    return false;
+}
+
+bool SqlitePersistentStorage::exec(const char* sql)
+{
+    if (sqlite3_exec(db_m, sql, NULL, NULL, NULL) != SQLITE_OK)
+        return fail(std::string("Error executing '") + sql + "'");
+    return true;
+}
+
+bool SqlitePersistentStorage::prepare(sqlite3_stmt** stmt, const char* sql)
+{
+    if (sqlite3_prepare_v2(db_m, sql, -1, stmt, NULL) != SQLITE_OK)
+        return fail(std::string("Error preparing '") + sql + "'");
+    return true;
+}
+
+bool SqlitePersistentStorage::step(sqlite3_stmt* stmt, const std::string& what)
+{
+    bool ok = true;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        ok = fail(what);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return ok;
+}
+
+bool SqlitePersistentStorage::insertValues(const ValueMap_t& values)
+{
+    for (ValueMap_t::const_iterator it = values.begin(); it != values.end(); it++)
+    {
+        sqlite3_bind_text(valueInsert_m, 1, it->first.data(), it->first.size(), SQLITE_STATIC);
+        sqlite3_bind_text(valueInsert_m, 2, it->second.data(), it->second.size(), SQLITE_STATIC);
+        if (!step(valueInsert_m, "Error storing '" + it->first + "'"))
+            return false;
+    }
+    return true;
+}
+
+bool SqlitePersistentStorage::insertSamples(const SampleList_t& samples)
+{
+    for (SampleList_t::const_iterator it = samples.begin(); it != samples.end(); it++)
+    {
+        sqlite3_bind_int64(logInsert_m, 1, it->time);
+        sqlite3_bind_text(logInsert_m, 2, it->id.data(), it->id.size(), SQLITE_STATIC);
+        sqlite3_bind_text(logInsert_m, 3, it->value.data(), it->value.size(), SQLITE_STATIC);
+        if (!step(logInsert_m, "Error logging '" + it->id + "'"))
+            return false;
+    }
+    return true;
+}
+
+void SqlitePersistentStorage::writeBatch(Batch& batch)
+{
+    // Takes the write lock first, so that a busy database fails before
+    // anything is stored
+    if (exec("BEGIN IMMEDIATE") && insertValues(batch.values) && insertSamples(batch.samples) && exec("COMMIT"))
+        return;
+    batch.error = error_m;
+    if (!sqlite3_get_autocommit(db_m))
+        sqlite3_exec(db_m, "ROLLBACK", NULL, NULL, NULL);
+    if (errcode_m == SQLITE_BUSY || errcode_m == SQLITE_LOCKED)
+        batch.retry = true;
+}
+
+namespace
+{
+    std::string columnText(sqlite3_stmt* stmt, int col)
+    {
+        const char* text = (const char*)sqlite3_column_text(stmt, col);
+        return text ? std::string(text, sqlite3_column_bytes(stmt, col)) : "";
+    }
+}
+
+bool SqlitePersistentStorage::selectValue(const std::string& id, std::string& value, bool* found)
+{
+    sqlite3_bind_text(select_m, 1, id.data(), id.size(), SQLITE_STATIC);
+    int ret = sqlite3_step(select_m);
+    *found = (ret == SQLITE_ROW);
+    if (*found)
+        value = columnText(select_m, 0);
+    bool ok = (ret == SQLITE_ROW || ret == SQLITE_DONE) || fail("Error reading '" + id + "'");
+    sqlite3_reset(select_m);
+    sqlite3_clear_bindings(select_m);
+    return ok;
+}
+
+bool SqlitePersistentStorage::selectAll(ValueMap_t& values)
+{
+    int ret;
+    while ((ret = sqlite3_step(selectAll_m)) == SQLITE_ROW)
+        values[columnText(selectAll_m, 0)] = columnText(selectAll_m, 1);
+    bool ok = (ret == SQLITE_DONE) || fail("Error reading the values");
+    sqlite3_reset(selectAll_m);
+    return ok;
+}
+
+bool SqlitePersistentStorage::selectHistory(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit)
+{
+    sqlite3_bind_text(history_m, 1, id.data(), id.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(history_m, 2, start);
+    sqlite3_bind_int64(history_m, 3, end);
+    // A negative limit returns all the rows
+    sqlite3_bind_int(history_m, 4, limit > 0 ? limit : -1);
+    int ret;
+    while ((ret = sqlite3_step(history_m)) == SQLITE_ROW)
+    {
+        Sample sample;
+        sample.id = id;
+        sample.time = sqlite3_column_int64(history_m, 0);
+        sample.value = columnText(history_m, 1);
+        samples.push_back(sample);
+    }
+    bool ok = (ret == SQLITE_DONE) || fail("Error reading the history of '" + id + "'");
+    sqlite3_reset(history_m);
+    sqlite3_clear_bindings(history_m);
+    return ok;
+}
+
+std::string SqlitePersistentStorage::readValue(const std::string& id, const std::string& defval)
+{
+    ReadTask task(this, ReadTask::Value, id);
+    OffloadPool::instance()->execute(&task, this);
+    std::string value = task.found_m ? task.value_m : defval;
+    logger_m.infoStream() << "Reading '" << value << "' for object '" << id << "'" << endlog;
+    return value;
+}
+
+bool SqlitePersistentStorage::readAllValues(ValueMap_t& values)
+{
+    ReadTask task(this, ReadTask::All, "");
+    task.values_m = &values;
+    OffloadPool::instance()->execute(&task, this);
+    return task.ok_m;
+}
+
+bool SqlitePersistentStorage::readHistoryValues(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit)
+{
+    ReadTask task(this, ReadTask::History, id);
+    task.samples_m = &samples;
+    task.start_m = start;
+    task.end_m = end;
+    task.limit_m = limit;
+    OffloadPool::instance()->execute(&task, this);
+    return task.ok_m;
+}
+#endif // HAVE_SQLITE
@@ -21,47 +21,307 @@
 #define PERSISTENTSTORAGE_H
 
 #include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <ctime>
+#include <pthread.h>
+#include <sys/types.h>
 #include "config.h"
 #include "logger.h"
 #include "ticpp.h"
+#include "threads.h"
 
 #ifdef HAVE_MYSQL
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#endif
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
 #endif
 
-class PersistentStorage
+/** Base of the persistence backends. write and writelog only queue the
+ * update: the values are coalesced per object, the latest one wins, while
+ * every log sample is kept with the time it was taken. A flusher thread
+ * hands the queue over to the offload pool as a single batch at most
+ * flush-delay ms after the first queued update.
+ *
+ * With the snapshot attribute, the values of the objects in use are also
+ * saved to a single binary file on shutdown and every snapshot-interval
+ * ms. beginRestore maps it to restore all the objects at once. The file
+ * is removed before the first value stored after it, so an existing
+ * snapshot of the same backend is never stale. Without a valid snapshot
+ * the values are restored with readAll. */
+class PersistentStorage : protected Thread
 {
 public:
-    virtual ~PersistentStorage() {};
+    typedef std::map<std::string, std::string> ValueMap_t;
+
+    PersistentStorage();
+    virtual ~PersistentStorage();
 
     static PersistentStorage* create(ticpp::Element* pConfig);
 
     virtual void exportXml(ticpp::Element* pConfig) = 0;
 
-    virtual void write(const std::string& id, const std::string& value) = 0;
-    virtual std::string read(const std::string& id, const std::string& defval="") = 0;
-    virtual void writelog(const std::string& id, const std::string& value) = 0;
+    void write(const std::string& id, const std::string& value);
+    /** Returns the queued value of the object if any, the stored one otherwise */
+    std::string read(const std::string& id, const std::string& defval="");
+    void writelog(const std::string& id, const std::string& value);
+
+    /** Gets all the stored values, queued ones included. Returns false if
+     * the backend failed to list them. */
+    bool readAll(ValueMap_t& values);
+    /** Loads all the values at once, from the snapshot if it is valid or
+     * with readAll otherwise, for the reads up to endRestore */
+    void beginRestore();
+    void endRestore();
+
+    /** Writes the queued updates and waits until they are stored */
+    void flush();
+    void statusXml(ticpp::Element* pStatus);
+
+    int getFlushDelay() { return flushDelay_m; };
+    void setFlushDelay(int delayMs) { flushDelay_m = delayMs; };
+    int getQueuedCount() { return values_m.size() + samples_m.size(); };
+
+    static const int DefaultFlushDelay = 1000;
+    static const int DefaultSnapshotInterval = 300000;
+    /** Queue depth that triggers a flush without waiting for the delay */
+    static const int MaxQueued = 1000;
+    /** Bounds of the delay between the attempts to store a batch again */
+    static const int MinRetryDelay = 1000;
+    static const int MaxRetryDelay = 60000;
+    /** Log samples kept while the batches are retried, the oldest ones
+     * are dropped beyond */
+    static const int MaxRetainedSamples = 100000;
+
+    struct Sample
+    {
+        std::string id;
+        std::string value;
+        time_t time;
+    };
+    typedef std::vector<Sample> SampleList_t;
+
+    /** Gets the log samples of the object taken between start and end
+     * included, oldest first and at most limit of them if positive. The
+     * queued samples are included. Returns false if the backend keeps no
+     * queryable history or failed to read it. */
+    bool readHistory(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit = 0);
+
+    struct Batch
+    {
+        Batch() : retry(false) {};
+
+        ValueMap_t values;
+        SampleList_t samples;
+        /** First error met by writeBatch, empty on success */
+        std::string error;
+        /** Set by writeBatch when nothing was stored and the batch can be
+         * stored later, e.g. while the database is unreachable */
+        bool retry;
+    };
+
+protected:
+    /** Stores the batch. Runs in a worker of the offload pool, with the
+     * same restrictions as OffloadTask::run. read still looks the values
+     * of the batch up meanwhile, only its error may be changed. */
+    virtual void writeBatch(Batch& batch) = 0;
+    /** Reads the stored value, the queue and the batches being stored
+     * have already been checked */
+    virtual std::string readValue(const std::string& id, const std::string& defval) = 0;
+    /** Adds all the stored values to values. Runs in the pth thread. */
+    virtual bool readAllValues(ValueMap_t& values) = 0;
+    /** Adds the stored samples asked by readHistory to samples, false by
+     * default. The backends read through the offload pool, so that the
+     * batches still being stored afterwards were not seen. */
+    virtual bool readHistoryValues(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit);
+    /** Identifies the stored data, a snapshot of another one is ignored */
+    virtual std::string getSource() = 0;
+    /** Ms before the last batches written must be synced, -1 if nothing
+     * is waiting for a sync. Runs in the pth thread. */
+    virtual int64_t getSyncWait() { return -1; };
+    /** Syncs the last batches written when no other batch followed them,
+     * returns the error if any. Runs in a worker of the offload pool,
+     * serialized with the batches. */
+    virtual std::string syncIdle() { return ""; };
+
+    /** Stops the flusher and stores the remaining updates. The backends
+     * call it first in their destructor, while writeBatch is still
+     * available. */
+    void shutdown();
+
+    /** Handles the flush-delay and snapshot attributes common to all
+     * backends */
+    void importQueueXml(ticpp::Element* pConfig);
+    void exportQueueXml(ticpp::Element* pConfig);
+
+private:
+    class FlushTask;
+    friend class FlushTask;
+    class SnapshotTask;
+    friend class SnapshotTask;
+    class SyncTask;
+    friend class SyncTask;
+
+    void Run (pth_sem_t * stop);
+    /** Moves the queue into a new batch, null if it is empty. The batch
+     * is kept in flushing_m until it is stored. */
+    Batch* takeBatch();
+    /** Updates the metrics and wakes the flusher up if needed */
+    void queued();
+    void onFlushed(Batch* batch);
+    /** Puts the content of a batch to retry back in front of the queue */
+    void requeue(Batch* batch);
+    /** Returns the snapshot to remove before storing batch, if any */
+    std::string takeStaleSnapshot(Batch* batch);
+    /** Ms before the next periodic snapshot, -1 if none is needed */
+    int64_t getSnapshotWait();
+    /** Ms before the next snapshot or sync, -1 if none is needed */
+    int64_t getIdleWait();
+    /** Saves the values in use to the snapshot, waiting for it if sync */
+    void saveSnapshot(bool sync);
+    bool loadSnapshot(ValueMap_t& values);
+
+    ValueMap_t values_m;
+    SampleList_t samples_m;
+    std::list<Batch*> flushing_m;
+    int flushDelay_m;
+    bool stopped_m;
+    pth_sem_t wakeUp_m;
+    /** Delay before the next attempt, 0 unless a batch failed */
+    int retryDelay_m;
+
+    std::string snapshotFile_m;
+    int snapshotInterval_m;
+    /** Values read or written since startup, saved by the next snapshot */
+    ValueMap_t known_m;
+    /** Whether the snapshot file may exist and match the stored values */
+    bool snapshotCurrent_m;
+    /** Whether known_m changed since the last snapshot */
+    bool snapshotDirty_m;
+    int64_t lastSnapshot_m;
+    ValueMap_t restored_m;
+    bool restoring_m;
+    /** Whether restored_m holds all the stored values */
+    bool restoredComplete_m;
+    std::string restoreSource_m;
+
+    int maxQueued_m;
+    int coalesced_m;
+    int batches_m;
+    int writtenValues_m;
+    int writtenSamples_m;
+    int errors_m;
+    int retries_m;
+    int droppedSamples_m;
+    int snapshots_m;
+
+    static Logger& logger_m;
 };
 
 class FilePersistentStorage : public PersistentStorage
 {
 public:
     FilePersistentStorage(std::string &path, std::string &logPath);
-    virtual ~FilePersistentStorage() {};
+    virtual ~FilePersistentStorage();
+
+    virtual void exportXml(ticpp::Element* pConfig);
+
+protected:
+    virtual void writeBatch(Batch& batch);
+    virtual std::string readValue(const std::string& id, const std::string& defval);
+    virtual bool readAllValues(ValueMap_t& values);
+    virtual std::string getSource();
+private:
+    std::string path_m;
+    std::string logPath_m;
+protected:
+    static Logger& logger_m;
+};
+
+/** Backend keeping the values of all the objects in a single directory:
+ * an append-only record log, compacted into a sorted snapshot once it
+ * outgrows it. The values are indexed in memory, so reads do not touch
+ * the disk. Each batch is appended with a single write and synced
+ * according to the sync policy, with the interval policy the flusher also
+ * syncs the last batch once the interval elapsed. At startup the snapshot
+ * is loaded and the log replayed, a record torn by a crash is dropped
+ * along with the rest of the log. A corrupt snapshot is renamed to
+ * values.snap.corrupt, the values read before the corruption and those of
+ * the log are kept. The log samples of all the objects go to a single
+ * history.log. */
+class LsmPersistentStorage : public PersistentStorage
+{
+public:
+    enum SyncPolicy
+    {
+        SyncBatch,
+        SyncInterval,
+        SyncNone
+    };
+
+    LsmPersistentStorage(ticpp::Element* pConfig);
+    virtual ~LsmPersistentStorage();
 
     virtual void exportXml(ticpp::Element* pConfig);
 
-    virtual void write(const std::string& id, const std::string& value);
-    virtual std::string read(const std::string& id, const std::string& defval="");
-    virtual void writelog(const std::string& id, const std::string& value);
+    /** Bytes of the log dropped by the recovery at startup */
+    int getDroppedBytes() { return dropped_m; };
+    int getCompactionCount() { return compactions_m; };
+    int getSyncCount() { return syncs_m; };
+
+    static const int DefaultCompactSize = 1048576;
+    static const int DefaultSyncInterval = 1000;
+
+protected:
+    virtual void writeBatch(Batch& batch);
+    virtual std::string readValue(const std::string& id, const std::string& defval);
+    virtual bool readAllValues(ValueMap_t& values);
+    virtual std::string getSource();
+    virtual int64_t getSyncWait();
+    virtual std::string syncIdle();
 private:
+    /** Loads the snapshot and replays the log, throws on error */
+    void load();
+    /** Rewrites the index as the new snapshot and empties the log */
+    void compact(Batch& batch);
+    void sync(Batch& batch, bool force);
+    void setDirty();
+
     std::string path_m;
     std::string logPath_m;
+    SyncPolicy sync_m;
+    int syncInterval_m;
+    int compactSize_m;
+
+    int logFd_m;
+    int historyFd_m;
+    off_t logSize_m;
+    off_t snapshotSize_m;
+    /** Written by the offload pool under syncMutex_m, read by the flusher */
+    bool dirty_m;
+    int64_t lastSync_m;
+    pthread_mutex_t syncMutex_m;
+    int dropped_m;
+    int compactions_m;
+    int syncs_m;
+
+    /** Only the offload pool changes the index, under indexMutex_m */
+    ValueMap_t index_m;
+    pthread_mutex_t indexMutex_m;
 protected:
     static Logger& logger_m;
 };
 
 #ifdef HAVE_MYSQL
+/** Backend storing the values and the log samples in MySQL tables. The
+ * connection is only used by the offload pool. A batch is stored in a
+ * single transaction with prepared multi-row inserts of up to batch-rows
+ * rows. If the server is unreachable the connection is dropped and the
+ * batch queued again, the next attempt reconnects. Any other error
+ * stores the batch again row by row, only the failing rows are lost. */
 class MysqlPersistentStorage : public PersistentStorage
 {
 public:
@@ -70,11 +330,43 @@ public:
 
     virtual void exportXml(ticpp::Element* pConfig);
 
-    virtual void write(const std::string& id, const std::string& value);
-    virtual std::string read(const std::string& id, const std::string& defval="");
-    virtual void writelog(const std::string& id, const std::string& value);
+    static const int DefaultBatchRows = 100;
+
+protected:
+    virtual void writeBatch(Batch& batch);
+    virtual std::string readValue(const std::string& id, const std::string& defval);
+    virtual bool readAllValues(ValueMap_t& values);
+    virtual std::string getSource();
 private:
+    class ReadTask;
+    friend class ReadTask;
+
+    /** The following run in the offload pool and return false on error,
+     * with its description in error_m */
+    bool connect();
+    void disconnect();
+    bool fail(const std::string& what, MYSQL_STMT* stmt = 0);
+    /** Whether the last error was a connection failure */
+    bool isConnectionLost();
+    /** Prepared insert of rows rows, the ones of batchRows_m are kept */
+    MYSQL_STMT* prepareInsert(bool log, int rows);
+    bool execute(MYSQL_STMT* stmt, std::vector<MYSQL_BIND>& binds);
+    /** Multi-row inserts, or one row per insert if skipped is set: the
+     * rows that fail are then counted in skipped and left out */
+    bool insertValues(const ValueMap_t& values, int* skipped = 0);
+    bool insertSamples(const SampleList_t& samples, int* skipped = 0);
+    /** Stores the batch in one transaction, connecting if needed */
+    bool insertBatch(const Batch& batch, int* skipped = 0);
+    bool selectValue(const std::string& id, std::string& value, bool* found);
+    bool selectAll(ValueMap_t& values);
+
     MYSQL con_m;
+    bool connected_m;
+    MYSQL_STMT* valueInsert_m;
+    MYSQL_STMT* logInsert_m;
+    MYSQL_STMT* select_m;
+    std::string error_m;
+    unsigned int errno_m;
 
     std::string host_m;
     std::string user_m;
@@ -83,9 +375,63 @@ private:
     std::string table_m;
     std::string logtable_m;
     std::string charset_m;
+    int batchRows_m;
 protected:
     static Logger& logger_m;
 };
 #endif // HAVE_MYSQL
 
+#ifdef HAVE_SQLITE
+/** Backend storing the values and the log samples in a SQLite database,
+ * the log samples being indexed by object and time for readHistory. The
+ * database is in WAL mode so that other programs can query it while the
+ * batches are stored. The connection is only used by the offload pool, a
+ * batch is stored in a single transaction. */
+class SqlitePersistentStorage : public PersistentStorage
+{
+public:
+    SqlitePersistentStorage(ticpp::Element* pConfig);
+    virtual ~SqlitePersistentStorage();
+
+    virtual void exportXml(ticpp::Element* pConfig);
+
+protected:
+    virtual void writeBatch(Batch& batch);
+    virtual std::string readValue(const std::string& id, const std::string& defval);
+    virtual bool readAllValues(ValueMap_t& values);
+    virtual bool readHistoryValues(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit);
+    virtual std::string getSource();
+private:
+    class ReadTask;
+    friend class ReadTask;
+
+    /** The following return false on error, with its description in
+     * error_m. Except for open, they run in the offload pool. */
+    bool open();
+    bool fail(const std::string& what);
+    bool exec(const char* sql);
+    bool prepare(sqlite3_stmt** stmt, const char* sql);
+    /** Runs a statement returning no row and resets it */
+    bool step(sqlite3_stmt* stmt, const std::string& what);
+    bool insertValues(const ValueMap_t& values);
+    bool insertSamples(const SampleList_t& samples);
+    bool selectValue(const std::string& id, std::string& value, bool* found);
+    bool selectAll(ValueMap_t& values);
+    bool selectHistory(const std::string& id, time_t start, time_t end, SampleList_t& samples, int limit);
+    void close();
+
+    std::string path_m;
+    sqlite3* db_m;
+    sqlite3_stmt* valueInsert_m;
+    sqlite3_stmt* logInsert_m;
+    sqlite3_stmt* select_m;
+    sqlite3_stmt* selectAll_m;
+    sqlite3_stmt* history_m;
+    std::string error_m;
+    int errcode_m;
+protected:
+    static Logger& logger_m;
+};
+#endif // HAVE_SQLITE
+
 #endif
@@ -0,0 +1,373 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "processmanager.h"
+#include "clock.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+ProcessManager* ProcessManager::instance_m;
+int ProcessManager::wakeFd_m = -1;
+Logger& ProcessManager::logger_m(Logger::getInstance("ProcessManager"));
+
+ChildProcess::ChildProcess(const std::string& cmd, int timeout, bool captureOutput)
+    : cmd_m(cmd), timeout_m(timeout), captureOutput_m(captureOutput),
+      pid_m(-1), outFd_m(-1), deadline_m(0), exited_m(false), timedOut_m(false), status_m(0)
+{}
+
+ChildProcess::~ChildProcess()
+{
+    if (outFd_m >= 0)
+        close(outFd_m);
+}
+
+ProcessManager::ProcessManager() : maxRunning_m(DefaultMaxRunning)
+{
+    if (pipe(pipe_m) != 0)
+        throw ticpp::Exception("ProcessManager: unable to create wake-up pipe");
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(pipe_m[i], F_SETFL, fcntl(pipe_m[i], F_GETFL) | O_NONBLOCK);
+        fcntl(pipe_m[i], F_SETFD, FD_CLOEXEC);
+    }
+    wakeFd_m = pipe_m[1];
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &ProcessManager::sigchldHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, &oldAction_m);
+    Start();
+}
+
+ProcessManager::~ProcessManager()
+{
+    Stop();
+    sigaction(SIGCHLD, &oldAction_m, 0);
+    wakeFd_m = -1;
+
+    // Commands still running are asked to terminate but not waited for
+    for (ProcessList_t::iterator it = running_m.begin(); it != running_m.end(); it++)
+    {
+        logger_m.infoStream() << "Terminating '" << (*it)->cmd_m << "' (pid " << (*it)->pid_m << ")" << endlog;
+        kill(-(*it)->pid_m, SIGTERM);
+        delete (*it);
+    }
+    for (ProcessList_t::iterator it = queued_m.begin(); it != queued_m.end(); it++)
+        delete (*it);
+    close(pipe_m[0]);
+    close(pipe_m[1]);
+}
+
+ProcessManager* ProcessManager::instance()
+{
+    if (instance_m == 0)
+        instance_m = new ProcessManager();
+    return instance_m;
+}
+
+void ProcessManager::importXml(ticpp::Element* pConfig)
+{
+    std::string max = pConfig->GetAttribute("max-running");
+    if (max != "")
+    {
+        pConfig->GetAttribute("max-running", &maxRunning_m);
+        if (maxRunning_m < 1)
+            throw ticpp::Exception("ProcessManager: max-running must be at least 1");
+    }
+    else
+        maxRunning_m = DefaultMaxRunning;
+    wakeUp();
+}
+
+void ProcessManager::exportXml(ticpp::Element* pConfig)
+{
+    if (maxRunning_m != DefaultMaxRunning)
+        pConfig->SetAttribute("max-running", maxRunning_m);
+}
+
+void ProcessManager::launch(ChildProcess* process)
+{
+    queued_m.push_back(process);
+    if (queued_m.size() > 1 || (int)running_m.size() >= maxRunning_m)
+        logger_m.debugStream() << "Queued '" << process->cmd_m << "', " << running_m.size() << " processes running" << endlog;
+    startQueued();
+    wakeUp();
+}
+
+bool ProcessManager::splitCommand(const std::string& cmd, std::vector<std::string>& args)
+{
+    args.clear();
+    if (cmd.find_first_of("|&;<>()$`\\\"'*?[]#~=%{}\n") != std::string::npos)
+        return false;
+    std::string::size_type pos = cmd.find_first_not_of(" \t");
+    while (pos != std::string::npos)
+    {
+        std::string::size_type end = cmd.find_first_of(" \t", pos);
+        args.push_back(cmd.substr(pos, end == std::string::npos ? end : end - pos));
+        pos = cmd.find_first_not_of(" \t", end);
+    }
+    return !args.empty();
+}
+
+bool ProcessManager::spawn(ChildProcess* process)
+{
+    std::vector<std::string> args;
+    if (!splitCommand(process->cmd_m, args))
+    {
+        args.clear();
+        args.push_back("/bin/sh");
+        args.push_back("-c");
+        args.push_back(process->cmd_m);
+    }
+    std::vector<char*> argv;
+    for (std::vector<std::string>::iterator it = args.begin(); it != args.end(); it++)
+        argv.push_back(const_cast<char*>(it->c_str()));
+    argv.push_back(0);
+
+    int out[2] = {-1, -1};
+    if (process->captureOutput_m)
+    {
+        if (pipe(out) != 0)
+        {
+            logger_m.errorStream() << "Unable to create output pipe for '" << process->cmd_m << "': " << strerror(errno) << endlog;
+            return false;
+        }
+        fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+        fcntl(out[0], F_SETFD, FD_CLOEXEC);
+        fcntl(out[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    // The child gets its own process group, so a timeout also kills what
+    // the command started, and the default handling of the signals the
+    // daemon blocks or catches.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (out[1] >= 0)
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, &argv[0], environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (out[1] >= 0)
+        close(out[1]);
+
+    if (err != 0)
+    {
+        logger_m.errorStream() << "Unable to execute '" << process->cmd_m << "': " << strerror(err) << endlog;
+        if (out[0] >= 0)
+            close(out[0]);
+        return false;
+    }
+    logger_m.debugStream() << "Started '" << process->cmd_m << "' (pid " << pid << (args[0] == "/bin/sh" ? ", shell" : "") << ")" << endlog;
+    process->pid_m = pid;
+    process->outFd_m = out[0];
+    if (process->timeout_m > 0)
+        process->deadline_m = Clock::nowMs() + (int64_t)process->timeout_m * 1000;
+    return true;
+}
+
+void ProcessManager::startQueued()
+{
+    while (!queued_m.empty() && (int)running_m.size() < maxRunning_m)
+    {
+        ChildProcess* process = queued_m.front();
+        queued_m.pop_front();
+        if (spawn(process))
+            running_m.push_back(process);
+        else
+        {
+            // Same status as the shell gives for a command it cannot run
+            process->onExit(127, "");
+            delete process;
+        }
+    }
+}
+
+void ProcessManager::readOutput(ChildProcess* process)
+{
+    char buf[4096];
+    while (process->outFd_m >= 0)
+    {
+        int len = read(process->outFd_m, buf, sizeof(buf));
+        if (len > 0)
+        {
+            if (process->output_m.size() < MaxOutputSize)
+                process->output_m.append(buf, std::min((size_t)len, MaxOutputSize - process->output_m.size()));
+        }
+        else if (len == 0 || (errno != EINTR && errno != EAGAIN))
+        {
+            close(process->outFd_m);
+            process->outFd_m = -1;
+        }
+        else if (errno == EAGAIN)
+            break;
+    }
+}
+
+void ProcessManager::reap()
+{
+    // Only our own children are waited for, pth_system waits for its own
+    for (ProcessList_t::iterator it = running_m.begin(); it != running_m.end(); it++)
+    {
+        ChildProcess* process = *it;
+        int status;
+        if (!process->exited_m && waitpid(process->pid_m, &status, WNOHANG) == process->pid_m)
+        {
+            process->exited_m = true;
+            if (WIFEXITED(status))
+                process->status_m = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                process->status_m = 128 + WTERMSIG(status);
+        }
+    }
+}
+
+void ProcessManager::checkTimeouts(int64_t nowMs)
+{
+    for (ProcessList_t::iterator it = running_m.begin(); it != running_m.end(); it++)
+    {
+        ChildProcess* process = *it;
+        if (!process->exited_m && !process->timedOut_m && process->deadline_m && nowMs >= process->deadline_m)
+        {
+            logger_m.warnStream() << "'" << process->cmd_m << "' timed out after " << process->timeout_m << "s, killing it" << endlog;
+            kill(-process->pid_m, SIGKILL);
+            process->timedOut_m = true;
+        }
+    }
+}
+
+void ProcessManager::finishExited()
+{
+    ProcessList_t::iterator it = running_m.begin();
+    while (it != running_m.end())
+    {
+        ChildProcess* process = *it;
+        if (!process->exited_m)
+        {
+            ++it;
+            continue;
+        }
+        // Everything the process wrote is in the pipe by now, a background
+        // child still holding it open must not delay the completion
+        readOutput(process);
+        if (process->outFd_m >= 0)
+        {
+            close(process->outFd_m);
+            process->outFd_m = -1;
+        }
+        it = running_m.erase(it);
+        logger_m.debugStream() << "'" << process->cmd_m << "' (pid " << process->pid_m << ") exited with status " << process->status_m << endlog;
+        process->onExit(process->status_m, process->output_m);
+        delete process;
+    }
+}
+
+void ProcessManager::wakeUp()
+{
+    char c = 0;
+    if (write(pipe_m[1], &c, 1) < 0) {}
+}
+
+void ProcessManager::sigchldHandler(int sig)
+{
+    int savedErrno = errno;
+    if (wakeFd_m >= 0)
+    {
+        char c = 0;
+        if (write(wakeFd_m, &c, 1) < 0) {}
+    }
+    errno = savedErrno;
+}
+
+void ProcessManager::Run (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    logger_m.debugStream() << "Starting ProcessManager loop." << endlog;
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        startQueued();
+
+        fd_set readFds;
+        FD_ZERO(&readFds);
+        FD_SET(pipe_m[0], &readFds);
+        int maxFd = pipe_m[0];
+        int64_t deadline = 0;
+        for (ProcessList_t::iterator it = running_m.begin(); it != running_m.end(); it++)
+        {
+            ChildProcess* process = *it;
+            if (process->outFd_m >= 0)
+            {
+                FD_SET(process->outFd_m, &readFds);
+                if (process->outFd_m > maxFd)
+                    maxFd = process->outFd_m;
+            }
+            if (process->deadline_m && !process->timedOut_m && (deadline == 0 || process->deadline_m < deadline))
+                deadline = process->deadline_m;
+        }
+
+        // The timeouts run in the time of the clock, like the delays of the
+        // actions
+        int rc = 0;
+        pth_event_t ready = pth_event (PTH_EVENT_SELECT, &rc, maxFd + 1, &readFds, NULL, NULL);
+        pth_event_concat (ready, stop, NULL);
+        if (deadline)
+            Clock::sleep(std::max(deadline - Clock::nowMs(), (int64_t)0), ready);
+        else
+            pth_wait (ready);
+        pth_event_isolate (ready);
+        pth_event_free (ready, PTH_FREE_THIS);
+        if (pth_event_status (stop) == PTH_STATUS_OCCURRED)
+            break;
+        // The descriptors are non-blocking, the ones not ready are left as is
+        char buf[64];
+        while (read(pipe_m[0], buf, sizeof(buf)) > 0) {}
+        for (ProcessList_t::iterator it = running_m.begin(); it != running_m.end(); it++)
+            readOutput(*it);
+        reap();
+        checkTimeouts(Clock::nowMs());
+        finishExited();
+    }
+    logger_m.debugStream() << "Out of ProcessManager loop." << endlog;
+    pth_event_free (stop, PTH_FREE_THIS);
+}
@@ -0,0 +1,127 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef PROCESSMANAGER_H
+#define PROCESSMANAGER_H
+
+#include <list>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include "threads.h"
+#include "logger.h"
+#include "ticpp.h"
+
+/** Command launched by the ProcessManager. */
+class ChildProcess
+{
+public:
+    /** @param timeout seconds of the Clock before the process group is
+     * killed, 0 for none
+     * @param captureOutput whether stdout is collected for onExit */
+    ChildProcess(const std::string& cmd, int timeout = 0, bool captureOutput = false);
+    virtual ~ChildProcess();
+
+    /** Called from the pth scheduler once the process has exited. status is
+     * the exit code, or 128 + signal number if it was killed (a timeout
+     * gives 128 + SIGKILL). */
+    virtual void onExit(int status, const std::string& output) {};
+
+    const std::string& getCommand() { return cmd_m; };
+
+private:
+    friend class ProcessManager;
+
+    std::string cmd_m;
+    int timeout_m;
+    bool captureOutput_m;
+
+    pid_t pid_m;
+    int outFd_m;
+    /** Clock time in ms */
+    int64_t deadline_m;
+    bool exited_m;
+    bool timedOut_m;
+    int status_m;
+    std::string output_m;
+};
+
+/** Spawns commands without blocking the pth threads. Commands without shell
+ * syntax are executed directly, the others through /bin/sh. Children are
+ * reaped by a single pth thread woken through a SIGCHLD self-pipe, and at
+ * most maxRunning_m of them run at once, the next ones being queued. */
+class ProcessManager : protected Thread
+{
+public:
+    static ProcessManager* instance();
+    static void reset()
+    {
+        if (instance_m)
+            delete instance_m;
+        instance_m = 0;
+    };
+
+    void importXml(ticpp::Element* pConfig);
+    void exportXml(ticpp::Element* pConfig);
+
+    /** Starts the process as soon as the concurrency cap allows it. The
+     * manager takes ownership of process. */
+    void launch(ChildProcess* process);
+
+    int getMaxRunning() { return maxRunning_m; };
+    int getRunningCount() { return running_m.size(); };
+    int getQueuedCount() { return queued_m.size(); };
+
+    /** Splits cmd into arguments. Returns false if cmd uses shell syntax
+     * (quotes, redirections, variables, globbing...) and needs /bin/sh. */
+    static bool splitCommand(const std::string& cmd, std::vector<std::string>& args);
+
+    static const int DefaultMaxRunning = 4;
+    static const size_t MaxOutputSize = 65536;
+
+private:
+    ProcessManager();
+    virtual ~ProcessManager();
+
+    typedef std::list<ChildProcess*> ProcessList_t;
+
+    bool spawn(ChildProcess* process);
+    void readOutput(ChildProcess* process);
+    void reap();
+    void checkTimeouts(int64_t nowMs);
+    void finishExited();
+    void startQueued();
+    void wakeUp();
+    void Run (pth_sem_t * stop);
+
+    static void sigchldHandler(int sig);
+
+    ProcessList_t running_m;
+    ProcessList_t queued_m;
+    int maxRunning_m;
+    int pipe_m[2];
+    struct sigaction oldAction_m;
+
+    static int wakeFd_m;
+    static ProcessManager* instance_m;
+    static Logger& logger_m;
+};
+
+#endif
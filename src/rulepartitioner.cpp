@@ -0,0 +1,189 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+ 
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+ 
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "rulepartitioner.h"
+#include <algorithm>
+
+Logger& RulePartitioner::logger_m(Logger::getInstance("RulePartitioner"));
+
+namespace
+{
+    bool largerPartition(const RulePartitioner::Partition* a, const RulePartitioner::Partition* b)
+    {
+        return a->rules_m.size() > b->rules_m.size();
+    }
+}
+
+RulePartitioner::RulePartitioner()
+{}
+
+void RulePartitioner::addRule(Rule* rule)
+{
+    // Rules occupy the first nodes, objects get the following ones
+    ruleNodes_m.insert(RuleNodeMap_t::value_type(rule->getID(), rules_m.size()));
+    rules_m.push_back(rule);
+    deps_m.push_back(RuleDependencies());
+    rule->collectDependencies(deps_m.back());
+}
+
+int RulePartitioner::getNode(Object* object)
+{
+    ObjectNodeMap_t::iterator it = objectNodes_m.find(object);
+    if (it != objectNodes_m.end())
+        return it->second;
+    int node = parent_m.size();
+    parent_m.push_back(node);
+    objects_m.push_back(object);
+    objectNodes_m.insert(ObjectNodeMap_t::value_type(object, node));
+    return node;
+}
+
+int RulePartitioner::find(int node)
+{
+    while (parent_m[node] != node)
+    {
+        parent_m[node] = parent_m[parent_m[node]];
+        node = parent_m[node];
+    }
+    return node;
+}
+
+void RulePartitioner::merge(int a, int b)
+{
+    a = find(a);
+    b = find(b);
+    if (a != b)
+        parent_m[b] = a;
+}
+
+void RulePartitioner::compute(PartitionList_t& partitions)
+{
+    int nbRules = rules_m.size();
+    parent_m.resize(nbRules);
+    for (int i = 0; i < nbRules; i++)
+        parent_m[i] = i;
+    objects_m.assign(nbRules, (Object*)0);
+    objectNodes_m.clear();
+
+    for (int i = 0; i < nbRules; i++)
+    {
+        if (deps_m[i].isOpaque())
+            continue;
+        const std::list<Object*>& objects = deps_m[i].getObjects();
+        std::list<Object*>::const_iterator it;
+        for (it = objects.begin(); it != objects.end(); it++)
+            merge(i, getNode(*it));
+        const std::list<std::string>& rules = deps_m[i].getRules();
+        std::list<std::string>::const_iterator it2;
+        for (it2 = rules.begin(); it2 != rules.end(); it2++)
+        {
+            RuleNodeMap_t::iterator ruleIt = ruleNodes_m.find(*it2);
+            if (ruleIt != ruleNodes_m.end())
+                merge(i, ruleIt->second);
+        }
+    }
+
+    // A rule referring to an opaque rule must be serialized with it as well
+    std::vector<bool> shared(nbRules, false);
+    for (int i = 0; i < nbRules; i++)
+        if (deps_m[i].isOpaque())
+            shared[i] = true;
+    for (int i = 0; i < nbRules; i++)
+    {
+        const std::list<std::string>& rules = deps_m[i].getRules();
+        std::list<std::string>::const_iterator it;
+        for (it = rules.begin(); it != rules.end(); it++)
+        {
+            RuleNodeMap_t::iterator ruleIt = ruleNodes_m.find(*it);
+            if (ruleIt != ruleNodes_m.end() && deps_m[ruleIt->second].isOpaque())
+                shared[i] = true;
+        }
+    }
+
+    std::map<int, Partition> components;
+    Partition sharedPartition;
+    sharedPartition.shared_m = true;
+    for (int i = 0; i < nbRules; i++)
+    {
+        if (shared[i])
+            sharedPartition.rules_m.push_back(rules_m[i]);
+        else
+            components[find(i)].rules_m.push_back(rules_m[i]);
+    }
+    for (int node = nbRules; node < (int)parent_m.size(); node++)
+    {
+        std::map<int, Partition>::iterator it = components.find(find(node));
+        if (it != components.end())
+            it->second.objects_m.push_back(objects_m[node]);
+    }
+
+    std::vector<Partition*> sorted;
+    std::map<int, Partition>::iterator it;
+    for (it = components.begin(); it != components.end(); it++)
+        sorted.push_back(&(it->second));
+    std::stable_sort(sorted.begin(), sorted.end(), largerPartition);
+
+    partitions.clear();
+    partitions.reserve(sorted.size() + 1);
+    for (std::vector<Partition*>::iterator it2 = sorted.begin(); it2 != sorted.end(); it2++)
+        partitions.push_back(**it2);
+    if (!sharedPartition.rules_m.empty())
+        partitions.push_back(sharedPartition);
+
+    logger_m.debugStream() << "Found " << partitions.size() << " partitions for " << nbRules << " rules ("
+                           << sharedPartition.rules_m.size() << " shared)" << endlog;
+}
+
+void RulePartitioner::exportXml(ticpp::Element* pStatus)
+{
+    PartitionList_t partitions;
+    compute(partitions);
+
+    int nbShared = 0;
+    if (!partitions.empty() && partitions.back().shared_m)
+        nbShared = partitions.back().rules_m.size();
+    pStatus->SetAttribute("count", partitions.size());
+    pStatus->SetAttribute("rules", rules_m.size());
+    pStatus->SetAttribute("shared", nbShared);
+
+    int id = 0;
+    for (PartitionList_t::iterator it = partitions.begin(); it != partitions.end(); it++)
+    {
+        ticpp::Element pPartition("partition");
+        pPartition.SetAttribute("id", id++);
+        if (it->shared_m)
+            pPartition.SetAttribute("shared", "true");
+        pPartition.SetAttribute("rules", it->rules_m.size());
+        pPartition.SetAttribute("objects", it->objects_m.size());
+        for (std::vector<Rule*>::iterator ruleIt = it->rules_m.begin(); ruleIt != it->rules_m.end(); ruleIt++)
+        {
+            ticpp::Element pElem("rule");
+            pElem.SetAttribute("id", (*ruleIt)->getID());
+            pPartition.LinkEndChild(&pElem);
+        }
+        for (std::vector<Object*>::iterator objIt = it->objects_m.begin(); objIt != it->objects_m.end(); objIt++)
+        {
+            ticpp::Element pElem("object");
+            pElem.SetAttribute("id", (*objIt)->getID());
+            pPartition.LinkEndChild(&pElem);
+        }
+        pStatus->LinkEndChild(&pPartition);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+ 
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+ 
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef RULEPARTITIONER_H
+#define RULEPARTITIONER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "logger.h"
+#include "ruleserver.h"
+#include "ticpp.h"
+
+/*
+ * Splits the rule set into partitions that never share an object or refer
+ * to each other (connected components of the rule/object dependency graph).
+ * Every object used by the rules belongs to exactly one partition, which
+ * makes each partition a candidate for being processed independently.
+ * Rules with unknown dependencies (Lua scripts, ...) are collected in a
+ * single shared partition that must stay serialized with all the others.
+ */
+class RulePartitioner
+{
+public:
+    class Partition
+    {
+    public:
+        Partition() : shared_m(false) {};
+
+        std::vector<Rule*> rules_m;
+        std::vector<Object*> objects_m;
+        bool shared_m;
+    };
+    typedef std::vector<Partition> PartitionList_t;
+
+    RulePartitioner();
+
+    void addRule(Rule* rule);
+    // Partitions are returned largest first, the shared partition (if any) is the last one
+    void compute(PartitionList_t& partitions);
+
+    void exportXml(ticpp::Element* pStatus);
+
+private:
+    int getNode(Object* object);
+    int find(int node);
+    void merge(int a, int b);
+
+    typedef std::map<Object*, int> ObjectNodeMap_t;
+    typedef std::map<std::string, int> RuleNodeMap_t;
+    std::vector<Rule*> rules_m;
+    std::vector<RuleDependencies> deps_m;
+    std::vector<int> parent_m;
+    std::vector<Object*> objects_m;
+    ObjectNodeMap_t objectNodes_m;
+    RuleNodeMap_t ruleNodes_m;
+    static Logger& logger_m;
+};
+
+#endif
@@ -22,15 +22,27 @@
 #include "smsgateway.h"
 #include "luacondition.h"
 #include "ioport.h"
+#include "rulepartitioner.h"
+#include "ruleshardexecutor.h"
+#include "processmanager.h"
+#include "clock.h"
+#include "configcache.h"
 #include <cmath>
+#include <algorithm>
+#include <time.h>
 
 RuleServer* RuleServer::instance_m;
 
-RuleServer::RuleServer()
-{}
+RuleServer::RuleServer() : threads_m(0), executor_m(0)
+{
+    ConfigCache::instance()->invalidate(ConfigCache::RulesSection);
+}
 
 RuleServer::~RuleServer()
 {
+    // Workers must be stopped before the rules they evaluate are deleted
+    if (executor_m)
+        delete executor_m;
     RuleIdMap_t::iterator it;
     for (it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
         delete (*it).second;
@@ -44,6 +56,29 @@ RuleServer* RuleServer::instance()
 }
 
 void RuleServer::importXml(ticpp::Element* pConfig)
+{
+    ConfigCache::instance()->invalidate(ConfigCache::RulesSection);
+    // Partial updates sent by the XML server keep the current mode
+    int threads;
+    pConfig->GetAttributeOrDefault("threads", &threads, threads_m);
+    if (threads < 0 || threads > RuleShardExecutor::MaxThreads)
+        throw ticpp::Exception("Invalid number of rule threads");
+    // No rule may be deleted or modified while waiting for a worker
+    flush();
+    threads_m = threads;
+    try
+    {
+        importRules(pConfig);
+    }
+    catch (ticpp::Exception& ex)
+    {
+        updateShards();
+        throw;
+    }
+    updateShards();
+}
+
+void RuleServer::importRules(ticpp::Element* pConfig)
 {
     ticpp::Iterator< ticpp::Element > child("rule");
     for ( child = pConfig->FirstChildElement("rule", false); child != child.end(); child++ )
@@ -71,26 +106,67 @@ void RuleServer::importXml(ticpp::Element* pConfig)
 
 void RuleServer::exportXml(ticpp::Element* pConfig)
 {
-    RuleIdMap_t::iterator it;
-    for (it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
+    if (threads_m > 0)
+        pConfig->SetAttribute("threads", threads_m);
+    std::vector<Rule*> rules;
+    rulesMap_m.getSortedValues(rules);
+    std::vector<Rule*>::iterator it;
+    for (it = rules.begin(); it != rules.end(); it++)
     {
         ticpp::Element pElem("rule");
-        (*it).second->exportXml(&pElem);
+        (*it)->exportXml(&pElem);
         pConfig->LinkEndChild(&pElem);
     }
 }
 
 void RuleServer::statusXml(ticpp::Element* pStatus)
 {
-    RuleIdMap_t::iterator it;
-    for (it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
+    std::vector<Rule*> rules;
+    rulesMap_m.getSortedValues(rules);
+    std::vector<Rule*>::iterator it;
+    for (it = rules.begin(); it != rules.end(); it++)
     {
         ticpp::Element pElem("rule");
-        (*it).second->statusXml(&pElem);
+        (*it)->statusXml(&pElem);
         pStatus->LinkEndChild(&pElem);
     }
 }
 
+void RuleServer::partitionXml(ticpp::Element* pStatus)
+{
+    RulePartitioner partitioner;
+    std::vector<Rule*> rules;
+    rulesMap_m.getSortedValues(rules);
+    std::vector<Rule*>::iterator it;
+    for (it = rules.begin(); it != rules.end(); it++)
+        partitioner.addRule(*it);
+    partitioner.exportXml(pStatus);
+    if (executor_m)
+        executor_m->statusXml(pStatus);
+}
+
+void RuleServer::flush()
+{
+    if (executor_m)
+        executor_m->flush();
+}
+
+void RuleServer::updateShards()
+{
+    if (executor_m && executor_m->getThreads() != threads_m)
+    {
+        delete executor_m;
+        executor_m = 0;
+    }
+    if (threads_m == 0)
+        return;
+    if (!executor_m)
+        executor_m = new RuleShardExecutor(threads_m);
+    std::vector<Rule*> rules;
+    rulesMap_m.getSortedValues(rules);
+    executor_m->build(rules);
+}
+
 void RuleServer::initialize()
 {
     // Wait for knxconnection to be ready.
@@ -100,9 +176,11 @@ void RuleServer::initialize()
         pth_sleep(1);
     }
 
-    for (RuleIdMap_t::iterator it = rulesMap_m.begin(); it != rulesMap_m.end(); it++)
+    std::vector<Rule*> rules;
+    rulesMap_m.getSortedValues(rules);
+    for (std::vector<Rule*>::iterator it = rules.begin(); it != rules.end(); it++)
     {
-        Rule *rule = it->second;
+        Rule *rule = *it;
         rule->initialize();
     }  
 }
@@ -187,7 +265,8 @@ Logger& Rule::logger_m(Logger::getInstance("Rule"));
 
 Rule::Rule() : condition_m(0), prevValue_m(false), flags_m(Active),
 	actionsOnTrue_m(ActionList::OnTrue), actionsIfTrue_m(ActionList::IfTrue),
-	actionsOnFalse_m(ActionList::OnFalse), actionsIfFalse_m(ActionList::IfFalse)
+	actionsOnFalse_m(ActionList::OnFalse), actionsIfFalse_m(ActionList::IfFalse),
+	shard_m(0), scheduled_m(false)
 {}
 
 Rule::~Rule()
@@ -249,7 +328,11 @@ void Rule::importXml(ticpp::Element* pConfig)
     logger_m.infoStream() << "Rule: Configuring " << getID() << " (active=" << ((flags_m & Active) != 0) << ")" << endlog;
 
     ticpp::Element* pCondition = pConfig->FirstChildElement("condition");
+    TimerSnapshot* snapshot = Services::instance()->getTimerSnapshot();
+    snapshot->beginRule(id_m);
     setCondition(Condition::create(pCondition, this));
+    setStateRestored(snapshot->isRuleRestored());
+    snapshot->endRule();
 
     ticpp::Iterator<ticpp::Element> actionListIt("actionlist");
     for ( actionListIt = pConfig->FirstChildElement("actionlist"); actionListIt != actionListIt.end(); actionListIt++ )
@@ -310,7 +393,11 @@ void Rule::updateXml(ticpp::Element* pConfig)
     if (pCondition != NULL)
     {
         logger_m.infoStream() << "Rule: Reconfiguring condition " << getID() << endlog;
+        TimerSnapshot* snapshot = Services::instance()->getTimerSnapshot();
+        snapshot->beginRule(id_m);
         setCondition(Condition::create(pCondition, this));
+        setStateRestored(snapshot->isRuleRestored());
+        snapshot->endRule();
     }
 
     ticpp::Element* pActionList = pConfig->FirstChildElement("actionlist", false);
@@ -408,14 +495,44 @@ void Rule::statusXml(ticpp::Element* pStatus)
     }
 }
 
+void Rule::collectDependencies(RuleDependencies& deps)
+{
+    if (condition_m)
+        condition_m->collectDependencies(deps);
+    ActionList* lists[] = { &actionsOnTrue_m, &actionsIfTrue_m, &actionsOnFalse_m, &actionsIfFalse_m };
+    for (int i = 0; i < 4; i++)
+    {
+        for (ActionList::iterator it = lists[i]->begin(); it != lists[i]->end(); ++it)
+            (*it)->collectDependencies(deps);
+    }
+}
+
+void Rule::collectConditionDependencies(RuleDependencies& deps)
+{
+    if (condition_m)
+        condition_m->collectDependencies(deps);
+}
+
+void Rule::setStateRestored(bool restored)
+{
+    if (restored)
+        flags_m |= StateRestored;
+    else
+        flags_m &= ~StateRestored;
+}
+
 void Rule::initialize()
 {
-    if(flags_m & InitEval)
+    // The restored timers have the value they had before the restart, so
+    // has the rule, its on-true/on-false actions are not run again
+    if(flags_m & (InitEval|StateRestored))
         prevValue_m = condition_m->evaluate();
     else
         prevValue_m = (flags_m & InitTrue);
 
-    logger_m.infoStream() << "Rule " << id_m << " initialized with value " << prevValue_m << endlog;
+    logger_m.infoStream() << "Rule " << id_m << " initialized with value " << prevValue_m
+                          << ((flags_m & StateRestored) ? " (timer state restored)" : "") << endlog;
+    flags_m &= ~StateRestored;
 
     // Execute actions if stateless.
     if (prevValue_m)
@@ -426,7 +543,10 @@ void Rule::initialize()
 
 void Rule::onChange(Object* object)
 {
-    evaluate();
+    if (shard_m)
+        shard_m->schedule(this);
+    else
+        evaluate();
 }
 
 void Rule::evaluate()
@@ -434,25 +554,31 @@ void Rule::evaluate()
     if (flags_m & Active)
     {
         logger_m.infoStream() << "Evaluate rule " << id_m << endlog;
-        bool curValue = condition_m->evaluate();
-        logger_m.infoStream() << "Rule " << id_m << " evaluated as " << curValue << ", prev value was " << prevValue_m << endlog;
-        if (curValue)
-		{
-			executeActions(actionsIfTrue_m);
-			if (!prevValue_m) executeActions(actionsOnTrue_m);
-		}
-        else
-		{
-			executeActions(actionsIfFalse_m);
-			if (prevValue_m) executeActions(actionsOnFalse_m);
-		}
+        applyValue(condition_m->evaluate());
+    }
+}
 
-        prevValue_m = curValue;
+void Rule::applyValue(bool curValue)
+{
+    logger_m.infoStream() << "Rule " << id_m << " evaluated as " << curValue << ", prev value was " << prevValue_m << endlog;
+    if (curValue)
+    {
+        executeActions(actionsIfTrue_m);
+        if (!prevValue_m) executeActions(actionsOnTrue_m);
+    }
+    else
+    {
+        executeActions(actionsIfFalse_m);
+        if (prevValue_m) executeActions(actionsOnFalse_m);
     }
+
+    prevValue_m = curValue;
 }
 
 void Rule::setActive(bool active)
 {
+    // The active flag is part of the exported config
+    ConfigCache::instance()->invalidate(ConfigCache::RulesSection);
     if (active)
         flags_m |= Active;
     else
@@ -540,13 +666,20 @@ void Action::exportXml(ticpp::Element* pConfig)
         pConfig->SetAttribute("delay", RuleServer::formatDuration(delay_m, true));
 }
 
+void Action::release()
+{
+    setFinishedSem(0);
+    if (Thread::isFinished())
+        delete this;
+    else
+        // The thread deletes the action once it has stopped
+        StopDelete();
+}
+
 bool Action::sleep(int delay, pth_sem_t * stop)
 {
-    struct timeval timeout;
-    timeout.tv_sec = delay / 1000;
-    timeout.tv_usec = (delay % 1000) * 1000;
     pth_event_t stop_ev = pth_event (PTH_EVENT_SEM, stop);
-    pth_select_ev(0, NULL, NULL, NULL, &timeout, stop_ev);
+    Clock::sleep(delay, stop_ev);
     return (pth_event_status (stop_ev) == PTH_STATUS_OCCURRED);
 }
 
@@ -593,6 +726,29 @@ bool Action::parseVarString(std::string &str, bool checkOnly)
     return modified;
 }
 
+void Action::collectVarDependencies(const std::string &str, RuleDependencies& deps)
+{
+    size_t idx = 0;
+    while ((idx = str.find('$', idx)) != std::string::npos)
+    {
+        if (str.length() <= ++idx)
+            break;
+        char c = str[idx];
+        if (c == '{')
+        {
+            size_t idx2 = str.find('}', ++idx);
+            if (idx2 == std::string::npos)
+                break;
+            Object* obj = ObjectController::instance()->getObject(str.substr(idx, idx2-idx));
+            deps.addObject(obj);
+            obj->decRefCount();
+            idx = idx2;
+        }
+        else if (c == '$')
+            idx++; // skip double $
+    }
+}
+
 DimUpAction::DimUpAction() : object_m(0), start_m(0), stop_m(255), duration_m(60)
 {}
 
@@ -637,6 +793,11 @@ void DimUpAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void DimUpAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+}
+
 void DimUpAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -719,6 +880,11 @@ void SetValueAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void SetValueAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+}
+
 void SetValueAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -766,6 +932,12 @@ void CopyValueAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void CopyValueAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(from_m);
+    deps.addObject(to_m);
+}
+
 void CopyValueAction::Run (pth_sem_t * stop)
 {
     if (from_m && to_m)
@@ -821,6 +993,11 @@ void ToggleValueAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void ToggleValueAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+}
+
 void ToggleValueAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -899,6 +1076,13 @@ void FormulaAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void FormulaAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+    deps.addObject(x_m);
+    deps.addObject(y_m);
+}
+
 void FormulaAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -948,6 +1132,12 @@ void SetStringAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void SetStringAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+    collectVarDependencies(value_m, deps);
+}
+
 void SetStringAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -989,6 +1179,11 @@ void SendReadRequestAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void SendReadRequestAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+}
+
 void SendReadRequestAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -1065,6 +1260,13 @@ void CycleOnOffAction::exportXml(ticpp::Element* pConfig)
     }
 }
 
+void CycleOnOffAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+    if (stopCondition_m)
+        stopCondition_m->collectDependencies(deps);
+}
+
 void CycleOnOffAction::onChange(Object* object)
 {
     if (stopCondition_m && running_m && stopCondition_m->evaluate())
@@ -1147,6 +1349,13 @@ void RepeatListAction::exportXml(ticpp::Element* pConfig)
     }
 }
 
+void RepeatListAction::collectDependencies(RuleDependencies& deps)
+{
+    ActionsList_t::iterator it;
+    for (it = actionsList_m.begin(); it != actionsList_m.end(); it++)
+        (*it)->collectDependencies(deps);
+}
+
 void RepeatListAction::Run (pth_sem_t * stop)
 {
     bool running = true;
@@ -1240,6 +1449,15 @@ void ConditionalAction::exportXml(ticpp::Element* pConfig)
     }
 }
 
+void ConditionalAction::collectDependencies(RuleDependencies& deps)
+{
+    if (condition_m)
+        condition_m->collectDependencies(deps);
+    ActionsList_t::iterator it;
+    for (it = actionsList_m.begin(); it != actionsList_m.end(); it++)
+        (*it)->collectDependencies(deps);
+}
+
 void ConditionalAction::Run (pth_sem_t * stop)
 {
     bool running = true;
@@ -1314,6 +1532,14 @@ void SendSmsAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void SendSmsAction::collectDependencies(RuleDependencies& deps)
+{
+    if (varFlags_m & VarId)
+        collectVarDependencies(id_m, deps);
+    if (varFlags_m & VarValue)
+        collectVarDependencies(value_m, deps);
+}
+
 void SendSmsAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -1378,6 +1604,16 @@ void SendEmailAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void SendEmailAction::collectDependencies(RuleDependencies& deps)
+{
+    if (varFlags_m & VarTo)
+        collectVarDependencies(to_m, deps);
+    if (varFlags_m & VarSubject)
+        collectVarDependencies(subject_m, deps);
+    if (varFlags_m & VarText)
+        collectVarDependencies(text_m, deps);
+}
+
 void SendEmailAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -1398,11 +1634,86 @@ void SendEmailAction::Run (pth_sem_t * stop)
     Services::instance()->getEmailGateway()->sendEmail(to, subject, text);
 }
 
-ShellCommandAction::ShellCommandAction() : varFlags_m(0)
+/** Reports the outcome of a shell-cmd action to its status and output
+ * objects, which are kept referenced until the command exits. */
+class ShellCommandAction::Process : public ChildProcess
+{
+public:
+    Process(ShellCommandAction* action, const std::string& cmd)
+        : ChildProcess(cmd, action->timeout_m, action->outputObject_m != 0), action_m(action),
+          statusObject_m(action->statusObject_m), outputObject_m(action->outputObject_m)
+    {
+        if (statusObject_m)
+            statusObject_m->incRefCount();
+        if (outputObject_m)
+            outputObject_m->incRefCount();
+        action_m->processes_m.push_back(this);
+    }
+
+    virtual ~Process()
+    {
+        if (statusObject_m)
+            statusObject_m->decRefCount();
+        if (outputObject_m)
+            outputObject_m->decRefCount();
+        // Also reached without onExit when the process manager is reset
+        if (action_m)
+        {
+            action_m->processes_m.remove(this);
+            if (action_m->finished_m)
+                pth_sem_inc(action_m->finished_m, FALSE);
+        }
+    }
+
+    virtual void onExit(int status, const std::string& output)
+    {
+        if (status != 0)
+            logger_m.infoStream() << "Execute ShellCommandAction: '" << getCommand() << "' returned " << status << endlog;
+        try
+        {
+            if (outputObject_m)
+            {
+                std::string value = output;
+                std::string::size_type end = value.find_last_not_of("\r\n");
+                value.erase(end == std::string::npos ? 0 : end + 1);
+                outputObject_m->setValue(value);
+            }
+            if (statusObject_m)
+            {
+                std::stringstream value;
+                value << status;
+                statusObject_m->setValue(value.str());
+            }
+        }
+        catch (ticpp::Exception& ex)
+        {
+            logger_m.warnStream() << "Execute ShellCommandAction: unable to report result of '" << getCommand() << "': " << ex.m_details << endlog;
+        }
+    }
+
+    ShellCommandAction* action_m;
+
+private:
+    Object* statusObject_m;
+    Object* outputObject_m;
+    static Logger& logger_m;
+};
+
+Logger& ShellCommandAction::Process::logger_m(Logger::getInstance("ShellCommandAction"));
+
+ShellCommandAction::ShellCommandAction() : varFlags_m(0), timeout_m(0), statusObject_m(0), outputObject_m(0), finished_m(0)
 {}
 
 ShellCommandAction::~ShellCommandAction()
-{}
+{
+    // The commands keep running and still report their result
+    finished_m = 0;
+    detachProcesses();
+    if (statusObject_m)
+        statusObject_m->decRefCount();
+    if (outputObject_m)
+        outputObject_m->decRefCount();
+}
 
 void ShellCommandAction::importXml(ticpp::Element* pConfig)
 {
@@ -1417,6 +1728,23 @@ void ShellCommandAction::importXml(ticpp::Element* pConfig)
     else
         varFlags_m = 0;
 
+    timeout_m = 0;
+    pConfig->GetAttributeOrDefault("timeout", &timeout_m, 0);
+
+    if (statusObject_m)
+        statusObject_m->decRefCount();
+    statusObject_m = 0;
+    std::string id = pConfig->GetAttribute("status-object");
+    if (id != "")
+        statusObject_m = ObjectController::instance()->getObject(id);
+
+    if (outputObject_m)
+        outputObject_m->decRefCount();
+    outputObject_m = 0;
+    id = pConfig->GetAttribute("output-object");
+    if (id != "")
+        outputObject_m = ObjectController::instance()->getObject(id);
+
     logger_m.infoStream() << "ShellCommandAction: Configured" << endlog;
 }
 
@@ -1426,22 +1754,59 @@ void ShellCommandAction::exportXml(ticpp::Element* pConfig)
     pConfig->SetAttribute("cmd", cmd_m);
     if (varFlags_m & VarEnabled)
         pConfig->SetAttribute("var", "true");
+    if (timeout_m > 0)
+        pConfig->SetAttribute("timeout", timeout_m);
+    if (statusObject_m)
+        pConfig->SetAttribute("status-object", statusObject_m->getID());
+    if (outputObject_m)
+        pConfig->SetAttribute("output-object", outputObject_m->getID());
 
     Action::exportXml(pConfig);
 }
 
+void ShellCommandAction::collectDependencies(RuleDependencies& deps)
+{
+    if (varFlags_m & VarCmd)
+        collectVarDependencies(cmd_m, deps);
+    deps.addObject(statusObject_m);
+    deps.addObject(outputObject_m);
+}
+
+void ShellCommandAction::cancel()
+{
+    Action::cancel();
+    if (!processes_m.empty())
+        logger_m.infoStream() << "ShellCommandAction cancelled, '" << cmd_m << "' keeps running" << endlog;
+    // Finished for the waiters, the commands keep running and report their result
+    if (finished_m)
+        for (unsigned int i = 0; i < processes_m.size(); i++)
+            pth_sem_inc(finished_m, FALSE);
+    detachProcesses();
+}
+
+void ShellCommandAction::detachProcesses()
+{
+    for (std::list<Process*>::iterator it = processes_m.begin(); it != processes_m.end(); it++)
+        (*it)->action_m = 0;
+    processes_m.clear();
+}
+
 void ShellCommandAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
+    {
+        if (finished_m)
+            pth_sem_inc(finished_m, FALSE);
         return;
+    }
     std::string cmd = cmd_m;
     if (varFlags_m & VarCmd)
         parseVarString(cmd);
     logger_m.infoStream() << "Execute ShellCommandAction: " << cmd << endlog;
 
-    int ret = pth_system(cmd.c_str());
-    if (ret != 0)
-        logger_m.infoStream() << "Execute ShellCommandAction: returned " << ret << endlog;
+    // The process manager runs the command and signals finished_m once it
+    // exited, no thread waits for it
+    ProcessManager::instance()->launch(new Process(this, cmd));
 }
 
 StartActionlistAction::StartActionlistAction() : list_m(true)
@@ -1466,6 +1831,11 @@ void StartActionlistAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void StartActionlistAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addRule(ruleId_m);
+}
+
 void StartActionlistAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -1510,6 +1880,11 @@ void CancelAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void CancelAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addRule(ruleId_m);
+}
+
 void CancelAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -1547,6 +1922,11 @@ void SetRuleActiveAction::exportXml(ticpp::Element* pConfig)
     Action::exportXml(pConfig);
 }
 
+void SetRuleActiveAction::collectDependencies(RuleDependencies& deps)
+{
+    deps.addRule(ruleId_m);
+}
+
 void SetRuleActiveAction::Run (pth_sem_t * stop)
 {
     if (sleep(delay_m, stop))
@@ -1609,7 +1989,155 @@ Condition* Condition::create(ticpp::Element* pConfig, ChangeListener* cl)
     return condition;
 }
 
-AndCondition::AndCondition(ChangeListener* cl) : cl_m(cl)
+ConditionEvaluationOrder::Entry::Entry(Condition* condition, int index)
+    : condition_m(condition), index_m(index), pinned_m(!condition->isReorderable()),
+      cost_m(0), trueRatio_m(0.5), samples_m(0)
+{}
+
+// Orders entries by expected cost per short-circuit
+class ConditionEvaluationOrder::EntryCompare
+{
+public:
+    EntryCompare(bool shortCircuit) : shortCircuit_m(shortCircuit) {};
+    bool operator()(const Entry& a, const Entry& b) const { return score(a) < score(b); };
+private:
+    double score(const Entry& entry) const
+    {
+        double p = shortCircuit_m ? entry.trueRatio_m : 1 - entry.trueRatio_m;
+        return entry.cost_m / (p < 0.01 ? 0.01 : p);
+    };
+    bool shortCircuit_m;
+};
+
+ConditionEvaluationOrder::ConditionEvaluationOrder(bool shortCircuit)
+    : shortCircuit_m(shortCircuit), adaptive_m(false), ready_m(false), count_m(0)
+{}
+
+void ConditionEvaluationOrder::init(const Condition::ConditionsList_t& conditions)
+{
+    entries_m.clear();
+    count_m = 0;
+    adaptive_m = false;
+    ready_m = false;
+    int index = 0;
+    bool prevReorderable = false;
+    Condition::ConditionsList_t::const_iterator it;
+    for (it = conditions.begin(); it != conditions.end(); it++)
+    {
+        entries_m.push_back(Entry(*it, index++));
+        bool reorderable = !entries_m.back().pinned_m;
+        // Nothing to adapt unless two reorderable children are adjacent
+        if (reorderable && prevReorderable)
+            adaptive_m = true;
+        prevReorderable = reorderable;
+    }
+}
+
+bool ConditionEvaluationOrder::measure(Entry& entry)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool val = entry.condition_m->evaluate();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double cost = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    if (entry.samples_m == 0)
+    {
+        entry.cost_m = cost;
+        entry.trueRatio_m = val ? 1 : 0;
+    }
+    else
+    {
+        entry.cost_m += (cost - entry.cost_m) / 8;
+        entry.trueRatio_m += ((val ? 1 : 0) - entry.trueRatio_m) / 8;
+    }
+    entry.samples_m++;
+    return val;
+}
+
+void ConditionEvaluationOrder::reorder()
+{
+    ready_m = true;
+    EntryList_t::iterator begin = entries_m.begin();
+    while (begin != entries_m.end())
+    {
+        if (begin->pinned_m)
+        {
+            begin++;
+            continue;
+        }
+        EntryList_t::iterator end = begin;
+        bool ready = true;
+        for (; end != entries_m.end() && !end->pinned_m; end++)
+            ready = ready && end->samples_m >= MinSamples;
+        if (ready)
+            std::stable_sort(begin, end, EntryCompare(shortCircuit_m));
+        else
+            ready_m = false;
+        begin = end;
+    }
+}
+
+bool ConditionEvaluationOrder::evaluate()
+{
+    if (!adaptive_m)
+    {
+        for (EntryList_t::iterator it = entries_m.begin(); it != entries_m.end(); it++)
+            if (it->condition_m->evaluate() == shortCircuit_m)
+                return shortCircuit_m;
+        return !shortCircuit_m;
+    }
+
+    // Until every child has enough samples, all of them are evaluated
+    bool explore = !ready_m || (count_m % ExplorePeriod) == 0;
+    count_m++;
+    if (!ready_m || count_m % ReorderPeriod == 0)
+        reorder();
+
+    // While exploring, a short-circuit only stops evaluation at the end of
+    // the current group of reorderable children. The estimates are only
+    // sampled on these rounds, the others don't pay for the timing.
+    bool decided = false;
+    for (EntryList_t::iterator it = entries_m.begin(); it != entries_m.end(); it++)
+    {
+        if (decided && (it->pinned_m || !explore))
+            break;
+        bool val = (it->pinned_m || !explore) ? it->condition_m->evaluate() : measure(*it);
+        if (val == shortCircuit_m)
+        {
+            if (it->pinned_m || !explore)
+                return shortCircuit_m;
+            decided = true;
+        }
+    }
+    return decided ? shortCircuit_m : !shortCircuit_m;
+}
+
+void ConditionEvaluationOrder::statusXml(int index, ticpp::Element* pStatus)
+{
+    if (!adaptive_m)
+        return;
+    for (unsigned int rank = 0; rank < entries_m.size(); rank++)
+    {
+        Entry& entry = entries_m[rank];
+        if (entry.index_m != index)
+            continue;
+        pStatus->SetAttribute("eval-rank", rank);
+        if (entry.pinned_m)
+            pStatus->SetAttribute("eval-pinned", "true");
+        else if (entry.samples_m > 0)
+        {
+            std::stringstream cost, ratio;
+            cost << entry.cost_m / 1000;
+            ratio << entry.trueRatio_m;
+            pStatus->SetAttribute("eval-cost-us", cost.str());
+            pStatus->SetAttribute("eval-true-ratio", ratio.str());
+            pStatus->SetAttribute("eval-samples", entry.samples_m);
+        }
+        return;
+    }
+}
+
+AndCondition::AndCondition(ChangeListener* cl) : order_m(false), cl_m(cl)
 {}
 
 AndCondition::~AndCondition()
@@ -1621,11 +2149,7 @@ AndCondition::~AndCondition()
 
 bool AndCondition::evaluate()
 {
-    ConditionsList_t::iterator it;
-    for(it=conditionsList_m.begin(); it != conditionsList_m.end(); ++it)
-        if (!(*it)->evaluate())
-            return false;
-    return true;
+    return order_m.evaluate();
 }
 
 void AndCondition::importXml(ticpp::Element* pConfig)
@@ -1636,6 +2160,7 @@ void AndCondition::importXml(ticpp::Element* pConfig)
         Condition* condition = Condition::create(&(*child), cl_m);
         conditionsList_m.push_back(condition);
     }
+    order_m.init(conditionsList_m);
 }
 
 void AndCondition::exportXml(ticpp::Element* pConfig)
@@ -1653,16 +2178,43 @@ void AndCondition::exportXml(ticpp::Element* pConfig)
 void AndCondition::statusXml(ticpp::Element* pStatus)
 {
     pStatus->SetAttribute("type", "and");
+    int index = 0;
     ConditionsList_t::iterator it;
     for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
     {
         ticpp::Element pElem("condition");
         (*it)->statusXml(&pElem);
+        order_m.statusXml(index++, &pElem);
         pStatus->LinkEndChild(&pElem);
     }
 }
 
-OrCondition::OrCondition(ChangeListener* cl) : cl_m(cl)
+void AndCondition::collectDependencies(RuleDependencies& deps)
+{
+    ConditionsList_t::iterator it;
+    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
+        (*it)->collectDependencies(deps);
+}
+
+bool AndCondition::isReorderable()
+{
+    ConditionsList_t::iterator it;
+    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
+        if (!(*it)->isReorderable())
+            return false;
+    return true;
+}
+
+bool AndCondition::isThreadSafe()
+{
+    ConditionsList_t::iterator it;
+    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
+        if (!(*it)->isThreadSafe())
+            return false;
+    return true;
+}
+
+OrCondition::OrCondition(ChangeListener* cl) : order_m(true), cl_m(cl)
 {}
 
 OrCondition::~OrCondition()
@@ -1674,11 +2226,7 @@ OrCondition::~OrCondition()
 
 bool OrCondition::evaluate()
 {
-    ConditionsList_t::iterator it;
-    for(it=conditionsList_m.begin(); it != conditionsList_m.end(); ++it)
-        if ((*it)->evaluate())
-            return true;
-    return false;
+    return order_m.evaluate();
 }
 
 void OrCondition::importXml(ticpp::Element* pConfig)
@@ -1689,6 +2237,7 @@ void OrCondition::importXml(ticpp::Element* pConfig)
         Condition* condition = Condition::create(&(*child), cl_m);
         conditionsList_m.push_back(condition);
     }
+    order_m.init(conditionsList_m);
 }
 
 void OrCondition::exportXml(ticpp::Element* pConfig)
@@ -1706,15 +2255,42 @@ void OrCondition::exportXml(ticpp::Element* pConfig)
 void OrCondition::statusXml(ticpp::Element* pStatus)
 {
     pStatus->SetAttribute("type", "or");
+    int index = 0;
     ConditionsList_t::iterator it;
     for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
     {
         ticpp::Element pElem("condition");
         (*it)->statusXml(&pElem);
+        order_m.statusXml(index++, &pElem);
         pStatus->LinkEndChild(&pElem);
     }
 }
 
+void OrCondition::collectDependencies(RuleDependencies& deps)
+{
+    ConditionsList_t::iterator it;
+    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
+        (*it)->collectDependencies(deps);
+}
+
+bool OrCondition::isReorderable()
+{
+    ConditionsList_t::iterator it;
+    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
+        if (!(*it)->isReorderable())
+            return false;
+    return true;
+}
+
+bool OrCondition::isThreadSafe()
+{
+    ConditionsList_t::iterator it;
+    for (it = conditionsList_m.begin(); it != conditionsList_m.end(); it++)
+        if (!(*it)->isThreadSafe())
+            return false;
+    return true;
+}
+
 NotCondition::NotCondition(ChangeListener* cl) : condition_m(0), cl_m(cl)
 {}
 
@@ -1756,6 +2332,21 @@ void NotCondition::statusXml(ticpp::Element* pStatus)
     }
 }
 
+void NotCondition::collectDependencies(RuleDependencies& deps)
+{
+    condition_m->collectDependencies(deps);
+}
+
+bool NotCondition::isReorderable()
+{
+    return condition_m->isReorderable();
+}
+
+bool NotCondition::isThreadSafe()
+{
+    return condition_m->isThreadSafe();
+}
+
 ObjectCondition::ObjectCondition(ChangeListener* cl) : object_m(0), value_m(0), cl_m(cl), trigger_m(false), op_m(eq)
 {}
 
@@ -1870,6 +2461,23 @@ void ObjectCondition::statusXml(ticpp::Element* pStatus)
         pStatus->SetAttribute("trigger", "true");
 }
 
+void ObjectCondition::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+}
+
+bool ObjectCondition::isReorderable()
+{
+    return !trigger_m;
+}
+
+// The executor only hands the rule to a worker once the objects are
+// initialized, so get() never reads the bus there
+bool ObjectCondition::isThreadSafe()
+{
+    return true;
+}
+
 ObjectComparisonCondition::ObjectComparisonCondition(ChangeListener* cl) : ObjectCondition(cl), object2_m(0)
 {}
 
@@ -1968,6 +2576,12 @@ void ObjectComparisonCondition::statusXml(ticpp::Element* pStatus)
         pStatus->SetAttribute("trigger", "true");
 }
 
+void ObjectComparisonCondition::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+    deps.addObject(object2_m);
+}
+
 ObjectSourceCondition::ObjectSourceCondition(ChangeListener* cl) : ObjectCondition(cl), src_m(0)
 {}
 
@@ -2113,6 +2727,25 @@ void ObjectThresholdCondition::statusXml(ticpp::Element* pStatus)
         pStatus->SetAttribute("trigger", "true");
 }
 
+void ObjectThresholdCondition::collectDependencies(RuleDependencies& deps)
+{
+    deps.addObject(object_m);
+    if (condition_m)
+        condition_m->collectDependencies(deps);
+}
+
+bool ObjectThresholdCondition::isReorderable()
+{
+    // evaluate() updates the reference value
+    return false;
+}
+
+bool ObjectThresholdCondition::isThreadSafe()
+{
+    // The reference value belongs to the rule, only the reset condition matters
+    return condition_m->isThreadSafe();
+}
+
 
 TimerCondition::TimerCondition(ChangeListener* cl)
         : PeriodicTask(cl), trigger_m(false), initVal_m(initValGuess)
@@ -2179,21 +2812,36 @@ void TimerCondition::importXml(ticpp::Element* pConfig)
     else
         during_m = 0;
 
-    reschedule(0);
     if (initVal == "true")
-    {
-        value_m = true;
         initVal_m = initValTrue;
-    }
     else if (initVal == "false")
-    {
-        value_m = false;
         initVal_m = initValFalse;
-    }
     else
-        // if init value is not explicitly configured, we keep
-        // the value guessed during reschedule(0)
         initVal_m = initValGuess;
+
+    // A state saved before the last shutdown takes precedence over the
+    // init value
+    TimerSnapshot* snapshot = Services::instance()->getTimerSnapshot();
+    if (snapshot->isEnabled())
+    {
+        ticpp::Element pCanonical("condition");
+        exportXml(&pCanonical);
+        std::list<Object*> objects;
+        if (at_m)
+            at_m->getObjects(objects);
+        if (until_m)
+            until_m->getObjects(objects);
+        if (snapshot->addTimer(this, &pCanonical, objects))
+            return;
+    }
+
+    reschedule(0);
+    // if init value is not explicitly configured, we keep
+    // the value guessed during reschedule(0)
+    if (initVal_m == initValTrue)
+        value_m = true;
+    else if (initVal_m == initValFalse)
+        value_m = false;
 }
 
 void TimerCondition::exportXml(ticpp::Element* pConfig)
@@ -2245,6 +2893,23 @@ void TimerCondition::statusXml(ticpp::Element* pStatus)
     PeriodicTask::statusXml(pStatus);
 }
 
+void TimerCondition::collectDependencies(RuleDependencies& deps)
+{
+    std::list<Object*> objects;
+    if (at_m)
+        at_m->getObjects(objects);
+    if (until_m)
+        until_m->getObjects(objects);
+    std::list<Object*>::iterator it;
+    for (it = objects.begin(); it != objects.end(); it++)
+        deps.addObject(*it);
+}
+
+bool TimerCondition::isReorderable()
+{
+    return !trigger_m;
+}
+
 TimeCounterCondition::TimeCounterCondition(ChangeListener* cl) : condition_m(0), cl_m(cl), lastTime_m(0), lastVal_m(false), counter_m(0), threshold_m(0), resetDelay_m(0)
 {}
 
@@ -2256,7 +2921,7 @@ TimeCounterCondition::~TimeCounterCondition()
 
 bool TimeCounterCondition::evaluate()
 {
-    time_t now = time(0);
+    time_t now = Clock::now();
     bool val = condition_m->evaluate(); 
     if (lastVal_m && (counter_m < threshold_m))
     {
@@ -2269,9 +2934,15 @@ bool TimeCounterCondition::evaluate()
         lastVal_m = true;
         if (counter_m < threshold_m)
         {
-            execTime_m = now + (threshold_m - counter_m) + 1;
-            Services::instance()->getTimerManager()->removeTask(this);
-            reschedule(0);
+            // While the condition stays true the deadline does not move,
+            // there is no need to reschedule on every evaluation
+            time_t execTime = now + (threshold_m - counter_m) + 1;
+            if (execTime != execTime_m || !isScheduled())
+            {
+                execTime_m = execTime;
+                Services::instance()->getTimerManager()->removeTask(this);
+                reschedule(0);
+            }
         }
     }
     else if (lastVal_m)
@@ -2308,6 +2979,38 @@ void TimeCounterCondition::importXml(ticpp::Element* pConfig)
     threshold_m = RuleServer::parseDuration(pConfig->GetAttribute("threshold"));
     resetDelay_m = RuleServer::parseDuration(pConfig->GetAttribute("reset-delay"));
     condition_m = Condition::create(pConfig->FirstChildElement("condition"), cl_m);
+
+    TimerSnapshot* snapshot = Services::instance()->getTimerSnapshot();
+    if (snapshot->isEnabled())
+    {
+        ticpp::Element pCanonical("condition");
+        exportXml(&pCanonical);
+        snapshot->addTimer(this, &pCanonical);
+    }
+}
+
+void TimeCounterCondition::saveState(TimerState* state)
+{
+    state->execTime = isScheduled() ? execTime_m : 0;
+    state->lastTime = lastTime_m;
+    state->counter = counter_m;
+    state->lastValue = lastVal_m;
+}
+
+bool TimeCounterCondition::restoreState(const TimerState& state)
+{
+    time_t now = Clock::now();
+    counter_m = state.counter;
+    lastVal_m = state.lastValue;
+    // The time spent stopped is not counted
+    lastTime_m = (lastVal_m && state.lastTime != 0) ? now : state.lastTime;
+    if (state.execTime != 0)
+    {
+        // A deadline missed while stopped makes the rule evaluate soon
+        execTime_m = (state.execTime > now) ? state.execTime : now + 1;
+        reschedule(0);
+    }
+    return true;
 }
 
 void TimeCounterCondition::exportXml(ticpp::Element* pConfig)
@@ -2339,6 +3042,11 @@ void TimeCounterCondition::statusXml(ticpp::Element* pStatus)
     }
 }
 
+void TimeCounterCondition::collectDependencies(RuleDependencies& deps)
+{
+    condition_m->collectDependencies(deps);
+}
+
 void RuleInitializer::Run (pth_sem_t * stop)
 {
     RuleServer::instance()->initialize();
@@ -22,6 +22,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 #include "config.h"
 #include "logger.h"
 #include "objectcontroller.h"
@@ -29,6 +30,30 @@
 #include "collections.h"
 #include "ticpp.h"
 
+class RuleShard;
+class RuleShardExecutor;
+
+// Objects and rules a condition or an action may read or modify. Collected
+// by the rule partitioner to find groups of rules that never interact.
+class RuleDependencies
+{
+public:
+    RuleDependencies() : opaque_m(false) {};
+
+    void addObject(Object* object) { if (object) objects_m.push_back(object); };
+    void addRule(const std::string& id) { rules_m.push_back(id); };
+    void setOpaque() { opaque_m = true; };
+
+    const std::list<Object*>& getObjects() const { return objects_m; };
+    const std::list<std::string>& getRules() const { return rules_m; };
+    bool isOpaque() const { return opaque_m; };
+
+private:
+    std::list<Object*> objects_m;
+    std::list<std::string> rules_m;
+    bool opaque_m;
+};
+
 class Condition
 {
 public:
@@ -41,12 +66,74 @@ public:
     virtual void importXml(ticpp::Element* pConfig) = 0;
     virtual void exportXml(ticpp::Element* pConfig) = 0;
     virtual void statusXml(ticpp::Element* pStatus) = 0;
+    // Conditions that can't tell which objects they use (e.g. Lua scripts)
+    // keep the default and are marked as opaque
+    virtual void collectDependencies(RuleDependencies& deps) { deps.setOpaque(); };
+    // True if evaluating the condition has no side effect and it is not a
+    // trigger, so that and/or conditions may evaluate it in any order
+    virtual bool isReorderable() { return false; };
+    // True if evaluate() only reads object values and the condition's own
+    // state, so that the rule may be evaluated by a shard worker thread
+    virtual bool isThreadSafe() { return false; };
 
     typedef std::list<Condition*> ConditionsList_t;
 protected:
     static Logger& logger_m;
 };
 
+/*
+ * Evaluation order of the children of an and/or condition. Keeps running
+ * estimates (exponential moving averages) of the cost and the outcome of
+ * each child and evaluates first the children most likely to short-circuit
+ * the result for the least cost. Children that are not reorderable keep
+ * their configured position and no child is moved across them, so the
+ * children evaluated before a stateful one are always the same.
+ */
+class ConditionEvaluationOrder
+{
+public:
+    // shortCircuit is the value that decides the result (false for and, true for or)
+    ConditionEvaluationOrder(bool shortCircuit);
+
+    void init(const Condition::ConditionsList_t& conditions);
+    bool evaluate();
+    // Adds evaluation statistics of the child at configured position index
+    void statusXml(int index, ticpp::Element* pStatus);
+
+private:
+    class Entry
+    {
+    public:
+        Entry(Condition* condition, int index);
+
+        Condition* condition_m;
+        int index_m;
+        bool pinned_m;
+        double cost_m;
+        double trueRatio_m;
+        unsigned int samples_m;
+    };
+    class EntryCompare;
+
+    bool measure(Entry& entry);
+    void reorder();
+
+    typedef std::vector<Entry> EntryList_t;
+    EntryList_t entries_m;
+    bool shortCircuit_m;
+    bool adaptive_m;
+    bool ready_m;
+    unsigned int count_m;
+
+    // Every ExplorePeriod evaluations, all reorderable children are evaluated
+    // and timed to keep their estimates up to date, other evaluations are
+    // not sampled. Children are only reordered once they all have MinSamples
+    // samples.
+    static const unsigned int ExplorePeriod = 32;
+    static const unsigned int ReorderPeriod = 16;
+    static const unsigned int MinSamples = 4;
+};
+
 class AndCondition : public Condition
 {
 public:
@@ -57,9 +144,13 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual bool isReorderable();
+    virtual bool isThreadSafe();
 
 private:
     ConditionsList_t conditionsList_m;
+    ConditionEvaluationOrder order_m;
     ChangeListener* cl_m;
 };
 
@@ -73,9 +164,13 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual bool isReorderable();
+    virtual bool isThreadSafe();
 
 private:
     ConditionsList_t conditionsList_m;
+    ConditionEvaluationOrder order_m;
     ChangeListener* cl_m;
 };
 
@@ -89,6 +184,9 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual bool isReorderable();
+    virtual bool isThreadSafe();
 
 private:
     Condition* condition_m;
@@ -105,6 +203,9 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual bool isReorderable();
+    virtual bool isThreadSafe();
 
 protected:
     Object* object_m;
@@ -131,6 +232,7 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 protected:
     Object* object2_m;
@@ -161,6 +263,9 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual bool isReorderable();
+    virtual bool isThreadSafe();
 
 protected:
     double refValue_m;
@@ -178,6 +283,8 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual bool isReorderable();
 private:
     bool trigger_m;
     char initVal_m;
@@ -200,6 +307,9 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void collectDependencies(RuleDependencies& deps);
+    virtual void saveState(TimerState* state);
+    virtual bool restoreState(const TimerState& state);
 
 private:
     Condition* condition_m;
@@ -222,16 +332,21 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig) = 0;
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps) { deps.setOpaque(); };
 
     virtual void execute() { Start(true); };
     virtual void cancel() { Stop(); };
     virtual bool isFinished() { return Thread::isFinished(); };
+    virtual void setFinishedSem(pth_sem_t* sem) { Thread::setFinishedSem(sem); };
+    /** Deletes the action, stopping it first if it is still running */
+    void release();
 private:
     virtual void Run (pth_sem_t * stop) = 0;
 protected:
     static bool sleep(int delay, pth_sem_t * stop);
     static bool usleep(int delay, pth_sem_t * stop);
     bool parseVarString(std::string &str, bool checkOnly = false);
+    static void collectVarDependencies(const std::string &str, RuleDependencies& deps);
     int delay_m;
     static Logger& logger_m;
 };
@@ -244,6 +359,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -260,6 +376,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -276,6 +393,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -292,6 +410,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -307,6 +426,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -323,6 +443,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -339,6 +460,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -354,6 +476,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
     virtual void onChange(Object* object);
 
 private:
@@ -373,6 +496,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -390,6 +514,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -407,6 +532,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -430,6 +556,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -447,6 +574,8 @@ private:
     std::string text_m;
 };
 
+/** The thread of the action returns once the command is launched, the
+ * action is finished when all the commands it launched have exited. */
 class ShellCommandAction : public Action
 {
 public:
@@ -455,9 +584,19 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
+
+    virtual void cancel();
+    virtual bool isFinished() { return Thread::isFinished() && processes_m.empty(); };
+    virtual void setFinishedSem(pth_sem_t* sem) { finished_m = sem; };
 
 private:
+    class Process;
+    friend class Process;
+
     virtual void Run (pth_sem_t * stop);
+    /** Stops reporting the exit of the running commands to the action */
+    void detachProcesses();
 
     int varFlags_m;
     enum replaceVarFlags
@@ -466,6 +605,13 @@ private:
         VarCmd = 2,
     };
     std::string cmd_m;
+    int timeout_m;
+    Object* statusObject_m;
+    Object* outputObject_m;
+    /** Commands launched and not exited yet */
+    std::list<Process*> processes_m;
+    /** Incremented when a command exits, or when Run returns without one */
+    pth_sem_t* finished_m;
 };
 
 class StartActionlistAction : public Action
@@ -476,6 +622,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -492,6 +639,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -507,6 +655,7 @@ public:
 
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
+    virtual void collectDependencies(RuleDependencies& deps);
 
 private:
     virtual void Run (pth_sem_t * stop);
@@ -563,6 +712,22 @@ public:
     void setActive(bool active);
     void cancel();
     void initialize();
+    void collectDependencies(RuleDependencies& deps);
+
+    // Threaded evaluation, see RuleShardExecutor. The condition of a rule
+    // attached to a shard may be evaluated by a worker thread, the result is
+    // always applied by the pth thread.
+    void setShard(RuleShard* shard) { shard_m = shard; scheduled_m = false; };
+    RuleShard* getShard() { return shard_m; };
+    bool setScheduled(bool scheduled) { bool prev = scheduled_m; scheduled_m = scheduled; return prev; };
+    bool isThreadSafe() { return condition_m && condition_m->isThreadSafe(); };
+    // A shard evaluates a rule once per round on the latest values, the
+    // on-true/on-false lists would miss the transitions in between
+    bool isShardable() { return isThreadSafe() && actionsOnTrue_m.empty() && actionsOnFalse_m.empty(); };
+    bool isActive() { return flags_m & Active; };
+    bool evaluateCondition() { return condition_m->evaluate(); };
+    void collectConditionDependencies(RuleDependencies& deps);
+    void applyValue(bool curValue);
 
 	void executeActions(ActionList::TriggerType type)
 	{
@@ -578,6 +743,7 @@ public:
 
 private:
 	void executeActions(ActionList &actions);
+	void setStateRestored(bool restored);
 	ActionList &getActions(ActionList::TriggerType trigger);
 	static void exportActions(ActionList &actions, ticpp::Element *pRuleConfig);
 
@@ -596,8 +762,12 @@ private:
         Active = 0x01,
         InitEval = 0x10,
         InitTrue = 0x20,
+        /** The initial value is evaluated, a timer state was restored */
+        StateRestored = 0x40,
     };
     int flags_m;
+    RuleShard* shard_m;
+    bool scheduled_m;
 protected:
     static Logger& logger_m;
 };
@@ -616,10 +786,14 @@ public:
     virtual void importXml(ticpp::Element* pConfig);
     virtual void exportXml(ticpp::Element* pConfig);
     virtual void statusXml(ticpp::Element* pStatus);
+    void partitionXml(ticpp::Element* pStatus);
 
     void initialize();
     
     Rule *getRule(const char *id);
+    int getThreads() { return threads_m; };
+    /** Evaluates the rules waiting for a shard worker */
+    void flush();
 
     static int parseDuration(const std::string& duration, bool allowNegative = false, bool useMilliseconds = false);
     static std::string formatDuration(int duration, bool useMilliseconds = false);
@@ -628,8 +802,13 @@ private:
     RuleServer();
     ~RuleServer();
     typedef std::pair<std::string ,Rule*> RuleIdPair_t;
-    typedef std::map<std::string ,Rule*> RuleIdMap_t;
+    typedef HashMap<std::string ,Rule*> RuleIdMap_t;
     RuleIdMap_t rulesMap_m;
+    void importRules(ticpp::Element* pConfig);
+    void updateShards();
+
+    int threads_m;
+    RuleShardExecutor* executor_m;
     static RuleServer* instance_m;
 };
 
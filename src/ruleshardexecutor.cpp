@@ -0,0 +1,353 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "ruleshardexecutor.h"
+#include "rulepartitioner.h"
+#include <algorithm>
+#include <set>
+#include <signal.h>
+
+Logger& RuleShardExecutor::logger_m(Logger::getInstance("RuleShardExecutor"));
+
+RuleShard::RuleShard(RuleShardExecutor* executor, int index)
+    : executor_m(executor), index_m(index), ready_m(true), evaluations_m(0)
+{}
+
+void RuleShard::schedule(Rule* rule)
+{
+    if (!rule->setScheduled(true))
+    {
+        inbox_m.push_back(rule);
+        executor_m->wakeUp();
+    }
+}
+
+RuleShardExecutor::RuleShardExecutor(int threads)
+    : rounds_m(0), round_m(0), remaining_m(0), stopping_m(false)
+{
+    if (threads < 1 || threads > MaxThreads)
+        throw ticpp::Exception("RuleShardExecutor: invalid number of threads");
+    pth_mutex_init(&roundMutex_m);
+    pth_sem_init(&wakeUp_m);
+    pthread_mutex_init(&mutex_m, 0);
+    pthread_cond_init(&startCond_m, 0);
+    pthread_cond_init(&doneCond_m, 0);
+    for (int i = 0; i < threads; i++)
+        shards_m.push_back(new RuleShard(this, i));
+
+    // The first shard is evaluated by the dispatcher itself. Workers must
+    // not catch the signals handled by the pth main thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 1; i < threads; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, 0, &RuleShardExecutor::workerEntry, shards_m[i]) != 0)
+        {
+            pthread_sigmask(SIG_SETMASK, &old, 0);
+            throw ticpp::Exception("RuleShardExecutor: unable to start worker thread");
+        }
+        workers_m.push_back(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    logger_m.infoStream() << "Started " << workers_m.size() << " rule worker threads" << endlog;
+    Start();
+}
+
+RuleShardExecutor::~RuleShardExecutor()
+{
+    Stop();
+    pthread_mutex_lock(&mutex_m);
+    stopping_m = true;
+    pthread_cond_broadcast(&startCond_m);
+    pthread_mutex_unlock(&mutex_m);
+    for (std::vector<pthread_t>::iterator it = workers_m.begin(); it != workers_m.end(); it++)
+        pthread_join(*it, 0);
+
+    clear();
+    for (std::vector<RuleShard*>::iterator it = shards_m.begin(); it != shards_m.end(); it++)
+        delete (*it);
+    pthread_cond_destroy(&doneCond_m);
+    pthread_cond_destroy(&startCond_m);
+    pthread_mutex_destroy(&mutex_m);
+}
+
+void RuleShardExecutor::build(const std::vector<Rule*>& rules)
+{
+    pth_mutex_acquire(&roundMutex_m, FALSE, NULL);
+    clear();
+
+    RulePartitioner partitioner;
+    for (std::vector<Rule*>::const_iterator it = rules.begin(); it != rules.end(); it++)
+        partitioner.addRule(*it);
+    RulePartitioner::PartitionList_t partitions;
+    partitioner.compute(partitions);
+
+    // Partitions come largest first, each one goes to the least loaded shard
+    std::vector<int> load(shards_m.size(), 0);
+    int nbInline = 0;
+    for (RulePartitioner::PartitionList_t::iterator it = partitions.begin(); it != partitions.end(); it++)
+    {
+        bool threadSafe = !it->shared_m;
+        for (std::vector<Rule*>::iterator ruleIt = it->rules_m.begin(); threadSafe && ruleIt != it->rules_m.end(); ruleIt++)
+            threadSafe = (*ruleIt)->isShardable();
+        if (!threadSafe)
+        {
+            nbInline += it->rules_m.size();
+            continue;
+        }
+
+        int index = std::min_element(load.begin(), load.end()) - load.begin();
+        load[index] += it->rules_m.size();
+        RuleShard& shard = *shards_m[index];
+        std::set<Object*> objects;
+        for (std::vector<Rule*>::iterator ruleIt = it->rules_m.begin(); ruleIt != it->rules_m.end(); ruleIt++)
+        {
+            RuleDependencies deps;
+            (*ruleIt)->collectConditionDependencies(deps);
+            objects.insert(deps.getObjects().begin(), deps.getObjects().end());
+            (*ruleIt)->setShard(&shard);
+            shard.rules_m.push_back(*ruleIt);
+        }
+        shard.objects_m.insert(shard.objects_m.end(), objects.begin(), objects.end());
+        shard.ready_m = false;
+    }
+    logger_m.infoStream() << "Spread " << (rules.size() - nbInline) << " rules over " << shards_m.size()
+                          << " shards, " << nbInline << " rules evaluated inline" << endlog;
+    pth_mutex_release(&roundMutex_m);
+}
+
+void RuleShardExecutor::clear()
+{
+    for (std::vector<RuleShard*>::iterator it = shards_m.begin(); it != shards_m.end(); it++)
+    {
+        RuleShard& shard = **it;
+        for (std::vector<Rule*>::iterator ruleIt = shard.rules_m.begin(); ruleIt != shard.rules_m.end(); ruleIt++)
+            (*ruleIt)->setShard(0);
+        shard.rules_m.clear();
+        shard.objects_m.clear();
+        shard.inbox_m.clear();
+        shard.ready_m = true;
+    }
+}
+
+void RuleShardExecutor::flush()
+{
+    pth_mutex_acquire(&roundMutex_m, FALSE, NULL);
+    while (isPending())
+        runRound();
+    pth_mutex_release(&roundMutex_m);
+}
+
+void RuleShardExecutor::wakeUp()
+{
+    pth_sem_inc(&wakeUp_m, FALSE);
+}
+
+bool RuleShardExecutor::isPending()
+{
+    for (std::vector<RuleShard*>::iterator it = shards_m.begin(); it != shards_m.end(); it++)
+        if (!(*it)->inbox_m.empty())
+            return true;
+    return false;
+}
+
+void RuleShardExecutor::runRound()
+{
+    // Reading an object for the first time may wait for the bus, which
+    // yields to the other pth threads and lets them post more rules
+    std::vector<bool> tried(shards_m.size(), false);
+    bool prepared = false;
+    while (!prepared)
+    {
+        prepared = true;
+        for (unsigned int i = 0; i < shards_m.size(); i++)
+        {
+            RuleShard& shard = *shards_m[i];
+            if (shard.ready_m || tried[i] || shard.inbox_m.empty())
+                continue;
+            tried[i] = true;
+            prepared = false;
+            bool ready = true;
+            for (std::vector<Object*>::iterator objIt = shard.objects_m.begin(); objIt != shard.objects_m.end(); objIt++)
+            {
+                (*objIt)->get();
+                ready = ready && (*objIt)->isInitialized();
+            }
+            shard.ready_m = ready;
+        }
+    }
+
+    bool parallel = false;
+    for (std::vector<RuleShard*>::iterator it = shards_m.begin(); it != shards_m.end(); it++)
+    {
+        RuleShard& shard = **it;
+        shard.batch_m.swap(shard.inbox_m);
+        shard.inbox_m.clear();
+        for (std::vector<Rule*>::iterator ruleIt = shard.batch_m.begin(); ruleIt != shard.batch_m.end(); ruleIt++)
+            (*ruleIt)->setScheduled(false);
+        shard.results_m.resize(shard.batch_m.size());
+        if (shard.index_m > 0 && !shard.batch_m.empty())
+            parallel = true;
+    }
+    rounds_m++;
+
+    // Nothing below may yield until all workers are done
+    if (parallel)
+    {
+        pthread_mutex_lock(&mutex_m);
+        round_m++;
+        remaining_m = workers_m.size();
+        pthread_cond_broadcast(&startCond_m);
+        pthread_mutex_unlock(&mutex_m);
+    }
+    evaluate(*shards_m[0]);
+    if (parallel)
+    {
+        pthread_mutex_lock(&mutex_m);
+        while (remaining_m > 0)
+            pthread_cond_wait(&doneCond_m, &mutex_m);
+        pthread_mutex_unlock(&mutex_m);
+    }
+
+    for (std::vector<RuleShard*>::iterator it = shards_m.begin(); it != shards_m.end(); it++)
+        apply(**it);
+}
+
+// Runs in a worker thread: no pth call, only reads of initialized objects,
+// and the logs go to the buffer of the shard
+void RuleShardExecutor::evaluate(RuleShard& shard)
+{
+    LogBuffer::attach(&shard.log_m);
+    for (unsigned int i = 0; i < shard.batch_m.size(); i++)
+    {
+        Rule* rule = shard.batch_m[i];
+        if (!shard.ready_m)
+        {
+            shard.results_m[i] = RuleShard::Deferred;
+            continue;
+        }
+        if (!rule->isActive())
+        {
+            shard.results_m[i] = RuleShard::Inactive;
+            continue;
+        }
+        try
+        {
+            shard.results_m[i] = rule->evaluateCondition() ? RuleShard::True : RuleShard::False;
+        }
+        catch (...)
+        {
+            shard.results_m[i] = RuleShard::Failed;
+        }
+    }
+    LogBuffer::attach(0);
+}
+
+void RuleShardExecutor::apply(RuleShard& shard)
+{
+    shard.log_m.flush();
+    for (unsigned int i = 0; i < shard.batch_m.size(); i++)
+    {
+        Rule* rule = shard.batch_m[i];
+        switch (shard.results_m[i])
+        {
+        case RuleShard::Inactive:
+            break;
+        case RuleShard::Deferred:
+        case RuleShard::Failed:
+            // Evaluated inline, which also reports the errors
+            try
+            {
+                rule->evaluate();
+            }
+            catch (ticpp::Exception& ex)
+            {
+                logger_m.errorStream() << "Unable to evaluate rule " << rule->getID() << ": " << ex.m_details << endlog;
+            }
+            break;
+        default:
+            rule->applyValue(shard.results_m[i] == RuleShard::True);
+        }
+    }
+    shard.evaluations_m += shard.batch_m.size();
+    shard.batch_m.clear();
+}
+
+void* RuleShardExecutor::workerEntry(void* arg)
+{
+    RuleShard* shard = static_cast<RuleShard*>(arg);
+    shard->executor_m->worker(*shard);
+    return 0;
+}
+
+void RuleShardExecutor::worker(RuleShard& shard)
+{
+    unsigned long round = 0;
+    pthread_mutex_lock(&mutex_m);
+    while (!stopping_m)
+    {
+        if (round == round_m)
+        {
+            pthread_cond_wait(&startCond_m, &mutex_m);
+            continue;
+        }
+        round = round_m;
+        pthread_mutex_unlock(&mutex_m);
+        evaluate(shard);
+        pthread_mutex_lock(&mutex_m);
+        if (--remaining_m == 0)
+            pthread_cond_signal(&doneCond_m);
+    }
+    pthread_mutex_unlock(&mutex_m);
+}
+
+void RuleShardExecutor::statusXml(ticpp::Element* pStatus)
+{
+    pStatus->SetAttribute("threads", shards_m.size());
+    pStatus->SetAttribute("rounds", rounds_m);
+    for (std::vector<RuleShard*>::iterator it = shards_m.begin(); it != shards_m.end(); it++)
+    {
+        ticpp::Element pShard("shard");
+        pShard.SetAttribute("id", (*it)->index_m);
+        pShard.SetAttribute("rules", (*it)->rules_m.size());
+        pShard.SetAttribute("objects", (*it)->objects_m.size());
+        pShard.SetAttribute("evaluations", (*it)->evaluations_m);
+        pStatus->LinkEndChild(&pShard);
+    }
+}
+
+void RuleShardExecutor::Run (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeUp = pth_event (PTH_EVENT_SEM, &wakeUp_m);
+    pth_event_concat (stop, wakeUp, NULL);
+    logger_m.debugStream() << "Starting rule shard dispatcher." << endlog;
+    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    {
+        pth_sem_set_value(&wakeUp_m, 0);
+        flush();
+        pth_wait(stop);
+    }
+    logger_m.debugStream() << "Out of rule shard dispatcher." << endlog;
+    pth_event_isolate (wakeUp);
+    pth_event_free (stop, PTH_FREE_THIS);
+    pth_event_free (wakeUp, PTH_FREE_THIS);
+}
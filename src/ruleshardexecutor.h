@@ -0,0 +1,139 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef RULESHARDEXECUTOR_H
+#define RULESHARDEXECUTOR_H
+
+#include <vector>
+#include <pthread.h>
+#include "threads.h"
+#include "logger.h"
+#include "ruleserver.h"
+#include "ticpp.h"
+
+class RuleShardExecutor;
+
+/** Group of rule partitions evaluated by the same worker thread. The inbox
+ * is the message queue of the shard: rules triggered by an object change
+ * are posted there by the pth thread and evaluated during the next round. */
+class RuleShard
+{
+public:
+    RuleShard(RuleShardExecutor* executor, int index);
+
+    /** Posts the rule to the inbox, a rule already waiting is not queued
+     * twice and is evaluated once on the latest object values. Only rules
+     * with if-true/if-false action lists are sharded, they don't depend on
+     * the intermediate values. */
+    void schedule(Rule* rule);
+
+    enum Result
+    {
+        False = 0,
+        True = 1,
+        Inactive = 2,
+        Failed = 3,
+        Deferred = 4
+    };
+
+private:
+    friend class RuleShardExecutor;
+
+    RuleShardExecutor* executor_m;
+    int index_m;
+    std::vector<Rule*> rules_m;
+    /** Objects read by the conditions of the shard */
+    std::vector<Object*> objects_m;
+    /** True once all the objects are initialized, a worker can't issue a
+     * bus read. The rules of a shard that isn't ready are evaluated
+     * inline. */
+    bool ready_m;
+    std::vector<Rule*> inbox_m;
+    std::vector<Rule*> batch_m;
+    std::vector<char> results_m;
+    /** Logs of the conditions, written out when the results are applied */
+    LogBuffer log_m;
+    unsigned long evaluations_m;
+};
+
+/** Evaluates the rule conditions on several native threads. The rules are
+ * split into the partitions computed by RulePartitioner and the partitions
+ * are spread over the shards, largest first on the least loaded one. Rules
+ * of the shared partition, rules with a condition that is not thread safe
+ * and rules with on-true/on-false action lists stay evaluated inline.
+ *
+ * The pth thread remains the only one doing bus I/O and modifying objects.
+ * Evaluation proceeds in rounds: the dispatcher takes the inbox of every
+ * shard, starts the workers and evaluates the first shard itself, then
+ * blocks natively until all workers are done. No pth thread can run during
+ * that time, which makes concurrent reads of the objects safe. The results
+ * are finally applied (actions executed) by the pth thread, shard after
+ * shard, and the changes they cause are posted to the inboxes for the next
+ * round. */
+class RuleShardExecutor : protected Thread
+{
+public:
+    RuleShardExecutor(int threads);
+    virtual ~RuleShardExecutor();
+
+    /** Spreads the rules over the shards, replaces the previous assignment.
+     * The inboxes must be empty, see flush(). */
+    void build(const std::vector<Rule*>& rules);
+    /** Runs rounds until no rule is waiting */
+    void flush();
+    void statusXml(ticpp::Element* pStatus);
+
+    int getThreads() { return shards_m.size(); };
+    unsigned long getRounds() { return rounds_m; };
+
+    static const int MaxThreads = 64;
+
+private:
+    friend class RuleShard;
+
+    void wakeUp();
+    bool isPending();
+    void runRound();
+    void evaluate(RuleShard& shard);
+    void apply(RuleShard& shard);
+    void clear();
+    void Run (pth_sem_t * stop);
+
+    static void* workerEntry(void* arg);
+    void worker(RuleShard& shard);
+
+    std::vector<RuleShard*> shards_m;
+    std::vector<pthread_t> workers_m;
+    /** Serializes rounds and rebuilds between pth threads */
+    pth_mutex_t roundMutex_m;
+    pth_sem_t wakeUp_m;
+    unsigned long rounds_m;
+
+    pthread_mutex_t mutex_m;
+    pthread_cond_t startCond_m;
+    pthread_cond_t doneCond_m;
+    /** Incremented to start the workers on a new round */
+    unsigned long round_m;
+    int remaining_m;
+    bool stopping_m;
+
+    static Logger& logger_m;
+};
+
+#endif
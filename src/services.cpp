@@ -19,20 +19,29 @@
 
 #include "services.h"
 #include "ioport.h"
+#include "offloadpool.h"
+#include "processmanager.h"
+#include "configcache.h"
 
 Services* Services::instance_m;
 
-Services::Services() : xmlServer_m(0), persistentStorage_m(0)
-{}
+Services::Services() : xmlServer_m(0), binaryServer_m(0), persistentStorage_m(0)
+{
+    ConfigCache::instance()->invalidate(ConfigCache::ServicesSection);
+}
 
 Services::~Services()
 {
     stop();
     if (xmlServer_m)
         delete xmlServer_m;
+    if (binaryServer_m)
+        delete binaryServer_m;
     if (persistentStorage_m)
         delete persistentStorage_m;
     IOPortManager::reset();
+    ProcessManager::reset();
+    OffloadPool::reset();
 }
 
 Services* Services::instance()
@@ -51,8 +60,12 @@ void Services::start()
 void Services::stop()
 {
     infoStream("Services") << "Stopping services" << endlog;
+    if (timerSnapshot_m.isEnabled())
+        timerSnapshot_m.save();
     timers_m.stopManager();
     knxConnection_m.stopConnection();
+    if (persistentStorage_m)
+        persistentStorage_m->flush();
 }
 
 void Services::createDefault()
@@ -64,6 +77,7 @@ void Services::createDefault()
 
 void Services::importXml(ticpp::Element* pConfig)
 {
+    ConfigCache::instance()->invalidate(ConfigCache::ServicesSection);
     ticpp::Element* pSmsGateway = pConfig->FirstChildElement("smsgateway", false);
     if (pSmsGateway)
         smsGateway_m.importXml(pSmsGateway);
@@ -73,10 +87,21 @@ void Services::importXml(ticpp::Element* pConfig)
     ticpp::Element* pXmlServer = pConfig->FirstChildElement("xmlserver", false);
     if (pXmlServer)
     {
+        // The request that changes the config may come from one of the
+        // clients of the current server
         if (xmlServer_m)
-            delete xmlServer_m;
+            xmlServer_m->release();
+        xmlServer_m = 0;
         xmlServer_m = XmlServer::create(pXmlServer);
     }
+    ticpp::Element* pBinaryServer = pConfig->FirstChildElement("binaryserver", false);
+    if (pBinaryServer)
+    {
+        if (binaryServer_m)
+            binaryServer_m->release();
+        binaryServer_m = 0;
+        binaryServer_m = XmlServer::create(pBinaryServer, XmlServer::Binary);
+    }
     ticpp::Element* pKnxConnection = pConfig->FirstChildElement("knxconnection", false);
     if (pKnxConnection)
         knxConnection_m.importXml(pKnxConnection);
@@ -86,6 +111,9 @@ void Services::importXml(ticpp::Element* pConfig)
     ticpp::Element* pLocationInfo = pConfig->FirstChildElement("location", false);
     if (pLocationInfo)
         locationInfo_m.importXml(pLocationInfo);
+    ticpp::Element* pTimerSnapshot = pConfig->FirstChildElement("timer-snapshot", false);
+    if (pTimerSnapshot)
+        timerSnapshot_m.importXml(pTimerSnapshot);
     ticpp::Element* pPersistence = pConfig->FirstChildElement("persistence", false);
     if (pPersistence)
     {
@@ -96,6 +124,9 @@ void Services::importXml(ticpp::Element* pConfig)
     ticpp::Element* pIOPorts = pConfig->FirstChildElement("ioports", false);
     if (pIOPorts)
         IOPortManager::instance()->importXml(pIOPorts);
+    ticpp::Element* pProcesses = pConfig->FirstChildElement("processes", false);
+    if (pProcesses)
+        ProcessManager::instance()->importXml(pProcesses);
 }
 
 void Services::exportXml(ticpp::Element* pConfig)
@@ -114,6 +145,12 @@ void Services::exportXml(ticpp::Element* pConfig)
         xmlServer_m->exportXml(&pXmlServer);
         pConfig->LinkEndChild(&pXmlServer);
     }
+    if (binaryServer_m)
+    {
+        ticpp::Element pBinaryServer("binaryserver");
+        binaryServer_m->exportXml(&pBinaryServer);
+        pConfig->LinkEndChild(&pBinaryServer);
+    }
 
     ticpp::Element pKnxConnection("knxconnection");
     knxConnection_m.exportXml(&pKnxConnection);
@@ -130,6 +167,13 @@ void Services::exportXml(ticpp::Element* pConfig)
         pConfig->LinkEndChild(&pLocationInfo);
     }
 
+    if (timerSnapshot_m.isEnabled())
+    {
+        ticpp::Element pTimerSnapshot("timer-snapshot");
+        timerSnapshot_m.exportXml(&pTimerSnapshot);
+        pConfig->LinkEndChild(&pTimerSnapshot);
+    }
+
     if (persistentStorage_m)
     {
         ticpp::Element pPersistence("persistence");
@@ -140,4 +184,11 @@ void Services::exportXml(ticpp::Element* pConfig)
     ticpp::Element pIOPorts("ioports");
     IOPortManager::instance()->exportXml(&pIOPorts);
     pConfig->LinkEndChild(&pIOPorts);
+
+    if (ProcessManager::instance()->getMaxRunning() != ProcessManager::DefaultMaxRunning)
+    {
+        ticpp::Element pProcesses("processes");
+        ProcessManager::instance()->exportXml(&pProcesses);
+        pConfig->LinkEndChild(&pProcesses);
+    }
 }
@@ -24,6 +24,7 @@
 #include <string>
 #include "ticpp.h"
 #include "timermanager.h"
+#include "timersnapshot.h"
 #include "xmlserver.h"
 #include "smsgateway.h"
 #include "emailgateway.h"
@@ -52,6 +53,7 @@ public:
     SmsGateway* getSmsGateway() { return &smsGateway_m; };
     EmailGateway* getEmailGateway() { return &emailGateway_m; };
     TimerManager* getTimerManager() { return &timers_m; };
+    TimerSnapshot* getTimerSnapshot() { return &timerSnapshot_m; };
     ExceptionDays* getExceptionDays() { return &exceptionDays_m; };
     PersistentStorage* getPersistentStorage() { return persistentStorage_m; };
     LocationInfo* getLocationInfo() { return &locationInfo_m; };
@@ -66,8 +68,10 @@ private:
     static Services* instance_m;
 
     XmlServer *xmlServer_m;
+    XmlServer *binaryServer_m;
     PersistentStorage *persistentStorage_m;
     TimerManager timers_m;
+    TimerSnapshot timerSnapshot_m;
     SmsGateway smsGateway_m;
     EmailGateway emailGateway_m;
     KnxConnection knxConnection_m;
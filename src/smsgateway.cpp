@@ -18,6 +18,7 @@
 */
 
 #include "smsgateway.h"
+#include "offloadpool.h"
 #include <iostream>
 #ifdef HAVE_LIBCURL
 #include <curl/curl.h>
@@ -90,20 +91,45 @@ void SmsGateway::exportXml(ticpp::Element* pConfig)
 	}
 }
 
-void SmsGateway::sendSmsThroughREST(const std::string &baseUrl, const std::map<std::string, std::string> &parameters)
-{
 #ifdef HAVE_LIBCURL
+namespace
+{
+    // HTTP request run by the offload pool, curl_easy_perform blocks until
+    // the gateway has answered. The outcome is logged back in finish().
+    class RestRequest : public OffloadTask
+    {
+    public:
+        RestRequest(const std::string &baseUrl, const std::map<std::string, std::string> &parameters)
+            : baseUrl_m(baseUrl), parameters_m(parameters), available_m(false), res_m(CURLE_OK) {};
+
+        virtual void run();
+        virtual void finish();
+
+    private:
+        std::string baseUrl_m;
+        std::map<std::string, std::string> parameters_m;
+        bool available_m;
+        CURLcode res_m;
+
+        static Logger& logger_m;
+    };
+}
+
+Logger& RestRequest::logger_m(Logger::getInstance("SmsGateway"));
+
+void RestRequest::run()
+{
 	CURL *curl;
-	CURLcode res;
 
 	curl = curl_easy_init();
 	if(curl)
 	{
+		available_m = true;
 		std::stringstream msg;
-		msg << baseUrl;
-		for(std::map<std::string, std::string>::const_iterator itParam = parameters.begin(); itParam != parameters.end(); ++itParam)
+		msg << baseUrl_m;
+		for(std::map<std::string, std::string>::const_iterator itParam = parameters_m.begin(); itParam != parameters_m.end(); ++itParam)
 		{
-			if(itParam == parameters.begin())
+			if(itParam == parameters_m.begin())
 			{
 				msg << "?";
 			}
@@ -118,21 +144,37 @@ void SmsGateway::sendSmsThroughREST(const std::string &baseUrl, const std::map<s
 		}
 
 		std::string url = msg.str();
-		//logger_m.errorStream() << "curl's url is " << url << endlog;
 
 		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
-		res = curl_easy_perform(curl);
-
-		logger_m.infoStream() << "curl_easy_perform returned: " << res << endlog;
-		if (res != 0)
-			logger_m.infoStream() << "msg=" << curl_easy_strerror(res) << endlog;
+		// No SIGALRM based timeouts from a worker thread
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+		res_m = curl_easy_perform(curl);
 
 		curl_easy_cleanup(curl);
 	}
+}
+
+void RestRequest::finish()
+{
+	if (available_m)
+	{
+		logger_m.infoStream() << "curl_easy_perform returned: " << res_m << endlog;
+		if (res_m != 0)
+			logger_m.infoStream() << "msg=" << curl_easy_strerror(res_m) << endlog;
+	}
 	else
 		logger_m.errorStream() << "Unable to execute SendSmsAction. Curl not available" << endlog;
+}
+#endif
+
+void SmsGateway::sendSmsThroughREST(const std::string &baseUrl, const std::map<std::string, std::string> &parameters)
+{
+#ifdef HAVE_LIBCURL
+	// Requests are serialized, the first curl_easy_init isn't thread-safe
+	RestRequest request(baseUrl, parameters);
+	OffloadPool::instance()->execute(&request, this);
 #endif
 }
 
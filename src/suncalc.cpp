@@ -24,8 +24,10 @@
 
 #include "suncalc.h"
 #include "services.h"
+#include "clock.h"
 #include <stdio.h>
 #include <cmath>
+#include <algorithm>
 #include <time.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -471,37 +473,35 @@ void SolarNoonTimeSpec::exportXml(ticpp::Element* pConfig)
     SolarTimeSpec::exportXml(pConfig);
 }
 
-double SunriseTimeSpec::computeTime(double rise, double set)
+double SunriseTimeSpec::computeTime(double rise, double set, double noon)
 {
     return rise;
 }
 
-double SunsetTimeSpec::computeTime(double rise, double set)
+double SunsetTimeSpec::computeTime(double rise, double set, double noon)
 {
     return set;
 }
 
-double SolarNoonTimeSpec::computeTime(double rise, double set)
+double SolarNoonTimeSpec::computeTime(double rise, double set, double noon)
 {
-    return (rise+set)/2.0;
+    return noon;
 }
 
 void SolarTimeSpec::getData(int *min, int *hour, int *mday, int *mon, int *year, int *wdays, ExceptionDays *exception, const struct tm * timeinfo)
 {
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
     long tzOffset = params->getGmtOffset(timeinfo);
     
-    double rise, set;
+    double rise, set, noon;
     
     int    rs;
     logger_m.infoStream() << "sun_rise_set date " << timeinfo->tm_year+1900<< "-" << timeinfo->tm_mon+1 << "-" << timeinfo->tm_mday << endlog;
-    rs   = suncalc::sun_rise_set( timeinfo->tm_year+1900, timeinfo->tm_mon+1, timeinfo->tm_mday, lon, lat, &rise, &set );
+    rs   = params->getSunRiseSet( timeinfo->tm_year, timeinfo->tm_mon, timeinfo->tm_mday, &rise, &set, &noon );
 
     if (rs == 0)
     {
-        double res = computeTime(rise, set);
+        double res = computeTime(rise, set, noon);
         res += (((double)offset_m)/3600);
         *min = minutes(res + minutes((double)tzOffset/3600));
         *hour = hours(res + (double)tzOffset/3600);
@@ -528,19 +528,17 @@ void SolarTimeSpec::getData(int *min, int *hour, int *mday, int *mon, int *year,
 bool SolarTimeSpec::adjustTime(struct tm * timeinfo)
 {
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
     long tz_offset = params->getGmtOffset(timeinfo);
     
-    double rise, set;
+    double rise, set, noon;
     
     int    rs;
     logger_m.infoStream() << "adjustTime date " << timeinfo->tm_year+1900<< "-" <<timeinfo->tm_mon+1 << "-" << timeinfo->tm_mday << endlog;
-    rs   = suncalc::sun_rise_set( timeinfo->tm_year+1900, timeinfo->tm_mon+1, timeinfo->tm_mday, lon, lat, &rise, &set );
+    rs   = params->getSunRiseSet( timeinfo->tm_year, timeinfo->tm_mon, timeinfo->tm_mday, &rise, &set, &noon );
 
     if (rs == 0)
     {
-        double res = computeTime(rise, set);
+        double res = computeTime(rise, set, noon);
         res += (((double)offset_m)/3600);
         timeinfo->tm_min = minutes(res + minutes((double)tz_offset/3600));
         timeinfo->tm_hour = hours(res + (double)tz_offset/3600);
@@ -564,12 +562,10 @@ Logger& SolarInfo::logger_m(Logger::getInstance("SolarInfo"));
 SolarInfo::SolarInfo(struct tm * timeinfo) : rs_m(0)
 {
     LocationInfo* params = Services::instance()->getLocationInfo();
-    double lon, lat;
-    params->getCoord(&lon, &lat);
     tz_offset_m = params->getGmtOffset(timeinfo);
 
     logger_m.infoStream() << "SolarInfo date " << timeinfo->tm_year+1900<< "-" <<timeinfo->tm_mon+1 << "-" << timeinfo->tm_mday << endlog;
-    rs_m  = suncalc::sun_rise_set( timeinfo->tm_year+1900, timeinfo->tm_mon+1, timeinfo->tm_mday, lon, lat, &rise_m, &set_m );
+    rs_m  = params->getSunRiseSet( timeinfo->tm_year, timeinfo->tm_mon, timeinfo->tm_mday, &rise_m, &set_m, &noon_m );
 }
 
 SolarInfo::~SolarInfo() {};
@@ -586,7 +582,7 @@ bool SolarInfo::getSunset(int *min, int *hour)
 
 bool SolarInfo::getNoon(int *min, int *hour)
 {
-    return get((rise_m+set_m)/2.0, min, hour);
+    return get(noon_m, min, hour);
 }
 
 bool SolarInfo::get(double res, int *min, int *hour)
@@ -610,10 +606,20 @@ bool SolarInfo::get(double res, int *min, int *hour)
     return true;
 }
 
+Logger& LocationInfo::logger_m(Logger::getInstance("LocationInfo"));
+
 void LocationInfo::importXml(ticpp::Element* pConfig)
 {
     pConfig->GetAttributeOrDefault("lon", &lon_m, 0);
     pConfig->GetAttributeOrDefault("lat", &lat_m, 0);
+
+    // The table depends on the location, start again with the current year
+    ephemeris_m.clear();
+    ephemerisYears_m.clear();
+    time_t now = Clock::now();
+    struct tm timeinfo;
+    localtime_r(&now, &timeinfo);
+    getYearEphemeris(timeinfo.tm_year);
 }
 
 void LocationInfo::exportXml(ticpp::Element* pConfig)
@@ -622,6 +628,69 @@ void LocationInfo::exportXml(ticpp::Element* pConfig)
     pConfig->SetAttribute("lat", lat_m);
 }
 
+int LocationInfo::computeSunRiseSet(int year, int mon, int mday, double lon, double lat, double *rise, double *set)
+{
+    return suncalc::sun_rise_set( year+1900, mon+1, mday, lon, lat, rise, set );
+}
+
+int LocationInfo::getSunRiseSet(int year, int mon, int mday, double *rise, double *set, double *noon)
+{
+    int rs;
+    YearEphemeris_t* days = 0;
+    unsigned int yday = 0;
+    if (mon >= 0 && mon <= 11 && mday >= 1 && mday <= 31)
+    {
+        days = &getYearEphemeris(year);
+        yday = days_since_2000_Jan_0(year+1900, mon+1, mday) - days_since_2000_Jan_0(year+1900, 1, 1);
+    }
+    if (days && yday < days->size())
+    {
+        *rise = (*days)[yday].rise;
+        *set = (*days)[yday].set;
+        if (noon)
+            *noon = (*days)[yday].noon;
+        return (*days)[yday].rs;
+    }
+    rs = computeSunRiseSet(year, mon, mday, lon_m, lat_m, rise, set);
+    // The sun is at south halfway, also when it doesn't rise or set
+    if (noon)
+        *noon = (*rise + *set) / 2.0;
+    return rs;
+}
+
+LocationInfo::YearEphemeris_t& LocationInfo::getYearEphemeris(int year)
+{
+    EphemerisMap_t::iterator it = ephemeris_m.find(year);
+    if (it != ephemeris_m.end())
+    {
+        if (ephemerisYears_m.back() != year)
+        {
+            ephemerisYears_m.erase(std::find(ephemerisYears_m.begin(), ephemerisYears_m.end(), year));
+            ephemerisYears_m.push_back(year);
+        }
+        return it->second;
+    }
+
+    if (ephemerisYears_m.size() >= MaxCachedYears)
+    {
+        ephemeris_m.erase(ephemerisYears_m.front());
+        ephemerisYears_m.erase(ephemerisYears_m.begin());
+    }
+    logger_m.debugStream() << "Computing ephemeris for year " << year+1900 << endlog;
+    YearEphemeris_t& days = ephemeris_m[year];
+    int count = days_since_2000_Jan_0(year+1901, 1, 1) - days_since_2000_Jan_0(year+1900, 1, 1);
+    days.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        // mday past the end of January is handled by __sunriset__ as the
+        // following days of the year
+        days[i].rs = computeSunRiseSet(year, 0, i+1, lon_m, lat_m, &days[i].rise, &days[i].set);
+        days[i].noon = (days[i].rise + days[i].set) / 2.0;
+    }
+    ephemerisYears_m.push_back(year);
+    return days;
+}
+
 /* The GMT offset calculation code below has been borrowed from the APR library
  * Licensed to the Apache Software Foundation (ASF) under one or more
  * contributor license agreements.  See the NOTICE file distributed with
@@ -27,6 +27,8 @@
 #include "objectcontroller.h"
 #include "ruleserver.h"
 #include "ticpp.h"
+#include "collections.h"
+#include <vector>
 
 class SolarTimeSpec : public TimeSpec
 {
@@ -40,7 +42,7 @@ public:
     virtual void getData(int *min, int *hour, int *mday, int *mon, int *year, int *wdays, ExceptionDays *exception, const struct tm * timeinfo);
     virtual bool adjustTime(struct tm * timeinfo);
 protected:
-    virtual double computeTime(double rise, double set) = 0;
+    virtual double computeTime(double rise, double set, double noon) = 0;
 private:
     int offset_m;
     static Logger& logger_m;
@@ -52,7 +54,7 @@ public:
     virtual ~SunriseTimeSpec();
     virtual void exportXml(ticpp::Element* pConfig);
 protected:
-    virtual double computeTime(double rise, double set);
+    virtual double computeTime(double rise, double set, double noon);
 
 };
 
@@ -62,7 +64,7 @@ public:
     virtual ~SunsetTimeSpec();
     virtual void exportXml(ticpp::Element* pConfig);
 protected:
-    virtual double computeTime(double rise, double set);
+    virtual double computeTime(double rise, double set, double noon);
 
 };
 
@@ -72,7 +74,7 @@ public:
     virtual ~SolarNoonTimeSpec();
     virtual void exportXml(ticpp::Element* pConfig);
 protected:
-    virtual double computeTime(double rise, double set);
+    virtual double computeTime(double rise, double set, double noon);
 
 };
 
@@ -87,7 +89,7 @@ public:
     virtual bool getNoon(int *min, int *hour);
 private:
     bool get(double res, int *min, int *hour);
-    double rise_m, set_m;
+    double rise_m, set_m, noon_m;
     int    rs_m;
     long tz_offset_m;
     static Logger& logger_m;
@@ -102,9 +104,35 @@ public:
     void getCoord(double *lon, double *lat) { *lon = lon_m; *lat = lat_m; };
     long getGmtOffset(const struct tm* timeinfo);
     bool isEmpty() { return lon_m==0 && lat_m==0; };
+
+    /** Sunrise, sunset and, if noon is not null, solar noon of the day
+     * (tm_year/tm_mon/tm_mday based) in UT hours. The values are taken from
+     * a table holding a whole year for the current location, computed on
+     * first use of that year. Returns 0 on success, or the __sunriset__
+     * code if the sun stays above (+1) or below (-1) the horizon all day. */
+    int getSunRiseSet(int year, int mon, int mday, double *rise, double *set, double *noon = 0);
+    static int computeSunRiseSet(int year, int mon, int mday, double lon, double lat, double *rise, double *set);
+
+    /** Years kept in the ephemeris table, the least recently used ones
+     * are dropped */
+    static const unsigned int MaxCachedYears = 4;
 protected:
+    struct DayEphemeris
+    {
+        double rise, set, noon;
+        int rs;
+    };
+    typedef std::vector<DayEphemeris> YearEphemeris_t;
+    typedef HashMap<int, YearEphemeris_t> EphemerisMap_t;
+
+    YearEphemeris_t& getYearEphemeris(int year);
+
     double lon_m, lat_m;
     long gmtOffset_m;
+    EphemerisMap_t ephemeris_m;
+    /** Years of the table, most recently used last */
+    std::vector<int> ephemerisYears_m;
+    static Logger& logger_m;
 };
 
 #endif
@@ -26,6 +26,9 @@ Thread::ThreadWrapper (void *arg)
     t->Run (&t->should_stop);
     if (!t->joinable)
         t->tid = 0;
+    // Does not yield, so t is still valid below
+    if (t->finished)
+        pth_sem_inc (t->finished, FALSE);
     if (t->autodel)
         delete t;
     pth_exit (0);
@@ -41,6 +44,7 @@ Thread::Thread (int Priority, Runable * o, THREADENTRY t)
     pth_sem_init (&should_stop);
     prio = Priority;
     tid = 0;
+    finished = 0;
 }
 
 Thread::~Thread ()
@@ -116,3 +120,7 @@ bool Thread::isFinished ()
     return (state == PTH_STATE_DEAD);
 }
 
+void Thread::setFinishedSem (pth_sem_t * sem)
+{
+    finished = sem;
+}
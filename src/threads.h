@@ -54,6 +54,8 @@ class Thread
     pth_sem_t should_stop;
     /** priority */
     int prio;
+    /** Semaphore incremented when Run returns, can be null. */
+    pth_sem_t *finished;
 
 protected:
     /** main function of the thread
@@ -79,6 +81,9 @@ public:
     bool isRunning ();
     /** is thread processing finished */
     bool isFinished();
+    /** increments sem each time the job returns, instead of polling
+     * isFinished. Pass null to stop. */
+    void setFinishedSem (pth_sem_t * sem);
 };
 
 
@@ -23,91 +23,166 @@
 #include <iostream>
 #include <ctime>
 #include <iomanip>
+#include <algorithm>
+#include "clock.h"
 
 Logger& TimerManager::logger_m(Logger::getInstance("TimerManager"));
 
-TimerManager::TimerManager()
-{}
+TimerManager::TimerManager() : seq_m(0), currentSeq_m(0), currentRemoved_m(false)
+{
+    pth_sem_init(&wakeUp_m);
+}
 
 TimerManager::~TimerManager()
 {
     StopDelete ();
+    for (Heap_t::iterator it = heap_m.begin(); it != heap_m.end(); it++)
+        it->task->timerIndex_m = -1;
+}
+
+int64_t TimerManager::nowMs()
+{
+    return Clock::nowMs();
 }
 
-TimerManager::TimerCheck TimerManager::checkTaskList(time_t now)
+TimerManager::TimerCheck TimerManager::checkTaskListMs(int64_t now)
 {
-    if (taskList_m.empty())
+    if (heap_m.empty())
         return Long;
 
-    TimerTask* first = taskList_m.front();
-    time_t nextExec = first->getExecTime();
-    if (nextExec > now)
+    Entry first = heap_m.front();
+    if (first.execTime > now)
         return Short;
-    
-    if (nextExec > now-60)
+
+    currentSeq_m = first.seq;
+    currentRemoved_m = false;
+    if (first.execTime > now - 60000)
     {
-        logger_m.infoStream() << "TimerTask execution. " << nextExec << endlog;
-        first->onTimer(now);
+        logger_m.infoStream() << "TimerTask execution. " << first.execTime / 1000 << endlog;
+        first.task->onTimer(now / 1000);
     }
     else
-        logger_m.warnStream() << "TimerTask skipped due to clock skew or heavy load. " << nextExec << endlog;
-    
-    if (first == taskList_m.front())
+        logger_m.warnStream() << "TimerTask skipped due to clock skew or heavy load. " << first.execTime / 1000 << endlog;
+
+    if (!currentRemoved_m)
     {
-        // If the taskList was modified, do not remove the first item
-        // because it's not the one we just called onTimer for.
-        taskList_m.pop_front();
-        first->reschedule(now);
+        // onTimer did not remove or reschedule the task itself
+        removeAt(first.task->timerIndex_m);
+        first.task->reschedule(now / 1000);
     }
+    currentSeq_m = 0;
     return Immediate;
 }
 
 void TimerManager::Run (pth_sem_t * stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t wakeUp = pth_event (PTH_EVENT_SEM, &wakeUp_m);
+    pth_event_concat (stop, wakeUp, NULL);
     logger_m.debugStream() << "Starting TimerManager loop." << endlog;
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
     while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
     {
-        TimerCheck interval = checkTaskList(time(0));
-        if (interval == Immediate)
-            tv.tv_sec = 0;
-        else if (interval == Short)
-            tv.tv_sec = 1;
-        else
-            tv.tv_sec = 10;
-        pth_select_ev(0,0,0,0,&tv,stop);
+        pth_sem_set_value(&wakeUp_m, 0);
+        int64_t now = nowMs();
+        TimerCheck interval = checkTaskListMs(now);
+        int64_t wait = 0;
+        if (interval == Short)
+            wait = std::min(getNextExecTimeMs() - now, (int64_t)MaxSleepMs);
+        else if (interval == Long)
+            wait = MaxSleepMs;
+        Clock::sleep(wait, stop);
     }
     logger_m.debugStream() << "Out of TimerManager loop." << endlog;
+    pth_event_isolate (wakeUp);
+    pth_event_free (wakeUp, PTH_FREE_THIS);
     pth_event_free (stop, PTH_FREE_THIS);
 }
 
-void TimerManager::addTask(TimerTask* task)
+void TimerManager::place(int i, const Entry& entry)
+{
+    heap_m[i] = entry;
+    entry.task->timerIndex_m = i;
+}
+
+void TimerManager::siftUp(int i)
 {
-    TaskList_t::iterator it;
-    time_t execTime = task->getExecTime();
-    for (it = taskList_m.begin(); it != taskList_m.end(); it++)
+    Entry entry = heap_m[i];
+    while (i > 0)
     {
-        if (execTime < (*it)->getExecTime())
+        int parent = (i - 1) / 2;
+        if (!before(entry, heap_m[parent]))
             break;
+        place(i, heap_m[parent]);
+        i = parent;
     }
-    taskList_m.insert(it, task);
+    place(i, entry);
+}
+
+void TimerManager::siftDown(int i)
+{
+    Entry entry = heap_m[i];
+    int size = heap_m.size();
+    while (true)
+    {
+        int child = 2 * i + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && before(heap_m[child + 1], heap_m[child]))
+            child++;
+        if (!before(heap_m[child], entry))
+            break;
+        place(i, heap_m[child]);
+        i = child;
+    }
+    place(i, entry);
+}
+
+void TimerManager::removeAt(int i)
+{
+    TimerTask* task = heap_m[i].task;
+    if (heap_m[i].seq == currentSeq_m)
+        currentRemoved_m = true;
+    Entry last = heap_m.back();
+    heap_m.pop_back();
+    if (i < (int)heap_m.size())
+    {
+        place(i, last);
+        siftUp(i);
+        siftDown(last.task->timerIndex_m);
+    }
+    task->timerIndex_m = -1;
+}
+
+void TimerManager::addTask(TimerTask* task)
+{
+    removeTask(task);
+    Entry entry;
+    entry.execTime = task->getExecTimeMs();
+    entry.seq = ++seq_m;
+    entry.task = task;
+    heap_m.push_back(entry);
+    siftUp(heap_m.size() - 1);
+    if (task->timerIndex_m == 0)
+        pth_sem_inc(&wakeUp_m, FALSE);
 }
 
 void TimerManager::removeTask(TimerTask* task)
 {
-    taskList_m.remove(task);
+    int i = task->timerIndex_m;
+    // The task may be scheduled in another manager
+    if (i >= 0 && i < (int)heap_m.size() && heap_m[i].task == task)
+        removeAt(i);
 }
 
 void TimerManager::statusXml(ticpp::Element* pStatus)
 {
-    TaskList_t::iterator it;
-    for (it = taskList_m.begin(); it != taskList_m.end(); it++)
+    Heap_t sorted(heap_m);
+    std::sort(sorted.begin(), sorted.end(), &TimerManager::before);
+    Heap_t::iterator it;
+    for (it = sorted.begin(); it != sorted.end(); it++)
     {
         ticpp::Element pElem("task");
-        (*it)->statusXml(&pElem);
+        it->task->statusXml(&pElem);
         pStatus->LinkEndChild(&pElem);
     }
 }
@@ -321,6 +396,14 @@ void VariableTimeSpec::exportXml(ticpp::Element* pConfig)
         pConfig->SetAttribute("offset", RuleServer::formatDuration(offset_m));
 }
 
+void VariableTimeSpec::getObjects(std::list<Object*>& objects)
+{
+    if (time_m)
+        objects.push_back(time_m);
+    if (date_m)
+        objects.push_back(date_m);
+}
+
 void VariableTimeSpec::getData(int *min, int *hour, int *mday, int *mon, int *year, int *wdays, ExceptionDays *exception, const struct tm * timeinfo)
 {
     *min = min_m;
@@ -366,6 +449,209 @@ void VariableTimeSpec::getData(int *min, int *hour, int *mday, int *mon, int *ye
         *min += off_min % 60;
 }
 
+namespace
+{
+    inline int lowestBit(uint64_t mask)
+    {
+        return __builtin_ctzll(mask);
+    }
+
+    bool isLeapYear(int year)
+    {
+        year += 1900;
+        return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    }
+
+    int daysInMonth(int year, int mon)
+    {
+        static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        return (mon == 1 && isLeapYear(year)) ? 29 : days[mon];
+    }
+
+    // Day of week of the first day of the month, 0 for Sunday
+    int firstWeekDay(int year, int mon)
+    {
+        static const int offsets[] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+        int y = year + 1900;
+        if (mon < 2)
+            y--;
+        return (y + y/4 - y/100 + y/400 + offsets[mon] + 1) % 7;
+    }
+}
+
+CalendarSchedule::CalendarSchedule()
+    : minutes_m(0), hours_m(0), mdays_m(0), months_m(0), wdays_m(0), year_m(-1), exception_m(TimeSpec::DontCare)
+{}
+
+bool CalendarSchedule::compile(int min, int hour, int mday, int mon, int year, int wdays, TimeSpec::ExceptionDays exception)
+{
+    if (min < -1 || min > 59 || hour < -1 || hour > 23 || mday < -1 || mday == 0 || mday > 31 ||
+            mon < -1 || mon > 11 || year < -1 || wdays < 0 || wdays > 0x7f)
+        return false;
+
+    minutes_m = (min == -1) ? ((uint64_t)1 << 60) - 1 : (uint64_t)1 << min;
+    hours_m = (hour == -1) ? ((uint32_t)1 << 24) - 1 : (uint32_t)1 << hour;
+    // As before, a weekday selection overrides the date fields
+    if (wdays != TimeSpec::All)
+    {
+        mdays_m = 0xfffffffe;
+        months_m = 0xfff;
+        year_m = -1;
+        wdays_m = wdays;
+    }
+    else
+    {
+        mdays_m = (mday == -1) ? 0xfffffffe : (uint32_t)1 << mday;
+        months_m = (mon == -1) ? 0xfff : 1 << mon;
+        year_m = year;
+        wdays_m = 0x7f;
+    }
+    exception_m = exception;
+    return true;
+}
+
+uint32_t CalendarSchedule::getDays(int year, int mon, ExceptionDays* exceptionDays)
+{
+    uint32_t days = mdays_m & (((uint32_t)2 << daysInMonth(year, mon)) - 2);
+    if (wdays_m != 0x7f)
+    {
+        // Bit k of pattern is set if day k+1 of the month has a selected
+        // weekday, then the pattern repeats every week
+        int first = firstWeekDay(year, mon);
+        uint64_t pattern = 0;
+        for (int k = 0; k < 7; k++)
+        {
+            if (wdays_m & (1 << ((first + k + 6) % 7)))
+                pattern |= 1 << k;
+        }
+        pattern |= pattern << 7;
+        pattern |= pattern << 14;
+        pattern |= pattern << 28;
+        days &= (uint32_t)(pattern << 1);
+    }
+    if (exception_m != TimeSpec::DontCare && exceptionDays)
+    {
+        uint32_t exceptions = exceptionDays->getMonthMask(year, mon);
+        days &= (exception_m == TimeSpec::Yes) ? exceptions : ~exceptions;
+    }
+    return days;
+}
+
+// First selected minute of the day at or after minute from, -1 if none
+int CalendarSchedule::findMinute(int from)
+{
+    int hour = from / 60;
+    if (hour > 23)
+        return -1;
+    if (hours_m & ((uint32_t)1 << hour))
+    {
+        uint64_t minutes = minutes_m & ~(((uint64_t)1 << (from % 60)) - 1);
+        if (minutes)
+            return hour * 60 + lowestBit(minutes);
+    }
+    uint32_t hours = hours_m & ~(((uint32_t)2 << hour) - 1);
+    if (!hours)
+        return -1;
+    return lowestBit(hours) * 60 + lowestBit(minutes_m);
+}
+
+time_t CalendarSchedule::toTime(int year, int mon, int mday, int minute, time_t start)
+{
+    // Try both DST states, a local time is valid in the state mktime keeps
+    time_t candidates[2];
+    int valid = 0;
+    for (int dst = 1; dst >= 0; dst--)
+    {
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_year = year;
+        timeinfo.tm_mon = mon;
+        timeinfo.tm_mday = mday;
+        timeinfo.tm_hour = minute / 60;
+        timeinfo.tm_min = minute % 60;
+        timeinfo.tm_isdst = dst;
+        time_t t = mktime(&timeinfo);
+        if (t != -1 && timeinfo.tm_isdst == dst && timeinfo.tm_mday == mday &&
+                timeinfo.tm_hour == minute / 60 && timeinfo.tm_min == minute % 60)
+            candidates[valid++] = t;
+    }
+    if (valid == 0)
+    {
+        // Inside the hour skipped when DST starts, use the end of the gap
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_year = year;
+        timeinfo.tm_mon = mon;
+        timeinfo.tm_mday = mday;
+        timeinfo.tm_hour = minute / 60 + 1;
+        timeinfo.tm_isdst = -1;
+        return mktime(&timeinfo);
+    }
+    if (valid == 2 && candidates[0] > candidates[1])
+        std::swap(candidates[0], candidates[1]);
+    if (valid == 2 && candidates[0] <= start)
+        return candidates[1];
+    return candidates[0];
+}
+
+time_t CalendarSchedule::findNext(time_t start, ExceptionDays* exceptionDays)
+{
+    struct tm timeinfo;
+    memcpy(&timeinfo, localtime(&start), sizeof(struct tm));
+    int startYear = timeinfo.tm_year, startMon = timeinfo.tm_mon, startDay = timeinfo.tm_mday;
+    int startMinute = timeinfo.tm_hour * 60 + timeinfo.tm_min + 1;
+
+    int year = startYear;
+    int mon = startMon;
+    if (year_m != -1)
+    {
+        if (year_m < year)
+            return 0;
+        if (year_m > year)
+        {
+            year = year_m;
+            mon = 0;
+        }
+    }
+    int lastYear = (year_m != -1) ? year_m : startYear + MaxYears;
+    while (year <= lastYear)
+    {
+        uint16_t months = months_m & ~((1 << mon) - 1);
+        if (!months)
+        {
+            year++;
+            mon = 0;
+            continue;
+        }
+        mon = lowestBit(months);
+
+        uint32_t days = getDays(year, mon, exceptionDays);
+        bool startMonth = (year == startYear && mon == startMon);
+        if (startMonth)
+            days &= ~(((uint32_t)1 << startDay) - 1);
+        while (days)
+        {
+            int mday = lowestBit(days);
+            int minute = (startMonth && mday == startDay) ? startMinute : 0;
+            while ((minute = findMinute(minute)) != -1)
+            {
+                time_t t = toTime(year, mon, mday, minute, start);
+                if (t > start)
+                    return t;
+                minute++;
+            }
+            days &= days - 1;
+        }
+        mon++;
+        if (mon > 11)
+        {
+            year++;
+            mon = 0;
+        }
+    }
+    return 0;
+}
+
 Logger& PeriodicTask::logger_m(Logger::getInstance("PeriodicTask"));
 
 PeriodicTask::PeriodicTask(ChangeListener* cl)
@@ -375,6 +661,7 @@ PeriodicTask::PeriodicTask(ChangeListener* cl)
 PeriodicTask::~PeriodicTask()
 {
     Services::instance()->getTimerManager()->removeTask(this);
+    Services::instance()->getTimerSnapshot()->removeTimer(this);
     if (at_m)
         delete at_m;
     if (until_m)
@@ -403,7 +690,7 @@ void PeriodicTask::onChange(Object* object)
 void PeriodicTask::reschedule(time_t now)
 {
     if (now == 0)
-        now = time(0);
+        now = Clock::now();
     if (nextExecTime_m == 0 && during_m != 0)
     {
         // first schedule. check if value must be on or off (except if timer is instantaneous)
@@ -471,6 +758,24 @@ void PeriodicTask::reschedule(time_t now)
 
 }
 
+void PeriodicTask::saveState(TimerState* state)
+{
+    state->execTime = nextExecTime_m;
+    state->value = value_m;
+}
+
+bool PeriodicTask::restoreState(const TimerState& state)
+{
+    // A deadline missed while stopped needs the first schedule logic
+    if (state.execTime <= Clock::now())
+        return false;
+    value_m = state.value;
+    nextExecTime_m = state.execTime;
+    logger_m.infoStream() << "Restored schedule at " << nextExecTime_m << " (value=" << value_m << ")" << endlog;
+    Services::instance()->getTimerManager()->addTask(this);
+    return true;
+}
+
 time_t PeriodicTask::mktimeNoDst(struct tm * timeinfo)
 {
     time_t ret;
@@ -520,7 +825,28 @@ time_t PeriodicTask::findNext(time_t start, TimeSpec* next)
     int min, hour, mday, mon, year, wdays;
     TimeSpec::ExceptionDays exception;
     next->getData(&min, &hour, &mday, &mon, &year, &wdays, &exception, timeinfo);
-    
+
+    CalendarSchedule schedule;
+    if (!schedule.compile(min, hour, mday, mon, year, wdays, exception))
+        return findNextByFields(start, next, timeinfo, min, hour, mday, mon, year, wdays, exception);
+
+    time_t nextExecTime = schedule.findNext(start, Services::instance()->getExceptionDays());
+    if (nextExecTime == 0)
+    {
+        logger_m.infoStream() << "No more schedule available" << endlog;
+        return 0;
+    }
+    memcpy(timeinfo, localtime(&nextExecTime), sizeof(struct tm));
+    // now that we selected a day, make time adjustments for that day if needed (e.g. for sunrise or sunset)
+    if (next->adjustTime(timeinfo))
+        nextExecTime = mktime(timeinfo);
+    return nextExecTime;
+}
+
+// Former search, adjusting the struct tm fields one after the other. Only
+// used for the specs CalendarSchedule does not compile.
+time_t PeriodicTask::findNextByFields(time_t start, TimeSpec* next, struct tm * timeinfo, int min, int hour, int mday, int mon, int year, int wdays, TimeSpec::ExceptionDays exception)
+{
     if (min != -1)
     {
         if  (timeinfo->tm_min > min)
@@ -664,12 +990,13 @@ FixedTimeTask::FixedTimeTask() : execTime_m(0)
 FixedTimeTask::~FixedTimeTask()
 {
     Services::instance()->getTimerManager()->removeTask(this);
+    Services::instance()->getTimerSnapshot()->removeTimer(this);
 }
 
 void FixedTimeTask::reschedule(time_t now)
 {
     if (now == 0)
-        now = time(0);
+        now = Clock::now();
     if (execTime_m > now)
     {
         struct tm timeinfo;
@@ -736,7 +1063,9 @@ void DaySpec::exportXml(ticpp::Element* pConfig)
 
 
 ExceptionDays::ExceptionDays()
-{}
+{
+    memset(recurring_m, 0, sizeof(recurring_m));
+}
 
 ExceptionDays::~ExceptionDays()
 {
@@ -749,6 +1078,8 @@ void ExceptionDays::clear()
     for (it = daysList_m.begin(); it != daysList_m.end(); it++)
         delete (*it);
     daysList_m.clear();
+    years_m.clear();
+    memset(recurring_m, 0, sizeof(recurring_m));
 }
 
 void ExceptionDays::importXml(ticpp::Element* pConfig)
@@ -762,7 +1093,7 @@ void ExceptionDays::importXml(ticpp::Element* pConfig)
         {
             DaySpec* day = new DaySpec();
             day->importXml(&(*child));
-            daysList_m.push_back(day);
+            addDay(day);
         }
         else
         {
@@ -785,34 +1116,56 @@ void ExceptionDays::exportXml(ticpp::Element* pConfig)
 bool ExceptionDays::isException(time_t time)
 {
     struct tm timeinfo;
-    memcpy(&timeinfo, localtime(&time), sizeof(struct tm));
+    localtime_r(&time, &timeinfo);
 
-    DaysList_t::iterator it;
-    for (it = daysList_m.begin(); it != daysList_m.end(); it++)
+    if (isException(timeinfo.tm_year, timeinfo.tm_mon, timeinfo.tm_mday))
     {
-        if (((*it)->year_m == -1 || (*it)->year_m == timeinfo.tm_year) &&
-                ((*it)->mon_m == -1 || (*it)->mon_m == timeinfo.tm_mon) &&
-                ((*it)->mday_m == -1 || (*it)->mday_m == timeinfo.tm_mday))
-        {
-            infoStream("ExceptionDays")
-            << timeinfo.tm_year+1900 << "-"
-            << timeinfo.tm_mon+1 << "-"
-            << timeinfo.tm_mday << " is an exception day!" << endlog;
-            return true;
-        }
+        debugStream("ExceptionDays")
+        << timeinfo.tm_year+1900 << "-"
+        << timeinfo.tm_mon+1 << "-"
+        << timeinfo.tm_mday << " is an exception day!" << endlog;
+        return true;
     }
     return false;
 }
 
 void ExceptionDays::addDay(DaySpec* day)
 {
-    DaysList_t::iterator it;
-    for (it = daysList_m.begin(); it != daysList_m.end(); it++)
-    {}
-    daysList_m.insert(it, day);
+    daysList_m.push_back(day);
+    indexDay(day);
 }
 
 void ExceptionDays::removeDay(DaySpec* day)
 {
     daysList_m.remove(day);
+    // Other days may cover the same bits, the year is indexed again
+    rebuildIndex(day->year_m);
+}
+
+void ExceptionDays::indexDay(DaySpec* day)
+{
+    // Same matching as before: out of range values never match
+    if (day->mon_m < -1 || day->mon_m > 11 || day->mday_m < -1 || day->mday_m == 0 || day->mday_m > 31)
+        return;
+    uint32_t days = (day->mday_m == -1) ? 0xfffffffe : (uint32_t)1 << day->mday_m;
+    uint32_t* months = (day->year_m == -1) ? recurring_m : years_m[day->year_m].months;
+    for (int mon = 0; mon < 12; mon++)
+    {
+        if (day->mon_m == -1 || day->mon_m == mon)
+            months[mon] |= days;
+    }
+}
+
+void ExceptionDays::rebuildIndex(int year)
+{
+    if (year == -1)
+        memset(recurring_m, 0, sizeof(recurring_m));
+    else
+        years_m.erase(year);
+    DaysList_t::iterator it;
+    for (it = daysList_m.begin(); it != daysList_m.end(); it++)
+    {
+        if ((*it)->year_m == year)
+            indexDay(*it);
+    }
 }
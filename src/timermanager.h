@@ -21,22 +21,49 @@
 #define TIMERMANAGER_H
 
 #include <list>
+#include <vector>
 #include <string>
 #include <map>
 #include "config.h"
 #include "logger.h"
 #include "threads.h"
 #include "ticpp.h"
+#include "collections.h"
 #include "objectcontroller.h"
 
+/** Runtime state of a timer kept across restarts by the TimerSnapshot */
+struct TimerState
+{
+    int64_t execTime;
+    int64_t lastTime;
+    int32_t counter;
+    uint8_t value;
+    uint8_t lastValue;
+};
+
 class TimerTask
 {
 public:
+    TimerTask() : timerIndex_m(-1) {};
     virtual ~TimerTask() {};
     virtual void onTimer(time_t time) = 0;
     virtual void reschedule(time_t from = 0) = 0;
     virtual time_t getExecTime() = 0;
+    /** Execution time in milliseconds since the epoch. Tasks needing more
+     * than one second resolution override this one. */
+    virtual int64_t getExecTimeMs() { return (int64_t)getExecTime() * 1000; };
     virtual void statusXml(ticpp::Element* pStatus) = 0;
+    bool isScheduled() { return timerIndex_m >= 0; };
+
+    virtual void saveState(TimerState* state) {};
+    /** Restores a saved state and schedules the task accordingly. Returns
+     * false if the state is outdated and the task must be rescheduled. */
+    virtual bool restoreState(const TimerState& state) { return false; };
+
+private:
+    friend class TimerManager;
+    /** Position in the TimerManager heap, -1 when not scheduled */
+    int timerIndex_m;
 };
 
 class TimeSpec
@@ -74,6 +101,7 @@ public:
 
     virtual void getData(int *min, int *hour, int *mday, int *mon, int *year, int *wdays, ExceptionDays *exception, const struct tm * timeinfo);
     virtual bool adjustTime(struct tm * timeinfo) { return false; };
+    virtual void getObjects(std::list<Object*>& objects) {};
 protected:
     //		int sec_m;
     int min_m;
@@ -96,6 +124,7 @@ public:
     virtual void exportXml(ticpp::Element* pConfig);
 
     virtual void getData(int *min, int *hour, int *mday, int *mon, int *year, int *wdays, ExceptionDays *exception, const struct tm * timeinfo);
+    virtual void getObjects(std::list<Object*>& objects);
 protected:
     TimeObject* time_m;
     DateObject* date_m;
@@ -103,6 +132,41 @@ protected:
     int offset_m;
 };
 
+class ExceptionDays;
+
+/** Calendar bitmaps compiled from the data of a TimeSpec: one bit per
+ * matching minute, hour, day of month, month and weekday. The next
+ * occurrence is then found by scanning the bitmaps a month at a time
+ * instead of adjusting and normalizing struct tm fields. */
+class CalendarSchedule
+{
+public:
+    CalendarSchedule();
+
+    /** Returns false if a value is out of its calendar range (e.g. hour 25
+     * after a variable time offset), such specs are not compiled. */
+    bool compile(int min, int hour, int mday, int mon, int year, int wdays, TimeSpec::ExceptionDays exception);
+    /** First matching time strictly after start, 0 if there is none within
+     * MaxYears. Local times skipped by a DST change are moved to the end of
+     * the gap, the first of two repeated local times is preferred. */
+    time_t findNext(time_t start, ExceptionDays* exceptionDays);
+
+    static const int MaxYears = 28;
+
+private:
+    uint32_t getDays(int year, int mon, ExceptionDays* exceptionDays);
+    int findMinute(int from);
+    static time_t toTime(int year, int mon, int mday, int minute, time_t start);
+
+    uint64_t minutes_m;
+    uint32_t hours_m;
+    uint32_t mdays_m;
+    uint16_t months_m;
+    uint8_t wdays_m;
+    int year_m;
+    TimeSpec::ExceptionDays exception_m;
+};
+
 class PeriodicTask : public TimerTask, public ChangeListener
 {
 public:
@@ -113,6 +177,8 @@ public:
     virtual void reschedule(time_t from);
     virtual time_t getExecTime() { return nextExecTime_m; };
     virtual void statusXml(ticpp::Element* pStatus);
+    virtual void saveState(TimerState* state);
+    virtual bool restoreState(const TimerState& state);
 
     void setAt(TimeSpec* at) { at_m = at; };
     void setUntil(TimeSpec* until) { until_m = until; };
@@ -127,6 +193,7 @@ protected:
     bool value_m;
 
     time_t findNext(time_t start, TimeSpec* next);
+    time_t findNextByFields(time_t start, TimeSpec* next, struct tm * timeinfo, int min, int hour, int mday, int mon, int year, int wdays, TimeSpec::ExceptionDays exception);
     time_t mktimeNoDst(struct tm * timeinfo);
     static Logger& logger_m;
 };
@@ -156,25 +223,59 @@ public:
         Short,
         Long
     };
-
     TimerManager();
     virtual ~TimerManager();
 
-    TimerCheck checkTaskList(time_t now);
-
+    TimerCheck checkTaskList(time_t now) { return checkTaskListMs((int64_t)now * 1000); };
+    TimerCheck checkTaskListMs(int64_t now);
+    /** Schedules the task at its current execution time. A task already
+     * scheduled is moved to its new position. */
     void addTask(TimerTask* task);
     void removeTask(TimerTask* task);
+    /** Execution time of the next task in ms, -1 if there is none */
+    int64_t getNextExecTimeMs() { return heap_m.empty() ? -1 : heap_m.front().execTime; };
+    int getTaskCount() { return heap_m.size(); };
 
     void startManager() { Start(); };
     void stopManager() { Stop(); };
-
     virtual void statusXml(ticpp::Element* pStatus);
 
+    static int64_t nowMs();
+
+    /** Longest sleep of the loop, wall clock steps are noticed after it */
+    static const int MaxSleepMs = 10000;
+
 private:
     void Run (pth_sem_t * stop);
 
-    typedef std::list<TimerTask*> TaskList_t;
-    TaskList_t taskList_m;
+    /** Tasks are kept in a binary heap ordered by execution time, then by
+     * insertion order. Each task knows its position, so that removing or
+     * moving it is O(log n). */
+    struct Entry
+    {
+        int64_t execTime;
+        unsigned long seq;
+        TimerTask* task;
+    };
+    typedef std::vector<Entry> Heap_t;
+
+    static bool before(const Entry& a, const Entry& b)
+    {
+        return a.execTime < b.execTime || (a.execTime == b.execTime && a.seq < b.seq);
+    };
+    void place(int i, const Entry& entry);
+    void siftUp(int i);
+    void siftDown(int i);
+    void removeAt(int i);
+
+    Heap_t heap_m;
+    unsigned long seq_m;
+    /** Sequence number of the task being executed, to know whether its
+     * onTimer() removed or rescheduled it */
+    unsigned long currentSeq_m;
+    bool currentRemoved_m;
+    /** Signaled when the next execution time moves earlier */
+    pth_sem_t wakeUp_m;
     static Logger& logger_m;
 };
 
@@ -205,10 +306,33 @@ public:
     void exportXml(ticpp::Element* pConfig);
 
     bool isException(time_t time);
+    bool isException(int year, int mon, int mday) { return (getMonthMask(year, mon) >> mday) & 1; };
+    /** Exception days of the month as a bitmap, bit n for day n */
+    uint32_t getMonthMask(int year, int mon)
+    {
+        if (mon < 0 || mon > 11)
+            return 0;
+        YearMasks_t::iterator it = years_m.find(year);
+        return recurring_m[mon] | (it != years_m.end() ? it->second.months[mon] : 0);
+    };
 
 private:
     typedef std::list<DaySpec*> DaysList_t;
     DaysList_t daysList_m;
+
+    /** Index of the days list: day bitmaps of each month, for the days
+     * given with a year and for the ones recurring every year */
+    struct YearMask
+    {
+        uint32_t months[12];
+    };
+    typedef HashMap<int, YearMask> YearMasks_t;
+    YearMasks_t years_m;
+    uint32_t recurring_m[12];
+
+    void indexDay(DaySpec* day);
+    void rebuildIndex(int year);
+
     static ExceptionDays* instance_m;
 };
 
@@ -0,0 +1,291 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "timersnapshot.h"
+#include "services.h"
+#include "ruleserver.h"
+#include "clock.h"
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+
+Logger& TimerSnapshot::logger_m(Logger::getInstance("TimerSnapshot"));
+
+namespace
+{
+    // The file is written in little-endian order, whatever the host
+    void putInt(std::string& buf, uint64_t value, int size)
+    {
+        for (int i = 0; i < size; i++)
+            buf += (char)((value >> (8 * i)) & 0xff);
+    }
+
+    bool getInt(const std::string& buf, size_t& pos, uint64_t* value, int size)
+    {
+        if (pos + size > buf.size())
+            return false;
+        *value = 0;
+        for (int i = 0; i < size; i++)
+            *value |= (uint64_t)(uint8_t)buf[pos + i] << (8 * i);
+        pos += size;
+        return true;
+    }
+}
+
+TimerSnapshot::TimerSnapshot() : interval_m(0), ruleIndex_m(0), ruleRestored_m(false), loadedEnvHash_m(0), envChecked_m(false), saveTask_m(this)
+{}
+
+TimerSnapshot::~TimerSnapshot()
+{}
+
+void TimerSnapshot::importXml(ticpp::Element* pConfig)
+{
+    path_m = pConfig->GetAttribute("path");
+    interval_m = RuleServer::parseDuration(pConfig->GetAttribute("interval"));
+    records_m.clear();
+    if (isEnabled())
+        load();
+    Services::instance()->getTimerManager()->removeTask(&saveTask_m);
+    if (isEnabled() && interval_m > 0)
+        saveTask_m.schedule(Clock::now() + interval_m);
+}
+
+void TimerSnapshot::exportXml(ticpp::Element* pConfig)
+{
+    pConfig->SetAttribute("path", path_m);
+    if (interval_m > 0)
+        pConfig->SetAttribute("interval", RuleServer::formatDuration(interval_m));
+}
+
+void TimerSnapshot::beginRule(const std::string& ruleId)
+{
+    rule_m = ruleId;
+    ruleIndex_m = 0;
+    ruleRestored_m = false;
+}
+
+uint32_t TimerSnapshot::hash(const std::string& data)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (std::string::const_iterator it = data.begin(); it != data.end(); it++)
+    {
+        h ^= (uint8_t)*it;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t TimerSnapshot::getHash(const Timer& timer)
+{
+    std::stringstream data;
+    data << timer.configHash;
+    for (std::list<Object*>::const_iterator it = timer.objects.begin(); it != timer.objects.end(); it++)
+        data << '\n' << (*it)->getID() << '=' << (*it)->getValue();
+    return hash(data.str());
+}
+
+uint32_t TimerSnapshot::getEnvironmentHash()
+{
+    ticpp::Document doc;
+    ticpp::Element pExceptionDays("exceptiondays");
+    Services::instance()->getExceptionDays()->exportXml(&pExceptionDays);
+    doc.LinkEndChild(&pExceptionDays);
+    ticpp::Element pLocationInfo("location");
+    Services::instance()->getLocationInfo()->exportXml(&pLocationInfo);
+    doc.LinkEndChild(&pLocationInfo);
+    return hash(doc.GetAsString());
+}
+
+bool TimerSnapshot::addTimer(TimerTask* task, ticpp::Element* pConfig, const std::list<Object*>& objects)
+{
+    if (!isEnabled())
+        return false;
+    std::stringstream key;
+    key << rule_m << "#" << ruleIndex_m++;
+
+    ticpp::Document doc;
+    doc.LinkEndChild(pConfig);
+    Timer timer;
+    timer.configHash = hash(doc.GetAsString());
+    timer.objects = objects;
+    timer.task = task;
+    timers_m[key.str()] = timer;
+    keys_m[task] = key.str();
+
+    // The services are imported before the rules, checked once all of
+    // them are known
+    if (!envChecked_m)
+    {
+        envChecked_m = true;
+        if (!records_m.empty() && loadedEnvHash_m != getEnvironmentHash())
+        {
+            logger_m.infoStream() << "Exception days or location changed, rescheduling all timers" << endlog;
+            records_m.clear();
+        }
+    }
+
+    RecordMap_t::iterator it = records_m.find(key.str());
+    if (it == records_m.end())
+        return false;
+    bool restored = false;
+    if (it->second.hash != getHash(timer))
+        logger_m.infoStream() << "Config of timer " << key.str() << " changed, rescheduling it" << endlog;
+    else
+        restored = task->restoreState(it->second.state);
+    ruleRestored_m = ruleRestored_m || restored;
+    records_m.erase(it);
+    return restored;
+}
+
+void TimerSnapshot::removeTimer(TimerTask* task)
+{
+    TimerKeyMap_t::iterator it = keys_m.find(task);
+    if (it == keys_m.end())
+        return;
+    // The key may already belong to the timer replacing this one
+    TimerMap_t::iterator timer = timers_m.find(it->second);
+    if (timer != timers_m.end() && timer->second.task == task)
+        timers_m.erase(timer);
+    keys_m.erase(it);
+}
+
+bool TimerSnapshot::save()
+{
+    if (!isEnabled())
+        return false;
+    std::string buf;
+    putInt(buf, Magic, 4);
+    putInt(buf, Version, 4);
+    putInt(buf, getEnvironmentHash(), 4);
+    putInt(buf, timers_m.size(), 4);
+    for (TimerMap_t::iterator it = timers_m.begin(); it != timers_m.end(); it++)
+    {
+        TimerState state;
+        memset(&state, 0, sizeof(state));
+        it->second.task->saveState(&state);
+        putInt(buf, it->first.size(), 2);
+        buf += it->first;
+        putInt(buf, getHash(it->second), 4);
+        putInt(buf, state.execTime, 8);
+        putInt(buf, state.lastTime, 8);
+        putInt(buf, (uint32_t)state.counter, 4);
+        putInt(buf, state.value, 1);
+        putInt(buf, state.lastValue, 1);
+    }
+    putInt(buf, hash(buf), 4);
+
+    std::string tmpPath = path_m + ".tmp";
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp)
+    {
+        logger_m.errorStream() << "Unable to write " << tmpPath << ": " << strerror(errno) << endlog;
+        return false;
+    }
+    bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    ok = (fflush(fp) == 0) && ok;
+    ok = (fsync(fileno(fp)) == 0) && ok;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path_m.c_str()) != 0)
+    {
+        logger_m.errorStream() << "Unable to save timer snapshot to " << path_m << ": " << strerror(errno) << endlog;
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    logger_m.debugStream() << "Saved " << timers_m.size() << " timers to " << path_m << endlog;
+    return true;
+}
+
+bool TimerSnapshot::load()
+{
+    records_m.clear();
+    envChecked_m = false;
+    FILE* fp = fopen(path_m.c_str(), "rb");
+    if (!fp)
+    {
+        logger_m.infoStream() << "No timer snapshot in " << path_m << endlog;
+        return false;
+    }
+    std::string buf;
+    char chunk[4096];
+    size_t len;
+    while ((len = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        buf.append(chunk, len);
+    fclose(fp);
+
+    uint64_t magic, version, envHash, count, checksum;
+    size_t pos = 0;
+    if (buf.size() < 20 || !getInt(buf, pos, &magic, 4) || magic != Magic ||
+            !getInt(buf, pos, &version, 4) || version != Version ||
+            !getInt(buf, pos, &envHash, 4) || !getInt(buf, pos, &count, 4))
+    {
+        logger_m.warnStream() << "Ignoring timer snapshot " << path_m << ": bad header" << endlog;
+        return false;
+    }
+    size_t end = buf.size() - 4;
+    getInt(buf, end, &checksum, 4);
+    if (checksum != hash(buf.substr(0, buf.size() - 4)))
+    {
+        logger_m.warnStream() << "Ignoring timer snapshot " << path_m << ": bad checksum" << endlog;
+        return false;
+    }
+
+    RecordMap_t records;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t keyLen, h, execTime, lastTime, counter, value, lastValue;
+        if (!getInt(buf, pos, &keyLen, 2) || pos + keyLen > buf.size() - 4)
+            break;
+        std::string key = buf.substr(pos, keyLen);
+        pos += keyLen;
+        if (!getInt(buf, pos, &h, 4) || !getInt(buf, pos, &execTime, 8) || !getInt(buf, pos, &lastTime, 8) ||
+                !getInt(buf, pos, &counter, 4) || !getInt(buf, pos, &value, 1) || !getInt(buf, pos, &lastValue, 1))
+            break;
+        Record& record = records[key];
+        record.hash = h;
+        record.state.execTime = (int64_t)execTime;
+        record.state.lastTime = (int64_t)lastTime;
+        record.state.counter = (int32_t)(uint32_t)counter;
+        record.state.value = value;
+        record.state.lastValue = lastValue;
+    }
+    if (records.size() != count || pos != buf.size() - 4)
+    {
+        logger_m.warnStream() << "Ignoring timer snapshot " << path_m << ": truncated" << endlog;
+        return false;
+    }
+    records_m.swap(records);
+    loadedEnvHash_m = envHash;
+    logger_m.infoStream() << "Loaded " << records_m.size() << " timers from " << path_m << endlog;
+    return true;
+}
+
+void TimerSnapshot::SaveTask::schedule(time_t time)
+{
+    execTime_m = time;
+    reschedule(0);
+}
+
+void TimerSnapshot::SaveTask::onTimer(time_t time)
+{
+    snapshot_m->save();
+    execTime_m = time + snapshot_m->interval_m;
+}
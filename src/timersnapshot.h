@@ -0,0 +1,126 @@
+/*
+    LinKNX KNX home automation platform
+    Copyright (C) 2007 Jean-François Meessen <linknx@ouaye.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TIMERSNAPSHOT_H
+#define TIMERSNAPSHOT_H
+
+#include <list>
+#include <map>
+#include <string>
+#include "collections.h"
+#include "logger.h"
+#include "ticpp.h"
+#include "timermanager.h"
+
+/** State of the timers (next execution, current value, time counters)
+ * saved periodically and on shutdown, so that a restart does not have to
+ * recompute the schedules and does not fire their actions again.
+ *
+ * Timers register themselves while the rules are imported. They are
+ * identified by their rule and their position in it, and a hash of their
+ * config and of the values of the time/date objects they refer to tells
+ * whether the saved state still applies. The whole file is discarded when
+ * the exception days or the location changed. */
+class TimerSnapshot
+{
+public:
+    TimerSnapshot();
+    ~TimerSnapshot();
+
+    /** Sets the path and period, and loads the snapshot if it exists */
+    void importXml(ticpp::Element* pConfig);
+    void exportXml(ticpp::Element* pConfig);
+    bool isEnabled() { return path_m != ""; };
+
+    /** Sets the rule whose timers are registered next */
+    void beginRule(const std::string& ruleId);
+    void endRule() { beginRule(""); };
+    /** Whether a timer of the current rule got its state restored */
+    bool isRuleRestored() { return ruleRestored_m; };
+
+    /** Registers the timer with the canonical XML of its config and the
+     * objects its schedule depends on, and restores its state if the
+     * loaded snapshot has a matching entry. Returns false if the timer
+     * must compute its schedule itself. */
+    bool addTimer(TimerTask* task, ticpp::Element* pConfig,
+                  const std::list<Object*>& objects = std::list<Object*>());
+    void removeTimer(TimerTask* task);
+
+    /** Writes the state of the registered timers, atomically replacing
+     * the previous snapshot */
+    bool save();
+    /** Reads the snapshot file, returns false if it is missing or invalid */
+    bool load();
+
+    int getTimerCount() { return timers_m.size(); };
+    int getLoadedCount() { return records_m.size(); };
+
+    static uint32_t hash(const std::string& data);
+
+    static const uint32_t Magic = 0x53544b4c; // "LKTS"
+    static const uint32_t Version = 2;
+
+private:
+    class SaveTask : public FixedTimeTask
+    {
+    public:
+        SaveTask(TimerSnapshot* snapshot) : snapshot_m(snapshot) {};
+        virtual void onTimer(time_t time);
+        void schedule(time_t time);
+    private:
+        TimerSnapshot* snapshot_m;
+    };
+
+    struct Timer
+    {
+        uint32_t configHash;
+        std::list<Object*> objects;
+        TimerTask* task;
+    };
+    struct Record
+    {
+        uint32_t hash;
+        TimerState state;
+    };
+    typedef std::map<std::string, Timer> TimerMap_t;
+    typedef HashMap<TimerTask*, std::string> TimerKeyMap_t;
+    typedef std::map<std::string, Record> RecordMap_t;
+
+    /** Hash of the config and of the current values of the objects */
+    static uint32_t getHash(const Timer& timer);
+    /** Hash of the exception days and location config */
+    static uint32_t getEnvironmentHash();
+
+    std::string path_m;
+    int interval_m;
+    std::string rule_m;
+    int ruleIndex_m;
+    bool ruleRestored_m;
+    TimerMap_t timers_m;
+    TimerKeyMap_t keys_m;
+    RecordMap_t records_m;
+    uint32_t loadedEnvHash_m;
+    /** False until the loaded records are checked against the current
+     * exception days and location */
+    bool envChecked_m;
+    SaveTask saveTask_m;
+    static Logger& logger_m;
+};
+
+#endif
@@ -21,6 +21,10 @@
 */
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include "xmlserver.h"
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -29,42 +33,54 @@
 #include "objectcontroller.h"
 #include "timermanager.h"
 #include "services.h"
+#include "clock.h"
+#include "configcache.h"
+
+XmlServer::XmlServer () : fd_m(-1), epollFd_m(-1), protocol_m(Xml), maxQueued_m(DefaultMaxQueued), overflowPolicy_m(Coalesce)
+{}
 
 XmlServer::~XmlServer ()
 {
     Stop ();
-    std::list<ClientConnection*>::iterator it;
+    // Deleting the connections also stops the execute requests in progress
+    ConnectionMap_t::iterator it;
     for (it = connections_m.begin(); it != connections_m.end(); it++)
-    {
-        (*it)->RemoveServer();
-        (*it)->StopDelete();
-    }
-    if (!connections_m.empty())
-        pth_sleep (1); // Wait some time to let client connections close
+        delete it->second;
+    connections_m.clear();
 
-    close (fd_m);
+    if (epollFd_m != -1)
+        close (epollFd_m);
+    if (fd_m != -1)
+        close (fd_m);
 }
 
-bool
-XmlServer::deregister (ClientConnection * con)
+void XmlServer::release ()
 {
-    connections_m.remove(con);
-    return 1;
+    epoll_ctl (epollFd_m, EPOLL_CTL_DEL, fd_m, 0);
+    close (fd_m);
+    fd_m = -1;
+    StopDelete ();
 }
 
-XmlServer* XmlServer::create(ticpp::Element* pConfig)
+XmlServer* XmlServer::create(ticpp::Element* pConfig, Protocol protocol)
 {
     std::string type = pConfig->GetAttributeOrDefault("type", "inet");
+    int maxQueued;
+    pConfig->GetAttributeOrDefault("notify-queue", &maxQueued, DefaultMaxQueued);
+    if (maxQueued < 1)
+        throw ticpp::Exception("XmlServer: notify-queue must be at least 1");
+    OverflowPolicy policy = parseOverflowPolicy(pConfig->GetAttributeOrDefault("notify-overflow", "coalesce"));
+    XmlServer* server;
     if (type == "inet")
     {
         int port = 0;
-        pConfig->GetAttributeOrDefault("port", &port, 1028);
-        return new XmlInetServer(port);
+        pConfig->GetAttributeOrDefault("port", &port, protocol == Binary ? 1029 : 1028);
+        server = new XmlInetServer(port);
     }
     else if (type == "unix")
     {
-        std::string path = pConfig->GetAttributeOrDefault("path", "/tmp/xmlserver.sock");
-        return new XmlUnixServer(path.c_str());
+        std::string path = pConfig->GetAttributeOrDefault("path", protocol == Binary ? "/tmp/binaryserver.sock" : "/tmp/xmlserver.sock");
+        server = new XmlUnixServer(path.c_str());
     }
     else
     {
@@ -72,6 +88,56 @@ XmlServer* XmlServer::create(ticpp::Element* pConfig)
         msg << "XmlServer: server type not supported: '" << type << "'" << std::endl;
         throw ticpp::Exception(msg.str());
     }
+    // The server thread only accepts connections once this one yields
+    server->protocol_m = protocol;
+    server->maxQueued_m = maxQueued;
+    server->overflowPolicy_m = policy;
+    return server;
+}
+
+XmlServer::OverflowPolicy XmlServer::parseOverflowPolicy(const std::string& policy)
+{
+    if (policy == "coalesce")
+        return Coalesce;
+    else if (policy == "drop-oldest")
+        return DropOldest;
+    else if (policy == "disconnect")
+        return Disconnect;
+    std::stringstream msg;
+    msg << "XmlServer: Bad notify-overflow policy: '" << policy << "'" << std::endl;
+    throw ticpp::Exception(msg.str());
+}
+
+std::string XmlServer::formatOverflowPolicy(OverflowPolicy policy)
+{
+    switch (policy)
+    {
+    case DropOldest:
+        return "drop-oldest";
+    case Disconnect:
+        return "disconnect";
+    default:
+        return "coalesce";
+    }
+}
+
+void XmlServer::exportQueueXml(ticpp::Element* pConfig)
+{
+    if (maxQueued_m != DefaultMaxQueued)
+        pConfig->SetAttribute("notify-queue", maxQueued_m);
+    if (overflowPolicy_m != Coalesce)
+        pConfig->SetAttribute("notify-overflow", formatOverflowPolicy(overflowPolicy_m));
+}
+
+void XmlServer::statusXml(ticpp::Element* pStatus)
+{
+    ConnectionMap_t::iterator it;
+    for (it = connections_m.begin(); it != connections_m.end(); it++)
+    {
+        ticpp::Element pConnection("connection");
+        it->second->statusXml(&pConnection);
+        pStatus->LinkEndChild(&pConnection);
+    }
 }
 
 XmlInetServer::XmlInetServer (int port)
@@ -100,16 +166,17 @@ XmlInetServer::XmlInetServer (int port)
         throw ticpp::Exception(msg.str());
     }
 
-    if (listen (fd_m, 10) == -1)
+    if (listen (fd_m, SOMAXCONN) == -1)
         throw ticpp::Exception("XmlServer: Unable to listen on TCP socket");
 
-    Start ();
+    startServer ();
 }
 
 void XmlInetServer::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "inet");
     pConfig->SetAttribute("port", port_m);
+    exportQueueXml(pConfig);
 }
 
 XmlUnixServer::XmlUnixServer (const char *path)
@@ -135,343 +202,569 @@ XmlUnixServer::XmlUnixServer (const char *path)
         throw ticpp::Exception(msg.str());
     }
 
-    if (listen (fd_m, 10) == -1)
+    if (listen (fd_m, SOMAXCONN) == -1)
         throw ticpp::Exception("XmlServer: Unable to listen on UNIX socket");
 
-    Start ();
+    startServer ();
 }
 
 void XmlUnixServer::exportXml(ticpp::Element* pConfig)
 {
     pConfig->SetAttribute("type", "unix");
     pConfig->SetAttribute("path", path_m);
+    exportQueueXml(pConfig);
+}
+
+void XmlServer::startServer ()
+{
+    epollFd_m = epoll_create (MaxEvents);
+    if (epollFd_m == -1)
+        throw ticpp::Exception("XmlServer: Unable to create epoll set");
+    fcntl (fd_m, F_SETFL, fcntl (fd_m, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd_m;
+    if (epoll_ctl (epollFd_m, EPOLL_CTL_ADD, fd_m, &ev) == -1)
+        throw ticpp::Exception("XmlServer: Unable to watch listening socket");
+
+    Start ();
+}
+
+void XmlServer::watch (ClientConnection *con, bool readable, bool writable)
+{
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+    ev.data.fd = con->getFd();
+    epoll_ctl (epollFd_m, EPOLL_CTL_MOD, con->getFd(), &ev);
+}
+
+void XmlServer::closeConnection (ClientConnection *con)
+{
+    ConnectionMap_t::iterator it = connections_m.find(con->getFd());
+    if (it == connections_m.end() || it->second != con)
+        return;
+    if (!con->isClosing())
+    {
+        epoll_ctl (epollFd_m, EPOLL_CTL_DEL, con->getFd(), 0);
+        con->setClosing();
+    }
+    connections_m.erase(it);
+    delete con;
+}
+
+void XmlServer::acceptConnections ()
+{
+    int cfd;
+    while ((cfd = accept (fd_m, 0, 0)) != -1)
+    {
+        fcntl (cfd, F_SETFL, fcntl (cfd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev;
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = cfd;
+        if (epoll_ctl (epollFd_m, EPOLL_CTL_ADD, cfd, &ev) == -1)
+        {
+            errorStream("XmlServer") << "Unable to watch client connection: " << strerror(errno) << endlog;
+            close (cfd);
+            continue;
+        }
+        if (protocol_m == Binary)
+            connections_m[cfd] = new BinaryConnection (this, cfd);
+        else
+            connections_m[cfd] = new ClientConnection (this, cfd);
+    }
 }
 
 void XmlServer::Run (pth_sem_t *stop1)
 {
     pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t ready = pth_event (PTH_EVENT_FD|PTH_UNTIL_FD_READABLE, epollFd_m);
+    pth_event_concat (stop, ready, NULL);
+    struct epoll_event events[MaxEvents];
     while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
     {
-        int cfd;
-        cfd = pth_accept_ev (fd_m, 0, 0, stop);
-        if (cfd != -1)
+        pth_wait (stop);
+        int count = epoll_wait (epollFd_m, events, MaxEvents, 0);
+        for (int i = 0; i < count; i++)
         {
-            ClientConnection *c = new ClientConnection (this, cfd);
-            connections_m.push_back(c);
-            c->Start ();
+            int fd = events[i].data.fd;
+            if (fd == fd_m)
+            {
+                acceptConnections();
+                continue;
+            }
+            // A connection handled earlier in this batch may have closed
+            // this one
+            ConnectionMap_t::iterator it = connections_m.find(fd);
+            if (it == connections_m.end())
+                continue;
+            ClientConnection *con = it->second;
+            bool open = true;
+            if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+                open = con->processInput();
+            // The client is gone and cannot get the status of its
+            // execute requests
+            if (open && con->isBusy() && (events[i].events & (EPOLLHUP|EPOLLERR)))
+                open = false;
+            if (open && (events[i].events & EPOLLOUT))
+                open = con->flush();
+            if (!open)
+                closeConnection(con);
         }
     }
+    pth_event_isolate (ready);
+    pth_event_free (ready, PTH_FREE_THIS);
     pth_event_free (stop, PTH_FREE_THIS);
 }
 
 ClientConnection::ClientConnection (XmlServer *server, int fd)
-{
-    fd_m = fd;
-    server_m = server;
-}
+    : inStart_m(0), scanned_m(0), fd_m(fd), server_m(server), outStart_m(0),
+      eof_m(false), error_m(false), closing_m(false), readable_m(true), writable_m(false), lastRequestId_m(0),
+      overflow_m(false), maxQueueLength_m(0), dropped_m(0), coalesced_m(0), sent_m(0), maxLag_m(0)
+{}
 
 ClientConnection::~ClientConnection ()
 {
-    NotifyList_t::iterator it;
-    for (it = notifyList_m.begin(); it != notifyList_m.end(); it++)
+    // Stops the execute requests in progress without reporting them
+    ExecutionMap_t::iterator it;
+    for (it = executions_m.begin(); it != executions_m.end(); it++)
     {
-        (*it)->removeChangeListener(this);
-        (*it)->decRefCount();
+        it->second->Stop();
+        delete it->second;
     }
-    notifyList_m.clear();
-    if (server_m)
-        server_m->deregister (this);
+    ObjectController::instance()->getSubscriptions()->unsubscribeAll(this);
+    ConfigSaver::instance()->removeListener(this);
     close (fd_m);
 }
 
-void ClientConnection::Run (pth_sem_t * stop1)
+bool ClientConnection::isOpen ()
 {
-    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
-    while (pth_event_status (stop) != PTH_STATUS_OCCURRED)
+    if (error_m || overflow_m)
+        return false;
+    // After the end of stream, stay until the replies are sent
+    return !eof_m || !executions_m.empty() || !pendingSaves_m.empty() || outStart_m < outbuf_m.size();
+}
+
+void ClientConnection::updateWatch ()
+{
+    bool readable = !eof_m;
+    bool writable = outStart_m < outbuf_m.size() || !notifications_m.empty() || error_m || overflow_m;
+    if (server_m && !closing_m && (readable != readable_m || writable != writable_m))
+        server_m->watch (this, readable, writable);
+    readable_m = readable;
+    writable_m = writable;
+}
+
+bool ClientConnection::processInput ()
+{
+    while (!closing_m)
     {
-        if (readmessage (stop) == -1)
+        int ret = readmessage ();
+        if (ret == 0)
             break;
-        std::string msgType;
-        try
+        if (ret == -1)
+            return flush ();
+        handleMessage ();
+    }
+    updateWatch ();
+    return isOpen ();
+}
+
+bool ClientConnection::flush ()
+{
+    while (!error_m && !overflow_m)
+    {
+        if (outStart_m >= outbuf_m.size())
+        {
+            if (notifications_m.empty())
+                break;
+            drainNotifications ();
+        }
+        ssize_t i = send (fd_m, outbuf_m.data() + outStart_m, outbuf_m.size() - outStart_m, MSG_NOSIGNAL);
+        if (i > 0)
+            outStart_m += i;
+        else if (i == -1 && errno == EINTR)
+            continue;
+        else if (i == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            error_m = true;
+    }
+    if (outStart_m >= outbuf_m.size())
+    {
+        outbuf_m.clear();
+        outStart_m = 0;
+    }
+    updateWatch ();
+    return isOpen ();
+}
+
+void ClientConnection::onExecuteDone (ExecuteWaiter *waiter, const char* status)
+{
+    // The waiter deletes itself when its thread returns
+    executions_m.erase(waiter->getId());
+    waiter->StopDelete ();
+    std::stringstream msg;
+    msg << "<execute status='" << status << "' id='" << waiter->getId() << "'/>" << std::endl;
+    sendmessage (msg.str());
+    // After the end of stream, the connection was only waiting for this
+    if (!isOpen () && server_m)
+        server_m->closeConnection (this);
+}
+
+void ClientConnection::onConfigSaved (int id, const std::string& error)
+{
+    PendingSaveMap_t::iterator it = pendingSaves_m.find(id);
+    if (it == pendingSaves_m.end())
+        return;
+    if (it->second.error == "")
+        it->second.error = error;
+    if (--it->second.remaining > 0)
+        return;
+    std::stringstream msg;
+    if (it->second.error == "")
+        msg << "<admin status='success' id='" << id << "'/>" << std::endl;
+    else
+        msg << "<admin status='error' id='" << id << "'>" << it->second.error << "</admin>" << std::endl;
+    pendingSaves_m.erase(it);
+    sendmessage (msg.str());
+    if (!isOpen () && server_m)
+        server_m->closeConnection (this);
+}
+
+void ClientConnection::handleMessage ()
+{
+    std::string msgType;
+    try
+    {
+        if (handleFastMessage (msgType))
+            return;
+
+        // Load a document
+        ticpp::Document doc;
+        debugStream("ClientConnection") << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
+        doc.LoadFromString(msg_m);
+
+        ticpp::Element* pMsg = doc.FirstChildElement();
+        msgType = pMsg->Value();
+        if (msgType == "read")
         {
-            // Load a document
-            ticpp::Document doc;
-            debugStream("ClientConnection") << "PROCESSING MESSAGE:" << endlog << msg_m << endlog << "END OF MESSAGE" << endlog;
-            doc.LoadFromString(msg_m);
-
-            ticpp::Element* pMsg = doc.FirstChildElement();
-            msgType = pMsg->Value();
-            if (msgType == "read")
+            ticpp::Element* pRead = pMsg->FirstChildElement();
+            if (pRead->Value() == "object")
+            {
+                std::string id = pRead->GetAttribute("id");
+                Object* obj = ObjectController::instance()->getObject(id);
+                std::stringstream msg;
+                msg << "<read status='success'>" << obj->getValue() << "</read>" << std::endl;
+                obj->decRefCount();
+                debugStream("ClientConnection") << "SENDING MESSAGE:" << endlog << msg.str() << endlog << "END OF MESSAGE" << endlog;
+                sendmessage (msg.str());
+            }
+            else if (pRead->Value() == "objects")
             {
-                ticpp::Element* pRead = pMsg->FirstChildElement();
-                if (pRead->Value() == "object")
+                if (pRead->GetAttribute("since") != "")
                 {
-                    std::string id = pRead->GetAttribute("id");
-                    Object* obj = ObjectController::instance()->getObject(id);
-                    std::stringstream msg;
-                    msg << "<read status='success'>" << obj->getValue() << "</read>" << std::endl;
-                    obj->decRefCount();
-                    debugStream("ClientConnection") << "SENDING MESSAGE:" << endlog << msg.str() << endlog << "END OF MESSAGE" << endlog;
-                    sendmessage (msg.str(), stop);
+                    uint64_t since;
+                    pRead->GetAttribute("since", &since);
+                    uint64_t epoch = ObjectController::instance()->getEpoch();
+                    if (pRead->GetAttribute("epoch") != "")
+                        pRead->GetAttribute("epoch", &epoch);
+                    // Rebuilt to list the attributes in the order of the fast path
+                    ticpp::Element pObjects("objects");
+                    pObjects.SetAttribute("since", pRead->GetAttribute("since"));
+                    ObjectController::instance()->exportChangedValues(&pObjects, since, epoch);
+                    pMsg->ReplaceChild(pRead, pObjects);
                 }
-                else if (pRead->Value() == "objects")
+                else if (pRead->NoChildren())
                 {
-                    if (pRead->NoChildren())
-                    {
-                        ObjectController::instance()->exportObjectValues(pRead);
-                    }
-                    else
+                    ObjectController::instance()->exportObjectValues(pRead);
+                }
+                else
+                {
+                    ticpp::Iterator< ticpp::Element > pObjects;
+                    for ( pObjects = pRead->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
                     {
-                        ticpp::Iterator< ticpp::Element > pObjects;
-                        for ( pObjects = pRead->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
+                        if (pObjects->Value() == "object")
                         {
-                            if (pObjects->Value() == "object")
-                            {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                pObjects->SetAttribute("value", obj->getValue());
-                                obj->decRefCount();
-                            }
-                            else
-                                throw "Unknown objects element";
+                            std::string id = pObjects->GetAttribute("id");
+                            Object* obj = ObjectController::instance()->getObject(id);
+                            pObjects->SetAttribute("value", obj->getValue());
+                            obj->decRefCount();
                         }
+                        else
+                            throw "Unknown objects element";
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
                 }
-                else if (pRead->Value() == "config")
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "config")
+            {
+                // The sections are served from the cache, printed as the
+                // DOM of the reply would be
+                ConfigCache* cache = ConfigCache::instance();
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                ConfigCache::Section section;
+                if (pConfig && !ConfigCache::getSection(pConfig->Value(), &section))
+                    throw "Unknown config element";
+                std::string msg = "<read status=\"success\">\n\t<config>\n";
+                if (pConfig == 0)
+                {
+                    for (int i = 0; i < ConfigCache::SectionCount; i++)
+                        cache->append(msg, (ConfigCache::Section)i, 2);
+                }
+                else
+                    cache->append(msg, section, 2);
+                msg.append("\t</config>\n</read>\n");
+                sendmessage (msg);
+            }
+            else if (pRead->Value() == "status")
+            {
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
                 {
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        ticpp::Element objects("objects");
-                        ObjectController::instance()->exportXml(&objects);
-                        pRead->LinkEndChild(&objects);
-
-                        ticpp::Element rules("rules");
-                        RuleServer::instance()->exportXml(&rules);
-                        pRead->LinkEndChild(&rules);
+                    ticpp::Element timers("timers");
+                    Services::instance()->getTimerManager()->statusXml(&timers);
+                    pRead->LinkEndChild(&timers);
 
-                        ticpp::Element services("services");
-                        Services::instance()->exportXml(&services);
-                        pRead->LinkEndChild(&services);
+                    ticpp::Element rules("rules");
+                    RuleServer::instance()->statusXml(&rules);
+                    pRead->LinkEndChild(&rules);
 
-                        ticpp::Element logging("logging");
-                        Logging::instance()->exportXml(&logging);
-                        pRead->LinkEndChild(&logging);
-                    }
-                    else if (pConfig->Value() == "objects")
-                    {
-                        ObjectController::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "rules")
-                    {
-                        RuleServer::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "services")
-                    {
-                        Services::instance()->exportXml(pConfig);
-                    }
-                    else if (pConfig->Value() == "logging")
+                    PersistentStorage* storage = Services::instance()->getPersistentStorage();
+                    if (storage)
                     {
-                        Logging::instance()->exportXml(pConfig);
+                        ticpp::Element persistence("persistence");
+                        storage->statusXml(&persistence);
+                        pRead->LinkEndChild(&persistence);
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
                 }
-                else if (pRead->Value() == "status")
+                else if (pConfig->Value() == "timers")
                 {
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        ticpp::Element timers("timers");
-                        Services::instance()->getTimerManager()->statusXml(&timers);
-                        pRead->LinkEndChild(&timers);
-
-                        ticpp::Element rules("rules");
-                        RuleServer::instance()->statusXml(&rules);
-                        pRead->LinkEndChild(&rules);
-                    }
-                    else if (pConfig->Value() == "timers")
-                    {
-                        Services::instance()->getTimerManager()->statusXml(pConfig);
+                    Services::instance()->getTimerManager()->statusXml(pConfig);
+                }
+                else if (pConfig->Value() == "rules")
+                {
+                    RuleServer::instance()->statusXml(pConfig);
+                }
+                else if (pConfig->Value() == "persistence")
+                {
+                    PersistentStorage* storage = Services::instance()->getPersistentStorage();
+                    if (storage)
+                        storage->statusXml(pConfig);
+                }
+                else if (pConfig->Value() == "partitions")
+                {
+                    RuleServer::instance()->partitionXml(pConfig);
+                }
+                else if (pConfig->Value() == "connections")
+                {
+                    if (server_m)
+                        server_m->statusXml(pConfig);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "history")
+            {
+                std::string id = pRead->GetAttribute("id");
+                long start, end;
+                int limit;
+                pRead->GetAttributeOrDefault("start", &start, 0);
+                pRead->GetAttributeOrDefault("end", &end, (long)Clock::now());
+                pRead->GetAttributeOrDefault("limit", &limit, 0);
+                PersistentStorage* storage = Services::instance()->getPersistentStorage();
+                PersistentStorage::SampleList_t samples;
+                if (!storage || !storage->readHistory(id, start, end, samples, limit))
+                    throw ticpp::Exception("History not available for object '" + id + "'");
+                for (PersistentStorage::SampleList_t::iterator it = samples.begin(); it != samples.end(); it++)
+                {
+                    ticpp::Element sample("sample");
+                    sample.SetAttribute("ts", (long)it->time);
+                    sample.SetAttribute("value", it->value);
+                    pRead->InsertEndChild(sample);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "calendar")
+            {
+                int year, month, day, h,m;
+                time_t ts = Clock::now();
+                struct tm * date = localtime(&ts);
+                pRead->GetAttributeOrDefault("year", &year, 0);
+                pRead->GetAttributeOrDefault("month", &month, 0);
+                pRead->GetAttributeOrDefault("day", &day, 0);
+                if (year != 0 || month != 0 || day != 0) {
+                    if (year == 0 && month == 0) {
+                        date->tm_mday += day;
                     }
-                    else if (pConfig->Value() == "rules")
-                    {
-                        RuleServer::instance()->statusXml(pConfig);
+                    else {
+                        if (year >= 1900)
+                            year -= 1900;
+                        if (month > 0)
+                            date->tm_mon = month-1;
+                        if (year > 0)
+                            date->tm_year = year;
+                        date->tm_mday = day;
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
+                    ts = mktime(date);
+                    pRead->SetAttribute("year", date->tm_year+1900);
+                    pRead->SetAttribute("month", date->tm_mon+1);
+                    pRead->SetAttribute("day", date->tm_mday);
                 }
-                else if (pRead->Value() == "calendar")
+
+                SolarInfo info(date);
+                ticpp::Element* pConfig = pRead->FirstChildElement(false);
+                if (pConfig == 0)
                 {
-                    int year, month, day, h,m;
-                    time_t ts = time(0);
-                    struct tm * date = localtime(&ts);
-                    pRead->GetAttributeOrDefault("year", &year, 0);
-                    pRead->GetAttributeOrDefault("month", &month, 0);
-                    pRead->GetAttributeOrDefault("day", &day, 0);
-                    if (year != 0 || month != 0 || day != 0) {
-                        if (year == 0 && month == 0) {
-                            date->tm_mday += day;
-                        }
-                        else {
-                            if (year >= 1900)
-                                year -= 1900;
-                            if (month > 0)
-                                date->tm_mon = month-1;
-                            if (year > 0)
-                                date->tm_year = year;
-                            date->tm_mday = day;
-                        }
-                        ts = mktime(date);
-                        pRead->SetAttribute("year", date->tm_year+1900);
-                        pRead->SetAttribute("month", date->tm_mon+1);
-                        pRead->SetAttribute("day", date->tm_mday);
-                    }
+                    bool isException = Services::instance()->getExceptionDays()->isException(ts);
+                    ticpp::Element exceptionday("exception-day");
+                    exceptionday.SetText(isException ? "true" : "false");
+                    pRead->LinkEndChild(&exceptionday);
 
-                    SolarInfo info(date);
-                    ticpp::Element* pConfig = pRead->FirstChildElement(false);
-                    if (pConfig == 0)
-                    {
-                        bool isException = Services::instance()->getExceptionDays()->isException(ts);
-                        ticpp::Element exceptionday("exception-day");
-                        exceptionday.SetText(isException ? "true" : "false");
-                        pRead->LinkEndChild(&exceptionday);
-
-                        if (info.getSunrise(&m, &h)) {
-                            ticpp::Element sunrise("sunrise");
-                            sunrise.SetAttribute("hour", h);
-                            sunrise.SetAttribute("min", m);
-                            pRead->LinkEndChild(&sunrise);
-                        }
-                        if (info.getSunset(&m, &h)) {
-                            ticpp::Element sunset("sunset");
-                            sunset.SetAttribute("hour", h);
-                            sunset.SetAttribute("min", m);
-                            pRead->LinkEndChild(&sunset);
-                        }
-                        if (info.getNoon(&m, &h)) {
-                            ticpp::Element noon("noon");
-                            noon.SetAttribute("hour", h);
-                            noon.SetAttribute("min", m);
-                            pRead->LinkEndChild(&noon);
-                        }
-                    }
-                    else if (pConfig->Value() == "exception-day")
-                    {
-                        bool isException = Services::instance()->getExceptionDays()->isException(ts);
-                        pConfig->SetText(isException ? "true" : "false");
-                    }
-                    else if (pConfig->Value() == "sunrise")
-                    {
-                        if (!info.getSunrise(&m, &h))
-                            throw "Error while calculating sunrise";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getSunrise(&m, &h)) {
+                        ticpp::Element sunrise("sunrise");
+                        sunrise.SetAttribute("hour", h);
+                        sunrise.SetAttribute("min", m);
+                        pRead->LinkEndChild(&sunrise);
                     }
-                    else if (pConfig->Value() == "sunset")
-                    {
-                        if (!info.getSunset(&m, &h))
-                            throw "Error while calculating sunset";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getSunset(&m, &h)) {
+                        ticpp::Element sunset("sunset");
+                        sunset.SetAttribute("hour", h);
+                        sunset.SetAttribute("min", m);
+                        pRead->LinkEndChild(&sunset);
                     }
-                    else if (pConfig->Value() == "noon")
-                    {
-                        if (!info.getNoon(&m, &h))
-                            throw "Error while calculating solar noon";
-                        pConfig->SetAttribute("hour", h);
-                        pConfig->SetAttribute("min", m);
+                    if (info.getNoon(&m, &h)) {
+                        ticpp::Element noon("noon");
+                        noon.SetAttribute("hour", h);
+                        noon.SetAttribute("min", m);
+                        pRead->LinkEndChild(&noon);
                     }
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
                 }
-                else if (pRead->Value() == "version")
+                else if (pConfig->Value() == "exception-day")
+                {
+                    bool isException = Services::instance()->getExceptionDays()->isException(ts);
+                    pConfig->SetText(isException ? "true" : "false");
+                }
+                else if (pConfig->Value() == "sunrise")
+                {
+                    if (!info.getSunrise(&m, &h))
+                        throw "Error while calculating sunrise";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                else if (pConfig->Value() == "sunset")
                 {
-                    ticpp::Element value("value");
-                    value.SetText(VERSION);
-                    pRead->LinkEndChild(&value);
+                    if (!info.getSunset(&m, &h))
+                        throw "Error while calculating sunset";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                else if (pConfig->Value() == "noon")
+                {
+                    if (!info.getNoon(&m, &h))
+                        throw "Error while calculating solar noon";
+                    pConfig->SetAttribute("hour", h);
+                    pConfig->SetAttribute("min", m);
+                }
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
+            }
+            else if (pRead->Value() == "version")
+            {
+                ticpp::Element value("value");
+                value.SetText(VERSION);
+                pRead->LinkEndChild(&value);
 
-                    ticpp::Element features("features");
+                ticpp::Element features("features");
 #ifdef HAVE_LIBCURL
-                    ticpp::Element sms("sms");
-                    features.LinkEndChild(&sms);
+                ticpp::Element sms("sms");
+                features.LinkEndChild(&sms);
 #endif
 #ifdef HAVE_LIBESMTP
-                    ticpp::Element email("e-mail");
-                    features.LinkEndChild(&email);
+                ticpp::Element email("e-mail");
+                features.LinkEndChild(&email);
 #endif
 #ifdef HAVE_MYSQL
-                    ticpp::Element mysql("mysql");
-                    features.LinkEndChild(&mysql);
+                ticpp::Element mysql("mysql");
+                features.LinkEndChild(&mysql);
+#endif
+#ifdef HAVE_SQLITE
+                ticpp::Element sqlite("sqlite");
+                features.LinkEndChild(&sqlite);
 #endif
 #ifdef HAVE_LUA
-                    ticpp::Element lua("lua");
-                    features.LinkEndChild(&lua);
+                ticpp::Element lua("lua");
+                features.LinkEndChild(&lua);
 #endif
 #ifdef HAVE_LOG4CPP
-                    ticpp::Element log4cpp("log4cpp");
-                    features.LinkEndChild(&log4cpp);
+                ticpp::Element log4cpp("log4cpp");
+                features.LinkEndChild(&log4cpp);
 #endif
 
-                    pRead->LinkEndChild(&features);
+                pRead->LinkEndChild(&features);
 
-                    pMsg->SetAttribute("status", "success");
-                    sendmessage (doc.GetAsString(), stop);
-                }
-                else
-                    throw "Unknown read element";
+                pMsg->SetAttribute("status", "success");
+                sendmessage (doc.GetAsString());
             }
-            else if (msgType == "write")
+            else
+                throw "Unknown read element";
+        }
+        else if (msgType == "write")
+        {
+            ticpp::Iterator< ticpp::Element > pWrite;
+            for ( pWrite = pMsg->FirstChildElement(); pWrite != pWrite.end(); pWrite++ )
             {
-                ticpp::Iterator< ticpp::Element > pWrite;
-                for ( pWrite = pMsg->FirstChildElement(); pWrite != pWrite.end(); pWrite++ )
+                if (pWrite->Value() == "object")
                 {
-                    if (pWrite->Value() == "object")
-                    {
-                        std::string id = pWrite->GetAttribute("id");
-                        Object* obj = ObjectController::instance()->getObject(id);
-                        obj->setValue(pWrite->GetAttribute("value"));
-                        obj->decRefCount();
-                    }
-                    else if (pWrite->Value() == "config")
+                    std::string id = pWrite->GetAttribute("id");
+                    Object* obj = ObjectController::instance()->getObject(id);
+                    obj->setValue(pWrite->GetAttribute("value"));
+                    obj->decRefCount();
+                }
+                else if (pWrite->Value() == "config")
+                {
+                    ticpp::Iterator< ticpp::Element > pConfigItem;
+                    for ( pConfigItem = pWrite->FirstChildElement(); pConfigItem != pConfigItem.end(); pConfigItem++ )
                     {
-                        ticpp::Iterator< ticpp::Element > pConfigItem;
-                        for ( pConfigItem = pWrite->FirstChildElement(); pConfigItem != pConfigItem.end(); pConfigItem++ )
-                        {
-                            if (pConfigItem->Value() == "objects")
-                                ObjectController::instance()->importXml(&(*pConfigItem));
-                            else if (pConfigItem->Value() == "rules")
-                                RuleServer::instance()->importXml(&(*pConfigItem));
-                            else if (pConfigItem->Value() == "services")
-                                Services::instance()->importXml(&(*pConfigItem));
-                            else if (pConfigItem->Value() == "logging")
-                                Logging::instance()->importXml(&(*pConfigItem));
-                            else
-                                throw "Unknown config element";
-                        }
+                        if (pConfigItem->Value() == "objects")
+                            ObjectController::instance()->importXml(&(*pConfigItem));
+                        else if (pConfigItem->Value() == "rules")
+                            RuleServer::instance()->importXml(&(*pConfigItem));
+                        else if (pConfigItem->Value() == "services")
+                            Services::instance()->importXml(&(*pConfigItem));
+                        else if (pConfigItem->Value() == "logging")
+                            Logging::instance()->importXml(&(*pConfigItem));
+                        else
+                            throw "Unknown config element";
                     }
-                    else
-                        throw "Unknown write element";
                 }
-                sendmessage ("<write status='success'/>\n", stop);
+                else
+                    throw "Unknown write element";
             }
-            else if (msgType == "execute")
+            sendmessage ("<write status='success'/>\n");
+        }
+        else if (msgType == "execute")
+        {
+            // Everything is checked before anything is executed
+            std::list<Action*> al;
+            std::list<std::pair<Rule*, bool> > rules;
+            std::list<ExecuteWaiter*> cancels;
+            int timeout;
+            try
             {
-                std::list<Action*> al;
-                int timeout;
-                int count = 0;
                 pMsg->GetAttributeOrDefault("timeout", &timeout, 60);
+                if (timeout <= 0)
+                    throw "Invalid timeout. (Must be a positive number of seconds)";
                 ticpp::Iterator< ticpp::Element > pExecute;
                 for ( pExecute = pMsg->FirstChildElement(); pExecute != pExecute.end(); pExecute++ )
                 {
                     if (pExecute->Value() == "action")
-                    {
-                        Action *action = Action::create(&(*pExecute));
-                        action->execute();
-                        al.push_back(action);
-                    }
+                        al.push_back(Action::create(&(*pExecute)));
                     else if (pExecute->Value() == "rule-actions")
                     {
                         std::string id = pExecute->GetAttribute("id");
@@ -479,227 +772,1097 @@ void ClientConnection::Run (pth_sem_t * stop1)
                         Rule* rule = RuleServer::instance()->getRule(id.c_str());
                         if (rule == 0)
                             throw "Unknown rule id";
-                        if (list == "true")
-						{
-							rule->executeActions(ActionList::OnTrue);
-							rule->executeActions(ActionList::IfTrue);
-						}
-                        else if (list == "false")
-						{
-							rule->executeActions(ActionList::OnFalse);
-							rule->executeActions(ActionList::IfFalse);
-						}
-                        else
+                        if (list != "true" && list != "false")
                             throw "Invalid list attribute. (Must be 'true' or 'false')";
+                        rules.push_back(std::make_pair(rule, list == "true"));
+                    }
+                    else if (pExecute->Value() == "cancel")
+                    {
+                        int id;
+                        pExecute->GetAttribute("id", &id);
+                        ExecutionMap_t::iterator it = executions_m.find(id);
+                        if (it == executions_m.end())
+                            throw "Unknown execution id";
+                        cancels.push_back(it->second);
                     }
                     else
                         throw "Unknown execute element";
                 }
-                while (!al.empty()) {
-                    pth_yield(NULL);
-                    if (al.front()->isFinished() || count == timeout) {
-                        delete al.front();
-                        al.pop_front();
-                    }
-                    else {
-                        if (count++ == 0)
-                            sendmessage ("<execute status='ongoing'/>\n", stop);
-                        pth_sleep(1);
-                    }
+            }
+            catch (...)
+            {
+                while (!al.empty())
+                {
+                    delete al.front();
+                    al.pop_front();
+                }
+                throw;
+            }
+            for (std::list<ExecuteWaiter*>::iterator it = cancels.begin(); it != cancels.end(); it++)
+                (*it)->cancel();
+            for (std::list<std::pair<Rule*, bool> >::iterator it = rules.begin(); it != rules.end(); it++)
+            {
+                if (it->second)
+                {
+                    it->first->executeActions(ActionList::OnTrue);
+                    it->first->executeActions(ActionList::IfTrue);
                 }
-
-                if (count == timeout)
-                    sendmessage ("<execute status='timeout'/>\n", stop);
                 else
-                    sendmessage ("<execute status='success'/>\n", stop);
+                {
+                    it->first->executeActions(ActionList::OnFalse);
+                    it->first->executeActions(ActionList::IfFalse);
+                }
+            }
+            if (!al.empty())
+            {
+                // The final status is sent by the waiter once the actions
+                // are done, the next requests are handled meanwhile
+                ExecuteWaiter *waiter = new ExecuteWaiter(this, ++lastRequestId_m, al, timeout);
+                executions_m[waiter->getId()] = waiter;
+                waiter->Start();
+                std::stringstream msg;
+                msg << "<execute status='ongoing' id='" << waiter->getId() << "'/>" << std::endl;
+                sendmessage (msg.str());
             }
-            else if (msgType == "admin")
+            else
+                sendmessage ("<execute status='success'/>\n");
+        }
+        else if (msgType == "admin")
+        {
+            int saveId = 0;
+            ticpp::Iterator< ticpp::Element > pAdmin;
+            for ( pAdmin = pMsg->FirstChildElement(); pAdmin != pAdmin.end(); pAdmin++ )
             {
-                ticpp::Iterator< ticpp::Element > pAdmin;
-                for ( pAdmin = pMsg->FirstChildElement(); pAdmin != pAdmin.end(); pAdmin++ )
+                if (pAdmin->Value() == "save")
                 {
-                    if (pAdmin->Value() == "save")
+                    std::string filename = pAdmin->GetAttribute("file");
+                    if (filename == "")
+                        filename = Services::instance()->getConfigFile();
+                    if (filename == "")
+                        throw "No file to write config to";
+                    try
                     {
-                        std::string filename = pAdmin->GetAttribute("file");
-                        if (filename == "")
-                            filename = Services::instance()->getConfigFile();
-                        if (filename == "")
-                            throw "No file to write config to";
-                        try
-                        {
-                            // Save a document
-                            ticpp::Document doc;
-                            ticpp::Declaration decl("1.0", "", "");
-                            doc.LinkEndChild(&decl);
-                    
-                            ticpp::Element pConfig("config");
-                    
-                            ticpp::Element pServices("services");
-                            Services::instance()->exportXml(&pServices);
-                            pConfig.LinkEndChild(&pServices);
-                            ticpp::Element pObjects("objects");
-                            ObjectController::instance()->exportXml(&pObjects);
-                            pConfig.LinkEndChild(&pObjects);
-                            ticpp::Element pRules("rules");
-                            RuleServer::instance()->exportXml(&pRules);
-                            pConfig.LinkEndChild(&pRules);
-                            ticpp::Element pLogging("logging");
-                            Logging::instance()->exportXml(&pLogging);
-                            pConfig.LinkEndChild(&pLogging);
-                    
-                            doc.LinkEndChild(&pConfig);
-                            doc.SaveFile(filename);
-                        }
-                        catch( ticpp::Exception& ex )
-                        {
-                            // If any function has an error, execution will enter here.
-                            // Report the error
-                            errorStream("ClientConnection") << "Unable to write config to file: " << ex.m_details << endlog;
-                            throw "Error writing config to file";
-                        }
+                        // The reply is sent once the file is written
+                        if (saveId == 0)
+                            saveId = ++lastRequestId_m;
+                        ConfigSaver::instance()->save(filename, this, saveId);
+                        pendingSaves_m[saveId].remaining++;
                     }
-                    else if (pAdmin->Value() == "notification")
+                    catch( ticpp::Exception& ex )
+                    {
+                        // If any function has an error, execution will enter here.
+                        // Report the error
+                        errorStream("ClientConnection") << "Unable to write config to file: " << ex.m_details << endlog;
+                        throw "Error writing config to file";
+                    }
+                }
+                else if (pAdmin->Value() == "notification")
+                {
+                    ticpp::Iterator< ticpp::Element > pObjects;
+                    for ( pObjects = pAdmin->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
                     {
-                        ticpp::Iterator< ticpp::Element > pObjects;
-                        for ( pObjects = pAdmin->FirstChildElement(); pObjects != pObjects.end(); pObjects++ )
+                        SubscriptionIndex* subscriptions = ObjectController::instance()->getSubscriptions();
+                        if (pObjects->Value() == "register" || pObjects->Value() == "unregister")
                         {
-                            if (pObjects->Value() == "register")
-                            {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                notifyList_m.push_back(obj);
-                                obj->addChangeListener(this);
-                            }
-                            else if (pObjects->Value() == "unregister")
+                            SubscriptionFilter filter;
+                            filter.importXml(&(*pObjects));
+                            if (filter == SubscriptionFilter())
+                                throw "No subscription filter";
+                            if (filter.getId() != "")
                             {
-                                std::string id = pObjects->GetAttribute("id");
-                                Object* obj = ObjectController::instance()->getObject(id);
-                                notifyList_m.remove(obj);
-                                obj->decRefCount();
-                                obj->removeChangeListener(this);
-                                obj->decRefCount();
-                            }
-                            else if (pObjects->Value() == "registerall" || pObjects->Value() == "unregisterall")
-                            {
-                                NotifyList_t::iterator it;
-                                for (it=notifyList_m.begin(); it != notifyList_m.end(); it++)
-                                {
-                                    (*it)->removeChangeListener(this);
-                                    (*it)->decRefCount();
-                                }
-                                notifyList_m.clear();
-
-                                if (pObjects->Value() == "registerall") 
-                                {
-                                    std::list<Object*> objList = ObjectController::instance()->getObjects();
-                                    std::list<Object*>::iterator it;
-                                    for (it=objList.begin(); it != objList.end(); it++)
-                                    {
-                                        notifyList_m.push_back((*it));
-                                        (*it)->addChangeListener(this);
-                                    }
-                                }
+                                // Fails if the object does not exist
+                                ObjectController::instance()->getObject(filter.getId())->decRefCount();
                             }
+                            if (pObjects->Value() == "register")
+                                subscriptions->subscribe(this, filter);
                             else
-                                throw "Unknown objects element";
+                                subscriptions->unsubscribe(this, filter);
+                        }
+                        else if (pObjects->Value() == "registerall" || pObjects->Value() == "unregisterall")
+                        {
+                            subscriptions->unsubscribeAll(this);
+                            if (pObjects->Value() == "registerall")
+                                subscriptions->subscribe(this, SubscriptionFilter());
                         }
+                        else
+                            throw "Unknown objects element";
                     }
-                    else
-                        throw "Unknown admin element";
                 }
-                sendmessage ("<admin status='success'/>\n", stop);
+                else
+                    throw "Unknown admin element";
+            }
+            if (saveId != 0)
+            {
+                std::stringstream msg;
+                msg << "<admin status='ongoing' id='" << saveId << "'/>" << std::endl;
+                sendmessage (msg.str());
             }
             else
-                throw "Unknown element";
+                sendmessage ("<admin status='success'/>\n");
         }
-        catch( const char* ex )
+        else
+            throw "Unknown element";
+    }
+    catch( const char* ex )
+    {
+        sendreject (ex, msgType);
+    }
+    catch( ticpp::Exception& ex )
+    {
+        sendreject (ex.m_details.c_str(), msgType);
+    }
+}
+
+bool ClientConnection::handleFastMessage (std::string& msgType)
+{
+    XmlTokenizer tokenizer(msg_m);
+    if (tokenizer.next() != XmlTokenizer::StartTag || tokenizer.getAttributeCount() != 0)
+        return false;
+    if (tokenizer.getName() == "read")
+        return handleFastRead (tokenizer, msgType);
+    else if (tokenizer.getName() == "write")
+        return handleFastWrite (tokenizer, msgType);
+    return false;
+}
+
+bool ClientConnection::handleFastRead (XmlTokenizer& tokenizer, std::string& msgType)
+{
+    XmlTokenizer::Slice id;
+    if (tokenizer.next() != XmlTokenizer::StartTag)
+        return false;
+    if (tokenizer.getName() == "object")
+    {
+        // <read><object id="..."/></read>
+        if (tokenizer.getAttributeCount() != 1 || !tokenizer.getAttribute("id", &id) ||
+                tokenizer.next() != XmlTokenizer::EndTag || tokenizer.next() != XmlTokenizer::EndTag ||
+                tokenizer.next() != XmlTokenizer::End)
+            return false;
+        msgType = "read";
+        Object* obj = ObjectController::instance()->getObject(id.str());
+        std::string value = obj->getValue();
+        obj->decRefCount();
+        std::string& reply = beginReply ();
+        reply.append("<read status='success'>").append(value).append("</read>\n");
+        endReply ();
+        return true;
+    }
+    if (!(tokenizer.getName() == "objects"))
+        return false;
+    if (tokenizer.getAttribute("since", &id))
+    {
+        XmlTokenizer::Slice epoch;
+        if (tokenizer.getAttributeCount() == 1)
+            return handleFastDelta (tokenizer, id, 0, msgType);
+        if (tokenizer.getAttributeCount() == 2 && tokenizer.getAttribute("epoch", &epoch))
+            return handleFastDelta (tokenizer, id, &epoch, msgType);
+        return false;
+    }
+    if (tokenizer.getAttributeCount() != 0)
+        return false;
+
+    // <read><objects><object id="..."/>...</objects></read>
+    std::vector<XmlTokenizer::Slice> ids;
+    XmlTokenizer::Token token;
+    while ((token = tokenizer.next()) == XmlTokenizer::StartTag)
+    {
+        if (!(tokenizer.getName() == "object") || tokenizer.getAttributeCount() != 1 ||
+                !tokenizer.getAttribute("id", &id) || tokenizer.next() != XmlTokenizer::EndTag)
+            return false;
+        ids.push_back(id);
+    }
+    if (token != XmlTokenizer::EndTag || tokenizer.next() != XmlTokenizer::EndTag ||
+            tokenizer.next() != XmlTokenizer::End)
+        return false;
+
+    std::vector<Object*> objects;
+    if (ids.empty())
+    {
+        std::list<Object*> all = ObjectController::instance()->getObjects();
+        objects.assign(all.begin(), all.end());
+    }
+    else
+    {
+        objects.reserve(ids.size());
+        try
         {
-            sendreject (ex, msgType, stop);
+            for (std::vector<XmlTokenizer::Slice>::iterator it = ids.begin(); it != ids.end(); it++)
+                objects.push_back(ObjectController::instance()->getObject(it->str()));
         }
-        catch( ticpp::Exception& ex )
+        catch (...)
         {
-            sendreject (ex.m_details.c_str(), msgType, stop);
+            for (std::vector<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+                (*it)->decRefCount();
+            msgType = "read";
+            throw;
         }
     }
-    pth_event_free (stop, PTH_FREE_THIS);
-    StopDelete ();
+    // TinyXML prints an empty <objects/> differently, leave it to the DOM
+    if (objects.empty())
+        return false;
+
+    msgType = "read";
+    std::string& reply = beginReply ();
+    reply.append("<read status=\"success\">\n\t<objects>\n");
+    for (std::vector<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+    {
+        appendObjectValue (reply, *it);
+        (*it)->decRefCount();
+    }
+    reply.append("\t</objects>\n</read>\n");
+    endReply ();
+    return true;
+}
+
+bool ClientConnection::parseSeq (const XmlTokenizer::Slice& value, uint64_t* seq)
+{
+    if (value.size == 0 || value.size > 19)
+        return false;
+    *seq = 0;
+    for (std::string::size_type i = 0; i < value.size; i++)
+    {
+        if (value.data[i] < '0' || value.data[i] > '9')
+            return false;
+        *seq = *seq * 10 + (value.data[i] - '0');
+    }
+    return true;
+}
+
+bool ClientConnection::handleFastDelta (XmlTokenizer& tokenizer, const XmlTokenizer::Slice& since,
+                                        const XmlTokenizer::Slice* epoch, std::string& msgType)
+{
+    // <read><objects since="..." [epoch="..."]/></read>
+    if (tokenizer.next() != XmlTokenizer::EndTag || tokenizer.next() != XmlTokenizer::EndTag ||
+            tokenizer.next() != XmlTokenizer::End)
+        return false;
+    ObjectController* controller = ObjectController::instance();
+    uint64_t seq, epochValue = controller->getEpoch();
+    // Anything but a plain number is left to the DOM path and its errors
+    if (!parseSeq(since, &seq) || (epoch && !parseSeq(*epoch, &epochValue)))
+        return false;
+
+    msgType = "read";
+    std::vector<Object*> objects;
+    std::vector<std::string> deleted;
+    bool full;
+    std::stringstream current, currentEpoch;
+    current << controller->getChangedObjects(seq, epochValue, objects, deleted, full);
+    currentEpoch << controller->getEpoch();
+    std::string& reply = beginReply ();
+    reply.append("<read status=\"success\">\n\t<objects ");
+    appendAttribute (reply, "since", since.str());
+    reply.push_back(' ');
+    appendAttribute (reply, "seq", current.str());
+    reply.push_back(' ');
+    appendAttribute (reply, "epoch", currentEpoch.str());
+    if (full)
+        reply.append(" full=\"true\"");
+    if (objects.empty() && deleted.empty())
+        reply.append(" />\n</read>\n");
+    else
+    {
+        reply.append(">\n");
+        for (std::vector<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+            appendObjectValue (reply, *it);
+        for (std::vector<std::string>::iterator it = deleted.begin(); it != deleted.end(); it++)
+        {
+            reply.append("\t\t<object ");
+            appendAttribute (reply, "id", *it);
+            reply.append(" deleted=\"true\" />\n");
+        }
+        reply.append("\t</objects>\n</read>\n");
+    }
+    endReply ();
+    return true;
+}
+
+void ClientConnection::appendObjectValue (std::string& out, Object* object)
+{
+    out.append("\t\t<object ");
+    appendAttribute (out, "id", object->getID());
+    out.push_back(' ');
+    appendAttribute (out, "value", object->getValue());
+    out.append(" />\n");
+}
+
+void ClientConnection::releaseWrites (std::vector<Object*>& objects, std::vector<ObjectValue*>& values)
+{
+    for (unsigned i = 0; i < values.size(); i++)
+        delete values[i];
+    for (unsigned i = 0; i < objects.size(); i++)
+        objects[i]->decRefCount();
 }
 
-int ClientConnection::sendreject (const char* msgstr, const std::string& type, pth_event_t stop)
+bool ClientConnection::handleFastWrite (XmlTokenizer& tokenizer, std::string& msgType)
+{
+    // <write><object id="..." value="..."/>...</write>
+    std::vector<std::pair<XmlTokenizer::Slice, XmlTokenizer::Slice> > writes;
+    XmlTokenizer::Token token;
+    while ((token = tokenizer.next()) == XmlTokenizer::StartTag)
+    {
+        XmlTokenizer::Slice id, value;
+        if (!(tokenizer.getName() == "object") || tokenizer.getAttributeCount() != 2 ||
+                !tokenizer.getAttribute("id", &id) || !tokenizer.getAttribute("value", &value) ||
+                tokenizer.next() != XmlTokenizer::EndTag)
+            return false;
+        writes.push_back(std::make_pair(id, value));
+    }
+    if (token != XmlTokenizer::EndTag || tokenizer.next() != XmlTokenizer::End || writes.empty())
+        return false;
+
+    // The request is checked entirely before the first write, falling
+    // back to the DOM path after a partial update would apply it twice.
+    // Likewise, all objects are resolved and all values parsed before any
+    // of them is set, an error leaves every object unchanged.
+    msgType = "write";
+    std::vector<Object*> objects;
+    std::vector<ObjectValue*> values;
+    try
+    {
+        for (unsigned i = 0; i < writes.size(); i++)
+        {
+            objects.push_back(ObjectController::instance()->getObject(writes[i].first.str()));
+            values.push_back(objects.back()->createObjectValue(writes[i].second.str()));
+        }
+        for (unsigned i = 0; i < writes.size(); i++)
+            objects[i]->setValue(values[i]);
+    }
+    catch (...)
+    {
+        releaseWrites(objects, values);
+        throw;
+    }
+    releaseWrites(objects, values);
+    std::string& reply = beginReply ();
+    reply.append("<write status='success'/>\n");
+    endReply ();
+    return true;
+}
+
+std::string& ClientConnection::beginReply ()
+{
+    if (outStart_m >= outbuf_m.size())
+    {
+        outbuf_m.clear();
+        outStart_m = 0;
+    }
+    return outbuf_m;
+}
+
+void ClientConnection::endReply ()
+{
+    outbuf_m.push_back('\4');
+    flush ();
+}
+
+void ClientConnection::appendAttribute (std::string& out, const char* name, const std::string& value)
+{
+    // Same escaping as TiXmlBase::PutString
+    char quote = (value.find('"') == std::string::npos) ? '"' : '\'';
+    out.append(name).push_back('=');
+    out.push_back(quote);
+    std::string::size_type i = 0;
+    while (i < value.size())
+    {
+        unsigned char c = value[i];
+        if (c == '&' && i + 2 < value.size() && value[i+1] == '#' && value[i+2] == 'x')
+        {
+            // Hexadecimal character references are passed through
+            while (i < value.size() - 1)
+            {
+                out.push_back(value[i++]);
+                if (value[i] == ';')
+                    break;
+            }
+            continue;
+        }
+        if (c == '&')
+            out.append("&amp;");
+        else if (c == '<')
+            out.append("&lt;");
+        else if (c == '>')
+            out.append("&gt;");
+        else if (c == '"')
+            out.append("&quot;");
+        else if (c == '\'')
+            out.append("&apos;");
+        else if (c < 32)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "&#x%02X;", (unsigned)c);
+            out.append(buf);
+        }
+        else
+            out.push_back(c);
+        i++;
+    }
+    out.push_back(quote);
+}
+
+int ClientConnection::sendreject (const char* msgstr, const std::string& type)
 {
     std::stringstream msg;
     if (type == "")
         msg << "<error>" << msgstr << "</error>" << std::endl;
     else
         msg << "<" << type << " status='error'>" << msgstr << "</" << type << ">" << std::endl;
-    return sendmessage (msg.str(), stop);
+    return sendmessage (msg.str());
 }
 
-int ClientConnection::sendmessage (std::string msg, pth_event_t stop)
+int ClientConnection::sendmessage (std::string msg)
 {
-    msg.push_back('\4');
-    return sendmessage(msg.length(), msg.c_str(), stop);
+    if (error_m || closing_m)
+        return -1;
+    outbuf_m.append(msg);
+    outbuf_m.push_back('\4');
+    flush ();
+    return error_m ? -1 : 0;
 }
 
-int ClientConnection::sendmessage (int size, const char * msg, pth_event_t stop)
+int ClientConnection::readmessage ()
 {
-    int i;
-    int start = 0;
-
-    start = 0;
-    while (start < size)
+    char buf[4096];
+    while (true)
     {
-        i = pth_write_ev (fd_m, msg + start, size - start, stop);
-        if (i <= 0)
+        int ret = extractMessage ();
+        if (ret == 1)
+        {
+            if (inStart_m == inbuf_m.size())
+            {
+                inbuf_m.clear();
+                inStart_m = scanned_m = 0;
+            }
+            return 1;
+        }
+        if (ret == -1)
+        {
+            warnStream("ClientConnection") << "Invalid message received, closing connection" << endlog;
+            error_m = true;
             return -1;
-        start += i;
+        }
+        if (eof_m)
+            return -1;
+
+        ssize_t i = read (fd_m, buf, sizeof(buf));
+        if (i > 0)
+        {
+            if (inStart_m > 0)
+            {
+                inbuf_m.erase(0, inStart_m);
+                scanned_m -= inStart_m;
+                inStart_m = 0;
+            }
+            inbuf_m.append(buf, i);
+        }
+        else if (i == -1 && errno == EINTR)
+            continue;
+        else if (i == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else
+        {
+            if (i == -1)
+                error_m = true;
+            eof_m = true;
+            return -1;
+        }
     }
-    return 0;
 }
 
-int ClientConnection::readmessage (pth_event_t stop)
+int ClientConnection::extractMessage ()
 {
-    char buf[256];
-    int i;
-    std::stringstream msg;
+    // Only the bytes received since the last call are scanned
+    std::string::size_type len = inbuf_m.find('\004', scanned_m);
+    if (std::string::npos == len)
+    {
+        scanned_m = inbuf_m.size();
+        return 0;
+    }
+    msg_m.assign(inbuf_m, inStart_m, len - inStart_m);
+    inStart_m = scanned_m = len + 1;
+    return 1;
+}
+
+void ClientConnection::onChange(Object* object)
+{
+    queueNotification (object->getID(), object->getValue());
+}
 
-    if (msgbuf_m.size() > 0)
+void ClientConnection::queueNotification (const char* id, const std::string& value)
+{
+    if (error_m || overflow_m || closing_m)
+        return;
+    int maxQueued = server_m ? server_m->getMaxQueued() : XmlServer::DefaultMaxQueued;
+    XmlServer::OverflowPolicy policy = server_m ? server_m->getOverflowPolicy() : XmlServer::Coalesce;
+    if ((int)notifications_m.size() >= maxQueued)
     {
-        // we have already some data in the message buffer
-        std::string::size_type len = msgbuf_m.find_first_of('\004');
-        if (std::string::npos != len)
+        if (policy == XmlServer::Disconnect)
         {
-            // Complete message in the buffer
-            msg_m = msgbuf_m.substr(0, len);
-            msgbuf_m.erase(0, len+1);
-            return 1;
+            warnStream("ClientConnection") << "Notification queue full, disconnecting client" << endlog;
+            overflow_m = true;
+            updateWatch ();
+            return;
+        }
+        if (policy == XmlServer::Coalesce)
+            coalesceNotifications ();
+        if ((int)notifications_m.size() >= maxQueued)
+        {
+            popNotification ();
+            dropped_m++;
         }
-        msg << msgbuf_m;
     }
 
-    while ((i = pth_read_ev (fd_m, &buf, 256, stop)) > 0)
+    Notification notification;
+    notification.id = id;
+    notification.value = value;
+    notification.queuedAt = Clock::nowMs();
+    notifications_m.push_back(notification);
+    pendingCount_m[notification.id]++;
+    if ((int)notifications_m.size() > maxQueueLength_m)
+        maxQueueLength_m = notifications_m.size();
+    // The server loop sends it once the socket is writable
+    updateWatch ();
+}
+
+void ClientConnection::popNotification ()
+{
+    PendingCountMap_t::iterator count = pendingCount_m.find(notifications_m.front().id);
+    if (--count->second == 0)
+        pendingCount_m.erase(count);
+    notifications_m.pop_front();
+}
+
+void ClientConnection::coalesceNotifications ()
+{
+    // Nothing to gain if every notification is for a different object
+    if (pendingCount_m.size() == notifications_m.size())
+        return;
+    // Keep the last notification of each object, with the time its first
+    // one was queued so that the lag stays visible
+    HashMap<std::string, int64_t> firstQueued;
+    NotificationQueue_t latest;
+    NotificationQueue_t::iterator it;
+    for (it = notifications_m.begin(); it != notifications_m.end(); it++)
     {
-        std::string tstr(buf, i);
-        std::string::size_type len = tstr.find_first_of('\004');
-        if (std::string::npos != len)
+        if (firstQueued.find(it->id) == firstQueued.end())
+            firstQueued[it->id] = it->queuedAt;
+        PendingCountMap_t::iterator count = pendingCount_m.find(it->id);
+        if (--count->second > 0)
         {
-            // Complete message in the buffer
-            msg << tstr.substr(0, len);
-            msg_m = msg.str();
-            msgbuf_m = tstr.substr(len+1);
-            return 1;
+            coalesced_m++;
+            continue;
         }
-        msg << tstr;
+        count->second = 1;
+        latest.push_back(*it);
+        latest.back().queuedAt = firstQueued[it->id];
     }
+    notifications_m.swap(latest);
+}
 
-    return -1;
+void ClientConnection::drainNotifications ()
+{
+    outbuf_m.clear();
+    outStart_m = 0;
+    int64_t now = Clock::nowMs();
+    while (!notifications_m.empty() && outbuf_m.size() < MaxDrainSize)
+    {
+        Notification& notification = notifications_m.front();
+        appendNotification (outbuf_m, notification);
+        if (now - notification.queuedAt > maxLag_m)
+            maxLag_m = now - notification.queuedAt;
+        sent_m++;
+        popNotification ();
+    }
 }
 
-void ClientConnection::onChange(Object* object)
+void ClientConnection::appendNotification (std::string& out, const Notification& notification)
 {
-//    sendmessage ("<notify id=status='success'/>\n", stop);
-    std::stringstream msg;
-    msg << "<notify id='" << object->getID() << "'>" << object->getValue() << "</notify>" << std::endl;
-    sendmessage (msg.str(), NULL);
+    out.append("<notify id='").append(notification.id).append("'>");
+    out.append(notification.value).append("</notify>\n\004");
+}
+
+void ClientConnection::statusXml(ticpp::Element* pStatus)
+{
+    int64_t lag = notifications_m.empty() ? 0 : Clock::nowMs() - notifications_m.front().queuedAt;
+    pStatus->SetAttribute("fd", fd_m);
+    pStatus->SetAttribute("queued", notifications_m.size());
+    pStatus->SetAttribute("max-queued", maxQueueLength_m);
+    pStatus->SetAttribute("sent", sent_m);
+    pStatus->SetAttribute("dropped", dropped_m);
+    pStatus->SetAttribute("coalesced", coalesced_m);
+    pStatus->SetAttribute("lag-ms", lag);
+    pStatus->SetAttribute("max-lag-ms", maxLag_m);
+    pStatus->SetAttribute("pending-bytes", outbuf_m.size() - outStart_m);
+    pStatus->SetAttribute("executions", executions_m.size());
+}
+
+BinaryConnection::BinaryConnection (XmlServer *server, int fd) : ClientConnection(server, fd)
+{}
+
+BinaryConnection::~BinaryConnection ()
+{
+    ObjectController::instance()->getSubscriptions()->unsubscribeAll(this);
+    std::vector<Handle>::iterator it;
+    for (it = handles_m.begin(); it != handles_m.end(); it++)
+        it->object->decRefCount();
+}
+
+int BinaryConnection::extractMessage ()
+{
+    int ret = BinaryReader::extractFrame(inbuf_m, &inStart_m, msg_m);
+    scanned_m = (ret == 1) ? inStart_m : inbuf_m.size();
+    return ret;
+}
+
+void BinaryConnection::handleMessage ()
+{
+    BinaryReader reader(msg_m.data(), msg_m.size());
+    uint8_t opcode = reader.getInt(1);
+    uint32_t tag = reader.getInt(4);
+    std::string& out = beginReply ();
+    std::string::size_type start = out.size();
+    BinaryWriter writer(out);
+    std::string error;
+    try
+    {
+        writer.beginFrame(opcode | BinaryProtocol::Reply, tag);
+        switch (opcode)
+        {
+        case BinaryProtocol::Resolve:
+            resolve (reader, writer);
+            break;
+        case BinaryProtocol::Read:
+            readValues (reader, writer);
+            break;
+        case BinaryProtocol::Write:
+            writeValues (reader);
+            break;
+        case BinaryProtocol::Subscribe:
+        case BinaryProtocol::Unsubscribe:
+            subscribe (reader, opcode == BinaryProtocol::Subscribe);
+            break;
+        default:
+            throw "Unknown opcode";
+        }
+        writer.endFrame();
+    }
+    catch( const char* ex )
+    {
+        error = ex;
+    }
+    catch( ticpp::Exception& ex )
+    {
+        error = ex.m_details;
+    }
+    if (error != "")
+    {
+        out.resize(start);
+        writer.beginFrame(BinaryProtocol::Error, tag);
+        writer.putString(error);
+        writer.endFrame();
+    }
+    flush ();
 }
 
+void BinaryConnection::checkEnd (BinaryReader& reader)
+{
+    if (reader.hasError() || !reader.atEnd())
+        throw "Malformed request";
+}
+
+void BinaryConnection::readHandles (BinaryReader& reader, std::vector<uint32_t>& handles)
+{
+    int count = reader.getInt(2);
+    handles.reserve(count);
+    for (int i = 0; i < count; i++)
+        handles.push_back(reader.getInt(4));
+    checkEnd (reader);
+    for (std::vector<uint32_t>::iterator it = handles.begin(); it != handles.end(); it++)
+    {
+        if (*it == 0 || *it > handles_m.size())
+            throw "Unknown handle";
+    }
+}
+
+void BinaryConnection::resolve (BinaryReader& reader, BinaryWriter& writer)
+{
+    int count = reader.getInt(2);
+    std::vector<std::string> ids;
+    ids.reserve(count);
+    for (int i = 0; i < count; i++)
+        ids.push_back(reader.getString());
+    checkEnd (reader);
+
+    writer.putInt(count, 2);
+    for (std::vector<std::string>::iterator it = ids.begin(); it != ids.end(); it++)
+    {
+        HandleMap_t::iterator found = handleIds_m.find(*it);
+        if (found == handleIds_m.end())
+        {
+            Handle handle;
+            try
+            {
+                handle.object = ObjectController::instance()->getObject(*it);
+            }
+            catch( ticpp::Exception& )
+            {
+                writer.putInt(0, 4);
+                writer.putInt(BinaryValue::String, 1);
+                continue;
+            }
+            handle.kind = getKind (handle.object);
+            handle.subscription = 0;
+            handles_m.push_back(handle);
+            found = handleIds_m.insert(std::make_pair(*it, (uint32_t)handles_m.size())).first;
+        }
+        writer.putInt(found->second, 4);
+        writer.putInt(getType (handles_m[found->second - 1].kind), 1);
+    }
+}
+
+void BinaryConnection::readValues (BinaryReader& reader, BinaryWriter& writer)
+{
+    std::vector<uint32_t> handles;
+    readHandles (reader, handles);
+    writer.putInt(handles.size(), 2);
+    for (std::vector<uint32_t>::iterator it = handles.begin(); it != handles.end(); it++)
+        writer.putValue(getValue (handles_m[*it - 1]));
+}
+
+void BinaryConnection::writeValues (BinaryReader& reader)
+{
+    int count = reader.getInt(2);
+    std::vector<std::pair<uint32_t, BinaryValue> > writes;
+    writes.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t handle = reader.getInt(4);
+        writes.push_back(std::make_pair(handle, reader.getValue()));
+    }
+    checkEnd (reader);
+    // Only the parsing of string values may fail once the first value
+    // is written
+    for (int i = 0; i < count; i++)
+    {
+        if (writes[i].first == 0 || writes[i].first > handles_m.size())
+            throw "Unknown handle";
+        checkValue (handles_m[writes[i].first - 1], writes[i].second);
+    }
+    for (int i = 0; i < count; i++)
+        setValue (handles_m[writes[i].first - 1], writes[i].second);
+}
+
+void BinaryConnection::subscribe (BinaryReader& reader, bool subscribed)
+{
+    std::vector<uint32_t> handles;
+    readHandles (reader, handles);
+    for (std::vector<uint32_t>::iterator it = handles.begin(); it != handles.end(); it++)
+    {
+        Handle& handle = handles_m[*it - 1];
+        if ((handle.subscription != 0) == subscribed)
+            continue;
+        SubscriptionIndex* subscriptions = ObjectController::instance()->getSubscriptions();
+        if (subscribed)
+        {
+            SubscriptionFilter filter;
+            filter.setId(handle.object->getID());
+            handle.subscription = subscriptions->subscribe(this, filter);
+        }
+        else
+        {
+            subscriptions->unsubscribe(handle.subscription);
+            handle.subscription = 0;
+        }
+    }
+}
+
+void BinaryConnection::onChange(Object* object)
+{
+    HandleMap_t::iterator it = handleIds_m.find(object->getID());
+    if (it == handleIds_m.end())
+        return;
+    std::string frame;
+    BinaryWriter writer(frame);
+    writer.beginFrame(BinaryProtocol::Change, 0);
+    writer.putInt(it->second, 4);
+    writer.putValue(getValue (handles_m[it->second - 1]));
+    writer.endFrame();
+    queueNotification (object->getID(), frame);
+}
+
+void BinaryConnection::appendNotification (std::string& out, const Notification& notification)
+{
+    out.append(notification.value);
+}
+
+BinaryConnection::Kind BinaryConnection::getKind (Object* object)
+{
+    if (dynamic_cast<SwitchingObject*>(object))
+        return KindBool;
+    if (dynamic_cast<UIntObject*>(object))
+        return KindUInt;
+    if (dynamic_cast<IntObject*>(object))
+        return KindInt;
+#ifdef STL_STREAM_SUPPORT_INT64
+    if (dynamic_cast<S64Object*>(object))
+        return KindS64;
+#endif
+    if (dynamic_cast<ValueObject*>(object) || dynamic_cast<ValueObject32*>(object))
+        return KindFloat;
+    return KindString;
+}
+
+BinaryValue::Type BinaryConnection::getType (Kind kind)
+{
+    switch (kind)
+    {
+    case KindBool:
+        return BinaryValue::Bool;
+    case KindUInt:
+    case KindInt:
+    case KindS64:
+        return BinaryValue::Int;
+    case KindFloat:
+        return BinaryValue::Float;
+    default:
+        return BinaryValue::String;
+    }
+}
+
+BinaryValue BinaryConnection::getValue (const Handle& handle)
+{
+    switch (handle.kind)
+    {
+    case KindBool:
+        return BinaryValue::fromBool(static_cast<SwitchingObject*>(handle.object)->getBoolValue());
+    case KindUInt:
+        return BinaryValue::fromInt(static_cast<UIntObject*>(handle.object)->getIntValue());
+    case KindInt:
+        return BinaryValue::fromInt(static_cast<IntObject*>(handle.object)->getIntValue());
+#ifdef STL_STREAM_SUPPORT_INT64
+    case KindS64:
+        return BinaryValue::fromInt(static_cast<S64Object*>(handle.object)->getIntValue());
+#endif
+    case KindFloat:
+        return BinaryValue::fromFloat(handle.object->getFloatValue());
+    default:
+        return BinaryValue::fromString(handle.object->getValue());
+    }
+}
+
+void BinaryConnection::checkValue (const Handle& handle, const BinaryValue& value)
+{
+    // Strings are parsed as in the XML protocol, whatever the object
+    if (value.type == BinaryValue::String)
+        return;
+    if (value.type != getType (handle.kind) && !(handle.kind == KindFloat && value.type == BinaryValue::Int))
+        throw "Value type does not match object";
+    if (handle.kind == KindUInt && (value.intValue < 0 || value.intValue > 0xffffffffLL))
+        throw "Value out of range";
+    if (handle.kind == KindInt && (value.intValue < -2147483648LL || value.intValue > 2147483647LL))
+        throw "Value out of range";
+}
+
+void BinaryConnection::setValue (const Handle& handle, const BinaryValue& value)
+{
+    if (value.type == BinaryValue::String)
+    {
+        handle.object->setValue(value.stringValue);
+        return;
+    }
+    switch (handle.kind)
+    {
+    case KindBool:
+        static_cast<SwitchingObject*>(handle.object)->setBoolValue(value.boolValue);
+        break;
+    case KindUInt:
+        static_cast<UIntObject*>(handle.object)->setIntValue(value.intValue);
+        break;
+    case KindInt:
+        static_cast<IntObject*>(handle.object)->setIntValue(value.intValue);
+        break;
+#ifdef STL_STREAM_SUPPORT_INT64
+    case KindS64:
+        static_cast<S64Object*>(handle.object)->setIntValue(value.intValue);
+        break;
+#endif
+    default:
+        handle.object->setFloatValue(value.type == BinaryValue::Int ? (double)value.intValue : value.floatValue);
+        break;
+    }
+}
+
+XmlTokenizer::XmlTokenizer (const std::string& msg)
+    : pos_m(msg.data()), end_m(msg.data() + msg.size()), pendingEnd_m(false), attrCount_m(0), depth_m(0)
+{
+    name_m.data = pos_m;
+    name_m.size = 0;
+}
+
+void XmlTokenizer::skipSpace ()
+{
+    while (pos_m < end_m && (*pos_m == ' ' || *pos_m == '\t' || *pos_m == '\n'))
+        pos_m++;
+}
+
+bool XmlTokenizer::readName (Slice* name)
+{
+    name->data = pos_m;
+    while (pos_m < end_m && *pos_m != ' ' && *pos_m != '\t' && *pos_m != '\n' && *pos_m != '\r' &&
+            *pos_m != '/' && *pos_m != '>' && *pos_m != '=' && *pos_m != '<' && *pos_m != '"' && *pos_m != '\'')
+        pos_m++;
+    name->size = pos_m - name->data;
+    return name->size > 0;
+}
+
+XmlTokenizer::Token XmlTokenizer::next ()
+{
+    if (pendingEnd_m)
+    {
+        // Second half of an empty element
+        pendingEnd_m = false;
+        depth_m--;
+        return EndTag;
+    }
+    attrCount_m = 0;
+    skipSpace ();
+    if (pos_m == end_m)
+        return depth_m == 0 ? End : Unsupported;
+    // Line ending normalization is left to TinyXML
+    if (*pos_m == '\r')
+        return Unsupported;
+    if (*pos_m != '<')
+        return Text;
+    pos_m++;
+    if (pos_m == end_m || *pos_m == '?' || *pos_m == '!')
+        return Unsupported;
+
+    if (*pos_m == '/')
+    {
+        pos_m++;
+        if (!readName (&name_m) || depth_m == 0)
+            return Unsupported;
+        Slice& open = open_m[--depth_m];
+        if (open.size != name_m.size || memcmp(open.data, name_m.data, open.size) != 0)
+            return Unsupported;
+        skipSpace ();
+        if (pos_m == end_m || *pos_m != '>')
+            return Unsupported;
+        pos_m++;
+        return EndTag;
+    }
+
+    if (!readName (&name_m) || depth_m == MaxDepth)
+        return Unsupported;
+    while (true)
+    {
+        skipSpace ();
+        if (pos_m == end_m)
+            return Unsupported;
+        if (*pos_m == '>')
+        {
+            pos_m++;
+            break;
+        }
+        if (*pos_m == '/')
+        {
+            if (++pos_m == end_m || *pos_m != '>')
+                return Unsupported;
+            pos_m++;
+            pendingEnd_m = true;
+            break;
+        }
+        if (attrCount_m == MaxAttributes || !readName (&attrNames_m[attrCount_m]))
+            return Unsupported;
+        skipSpace ();
+        if (pos_m == end_m || *pos_m != '=')
+            return Unsupported;
+        pos_m++;
+        skipSpace ();
+        if (pos_m == end_m || (*pos_m != '"' && *pos_m != '\''))
+            return Unsupported;
+        char quote = *pos_m++;
+        Slice& value = attrValues_m[attrCount_m];
+        value.data = pos_m;
+        while (pos_m < end_m && *pos_m != quote)
+        {
+            // Entities are decoded by TinyXML only
+            if (*pos_m == '&' || *pos_m == '<' || *pos_m == '\r')
+                return Unsupported;
+            pos_m++;
+        }
+        if (pos_m == end_m)
+            return Unsupported;
+        value.size = pos_m - value.data;
+        pos_m++;
+        attrCount_m++;
+    }
+    open_m[depth_m++] = name_m;
+    return StartTag;
+}
+
+bool XmlTokenizer::getAttribute (const char* name, Slice* value)
+{
+    for (int i = 0; i < attrCount_m; i++)
+    {
+        if (attrNames_m[i] == name)
+        {
+            *value = attrValues_m[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+ExecuteWaiter::ExecuteWaiter (ClientConnection *con, int id, const std::list<Action*>& actions, int timeout)
+    : con_m(con), id_m(id), actions_m(actions), timeout_m(timeout)
+{
+    pth_sem_init (&finished_m);
+    pth_sem_init (&cancel_m);
+    std::list<Action*>::iterator it;
+    for (it = actions_m.begin(); it != actions_m.end(); it++)
+    {
+        (*it)->setFinishedSem (&finished_m);
+        (*it)->execute ();
+    }
+}
+
+ExecuteWaiter::~ExecuteWaiter ()
+{
+    // Actions still running are stopped and delete themselves
+    while (!actions_m.empty())
+    {
+        actions_m.front()->release();
+        actions_m.pop_front();
+    }
+}
+
+void ExecuteWaiter::cancel ()
+{
+    pth_sem_inc (&cancel_m, FALSE);
+}
+
+void ExecuteWaiter::Run (pth_sem_t * stop1)
+{
+    pth_event_t stop = pth_event (PTH_EVENT_SEM, stop1);
+    pth_event_t cancel = pth_event (PTH_EVENT_SEM, &cancel_m);
+    pth_event_t finished = pth_event (PTH_EVENT_SEM|PTH_UNTIL_COUNT, &finished_m, (unsigned long)actions_m.size());
+    pth_event_concat (stop, cancel, finished, NULL);
+    // Timeout in the time of the clock, like the delays of the actions
+    Clock::sleep((int64_t)timeout_m * 1000, stop);
+    pth_event_isolate (cancel);
+    pth_event_isolate (finished);
+
+    const char* status = 0;
+    if (pth_event_status (stop) == PTH_STATUS_OCCURRED)
+        status = 0;
+    else if (pth_event_status (finished) == PTH_STATUS_OCCURRED)
+        status = "success";
+    else if (pth_event_status (cancel) == PTH_STATUS_OCCURRED)
+        status = "cancelled";
+    else
+        status = "timeout";
+    pth_event_free (finished, PTH_FREE_THIS);
+    pth_event_free (cancel, PTH_FREE_THIS);
+    pth_event_free (stop, PTH_FREE_THIS);
+    if (status)
+        con_m->onExecuteDone (this, status);
+}
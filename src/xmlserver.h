@@ -25,29 +25,91 @@
 
 #include "config.h"
 #include "threads.h"
+#include <deque>
 #include <list>
+#include <map>
 #include <string>
+#include <vector>
+#include <cstring>
 #include "ticpp.h"
 #include "objectcontroller.h"
+#include "collections.h"
+#include "binaryprotocol.h"
+#include "configcache.h"
 
 
 class ClientConnection;
+class ExecuteWaiter;
+class Action;
 
+/** Serves the XML protocol. A single pth thread waits on an epoll set
+ * holding the listening socket and every client socket, and hands the
+ * ready connections their input and output. Connections only cost their
+ * buffers, not a thread.
+ *
+ * The same server serves the binary protocol on a separate listener,
+ * configured with a <binaryserver> element. */
 class XmlServer : protected Thread
 {
 public:
+    enum Protocol
+    {
+        Xml,
+        Binary
+    };
+
+    /** What a client whose notification queue is full loses */
+    enum OverflowPolicy
+    {
+        Coalesce,   // pending notifications are reduced to the latest value per object
+        DropOldest,
+        Disconnect
+    };
+
     virtual ~XmlServer();
 
-    static XmlServer* create(ticpp::Element* pConfig);
+    static XmlServer* create(ticpp::Element* pConfig, Protocol protocol = Xml);
 
     virtual void exportXml(ticpp::Element* pConfig) = 0;
+    /** Adds one <connection> element per client with its queue metrics */
+    void statusXml(ticpp::Element* pStatus);
+
+    /** Closes the listening socket at once and deletes the server from its
+     * own thread, so that it can be replaced while handling a request. */
+    void release();
+
+    /** Sets the socket events the server loop waits for on con */
+    void watch (ClientConnection *con, bool readable, bool writable);
+    /** Closes con. If a request of con is still running, the connection
+     * is only removed from the loop and deleted once the request ends. */
+    void closeConnection (ClientConnection *con);
+
+    int getConnectionCount() { return connections_m.size(); };
+    Protocol getProtocol() { return protocol_m; };
+    int getMaxQueued() { return maxQueued_m; };
+    OverflowPolicy getOverflowPolicy() { return overflowPolicy_m; };
+
+    static OverflowPolicy parseOverflowPolicy(const std::string& policy);
+    static std::string formatOverflowPolicy(OverflowPolicy policy);
 
-    bool deregister (ClientConnection *con);
+    static const int MaxEvents = 64;
+    static const int DefaultMaxQueued = 1000;
 protected:
+    XmlServer();
+    /** Registers the listening socket fd_m and starts the server thread */
+    void startServer();
+    void exportQueueXml(ticpp::Element* pConfig);
+
     int fd_m;
 private:
-    std::list<ClientConnection*> connections_m;
+    typedef std::map<int, ClientConnection*> ConnectionMap_t;
+    ConnectionMap_t connections_m;
+    int epollFd_m;
+    Protocol protocol_m;
+    int maxQueued_m;
+    OverflowPolicy overflowPolicy_m;
 
+    void acceptConnections();
     void Run (pth_sem_t * stop);
 };
 
@@ -73,31 +135,278 @@ private:
     std::string path_m;
 };
 
-class ClientConnection : public Thread, public ChangeListener
+/** Zero-copy pull tokenizer for the plain XML of client requests. Names
+ * and attribute values are returned as slices of the message. It gives up
+ * with Unsupported on what only the DOM parser handles (declarations,
+ * comments, CDATA, entity references) or on malformed input, so that the
+ * caller can fall back to ticpp. Empty elements are returned as a start
+ * tag followed by an end tag, and whitespace between tags is skipped. */
+class XmlTokenizer
+{
+public:
+    enum Token
+    {
+        StartTag,
+        EndTag,
+        Text,
+        End,
+        Unsupported
+    };
+
+    struct Slice
+    {
+        const char* data;
+        std::string::size_type size;
+
+        bool operator==(const char* str) const { return strlen(str) == size && memcmp(data, str, size) == 0; };
+        std::string str() const { return std::string(data, size); };
+    };
+
+    /** msg must outlive the tokenizer */
+    XmlTokenizer(const std::string& msg);
+
+    Token next();
+    /** Name of the last start or end tag */
+    const Slice& getName() { return name_m; };
+    int getAttributeCount() { return attrCount_m; };
+    /** Looks up an attribute of the last start tag */
+    bool getAttribute(const char* name, Slice* value);
+
+    static const int MaxAttributes = 8;
+    static const int MaxDepth = 8;
+private:
+    const char* pos_m;
+    const char* end_m;
+    Slice name_m;
+    bool pendingEnd_m;
+    int attrCount_m;
+    Slice attrNames_m[MaxAttributes];
+    Slice attrValues_m[MaxAttributes];
+    int depth_m;
+    Slice open_m[MaxDepth];
+
+    void skipSpace();
+    bool readName(Slice* name);
+};
+
+/** State of a client of the XML server. Input is accumulated in inbuf_m
+ * and split on the \004 terminator, output is queued in outbuf_m until
+ * the socket accepts it. All socket I/O is non-blocking. Subclasses serve
+ * other protocols by overriding the framing, the request handling and the
+ * format of the notifications.
+ *
+ * Change notifications go to a separate queue bounded by the server's
+ * max queue size, which onChange fills without writing to the socket. The
+ * server loop moves them to outbuf_m as the client reads them, so a slow
+ * client only costs its own queue. */
+class ClientConnection : public ChangeListener, public ConfigSaver::Listener
 {
 public:
     ClientConnection (XmlServer *server, int fd);
     virtual ~ ClientConnection ();
 
-    void RemoveServer() { server_m = 0; };
+    int getFd() { return fd_m; };
 
-    int readmessage (pth_event_t stop);
-    int sendmessage (int size, const char * msg, pth_event_t stop);
-    int sendmessage (std::string msg, pth_event_t stop);
-    int sendreject (const char* msgstr, const std::string& type, pth_event_t stop);
+    /** Extracts the next complete message into msg_m, reading what the
+     * socket has available if needed. Returns 1 if a message was
+     * extracted, 0 if more data must arrive and -1 at end of stream or
+     * on invalid input. */
+    int readmessage ();
+    /** Handles the complete messages received so far. Returns false if
+     * the connection must be closed. */
+    bool processInput ();
+    /** Writes as much pending output as the socket accepts. Returns
+     * false if the connection must be closed. */
+    bool flush ();
+    /** Handles the request in msg_m */
+    virtual void handleMessage ();
+    /** Handles the common object reads and writes without building a DOM.
+     * Returns false if msg_m has another shape and needs the DOM path. */
+    bool handleFastMessage (std::string& msgType);
+
+    int sendmessage (std::string msg);
+    int sendreject (const char* msgstr, const std::string& type);
+
+    /** Called by the waiter of an execute request once its actions are
+     * finished, cancelled or timed out. Sends the final status. */
+    void onExecuteDone (ExecuteWaiter *waiter, const char* status);
+    /** True while execute requests are in progress */
+    bool isBusy() { return !executions_m.empty(); };
+    /** Sends the final status of an admin request that saved the config */
+    virtual void onConfigSaved (int id, const std::string& error);
+    void setClosing() { closing_m = true; };
+    bool isClosing() { return closing_m; };
 
     virtual void onChange(Object* object);
+    void statusXml(ticpp::Element* pStatus);
+
+    int getQueuedCount() { return notifications_m.size(); };
+    int getDroppedCount() { return dropped_m; };
+    int getCoalescedCount() { return coalesced_m; };
 
     std::string msg_m;
-    std::string msgbuf_m;
+protected:
+    struct Notification
+    {
+        std::string id;
+        // Value of the object, or the encoded message for binary clients
+        std::string value;
+        int64_t queuedAt;
+    };
+
+    std::string inbuf_m;
+    std::string::size_type inStart_m;
+    // Input before this offset has been searched for a message
+    std::string::size_type scanned_m;
+
+    /** Moves the next complete message of inbuf_m to msg_m. Returns 1 if
+     * a message was extracted, 0 if more data must arrive and -1 if the
+     * input is invalid. */
+    virtual int extractMessage ();
+    /** Appends a queued notification to the output */
+    virtual void appendNotification (std::string& out, const Notification& notification);
+    /** Queues a notification for the object id, applying the overflow
+     * policy of the server */
+    void queueNotification (const char* id, const std::string& value);
+    /** Returns the output buffer to append a reply to */
+    std::string& beginReply ();
+
 private:
+    typedef std::deque<Notification> NotificationQueue_t;
+    typedef HashMap<std::string, int> PendingCountMap_t;
+
     int fd_m;
     XmlServer *server_m;
 
-    typedef std::list<Object*> NotifyList_t;
-    NotifyList_t notifyList_m;
+    std::string outbuf_m;
+    std::string::size_type outStart_m;
+    bool eof_m;
+    bool error_m;
+    bool closing_m;
+    bool readable_m;
+    bool writable_m;
+    typedef std::map<int, ExecuteWaiter*> ExecutionMap_t;
+    ExecutionMap_t executions_m;
+    // Id of the last asynchronous request
+    int lastRequestId_m;
+    struct PendingSave
+    {
+        int remaining;
+        std::string error;
+    };
+    typedef std::map<int, PendingSave> PendingSaveMap_t;
+    PendingSaveMap_t pendingSaves_m;
+
+    NotificationQueue_t notifications_m;
+    PendingCountMap_t pendingCount_m;
+    bool overflow_m;
+    int maxQueueLength_m;
+    int dropped_m;
+    int coalesced_m;
+    int sent_m;
+    int64_t maxLag_m;
+
+    bool isOpen();
+    void updateWatch();
+    bool handleFastRead (XmlTokenizer& tokenizer, std::string& msgType);
+    bool handleFastWrite (XmlTokenizer& tokenizer, std::string& msgType);
+    static void releaseWrites (std::vector<Object*>& objects, std::vector<ObjectValue*>& values);
+    /** Handles <read><objects since="..." [epoch="..."]/></read> */
+    bool handleFastDelta (XmlTokenizer& tokenizer, const XmlTokenizer::Slice& since,
+                          const XmlTokenizer::Slice* epoch, std::string& msgType);
+    /** Terminates and sends the reply started with beginReply */
+    void endReply ();
+    /** Appends name="value" escaped and quoted as TinyXML prints it */
+    static void appendAttribute (std::string& out, const char* name, const std::string& value);
+    /** Appends an <object> line of a <read><objects> reply */
+    static void appendObjectValue (std::string& out, Object* object);
+    /** Parses a sequence number, false if it isn't a plain number */
+    static bool parseSeq (const XmlTokenizer::Slice& value, uint64_t* seq);
+    void popNotification();
+    void coalesceNotifications();
+    /** Moves queued notifications to outbuf_m, up to MaxDrainSize bytes */
+    void drainNotifications();
+
+    static const std::string::size_type MaxDrainSize = 16384;
+};
+
+/** Client of the binary protocol (see BinaryProtocol). Each resolved
+ * handle holds a reference on its object until the connection closes. */
+class BinaryConnection : public ClientConnection
+{
+public:
+    BinaryConnection (XmlServer *server, int fd);
+    virtual ~BinaryConnection ();
+
+    virtual void handleMessage ();
+    virtual void onChange(Object* object);
+
+    int getHandleCount() { return handles_m.size(); };
+protected:
+    virtual int extractMessage ();
+    virtual void appendNotification (std::string& out, const Notification& notification);
+private:
+    /** How values are read and written, the class of the object */
+    enum Kind
+    {
+        KindString,
+        KindBool,
+        KindUInt,
+        KindInt,
+        KindS64,
+        KindFloat
+    };
+    struct Handle
+    {
+        Object* object;
+        Kind kind;
+        SubscriptionIndex::Subscription* subscription;
+    };
+    typedef HashMap<std::string, uint32_t> HandleMap_t;
+
+    // Handle n is handles_m[n-1], 0 is never a valid handle
+    std::vector<Handle> handles_m;
+    HandleMap_t handleIds_m;
+
+    void resolve (BinaryReader& reader, BinaryWriter& writer);
+    void readValues (BinaryReader& reader, BinaryWriter& writer);
+    void writeValues (BinaryReader& reader);
+    void subscribe (BinaryReader& reader, bool subscribed);
+    /** Reads a list of handles, checking that they are all valid */
+    void readHandles (BinaryReader& reader, std::vector<uint32_t>& handles);
+    static void checkEnd (BinaryReader& reader);
+
+    static Kind getKind (Object* object);
+    static BinaryValue::Type getType (Kind kind);
+    static BinaryValue getValue (const Handle& handle);
+    /** Throws if value cannot be written to the object of handle */
+    static void checkValue (const Handle& handle, const BinaryValue& value);
+    static void setValue (const Handle& handle, const BinaryValue& value);
+};
+
+/** Waits for the actions of an execute request without holding up the
+ * connection, which goes on with its next requests. The actions signal
+ * their completion to the waiter, which then reports it to the connection
+ * with the execution id. */
+class ExecuteWaiter : public Thread
+{
+public:
+    ExecuteWaiter (ClientConnection *con, int id, const std::list<Action*>& actions, int timeout);
+    virtual ~ExecuteWaiter ();
+
+    int getId() { return id_m; };
+    /** Stops the actions, the connection is told the execution was cancelled */
+    void cancel();
+
+private:
+    ClientConnection *con_m;
+    int id_m;
+    std::list<Action*> actions_m;
+    int timeout_m;
+    pth_sem_t finished_m;
+    pth_sem_t cancel_m;
 
     void Run (pth_sem_t * stop);
 };
 
-#endif
+#endif
\ No newline at end of file
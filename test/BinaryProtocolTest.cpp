@@ -0,0 +1,353 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "xmlserver.h"
+#include "binaryclient.h"
+#include "objectcontroller.h"
+#include "services.h"
+extern "C"
+{
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+class BinaryProtocolTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( BinaryProtocolTest );
+    CPPUNIT_TEST( testEncoding );
+    CPPUNIT_TEST( testResolveReadWrite );
+    CPPUNIT_TEST( testErrors );
+    CPPUNIT_TEST( testSubscribe );
+    CPPUNIT_TEST( testInvalidFrame );
+    CPPUNIT_TEST( testClient );
+    CPPUNIT_TEST( testServicesConfig );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    XmlServer* server_m;
+    Object* switch_m;
+    Object* count_m;
+    Object* temp_m;
+    Object* text_m;
+
+    Object* addObject(const char* id, const char* type)
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        Object* object = Object::create(&pConfig);
+        ObjectController::instance()->addObject(object);
+        return object;
+    }
+
+public:
+    void setUp()
+    {
+        switch_m = addObject("bin_sw", "1.001");
+        count_m = addObject("bin_count", "7.xxx");
+        temp_m = addObject("bin_temp", "9.xxx");
+        text_m = addObject("bin_text", "16.000");
+        ticpp::Element pConfig("binaryserver");
+        pConfig.SetAttribute("type", "unix");
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_binsock");
+        server_m = XmlServer::create(&pConfig, XmlServer::Binary);
+    }
+
+    void tearDown()
+    {
+        // The connections hold references on the objects
+        if (server_m)
+            delete server_m;
+        ObjectController::reset();
+    }
+
+    int connectClient()
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_LOCAL;
+        strcpy(addr.sun_path, "/tmp/linknx_unittest_binsock");
+        int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+        CPPUNIT_ASSERT(pth_connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+        return fd;
+    }
+
+    void sendFrame(int fd, uint8_t opcode, uint32_t tag, const std::string& payload)
+    {
+        std::string frame;
+        BinaryWriter writer(frame);
+        writer.beginFrame(opcode, tag);
+        frame.append(payload);
+        writer.endFrame();
+        CPPUNIT_ASSERT_EQUAL((ssize_t)frame.size(), pth_write(fd, frame.data(), frame.size()));
+    }
+
+    // Reads the next frame, waiting at most 5s, and checks its opcode and
+    // tag. Returns its payload.
+    std::string receiveFrame(int fd, uint8_t opcode, uint32_t tag)
+    {
+        std::string buf, frame;
+        std::string::size_type start = 0;
+        char c;
+        pth_event_t timeout = pth_event(PTH_EVENT_TIME, pth_timeout(5, 0));
+        while (BinaryReader::extractFrame(buf, &start, frame) == 0 && pth_read_ev(fd, &c, 1, timeout) == 1)
+            buf.push_back(c);
+        pth_event_free(timeout, PTH_FREE_THIS);
+        CPPUNIT_ASSERT(frame.size() >= BinaryProtocol::HeaderSize);
+        BinaryReader reader(frame.data(), frame.size());
+        CPPUNIT_ASSERT_EQUAL((int)opcode, (int)reader.getInt(1));
+        CPPUNIT_ASSERT_EQUAL(tag, (uint32_t)reader.getInt(4));
+        return frame.substr(BinaryProtocol::HeaderSize);
+    }
+
+    std::string handleList(uint32_t first, uint32_t second = 0)
+    {
+        std::string payload;
+        BinaryWriter writer(payload);
+        writer.putInt(second ? 2 : 1, 2);
+        writer.putInt(first, 4);
+        if (second)
+            writer.putInt(second, 4);
+        return payload;
+    }
+
+    std::vector<uint32_t> resolve(int fd, const char** ids, int count, std::vector<int>* types = 0)
+    {
+        std::string payload;
+        BinaryWriter writer(payload);
+        writer.putInt(count, 2);
+        for (int i = 0; i < count; i++)
+            writer.putString(ids[i]);
+        sendFrame(fd, BinaryProtocol::Resolve, 1, payload);
+        std::string reply = receiveFrame(fd, BinaryProtocol::Resolve | BinaryProtocol::Reply, 1);
+        BinaryReader reader(reply.data(), reply.size());
+        CPPUNIT_ASSERT_EQUAL(count, (int)reader.getInt(2));
+        std::vector<uint32_t> handles;
+        for (int i = 0; i < count; i++)
+        {
+            handles.push_back(reader.getInt(4));
+            int type = reader.getInt(1);
+            if (types)
+                types->push_back(type);
+        }
+        CPPUNIT_ASSERT(reader.atEnd() && !reader.hasError());
+        return handles;
+    }
+
+    void testEncoding()
+    {
+        std::string buf;
+        BinaryWriter writer(buf);
+        writer.beginFrame(BinaryProtocol::Write, 0x01020304);
+        writer.putValue(BinaryValue::fromBool(true));
+        writer.putValue(BinaryValue::fromInt(-5000000000LL));
+        writer.putValue(BinaryValue::fromFloat(21.5));
+        writer.putValue(BinaryValue::fromString("hello"));
+        writer.endFrame();
+        CPPUNIT_ASSERT_EQUAL(std::string("\x21\0\0\0\x03\x04\x03\x02\x01", 9), buf.substr(0, 9));
+
+        std::string frame;
+        std::string::size_type start = 0;
+        std::string partial = buf.substr(0, buf.size() - 1);
+        CPPUNIT_ASSERT_EQUAL(0, BinaryReader::extractFrame(partial, &start, frame));
+        CPPUNIT_ASSERT_EQUAL(1, BinaryReader::extractFrame(buf, &start, frame));
+        CPPUNIT_ASSERT_EQUAL(buf.size(), start);
+
+        BinaryReader reader(frame.data() + BinaryProtocol::HeaderSize, frame.size() - BinaryProtocol::HeaderSize);
+        CPPUNIT_ASSERT(BinaryValue::fromBool(true) == reader.getValue());
+        CPPUNIT_ASSERT(BinaryValue::fromInt(-5000000000LL) == reader.getValue());
+        CPPUNIT_ASSERT(BinaryValue::fromFloat(21.5) == reader.getValue());
+        CPPUNIT_ASSERT(BinaryValue::fromString("hello") == reader.getValue());
+        CPPUNIT_ASSERT(reader.atEnd() && !reader.hasError());
+        reader.getInt(1);
+        CPPUNIT_ASSERT(reader.hasError());
+
+        std::string huge("\xff\xff\xff\x7f", 4);
+        start = 0;
+        CPPUNIT_ASSERT_EQUAL(-1, BinaryReader::extractFrame(huge, &start, frame));
+    }
+
+    void testResolveReadWrite()
+    {
+        int fd = connectClient();
+        const char* ids[] = { "bin_sw", "bin_count", "bin_temp", "bin_text", "unknown" };
+        std::vector<int> types;
+        std::vector<uint32_t> handles = resolve(fd, ids, 5, &types);
+        CPPUNIT_ASSERT(handles[0] != 0 && handles[1] != 0 && handles[2] != 0 && handles[3] != 0);
+        CPPUNIT_ASSERT_EQUAL(0u, handles[4]);
+        CPPUNIT_ASSERT_EQUAL((int)BinaryValue::Bool, types[0]);
+        CPPUNIT_ASSERT_EQUAL((int)BinaryValue::Int, types[1]);
+        CPPUNIT_ASSERT_EQUAL((int)BinaryValue::Float, types[2]);
+        CPPUNIT_ASSERT_EQUAL((int)BinaryValue::String, types[3]);
+        // Resolving again returns the same handle
+        CPPUNIT_ASSERT_EQUAL(handles[1], resolve(fd, ids + 1, 1)[0]);
+
+        std::string payload;
+        BinaryWriter writer(payload);
+        writer.putInt(4, 2);
+        writer.putInt(handles[0], 4);
+        writer.putValue(BinaryValue::fromBool(true));
+        writer.putInt(handles[1], 4);
+        writer.putValue(BinaryValue::fromInt(1234));
+        writer.putInt(handles[2], 4);
+        writer.putValue(BinaryValue::fromFloat(21.5));
+        writer.putInt(handles[3], 4);
+        writer.putValue(BinaryValue::fromString("hello"));
+        sendFrame(fd, BinaryProtocol::Write, 2, payload);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), receiveFrame(fd, BinaryProtocol::Write | BinaryProtocol::Reply, 2));
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), switch_m->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("1234"), count_m->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("21.5"), temp_m->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("hello"), text_m->getValue());
+
+        temp_m->setValue("-3.2");
+        sendFrame(fd, BinaryProtocol::Read, 3, handleList(handles[2], handles[0]));
+        std::string reply = receiveFrame(fd, BinaryProtocol::Read | BinaryProtocol::Reply, 3);
+        BinaryReader reader(reply.data(), reply.size());
+        CPPUNIT_ASSERT_EQUAL(2, (int)reader.getInt(2));
+        CPPUNIT_ASSERT(BinaryValue::fromFloat(-3.2) == reader.getValue());
+        CPPUNIT_ASSERT(BinaryValue::fromBool(true) == reader.getValue());
+        CPPUNIT_ASSERT(reader.atEnd());
+        close(fd);
+    }
+
+    void testErrors()
+    {
+        int fd = connectClient();
+        const char* ids[] = { "bin_count" };
+        uint32_t handle = resolve(fd, ids, 1)[0];
+
+        sendFrame(fd, BinaryProtocol::Read, 7, handleList(handle, 99));
+        std::string reply = receiveFrame(fd, BinaryProtocol::Error, 7);
+        BinaryReader reader(reply.data(), reply.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("Unknown handle"), reader.getString());
+
+        // Nothing is written if a value is rejected
+        std::string payload;
+        BinaryWriter writer(payload);
+        writer.putInt(2, 2);
+        writer.putInt(handle, 4);
+        writer.putValue(BinaryValue::fromInt(12));
+        writer.putInt(handle, 4);
+        writer.putValue(BinaryValue::fromInt(-1));
+        sendFrame(fd, BinaryProtocol::Write, 8, payload);
+        receiveFrame(fd, BinaryProtocol::Error, 8);
+        payload.clear();
+        writer.putInt(1, 2);
+        writer.putInt(handle, 4);
+        writer.putValue(BinaryValue::fromBool(true));
+        sendFrame(fd, BinaryProtocol::Write, 9, payload);
+        receiveFrame(fd, BinaryProtocol::Error, 9);
+        sendFrame(fd, BinaryProtocol::Read, 10, handleList(handle).substr(1));
+        receiveFrame(fd, BinaryProtocol::Error, 10);
+        sendFrame(fd, 0x42, 11, "");
+        receiveFrame(fd, BinaryProtocol::Error, 11);
+
+        sendFrame(fd, BinaryProtocol::Read, 12, handleList(handle));
+        reply = receiveFrame(fd, BinaryProtocol::Read | BinaryProtocol::Reply, 12);
+        BinaryReader value(reply.data() + 2, reply.size() - 2);
+        CPPUNIT_ASSERT(BinaryValue::fromInt(0) == value.getValue());
+        close(fd);
+    }
+
+    void testSubscribe()
+    {
+        int fd = connectClient();
+        const char* ids[] = { "bin_sw", "bin_temp" };
+        std::vector<uint32_t> handles = resolve(fd, ids, 2);
+        sendFrame(fd, BinaryProtocol::Subscribe, 5, handleList(handles[1]));
+        receiveFrame(fd, BinaryProtocol::Subscribe | BinaryProtocol::Reply, 5);
+
+        switch_m->setValue("on");
+        temp_m->setValue("18");
+        std::string change = receiveFrame(fd, BinaryProtocol::Change, 0);
+        BinaryReader reader(change.data(), change.size());
+        CPPUNIT_ASSERT_EQUAL(handles[1], (uint32_t)reader.getInt(4));
+        CPPUNIT_ASSERT(BinaryValue::fromFloat(18) == reader.getValue());
+
+        sendFrame(fd, BinaryProtocol::Unsubscribe, 6, handleList(handles[1]));
+        receiveFrame(fd, BinaryProtocol::Unsubscribe | BinaryProtocol::Reply, 6);
+        temp_m->setValue("19");
+        // The next frame is the reply, not a change
+        sendFrame(fd, BinaryProtocol::Read, 7, handleList(handles[0]));
+        receiveFrame(fd, BinaryProtocol::Read | BinaryProtocol::Reply, 7);
+        close(fd);
+    }
+
+    void testInvalidFrame()
+    {
+        int fd = connectClient();
+        std::string frame("\x02\0\0\0\x01\x00", 6);
+        CPPUNIT_ASSERT_EQUAL((ssize_t)frame.size(), pth_write(fd, frame.data(), frame.size()));
+        for (int i = 0; i < 100 && server_m->getConnectionCount() > 0; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(0, server_m->getConnectionCount());
+        close(fd);
+    }
+
+    // The client library blocks, so it runs in a child process
+    void testClient()
+    {
+        count_m->setValue("7");
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            BinaryClient client;
+            std::vector<std::string> ids;
+            ids.push_back("bin_count");
+            ids.push_back("bin_sw");
+            std::vector<uint32_t> handles;
+            std::vector<BinaryValue> values;
+            if (!client.connectUnix("/tmp/linknx_unittest_binsock"))
+                _exit(1);
+            if (!client.resolve(ids, handles) || !client.read(handles, values))
+                _exit(2);
+            if (!(values[0] == BinaryValue::fromInt(7)) || !(values[1] == BinaryValue::fromBool(false)))
+                _exit(3);
+            values[0] = BinaryValue::fromInt(8);
+            values[1] = BinaryValue::fromBool(true);
+            if (!client.write(handles, values))
+                _exit(4);
+            values[0] = BinaryValue::fromString("bad");
+            if (client.write(handles, values) || client.getError() == "")
+                _exit(5);
+            _exit(0);
+        }
+        CPPUNIT_ASSERT(pid > 0);
+        int status = -1;
+        for (int i = 0; i < 500 && pth_waitpid(pid, &status, WNOHANG) == 0; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(WIFEXITED(status));
+        CPPUNIT_ASSERT_EQUAL(0, WEXITSTATUS(status));
+        CPPUNIT_ASSERT_EQUAL(std::string("8"), count_m->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), switch_m->getValue());
+    }
+
+    void testServicesConfig()
+    {
+        delete server_m;
+        server_m = 0;
+        ticpp::Element pServices("services");
+        ticpp::Element pBinaryServer("binaryserver");
+        pBinaryServer.SetAttribute("type", "unix");
+        pBinaryServer.SetAttribute("path", "/tmp/linknx_unittest_binsock");
+        pBinaryServer.SetAttribute("notify-queue", 50);
+        pServices.InsertEndChild(pBinaryServer);
+        Services::instance()->importXml(&pServices);
+
+        int fd = connectClient();
+        const char* ids[] = { "bin_sw" };
+        CPPUNIT_ASSERT(resolve(fd, ids, 1)[0] != 0);
+        close(fd);
+
+        ticpp::Element pExport("services");
+        Services::instance()->exportXml(&pExport);
+        ticpp::Element* pExported = pExport.FirstChildElement("binaryserver");
+        CPPUNIT_ASSERT_EQUAL(std::string("unix"), pExported->GetAttribute("type"));
+        CPPUNIT_ASSERT_EQUAL(std::string("50"), pExported->GetAttribute("notify-queue"));
+        Services::reset();
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( BinaryProtocolTest );
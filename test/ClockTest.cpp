@@ -0,0 +1,146 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "clock.h"
+#include "threads.h"
+#include "timermanager.h"
+
+class ClockSleeper : public Thread
+{
+public:
+    ClockSleeper(int64_t delay) : delay_m(delay), wokenAt_m(0), stopped_m(false) {}
+    virtual ~ClockSleeper() { Stop(); }
+
+    int64_t delay_m;
+    int64_t wokenAt_m;
+    bool stopped_m;
+
+protected:
+    virtual void Run (pth_sem_t * stop)
+    {
+        pth_event_t stop_ev = pth_event (PTH_EVENT_SEM, stop);
+        Clock::sleep(delay_m, stop_ev);
+        stopped_m = (pth_event_status (stop_ev) == PTH_STATUS_OCCURRED);
+        wokenAt_m = Clock::nowMs();
+        pth_event_free (stop_ev, PTH_FREE_THIS);
+    }
+};
+
+class ClockTimerTask : public TimerTask
+{
+public:
+    ClockTimerTask(time_t execTime) : execTime_m(execTime), count_m(0) {}
+    virtual void onTimer(time_t time) { count_m++; lastTime_m = time; }
+    virtual void reschedule(time_t from = 0) {}
+    virtual time_t getExecTime() { return execTime_m; }
+    virtual void statusXml(ticpp::Element* pStatus) {}
+
+    time_t execTime_m;
+    int count_m;
+    time_t lastTime_m;
+};
+
+class ClockTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( ClockTest );
+    CPPUNIT_TEST( testWallClock );
+    CPPUNIT_TEST( testVirtualSleep );
+    CPPUNIT_TEST( testVirtualSleepOrder );
+    CPPUNIT_TEST( testVirtualSleepInterrupted );
+    CPPUNIT_TEST( testVirtualTimerManager );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    VirtualClock* clock_m;
+
+public:
+    void setUp()
+    {
+        clock_m = 0;
+    }
+
+    void tearDown()
+    {
+        Clock::reset();
+    }
+
+    void useVirtualClock()
+    {
+        clock_m = new VirtualClock(1350000000000LL);
+        Clock::set(clock_m);
+    }
+
+    void testWallClock()
+    {
+        time_t before = time(0);
+        time_t now = Clock::now();
+        CPPUNIT_ASSERT(now >= before && now <= time(0));
+        int64_t start = Clock::nowMs();
+        Clock::sleep(20, 0);
+        CPPUNIT_ASSERT(Clock::nowMs() - start >= 19);
+    }
+
+    void testVirtualSleep()
+    {
+        useVirtualClock();
+        CPPUNIT_ASSERT_EQUAL((time_t)1350000000, Clock::now());
+        ClockSleeper sleeper(5000);
+        sleeper.Start();
+        clock_m->settle();
+        CPPUNIT_ASSERT_EQUAL(1, clock_m->getWaitingCount());
+
+        clock_m->advance(4999);
+        CPPUNIT_ASSERT_EQUAL((int64_t)0, sleeper.wokenAt_m);
+        clock_m->advance(1);
+        CPPUNIT_ASSERT_EQUAL(1350000005000LL, (long long)sleeper.wokenAt_m);
+        CPPUNIT_ASSERT(!sleeper.stopped_m);
+        CPPUNIT_ASSERT_EQUAL(0, clock_m->getWaitingCount());
+    }
+
+    void testVirtualSleepOrder()
+    {
+        useVirtualClock();
+        ClockSleeper late(86400000), early(60000);
+        late.Start();
+        early.Start();
+        // A single step goes through both deadlines, each one at its time
+        clock_m->advance(7 * 86400000LL);
+        CPPUNIT_ASSERT_EQUAL(1350000060000LL, (long long)early.wokenAt_m);
+        CPPUNIT_ASSERT_EQUAL(1350086400000LL, (long long)late.wokenAt_m);
+        CPPUNIT_ASSERT_EQUAL(1350604800000LL, (long long)clock_m->getTimeMs());
+    }
+
+    void testVirtualSleepInterrupted()
+    {
+        useVirtualClock();
+        ClockSleeper sleeper(3600000);
+        sleeper.Start();
+        clock_m->settle();
+        sleeper.Stop();
+        CPPUNIT_ASSERT(sleeper.stopped_m);
+        CPPUNIT_ASSERT_EQUAL(1350000000000LL, (long long)sleeper.wokenAt_m);
+        CPPUNIT_ASSERT_EQUAL(0, clock_m->getWaitingCount());
+    }
+
+    void testVirtualTimerManager()
+    {
+        useVirtualClock();
+        TimerManager manager;
+        ClockTimerTask task1(1350000000 + 3600), task2(1350000000 + 7 * 86400);
+        manager.addTask(&task1);
+        manager.addTask(&task2);
+        manager.startManager();
+
+        clock_m->advance(3599000);
+        CPPUNIT_ASSERT_EQUAL(0, task1.count_m);
+        clock_m->advance(1000);
+        CPPUNIT_ASSERT_EQUAL(1, task1.count_m);
+        CPPUNIT_ASSERT_EQUAL((time_t)1350003600, task1.lastTime_m);
+
+        clock_m->advance(7 * 86400000LL);
+        CPPUNIT_ASSERT_EQUAL(1, task2.count_m);
+        CPPUNIT_ASSERT_EQUAL((time_t)1350604800, task2.lastTime_m);
+        CPPUNIT_ASSERT_EQUAL(0, manager.getTaskCount());
+        manager.stopManager();
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ClockTest );
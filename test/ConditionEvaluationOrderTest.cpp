@@ -0,0 +1,165 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "ruleserver.h"
+
+class CountingCondition : public Condition
+{
+public:
+    CountingCondition(bool value, int work, bool reorderable = true)
+        : value_m(value), work_m(work), reorderable_m(reorderable), count_m(0) {}
+
+    virtual void importXml(ticpp::Element* pConfig) {}
+    virtual void exportXml(ticpp::Element* pConfig) {}
+    virtual void statusXml(ticpp::Element* pStatus) {}
+    virtual bool isReorderable() { return reorderable_m; }
+    virtual bool evaluate()
+    {
+        count_m++;
+        volatile int dummy = 0;
+        for (int i = 0; i < work_m; i++)
+            dummy += i;
+        return value_m;
+    }
+
+    bool value_m;
+    int work_m;
+    bool reorderable_m;
+    int count_m;
+};
+
+class ConditionEvaluationOrderTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( ConditionEvaluationOrderTest );
+    CPPUNIT_TEST( testResults );
+    CPPUNIT_TEST( testCheapFirst );
+    CPPUNIT_TEST( testLikelyFirst );
+    CPPUNIT_TEST( testPinned );
+    CPPUNIT_TEST( testStatus );
+    CPPUNIT_TEST( testSampledWhileExploring );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    Condition::ConditionsList_t conditions_m;
+
+    CountingCondition* add(bool value, int work, bool reorderable = true)
+    {
+        CountingCondition* condition = new CountingCondition(value, work, reorderable);
+        conditions_m.push_back(condition);
+        return condition;
+    }
+
+public:
+    void setUp()
+    {
+    }
+
+    void tearDown()
+    {
+        Condition::ConditionsList_t::iterator it;
+        for (it = conditions_m.begin(); it != conditions_m.end(); it++)
+            delete (*it);
+        conditions_m.clear();
+    }
+
+    void testResults()
+    {
+        CountingCondition* c1 = add(false, 0);
+        CountingCondition* c2 = add(false, 0);
+        CountingCondition* c3 = add(false, 0, false);
+        ConditionEvaluationOrder andOrder(false), orOrder(true);
+        andOrder.init(conditions_m);
+        orOrder.init(conditions_m);
+        for (int loop = 0; loop < 100; loop++)
+        {
+            for (int bits = 0; bits < 8; bits++)
+            {
+                c1->value_m = bits & 1;
+                c2->value_m = bits & 2;
+                c3->value_m = bits & 4;
+                CPPUNIT_ASSERT_EQUAL(bits == 7, andOrder.evaluate());
+                CPPUNIT_ASSERT_EQUAL(bits != 0, orOrder.evaluate());
+            }
+        }
+    }
+
+    void testCheapFirst()
+    {
+        CountingCondition* expensive = add(true, 20000);
+        CountingCondition* cheap = add(false, 0);
+        ConditionEvaluationOrder order(false);
+        order.init(conditions_m);
+        for (int i = 0; i < 1000; i++)
+            CPPUNIT_ASSERT(!order.evaluate());
+        CPPUNIT_ASSERT_EQUAL(1000, cheap->count_m);
+        // Only evaluated before the estimates are settled and while exploring
+        CPPUNIT_ASSERT(expensive->count_m < 100);
+    }
+
+    void testLikelyFirst()
+    {
+        CountingCondition* mostlyTrue = add(true, 100);
+        CountingCondition* alwaysTrue = add(true, 100);
+        CountingCondition* alwaysFalse = add(false, 100);
+        ConditionEvaluationOrder order(true);
+        order.init(conditions_m);
+        for (int i = 0; i < 1000; i++)
+        {
+            alwaysTrue->value_m = true;
+            mostlyTrue->value_m = (i % 4) != 0;
+            CPPUNIT_ASSERT(order.evaluate());
+        }
+        CPPUNIT_ASSERT(alwaysTrue->count_m > 900);
+        CPPUNIT_ASSERT(alwaysFalse->count_m < 100);
+    }
+
+    void testPinned()
+    {
+        CountingCondition* expensive = add(true, 20000);
+        CountingCondition* pinned = add(true, 0, false);
+        CountingCondition* cheap = add(false, 0);
+        ConditionEvaluationOrder order(false);
+        order.init(conditions_m);
+        for (int i = 0; i < 500; i++)
+            CPPUNIT_ASSERT(!order.evaluate());
+        // The cheap condition can't be moved before the pinned one
+        CPPUNIT_ASSERT_EQUAL(500, expensive->count_m);
+        CPPUNIT_ASSERT_EQUAL(500, pinned->count_m);
+        CPPUNIT_ASSERT_EQUAL(500, cheap->count_m);
+    }
+
+    void testStatus()
+    {
+        add(true, 20000);
+        add(false, 0);
+        ConditionEvaluationOrder order(false);
+        order.init(conditions_m);
+        for (int i = 0; i < 100; i++)
+            order.evaluate();
+        ticpp::Element pFirst("condition"), pSecond("condition");
+        order.statusXml(0, &pFirst);
+        order.statusXml(1, &pSecond);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pFirst.GetAttribute("eval-rank"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pSecond.GetAttribute("eval-rank"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pSecond.GetAttribute("eval-true-ratio"));
+        CPPUNIT_ASSERT(pFirst.GetAttribute("eval-cost-us") != "");
+    }
+
+    void testSampledWhileExploring()
+    {
+        CountingCondition* cheap = add(false, 0);
+        add(true, 20000);
+        ConditionEvaluationOrder order(false);
+        order.init(conditions_m);
+        for (int i = 0; i < 100; i++)
+            order.evaluate();
+        CPPUNIT_ASSERT_EQUAL(100, cheap->count_m);
+        // Warm-up and one sample every ExplorePeriod evaluations
+        ticpp::Element pCheap("condition");
+        order.statusXml(0, &pCheap);
+        int samples;
+        pCheap.GetAttribute("eval-samples", &samples);
+        CPPUNIT_ASSERT(samples >= 4);
+        CPPUNIT_ASSERT(samples < 16);
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ConditionEvaluationOrderTest );
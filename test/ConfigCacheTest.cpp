@@ -0,0 +1,174 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "configcache.h"
+#include "objectcontroller.h"
+#include "ruleserver.h"
+#include "services.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+class ConfigCacheTest : public CppUnit::TestFixture, public ConfigSaver::Listener
+{
+    CPPUNIT_TEST_SUITE( ConfigCacheTest );
+    CPPUNIT_TEST( testAppendIndent );
+    CPPUNIT_TEST( testInvalidate );
+    CPPUNIT_TEST( testSave );
+    CPPUNIT_TEST( testSaveCoalesce );
+    CPPUNIT_TEST( testSaveError );
+//    CPPUNIT_TEST(  );
+    
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    std::vector<std::pair<int, std::string> > saved_m;
+public:
+    void setUp()
+    {
+        saved_m.clear();
+        unlink("/tmp/linknx_unittest_save.xml");
+    }
+
+    void tearDown()
+    {
+        ConfigSaver::reset();
+        RuleServer::reset();
+        ObjectController::reset();
+        unlink("/tmp/linknx_unittest_save.xml");
+    }
+
+    virtual void onConfigSaved(int id, const std::string& error)
+    {
+        saved_m.push_back(std::make_pair(id, error));
+    }
+
+    void waitSaved(unsigned count)
+    {
+        for (int i = 0; i < 500 && saved_m.size() < count; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(count, (unsigned)saved_m.size());
+    }
+
+    void addObject(const char* id)
+    {
+        ticpp::Element pObject("object");
+        pObject.SetAttribute("id", id);
+        pObject.SetAttribute("type", "1.001");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+
+    void testAppendIndent()
+    {
+        ticpp::Document doc;
+        doc.LoadFromString("<rules><rule id='r1'><condition type='object' id='sw' value='on'/>"
+                           "<actionlist><action type='send-email' to='a@b.c' subject='s'><![CDATA[a\n\tb\n]]></action>"
+                           "</actionlist></rule></rules>");
+        addObject("sw");
+        RuleServer::instance()->importXml(doc.FirstChildElement());
+
+        ticpp::Document expected;
+        ticpp::Element pConfig("config");
+        ticpp::Element pRules("rules");
+        RuleServer::instance()->exportXml(&pRules);
+        pConfig.LinkEndChild(&pRules);
+        expected.LinkEndChild(&pConfig);
+
+        std::string text = "<config>\n";
+        ConfigCache::instance()->append(text, ConfigCache::RulesSection, 1);
+        text.append("</config>\n");
+        CPPUNIT_ASSERT_EQUAL(expected.GetAsString(), text);
+        // The CDATA section is not indented
+        CPPUNIT_ASSERT(text.find("<![CDATA[a\n\tb\n]]>") != std::string::npos);
+    }
+
+    void testInvalidate()
+    {
+        ConfigCache* cache = ConfigCache::instance();
+        std::string text;
+        cache->append(text, ConfigCache::ObjectsSection, 0);
+        CPPUNIT_ASSERT_EQUAL(std::string("<objects />\n"), text);
+        CPPUNIT_ASSERT(cache->isValid(ConfigCache::ObjectsSection));
+
+        addObject("sw");
+        CPPUNIT_ASSERT(!cache->isValid(ConfigCache::ObjectsSection));
+        text.clear();
+        cache->append(text, ConfigCache::ObjectsSection, 0);
+        CPPUNIT_ASSERT(text.find("id=\"sw\"") != std::string::npos);
+
+        // A new controller must not get the text of the previous one
+        ObjectController::reset();
+        ObjectController::instance();
+        text.clear();
+        cache->append(text, ConfigCache::ObjectsSection, 0);
+        CPPUNIT_ASSERT_EQUAL(std::string("<objects />\n"), text);
+
+        ConfigCache::Section section;
+        CPPUNIT_ASSERT(ConfigCache::getSection("logging", &section));
+        CPPUNIT_ASSERT_EQUAL(ConfigCache::LoggingSection, section);
+        CPPUNIT_ASSERT(!ConfigCache::getSection("unknown", &section));
+    }
+
+    void testSave()
+    {
+        addObject("sw");
+        const char* path = "/tmp/linknx_unittest_save.xml";
+        FILE* fp = fopen(path, "w");
+        fputs("old", fp);
+        fclose(fp);
+        chmod(path, 0600);
+
+        ConfigSaver::instance()->save(path, this, 3);
+        CPPUNIT_ASSERT(ConfigSaver::instance()->isSaving());
+        waitSaved(1);
+        CPPUNIT_ASSERT_EQUAL(3, saved_m[0].first);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), saved_m[0].second);
+        CPPUNIT_ASSERT(!ConfigSaver::instance()->isSaving());
+
+        ticpp::Document doc;
+        doc.LoadFile(path);
+        ticpp::Element* pObject = doc.FirstChildElement("config")->FirstChildElement("objects")->FirstChildElement("object");
+        CPPUNIT_ASSERT_EQUAL(std::string("sw"), pObject->GetAttribute("id"));
+        struct stat st;
+        CPPUNIT_ASSERT(stat(path, &st) == 0);
+        CPPUNIT_ASSERT_EQUAL(0600, (int)(st.st_mode & 07777));
+        CPPUNIT_ASSERT(access("/tmp/linknx_unittest_save.xml.tmp", F_OK) != 0);
+    }
+
+    void testSaveCoalesce()
+    {
+        const char* path = "/tmp/linknx_unittest_save.xml";
+        ConfigSaver* saver = ConfigSaver::instance();
+        saver->save(path, this, 1);
+        // Requested while the first one runs, they are written together
+        // with the config at the time the second write starts
+        saver->save(path, this, 2);
+        saver->save(path, this, 3);
+        addObject("late");
+        waitSaved(3);
+        CPPUNIT_ASSERT_EQUAL(1, saved_m[0].first);
+        CPPUNIT_ASSERT_EQUAL(2, saved_m[1].first);
+        CPPUNIT_ASSERT_EQUAL(3, saved_m[2].first);
+        CPPUNIT_ASSERT_EQUAL(2, saver->getWriteCount());
+
+        ticpp::Document doc;
+        doc.LoadFile(path);
+        ticpp::Element* pObject = doc.FirstChildElement("config")->FirstChildElement("objects")->FirstChildElement("object");
+        CPPUNIT_ASSERT_EQUAL(std::string("late"), pObject->GetAttribute("id"));
+
+        // A removed listener is not called
+        saver->save(path, this, 4);
+        saver->removeListener(this);
+        for (int i = 0; i < 500 && saver->isSaving(); i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(3, (int)saved_m.size());
+    }
+
+    void testSaveError()
+    {
+        ConfigSaver::instance()->save("/nonexistent/dir/linknx.xml", this, 5);
+        waitSaved(1);
+        CPPUNIT_ASSERT_EQUAL(5, saved_m[0].first);
+        CPPUNIT_ASSERT(saved_m[0].second.find("/nonexistent/dir/linknx.xml") != std::string::npos);
+        CPPUNIT_ASSERT_EQUAL(0, ConfigSaver::instance()->getWriteCount());
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ConfigCacheTest );
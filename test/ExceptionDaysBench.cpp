@@ -0,0 +1,86 @@
+#include "bench.h"
+#include "timermanager.h"
+#include "services.h"
+
+/*
+ * Looks up every hour of a 10-year holiday calendar (yearly holidays,
+ * movable feasts and school holidays given as fixed dates) and schedules
+ * a timer restricted to the exception days.
+ */
+
+namespace
+{
+    void addDay(ExceptionDays* days, int year, int mon, int mday)
+    {
+        DaySpec* day = new DaySpec();
+        day->year_m = year;
+        day->mon_m = mon;
+        day->mday_m = mday;
+        days->addDay(day);
+    }
+
+    time_t makeTime(int year, int mon, int mday)
+    {
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_year = year;
+        timeinfo.tm_mon = mon;
+        timeinfo.tm_mday = mday;
+        timeinfo.tm_hour = 12;
+        timeinfo.tm_isdst = -1;
+        return mktime(&timeinfo);
+    }
+}
+
+class ExceptionDaysBenchTask : public PeriodicTask
+{
+public:
+    ExceptionDaysBenchTask() : PeriodicTask(0) {};
+    time_t callFindNext(time_t start, TimeSpec* next) { return findNext(start, next); };
+};
+
+BENCHMARK(ExceptionDaysLookup)
+{
+    ExceptionDays* days = Services::instance()->getExceptionDays();
+    days->clear();
+    int yearly[][2] = {{0, 1}, {4, 1}, {4, 8}, {6, 14}, {7, 15}, {10, 1}, {10, 11}, {11, 25}};
+    for (unsigned i = 0; i < sizeof(yearly) / sizeof(yearly[0]); i++)
+        addDay(days, -1, yearly[i][0], yearly[i][1]);
+    int count = 8;
+    for (int year = 115; year < 125; year++)
+    {
+        // Movable feasts and two weeks of school holidays in July
+        addDay(days, year, 3, 1 + year % 20);
+        addDay(days, year, 4, 10 + year % 15);
+        addDay(days, year, 5, 1 + year % 12);
+        count += 3;
+        for (int mday = 1; mday <= 14; mday++)
+            addDay(days, year, 6, mday + year % 10);
+        count += 14;
+    }
+
+    time_t start = makeTime(115, 0, 1);
+    time_t end = makeTime(125, 0, 1);
+    double lookupStart = Benchmark::now();
+    int lookups = 0, found = 0;
+    for (time_t t = start; t < end; t += 3600)
+    {
+        lookups++;
+        if (days->isException(t))
+            found++;
+    }
+    double lookupTime = Benchmark::now() - lookupStart;
+
+    ExceptionDaysBenchTask task;
+    TimeSpec spec(0, 7, TimeSpec::All, TimeSpec::Yes);
+    double findStart = Benchmark::now();
+    int occurrences = 0;
+    for (time_t t = task.callFindNext(start, &spec); t != 0 && t < end; t = task.callFindNext(t, &spec))
+        occurrences++;
+    double findTime = Benchmark::now() - findStart;
+
+    std::cout << count << " exception days over 10 years:" << std::endl;
+    std::cout << "  " << lookups << " lookups (" << found << " exceptions) " << lookupTime << " s, "
+              << occurrences << " occurrences of an exception-only timer " << findTime << " s" << std::endl;
+    Services::reset();
+}
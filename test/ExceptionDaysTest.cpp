@@ -9,6 +9,7 @@ class ExceptionDaysTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testIsException );
     CPPUNIT_TEST( testIsExceptionWildcard );
     CPPUNIT_TEST( testIsExceptionWildcard2 );
+    CPPUNIT_TEST( testRemoveDay );
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -204,6 +205,48 @@ public:
         CPPUNIT_ASSERT(!exceptiondays_m->isException(time));
     }
 
+    void testRemoveDay()
+    {
+        time_t time;
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("day", "23");
+        pConfig.SetAttribute("month", "10");
+        pConfig.SetAttribute("year", "2007");
+        DaySpec* ds = new DaySpec();
+        ds->importXml(&pConfig);
+        exceptiondays_m->addDay(ds);
+
+        ticpp::Element pConfig2;
+        pConfig2.SetAttribute("day", "24");
+        pConfig2.SetAttribute("year", "2007");
+        DaySpec* ds2 = new DaySpec();
+        ds2->importXml(&pConfig2);
+        exceptiondays_m->addDay(ds2);
+
+        struct tm timeinfo;
+        timeinfo.tm_hour = 12;
+        timeinfo.tm_min = 0;
+        timeinfo.tm_sec = 0;
+        timeinfo.tm_mday = 24;
+        timeinfo.tm_mon = 10-1;
+        timeinfo.tm_year = 2007-1900;
+        time = mktime(&timeinfo);
+        CPPUNIT_ASSERT(exceptiondays_m->isException(time));
+
+        exceptiondays_m->removeDay(ds2);
+        delete ds2;
+
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(time));
+        timeinfo.tm_mday = 23;
+        time = mktime(&timeinfo);
+        CPPUNIT_ASSERT(exceptiondays_m->isException(time));
+
+        exceptiondays_m->removeDay(ds);
+        delete ds;
+
+        CPPUNIT_ASSERT(!exceptiondays_m->isException(time));
+    }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ExceptionDaysTest );
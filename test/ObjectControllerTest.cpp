@@ -1,5 +1,14 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "objectcontroller.h"
+#include <sstream>
+
+class CountingListener : public ChangeListener
+{
+public:
+    CountingListener() : count_m(0) {};
+    virtual void onChange(Object* object) { count_m++; };
+    int count_m;
+};
 
 class ObjectControllerTest : public CppUnit::TestFixture
 {
@@ -8,9 +17,14 @@ class ObjectControllerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testAddSameID );
     CPPUNIT_TEST( testGetNotFound );
     CPPUNIT_TEST( testAddRemove );
+    CPPUNIT_TEST( testSortedObjects );
     CPPUNIT_TEST( testWrite );
     CPPUNIT_TEST( testExportImport );
     CPPUNIT_TEST( testWriteMultipleGad );
+    CPPUNIT_TEST( testChangeLog );
+    CPPUNIT_TEST( testChangeLogTombstones );
+    CPPUNIT_TEST( testSubscriptionFilter );
+    CPPUNIT_TEST( testSubscriptionIndex );
 //    CPPUNIT_TEST(  );
 //    CPPUNIT_TEST(  );
     
@@ -91,6 +105,39 @@ public:
         CPPUNIT_ASSERT_THROW(oc_m->getObject("test_dim2"), ticpp::Exception);
     }
 
+    void testSortedObjects()
+    {
+        const char* ids[] = { "test_c", "test_a", "test_d", "test_b" };
+        for (int i = 0; i < 4; i++)
+        {
+            Object* obj = new SwitchingSwitchObject();
+            obj->setID(ids[i]);
+            oc_m->addObject(obj);
+        }
+        Object* obj = oc_m->getObject("test_d");
+        obj->decRefCount();
+        oc_m->removeObject(obj);
+        // Added and deleted by the config as well
+        ticpp::Document doc;
+        doc.LoadFromString("<objects><object id='test_0' type='1.001'/><object id='test_c' delete='true'/></objects>");
+        oc_m->importXml(doc.FirstChildElement());
+
+        std::list<Object*> objects = oc_m->getObjects();
+        std::string listed;
+        for (std::list<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+        {
+            listed += (*it)->getID() + std::string(" ");
+            (*it)->decRefCount();
+        }
+        CPPUNIT_ASSERT_EQUAL(std::string("test_0 test_a test_b "), listed);
+
+        ticpp::Element pObjects("objects");
+        oc_m->exportObjectValues(&pObjects);
+        ticpp::Element* pFirst = pObjects.FirstChildElement("object");
+        CPPUNIT_ASSERT_EQUAL(std::string("test_0"), pFirst->GetAttribute("id"));
+        CPPUNIT_ASSERT_EQUAL(std::string("test_b"), pObjects.LastChild()->ToElement()->GetAttribute("id"));
+    }
+
     void testWrite()
     {
         ticpp::Element pConfig;
@@ -226,6 +273,212 @@ public:
         CPPUNIT_ASSERT(obj3->getValue() == "off");
     }
 
+
+    void testChangeLog()
+    {
+        Object* obj1 = new SwitchingSwitchObject();
+        obj1->setID("test_sw1");
+        oc_m->addObject(obj1);
+        Object* obj2 = new SwitchingSwitchObject();
+        obj2->setID("test_sw2");
+        oc_m->addObject(obj2);
+        Object* obj3 = new SwitchingSwitchObject();
+        obj3->setID("test_sw3");
+        oc_m->addObject(obj3);
+        uint64_t seq = oc_m->getChangeSeq();
+        uint64_t epoch = oc_m->getEpoch();
+        CPPUNIT_ASSERT_EQUAL((uint64_t)3, seq);
+
+        std::vector<Object*> changed;
+        std::vector<std::string> deleted;
+        bool full;
+        CPPUNIT_ASSERT_EQUAL(seq, oc_m->getChangedObjects(seq, epoch, changed, deleted, full));
+        CPPUNIT_ASSERT(changed.empty());
+        CPPUNIT_ASSERT(!full);
+
+        obj3->setValue("on");
+        obj1->setValue("on");
+        obj3->setValue("off");
+        CPPUNIT_ASSERT_EQUAL(seq + 3, oc_m->getChangedObjects(seq, epoch, changed, deleted, full));
+        CPPUNIT_ASSERT_EQUAL(2, (int)changed.size());
+        CPPUNIT_ASSERT(changed[0] == obj1);
+        CPPUNIT_ASSERT(changed[1] == obj3);
+
+        changed.clear();
+        oc_m->getChangedObjects(seq + 2, epoch, changed, deleted, full);
+        CPPUNIT_ASSERT_EQUAL(1, (int)changed.size());
+        CPPUNIT_ASSERT(changed[0] == obj3);
+
+        // A sequence number of a previous run gets all objects
+        changed.clear();
+        oc_m->getChangedObjects(seq + 100, epoch, changed, deleted, full);
+        CPPUNIT_ASSERT_EQUAL(3, (int)changed.size());
+        CPPUNIT_ASSERT(full);
+
+        oc_m->removeObject(obj3);
+        changed.clear();
+        oc_m->getChangedObjects(seq, epoch, changed, deleted, full);
+        CPPUNIT_ASSERT_EQUAL(1, (int)changed.size());
+        CPPUNIT_ASSERT(changed[0] == obj1);
+        CPPUNIT_ASSERT_EQUAL(1, (int)deleted.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw3"), deleted[0]);
+
+        ticpp::Element pObjects("objects");
+        oc_m->exportChangedValues(&pObjects, seq, epoch);
+        CPPUNIT_ASSERT_EQUAL(std::string("7"), pObjects.GetAttribute("seq"));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), pObjects.GetAttribute("full"));
+        ticpp::Element* pObject = pObjects.FirstChildElement("object");
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw1"), pObject->GetAttribute("id"));
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), pObject->GetAttribute("value"));
+        pObject = pObject->NextSiblingElement(false);
+        CPPUNIT_ASSERT_EQUAL(std::string("test_sw3"), pObject->GetAttribute("id"));
+        CPPUNIT_ASSERT_EQUAL(std::string("true"), pObject->GetAttribute("deleted"));
+        CPPUNIT_ASSERT(pObject->NextSiblingElement(false) == 0);
+    }
+
+    void testChangeLogTombstones()
+    {
+        Object* obj1 = new SwitchingSwitchObject();
+        obj1->setID("test_sw1");
+        oc_m->addObject(obj1);
+        uint64_t epoch = oc_m->getEpoch();
+        oc_m->removeObject(obj1);
+        uint64_t seq = oc_m->getChangeSeq();
+        CPPUNIT_ASSERT_EQUAL((uint64_t)2, seq);
+
+        std::vector<Object*> changed;
+        std::vector<std::string> deleted;
+        bool full;
+        oc_m->getChangedObjects(1, epoch, changed, deleted, full);
+        CPPUNIT_ASSERT(changed.empty());
+        CPPUNIT_ASSERT_EQUAL(1, (int)deleted.size());
+
+        // The tombstone goes away when the ID is reused
+        Object* obj2 = new SwitchingSwitchObject();
+        obj2->setID("test_sw1");
+        oc_m->addObject(obj2);
+        deleted.clear();
+        oc_m->getChangedObjects(1, epoch, changed, deleted, full);
+        CPPUNIT_ASSERT(deleted.empty());
+        CPPUNIT_ASSERT_EQUAL(1, (int)changed.size());
+        CPPUNIT_ASSERT(changed[0] == obj2);
+
+        // Another epoch (daemon restarted) gets a full resync
+        oc_m->removeObject(obj2);
+        changed.clear();
+        oc_m->getChangedObjects(1, epoch + 1, changed, deleted, full);
+        CPPUNIT_ASSERT(full);
+        CPPUNIT_ASSERT(changed.empty());
+        CPPUNIT_ASSERT(deleted.empty());
+
+        ticpp::Element pObjects("objects");
+        oc_m->exportChangedValues(&pObjects, 1, epoch + 1);
+        CPPUNIT_ASSERT_EQUAL(std::string("true"), pObjects.GetAttribute("full"));
+        std::stringstream expected;
+        expected << epoch;
+        CPPUNIT_ASSERT_EQUAL(expected.str(), pObjects.GetAttribute("epoch"));
+    }
+
+    Object* addObject(const char* id, const char* type, const char* gad)
+    {
+        ticpp::Element pConfig("object");
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("gad", gad);
+        Object* obj = Object::create(&pConfig);
+        oc_m->addObject(obj);
+        return obj;
+    }
+
+    void testSubscriptionFilter()
+    {
+        Object* light = addObject("light_kitchen", "1.001", "1/2/3");
+        Object* temp = addObject("temp_kitchen", "9.001", "2/0/1");
+
+        ticpp::Element pFilter("register");
+        pFilter.SetAttribute("pattern", "light_*");
+        SubscriptionFilter filter;
+        filter.importXml(&pFilter);
+        CPPUNIT_ASSERT(filter.matches(light));
+        CPPUNIT_ASSERT(!filter.matches(temp));
+
+        ticpp::Element pType("register");
+        pType.SetAttribute("type", "9.*");
+        filter.importXml(&pType);
+        CPPUNIT_ASSERT(!filter.matches(light));
+        CPPUNIT_ASSERT(filter.matches(temp));
+
+        ticpp::Element pRange("register");
+        pRange.SetAttribute("gad-from", "1/0/0");
+        pRange.SetAttribute("gad-to", "1/7/255");
+        filter.importXml(&pRange);
+        CPPUNIT_ASSERT(filter.matches(light));
+        CPPUNIT_ASSERT(!filter.matches(temp));
+
+        pRange.SetAttribute("gad-to", "0/7/255");
+        CPPUNIT_ASSERT_THROW(filter.importXml(&pRange), ticpp::Exception);
+        ticpp::Element pFrom("register");
+        pFrom.SetAttribute("gad-from", "1/0/0");
+        CPPUNIT_ASSERT_THROW(filter.importXml(&pFrom), ticpp::Exception);
+
+        // An empty filter matches every object
+        CPPUNIT_ASSERT(SubscriptionFilter().matches(light));
+        CPPUNIT_ASSERT(SubscriptionFilter().matches(temp));
+    }
+
+    void testSubscriptionIndex()
+    {
+        Object* light = addObject("light_kitchen", "1.001", "1/2/3");
+        Object* temp = addObject("temp_kitchen", "9.001", "2/0/1");
+        SubscriptionIndex* index = oc_m->getSubscriptions();
+        CountingListener l1, l2;
+
+        SubscriptionFilter byId;
+        byId.setId("light_kitchen");
+        ticpp::Element pFilter("register");
+        pFilter.SetAttribute("pattern", "*_kitchen");
+        SubscriptionFilter byPattern;
+        byPattern.importXml(&pFilter);
+
+        index->subscribe(&l1, byId);
+        SubscriptionIndex::Subscription* sub = index->subscribe(&l1, byPattern);
+        index->subscribe(&l2, byId);
+        CPPUNIT_ASSERT_EQUAL(3, index->getSubscriptionCount());
+
+        // A listener matched by two subscriptions is notified once
+        light->setValue("on");
+        CPPUNIT_ASSERT_EQUAL(1, l1.count_m);
+        CPPUNIT_ASSERT_EQUAL(1, l2.count_m);
+        temp->setFloatValue(21.5);
+        CPPUNIT_ASSERT_EQUAL(2, l1.count_m);
+        CPPUNIT_ASSERT_EQUAL(1, l2.count_m);
+
+        // The fan-out is recomputed after the subscriptions changed
+        index->unsubscribe(sub);
+        temp->setFloatValue(22);
+        CPPUNIT_ASSERT_EQUAL(2, l1.count_m);
+        light->setValue("off");
+        CPPUNIT_ASSERT_EQUAL(3, l1.count_m);
+        CPPUNIT_ASSERT_EQUAL(2, l2.count_m);
+
+        index->unsubscribe(&l2, byId);
+        light->setValue("on");
+        CPPUNIT_ASSERT_EQUAL(4, l1.count_m);
+        CPPUNIT_ASSERT_EQUAL(2, l2.count_m);
+
+        // Objects added later match the existing subscriptions
+        index->subscribe(&l2, SubscriptionFilter());
+        Object* other = addObject("other", "1.001", "3/0/0");
+        other->setValue("on");
+        CPPUNIT_ASSERT_EQUAL(3, l2.count_m);
+
+        index->unsubscribeAll(&l1);
+        index->unsubscribeAll(&l2);
+        CPPUNIT_ASSERT_EQUAL(0, index->getSubscriptionCount());
+        light->setValue("off");
+        CPPUNIT_ASSERT_EQUAL(4, l1.count_m);
+        CPPUNIT_ASSERT_EQUAL(3, l2.count_m);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( ObjectControllerTest );
@@ -0,0 +1,195 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "offloadpool.h"
+#include "objectcontroller.h"
+#include "persistentstorage.h"
+#include <cstring>
+extern "C"
+{
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+}
+
+class ThreadIdTask : public OffloadTask
+{
+public:
+    ThreadIdTask() : finished_m(false) {}
+    virtual void run() { tid_m = pthread_self(); }
+    virtual void finish() { finished_m = true; }
+
+    pthread_t tid_m;
+    bool finished_m;
+};
+
+class SequenceTask : public OffloadTask
+{
+public:
+    SequenceTask(std::vector<int>* sequence, int value) : sequence_m(sequence), value_m(value) {}
+    virtual void run()
+    {
+        // Later tasks are shorter, they would overtake without serialization
+        usleep((20 - value_m % 20) * 100);
+        sequence_m->push_back(value_m);
+    }
+
+    std::vector<int>* sequence_m;
+    int value_m;
+};
+
+// HTTP-like request to a server that only answers when the test lets it
+class StalledRequest : public OffloadTask
+{
+public:
+    StalledRequest(int port) : port_m(port) {}
+    virtual void run()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port_m);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            const char* req = "GET / HTTP/1.0\r\n\r\n";
+            if (write(fd, req, strlen(req)) > 0)
+            {
+                char buf[64];
+                int len = read(fd, buf, sizeof(buf) - 1);
+                if (len > 0)
+                    response_m.assign(buf, len);
+            }
+        }
+        close(fd);
+    }
+
+    int port_m;
+    std::string response_m;
+};
+
+// Stands for the KNX connection: delivers telegrams while the call is stalled,
+// then lets the stand-in server answer
+class BusFeeder : public Thread
+{
+public:
+    BusFeeder(int serverFd, int count) : serverFd_m(serverFd), count_m(count), delivered_m(0) {}
+
+    void Run (pth_sem_t * stop)
+    {
+        eibaddr_t src = Object::ReadAddr("0.2.10");
+        eibaddr_t dest = Object::ReadGroupAddr("1/1/50");
+        for (int i = 0; i < count_m; i++)
+        {
+            uint8_t buf[2] = {0, (uint8_t)(i % 2 ? 0x80 : 0x81)};
+            ObjectController::instance()->onWrite(src, dest, buf, 2);
+            delivered_m++;
+            pth_usleep(10000);
+        }
+        int fd = pth_accept(serverFd_m, 0, 0);
+        const char* resp = "HTTP/1.0 200 OK\r\n\r\n";
+        pth_write(fd, resp, strlen(resp));
+        close(fd);
+    }
+
+    int serverFd_m;
+    int count_m;
+    int delivered_m;
+};
+
+class OffloadPoolTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( OffloadPoolTest );
+    CPPUNIT_TEST( testExecute );
+    CPPUNIT_TEST( testSerialKey );
+    CPPUNIT_TEST( testDispatchDuringStall );
+    CPPUNIT_TEST( testFileStorage );
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+    }
+
+    void tearDown()
+    {
+        OffloadPool::reset();
+        ObjectController::reset();
+    }
+
+    void testExecute()
+    {
+        ThreadIdTask task;
+        OffloadPool::instance()->execute(&task);
+        CPPUNIT_ASSERT(task.finished_m);
+        CPPUNIT_ASSERT(!pthread_equal(task.tid_m, pthread_self()));
+        CPPUNIT_ASSERT_EQUAL(0, OffloadPool::instance()->getPendingCount());
+    }
+
+    void testSerialKey()
+    {
+        std::vector<int> sequence;
+        for (int i = 0; i < 40; i++)
+            OffloadPool::instance()->post(new SequenceTask(&sequence, i), &sequence);
+        OffloadPool::instance()->sync(&sequence);
+        CPPUNIT_ASSERT_EQUAL(40, (int)sequence.size());
+        for (int i = 0; i < 40; i++)
+            CPPUNIT_ASSERT_EQUAL(i, sequence[i]);
+    }
+
+    void testDispatchDuringStall()
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "test_sw");
+        pConfig.SetAttribute("gad", "1/1/50");
+        Object *obj = Object::create(&pConfig);
+        obj->setValue("off");
+        ObjectController::instance()->addObject(obj);
+
+        int serverFd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        CPPUNIT_ASSERT_EQUAL(0, bind(serverFd, (struct sockaddr*)&addr, sizeof(addr)));
+        CPPUNIT_ASSERT_EQUAL(0, listen(serverFd, 1));
+        socklen_t len = sizeof(addr);
+        getsockname(serverFd, (struct sockaddr*)&addr, &len);
+
+        BusFeeder feeder(serverFd, 5);
+        feeder.Start();
+        StalledRequest request(ntohs(addr.sin_port));
+        OffloadPool::instance()->execute(&request);
+        // The server only answered once all the telegrams were dispatched
+        CPPUNIT_ASSERT_EQUAL(5, feeder.delivered_m);
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), obj->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("HTTP/1.0 200 OK\r\n\r\n"), request.response_m);
+        feeder.Stop();
+        close(serverFd);
+    }
+
+    void testFileStorage()
+    {
+        if (system ("rm -rf /tmp/linknx_unittest_persist && mkdir /tmp/linknx_unittest_persist") != 0)
+        {
+            CPPUNIT_FAIL("Test fixture setup failed.");
+        }
+        std::string path("/tmp/linknx_unittest_persist"), logPath;
+        FilePersistentStorage* storage = new FilePersistentStorage(path, logPath);
+        for (int i = 0; i < 20; i++)
+        {
+            std::stringstream value;
+            value << "value" << i;
+            storage->write("obj", value.str());
+        }
+        // Reads see the writes that are not stored yet
+        CPPUNIT_ASSERT_EQUAL(std::string("value19"), storage->read("obj"));
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage->read("unknown", "none"));
+        storage->writelog("obj", "on");
+        delete storage;
+        CPPUNIT_ASSERT_EQUAL(0, system("grep -q ' > on' /tmp/linknx_unittest_persist/obj.log"));
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( OffloadPoolTest );
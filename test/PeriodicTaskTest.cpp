@@ -24,6 +24,8 @@ class PeriodicTaskTest : public CppUnit::TestFixture, public ChangeListener
     CPPUNIT_TEST( testFindNextHourNoMinute2 );
     CPPUNIT_TEST( testFindNextHourAndWeekdayNotException );
     CPPUNIT_TEST( testFindNextHourAndWeekdayOnlyException );
+    CPPUNIT_TEST( testFindNextOnlyExceptionYearsAhead );
+    CPPUNIT_TEST( testFindNextMinuteAndWeekday );
     CPPUNIT_TEST( testFindNextHourDst );
     CPPUNIT_TEST( testFindNextHourDst2 );
     CPPUNIT_TEST( testFindNextHourDst3 );
@@ -449,6 +451,56 @@ public:
         CPPUNIT_ASSERT_EQUAL(3, timeinfo->tm_wday);
     }
     
+    void testFindNextOnlyExceptionYearsAhead()
+    {
+        time_t next;
+        struct tm * timeinfo;
+        TimeSpec ts1(30, 16, TimeSpec::Wed, TimeSpec::Yes);
+        DaySpec* ds = new DaySpec();
+        ds->mday_m = 3;
+        ds->mon_m = 2;
+        ds->year_m = 110;
+        Services::instance()->getExceptionDays()->addDay(ds);
+
+        next = task_m->callFindNext(timeref1_m, &ts1);
+
+        CPPUNIT_ASSERT(next != 0);
+        timeinfo = localtime(&next);
+        CPPUNIT_ASSERT_EQUAL(30, timeinfo->tm_min);
+        CPPUNIT_ASSERT_EQUAL(16, timeinfo->tm_hour);
+        CPPUNIT_ASSERT_EQUAL(3, timeinfo->tm_mday);
+        CPPUNIT_ASSERT_EQUAL(2, timeinfo->tm_mon);
+        CPPUNIT_ASSERT_EQUAL(110, timeinfo->tm_year);
+
+        next = task_m->callFindNext(next, &ts1);
+
+        CPPUNIT_ASSERT(next == 0);
+    }
+
+    void testFindNextMinuteAndWeekday()
+    {
+        time_t next;
+        struct tm * timeinfo;
+        TimeSpec ts1(15, -1, TimeSpec::Wed);
+
+        next = task_m->callFindNext(timeref1_m, &ts1);
+
+        CPPUNIT_ASSERT(next != 0);
+        timeinfo = localtime(&next);
+        CPPUNIT_ASSERT_EQUAL(15, timeinfo->tm_min);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo->tm_hour);
+        CPPUNIT_ASSERT_EQUAL(3, timeinfo->tm_mday);
+        CPPUNIT_ASSERT_EQUAL(0, timeinfo->tm_mon);
+
+        next = task_m->callFindNext(next, &ts1);
+
+        CPPUNIT_ASSERT(next != 0);
+        timeinfo = localtime(&next);
+        CPPUNIT_ASSERT_EQUAL(15, timeinfo->tm_min);
+        CPPUNIT_ASSERT_EQUAL(1, timeinfo->tm_hour);
+        CPPUNIT_ASSERT_EQUAL(3, timeinfo->tm_mday);
+    }
+
     void testFindNextHourDst()
     {
         time_t next;
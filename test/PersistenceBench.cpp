@@ -0,0 +1,120 @@
+#include "bench.h"
+#include "persistentstorage.h"
+#include "offloadpool.h"
+#include <sstream>
+
+/*
+ * Persists 5000 objects with the file, lsm and sqlite backends. Each round
+ * writes all of them and flushes the queue as one batch, then the storage
+ * is reopened and every value read back, as at startup.
+ *
+ * PersistenceRestore restores 5000 objects from the file backend with one
+ * read each, with readAll and from the mapped snapshot.
+ */
+
+namespace
+{
+    const int ObjectCount = 5000;
+    const int Rounds = 10;
+
+    void makeIds(std::vector<std::string>& ids)
+    {
+        for (int i = 0; i < ObjectCount; i++)
+        {
+            std::stringstream id;
+            id << "bench_obj_" << i;
+            ids.push_back(id.str());
+        }
+    }
+
+    double restore(ticpp::Element* pConfig, const std::vector<std::string>& ids, bool bulk)
+    {
+        double start = Benchmark::now();
+        PersistentStorage* storage = PersistentStorage::create(pConfig);
+        if (bulk)
+            storage->beginRestore();
+        for (unsigned i = 0; i < ids.size(); i++)
+            storage->read(ids[i]);
+        if (bulk)
+            storage->endRestore();
+        double time = Benchmark::now() - start;
+        delete storage;
+        return time;
+    }
+
+    void runBackend(const char* type, const char* path = "/tmp/linknx_bench_persist")
+    {
+        if (system("rm -rf /tmp/linknx_bench_persist && mkdir /tmp/linknx_bench_persist") != 0)
+            return;
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("path", path);
+        pConfig.SetAttribute("flush-delay", 60000);
+
+        std::vector<std::string> ids;
+        makeIds(ids);
+
+        PersistentStorage* storage = PersistentStorage::create(&pConfig);
+        double writeStart = Benchmark::now();
+        for (int round = 0; round < Rounds; round++)
+        {
+            std::stringstream value;
+            value << round * 1.5;
+            for (int i = 0; i < ObjectCount; i++)
+                storage->write(ids[i], value.str());
+            storage->flush();
+        }
+        double writeTime = Benchmark::now() - writeStart;
+        delete storage;
+
+        double readStart = Benchmark::now();
+        storage = PersistentStorage::create(&pConfig);
+        int found = 0;
+        for (int i = 0; i < ObjectCount; i++)
+            if (storage->read(ids[i]) != "")
+                found++;
+        double readTime = Benchmark::now() - readStart;
+        delete storage;
+
+        std::cout << "  " << type << ": " << ObjectCount * Rounds << " writes " << writeTime << " s ("
+                  << (int)(ObjectCount * Rounds / writeTime) << "/s), startup with " << found
+                  << " reads " << readTime << " s" << std::endl;
+    }
+}
+
+BENCHMARK(PersistenceBackends)
+{
+    runBackend("file");
+    runBackend("lsm");
+#ifdef HAVE_SQLITE
+    runBackend("sqlite", "/tmp/linknx_bench_persist/linknx.db");
+#endif
+    OffloadPool::reset();
+}
+
+BENCHMARK(PersistenceRestore)
+{
+    if (system("rm -rf /tmp/linknx_bench_persist /tmp/linknx_bench_persist.snap && mkdir /tmp/linknx_bench_persist") != 0)
+        return;
+    ticpp::Element pConfig("persistence");
+    pConfig.SetAttribute("type", "file");
+    pConfig.SetAttribute("path", "/tmp/linknx_bench_persist");
+    std::vector<std::string> ids;
+    makeIds(ids);
+
+    PersistentStorage* storage = PersistentStorage::create(&pConfig);
+    for (int i = 0; i < ObjectCount; i++)
+        storage->write(ids[i], "21.5");
+    delete storage;
+
+    double readTime = restore(&pConfig, ids, false);
+    double readAllTime = restore(&pConfig, ids, true);
+    // Saved on shutdown, after the values were read once
+    pConfig.SetAttribute("snapshot", "/tmp/linknx_bench_persist.snap");
+    restore(&pConfig, ids, false);
+    double snapshotTime = restore(&pConfig, ids, true);
+
+    std::cout << "  " << ObjectCount << " objects: one read each " << readTime << " s, readAll "
+              << readAllTime << " s, snapshot " << snapshotTime << " s" << std::endl;
+    OffloadPool::reset();
+}
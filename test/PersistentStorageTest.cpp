@@ -0,0 +1,817 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "persistentstorage.h"
+#include "offloadpool.h"
+#include "objectcontroller.h"
+#include "services.h"
+#include "clock.h"
+#include <fstream>
+#include <cstdlib>
+#include <unistd.h>
+
+// Backend that can be made unreachable, its batches are then retried
+class FlakyStorage : public PersistentStorage
+{
+public:
+    FlakyStorage() : samples_m(0), down_m(false) {};
+    virtual ~FlakyStorage() { shutdown(); };
+
+    virtual void exportXml(ticpp::Element* pConfig) {};
+
+    ValueMap_t stored_m;
+    int samples_m;
+    bool down_m;
+protected:
+    virtual void writeBatch(Batch& batch)
+    {
+        if (down_m)
+        {
+            batch.error = "Backend down";
+            batch.retry = true;
+            return;
+        }
+        for (ValueMap_t::iterator it = batch.values.begin(); it != batch.values.end(); it++)
+            stored_m[it->first] = it->second;
+        samples_m += batch.samples.size();
+    }
+    virtual std::string readValue(const std::string& id, const std::string& defval)
+    {
+        ValueMap_t::iterator it = stored_m.find(id);
+        return it != stored_m.end() ? it->second : defval;
+    }
+    virtual bool readAllValues(ValueMap_t& values)
+    {
+        values.insert(stored_m.begin(), stored_m.end());
+        return true;
+    }
+    virtual std::string getSource() { return "flaky"; };
+};
+
+class PersistentStorageTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( PersistentStorageTest );
+    CPPUNIT_TEST( testCoalesce );
+    CPPUNIT_TEST( testLogSamples );
+    CPPUNIT_TEST( testFlushDelay );
+    CPPUNIT_TEST( testShutdown );
+    CPPUNIT_TEST( testExportXml );
+    CPPUNIT_TEST( testLsmReopen );
+    CPPUNIT_TEST( testLsmCompaction );
+    CPPUNIT_TEST( testLsmRecovery );
+    CPPUNIT_TEST( testLsmCorruptSnapshot );
+    CPPUNIT_TEST( testLsmSyncInterval );
+    CPPUNIT_TEST( testLsmHistory );
+    CPPUNIT_TEST( testLsmExportXml );
+    CPPUNIT_TEST( testReadAll );
+    CPPUNIT_TEST( testSnapshotRestore );
+    CPPUNIT_TEST( testSnapshotOtherSource );
+    CPPUNIT_TEST( testImportRestore );
+    CPPUNIT_TEST( testRetry );
+    CPPUNIT_TEST( testShutdownWhileDown );
+    CPPUNIT_TEST( testHistoryNotSupported );
+#ifdef HAVE_SQLITE
+    CPPUNIT_TEST( testSqliteReopen );
+    CPPUNIT_TEST( testSqliteHistory );
+#endif
+#ifdef HAVE_MYSQL
+    CPPUNIT_TEST( testMysqlReopen );
+    CPPUNIT_TEST( testMysqlBadRow );
+    CPPUNIT_TEST( testMysqlExportXml );
+#endif
+//    CPPUNIT_TEST(  );
+    
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    PersistentStorage* storage_m;
+
+    PersistentStorage* createStorage(int flushDelay, const char* type = "file")
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_persist");
+        pConfig.SetAttribute("flush-delay", flushDelay);
+        return PersistentStorage::create(&pConfig);
+    }
+
+    PersistentStorage* createWithSnapshot(const char* type)
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", type);
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_persist");
+        pConfig.SetAttribute("flush-delay", 60000);
+        pConfig.SetAttribute("snapshot", "/tmp/linknx_unittest_persist.snap");
+        return PersistentStorage::create(&pConfig);
+    }
+
+    bool fileExists(const char* filename)
+    {
+        return access(filename, F_OK) == 0;
+    }
+
+    LsmPersistentStorage* createLsm(int compactSize = LsmPersistentStorage::DefaultCompactSize)
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", "lsm");
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_persist");
+        pConfig.SetAttribute("flush-delay", 60000);
+        pConfig.SetAttribute("compact-size", compactSize);
+        return dynamic_cast<LsmPersistentStorage*>(PersistentStorage::create(&pConfig));
+    }
+
+    std::string readFile(const std::string& name)
+    {
+        std::ifstream fp_in(("/tmp/linknx_unittest_persist/" + name).c_str());
+        std::string content;
+        std::getline(fp_in, content, static_cast<char>(-1));
+        return content;
+    }
+
+    int countLines(const std::string& text)
+    {
+        int count = 0;
+        for (std::string::size_type i = 0; i < text.size(); i++)
+            if (text[i] == '\n')
+                count++;
+        return count;
+    }
+
+public:
+    void setUp()
+    {
+        storage_m = 0;
+        CPPUNIT_ASSERT(system("rm -rf /tmp/linknx_unittest_persist") != -1);
+        CPPUNIT_ASSERT(system("mkdir /tmp/linknx_unittest_persist") != -1);
+        unlink("/tmp/linknx_unittest_persist.snap");
+    }
+
+    void tearDown()
+    {
+        if (storage_m)
+            delete storage_m;
+        ObjectController::reset();
+        Services::reset();
+        OffloadPool::reset();
+        Clock::reset();
+    }
+
+    void testCoalesce()
+    {
+        storage_m = createStorage(60000);
+        storage_m->write("a", "1");
+        storage_m->write("b", "2");
+        storage_m->write("a", "3");
+        CPPUNIT_ASSERT_EQUAL(2, storage_m->getQueuedCount());
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), storage_m->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), readFile("a"));
+
+        ticpp::Element status("persistence");
+        storage_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status.GetAttribute("queued-values"));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status.GetAttribute("coalesced"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status.GetAttribute("batches"));
+
+        storage_m->flush();
+        CPPUNIT_ASSERT_EQUAL(0, storage_m->getQueuedCount());
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), readFile("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), readFile("b"));
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), storage_m->read("a"));
+
+        ticpp::Element status2("persistence");
+        storage_m->statusXml(&status2);
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status2.GetAttribute("queued-values"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status2.GetAttribute("max-queued"));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status2.GetAttribute("batches"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status2.GetAttribute("written-values"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status2.GetAttribute("errors"));
+    }
+
+    void testLogSamples()
+    {
+        storage_m = createStorage(60000);
+        storage_m->writelog("a", "on");
+        storage_m->writelog("a", "off");
+        storage_m->writelog("b", "12");
+        storage_m->writelog("a", "on");
+        CPPUNIT_ASSERT_EQUAL(4, storage_m->getQueuedCount());
+        storage_m->flush();
+
+        std::string log = readFile("a.log");
+        CPPUNIT_ASSERT_EQUAL(3, countLines(log));
+        std::string::size_type on = log.find(" > on\n");
+        std::string::size_type off = log.find(" > off\n");
+        CPPUNIT_ASSERT(on != std::string::npos);
+        CPPUNIT_ASSERT(off != std::string::npos);
+        CPPUNIT_ASSERT(on < off);
+        CPPUNIT_ASSERT_EQUAL(1, countLines(readFile("b.log")));
+
+        ticpp::Element status("persistence");
+        storage_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("4"), status.GetAttribute("written-samples"));
+    }
+
+    void testFlushDelay()
+    {
+        storage_m = createStorage(20);
+        storage_m->write("a", "1");
+        storage_m->writelog("a", "1");
+        for (int i = 0; i < 100 && storage_m->getQueuedCount() > 0; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(0, storage_m->getQueuedCount());
+        OffloadPool::instance()->sync(storage_m);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), readFile("a"));
+        CPPUNIT_ASSERT_EQUAL(1, countLines(readFile("a.log")));
+
+        // The flusher goes back to sleep once the queue is empty
+        storage_m->write("a", "2");
+        for (int i = 0; i < 100 && storage_m->getQueuedCount() > 0; i++)
+            pth_usleep(10000);
+        OffloadPool::instance()->sync(storage_m);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), readFile("a"));
+    }
+
+    void testShutdown()
+    {
+        PersistentStorage* storage = createStorage(60000);
+        storage->write("a", "1");
+        storage->writelog("a", "1");
+        delete storage;
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), readFile("a"));
+        CPPUNIT_ASSERT_EQUAL(1, countLines(readFile("a.log")));
+    }
+
+    void testExportXml()
+    {
+        storage_m = createStorage(PersistentStorage::DefaultFlushDelay);
+        ticpp::Element pConfig("persistence");
+        storage_m->exportXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), pConfig.GetAttribute("flush-delay"));
+        delete storage_m;
+
+        storage_m = createStorage(250);
+        CPPUNIT_ASSERT_EQUAL(250, storage_m->getFlushDelay());
+        ticpp::Element pConfig2("persistence");
+        storage_m->exportXml(&pConfig2);
+        CPPUNIT_ASSERT_EQUAL(std::string("250"), pConfig2.GetAttribute("flush-delay"));
+    }
+
+    void testLsmReopen()
+    {
+        storage_m = createLsm();
+        CPPUNIT_ASSERT(storage_m);
+        storage_m->write("a", "1");
+        storage_m->write("b", "2");
+        storage_m->flush();
+        storage_m->write("a", "3");
+        storage_m->write("c", "");
+        delete storage_m;
+
+        storage_m = createLsm();
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), storage_m->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("b"));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), storage_m->read("c", "none"));
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage_m->read("d", "none"));
+    }
+
+    void testLsmCompaction()
+    {
+        LsmPersistentStorage* storage = createLsm(200);
+        storage_m = storage;
+        for (int round = 0; round < 10; round++)
+        {
+            for (int i = 0; i < 5; i++)
+            {
+                std::stringstream id, value;
+                id << "obj" << i;
+                value << "value" << round;
+                storage->write(id.str(), value.str());
+            }
+            storage->flush();
+        }
+        CPPUNIT_ASSERT(storage->getCompactionCount() > 0);
+        CPPUNIT_ASSERT(readFile("values.snap") != "");
+        CPPUNIT_ASSERT(readFile("values.log").size() <= 200);
+        delete storage_m;
+
+        storage_m = createLsm(200);
+        for (int i = 0; i < 5; i++)
+        {
+            std::stringstream id;
+            id << "obj" << i;
+            CPPUNIT_ASSERT_EQUAL(std::string("value9"), storage_m->read(id.str()));
+        }
+    }
+
+    void testLsmRecovery()
+    {
+        storage_m = createLsm();
+        storage_m->write("a", "1");
+        storage_m->write("b", "2");
+        delete storage_m;
+        storage_m = 0;
+
+        // Record torn by a crash in the middle of an append
+        std::ofstream fp_out("/tmp/linknx_unittest_persist/values.log", std::ios::app);
+        fp_out << std::string("\x20\x00\x00\x00\x12\x34", 6);
+        fp_out.close();
+
+        LsmPersistentStorage* storage = createLsm();
+        storage_m = storage;
+        CPPUNIT_ASSERT_EQUAL(6, storage->getDroppedBytes());
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), storage->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage->read("b"));
+        storage->write("a", "3");
+        delete storage_m;
+
+        // The records appended after the recovery are not lost behind the torn one
+        storage = createLsm();
+        storage_m = storage;
+        CPPUNIT_ASSERT_EQUAL(0, storage->getDroppedBytes());
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), storage->read("a"));
+    }
+
+    void testLsmCorruptSnapshot()
+    {
+        LsmPersistentStorage* storage = createLsm(200);
+        storage_m = storage;
+        for (int round = 0; round < 10; round++)
+        {
+            for (int i = 0; i < 5; i++)
+            {
+                std::stringstream id;
+                id << "obj" << i;
+                storage->write(id.str(), "old");
+            }
+            storage->flush();
+        }
+        CPPUNIT_ASSERT(storage->getCompactionCount() > 0);
+        storage->write("obj0", "new");
+        delete storage_m;
+        storage_m = 0;
+
+        // Damages the last record of the snapshot
+        std::string snapshot = readFile("values.snap");
+        snapshot[snapshot.size() - 1] ^= 0xff;
+        std::ofstream fp_out("/tmp/linknx_unittest_persist/values.snap", std::ios::trunc);
+        fp_out << snapshot;
+        fp_out.close();
+
+        storage_m = createLsm(200);
+        CPPUNIT_ASSERT(fileExists("/tmp/linknx_unittest_persist/values.snap.corrupt"));
+        CPPUNIT_ASSERT(!fileExists("/tmp/linknx_unittest_persist/values.snap"));
+        CPPUNIT_ASSERT_EQUAL(std::string("new"), storage_m->read("obj0"));
+        CPPUNIT_ASSERT_EQUAL(std::string("old"), storage_m->read("obj1"));
+    }
+
+    void testLsmSyncInterval()
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", "lsm");
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_persist");
+        pConfig.SetAttribute("sync", "interval");
+        pConfig.SetAttribute("sync-interval", 100);
+        LsmPersistentStorage* storage = dynamic_cast<LsmPersistentStorage*>(PersistentStorage::create(&pConfig));
+        storage_m = storage;
+        storage->write("a", "1");
+        storage->flush();
+        int syncs = storage->getSyncCount();
+        storage->write("a", "2");
+        storage->flush();
+        // Synced by the flusher once the interval elapsed, without another batch
+        for (int i = 0; i < 100 && storage->getSyncCount() == syncs; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(storage->getSyncCount() > syncs);
+    }
+
+    void testLsmHistory()
+    {
+        storage_m = createLsm();
+        storage_m->writelog("a", "on");
+        storage_m->writelog("b", "12");
+        storage_m->writelog("a", "off");
+        storage_m->flush();
+        std::string history = readFile("history.log");
+        CPPUNIT_ASSERT_EQUAL(3, countLines(history));
+        CPPUNIT_ASSERT(history.find(" a > on\n") != std::string::npos);
+        CPPUNIT_ASSERT(history.find(" b > 12\n") != std::string::npos);
+        CPPUNIT_ASSERT(history.find(" a > off\n") > history.find(" a > on\n"));
+    }
+
+    void testLsmExportXml()
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", "lsm");
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_persist/");
+        pConfig.SetAttribute("sync", "interval");
+        pConfig.SetAttribute("sync-interval", 5000);
+        storage_m = PersistentStorage::create(&pConfig);
+        ticpp::Element pExport("persistence");
+        storage_m->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("lsm"), pExport.GetAttribute("type"));
+        CPPUNIT_ASSERT_EQUAL(std::string("interval"), pExport.GetAttribute("sync"));
+        CPPUNIT_ASSERT_EQUAL(std::string("5000"), pExport.GetAttribute("sync-interval"));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), pExport.GetAttribute("compact-size"));
+
+        ticpp::Element pBad("persistence");
+        pBad.SetAttribute("type", "lsm");
+        pBad.SetAttribute("path", "/tmp/linknx_unittest_persist");
+        pBad.SetAttribute("sync", "sometimes");
+        CPPUNIT_ASSERT_THROW(PersistentStorage::create(&pBad), ticpp::Exception);
+    }
+
+    void testReadAll()
+    {
+        storage_m = createStorage(60000);
+        storage_m->write("a", "1");
+        storage_m->write("b", "2");
+        storage_m->writelog("a", "1");
+        // Not the log of an object, only looks like one
+        storage_m->write("e.log", "5");
+        storage_m->flush();
+        storage_m->write("a", "3");
+        storage_m->write("c", "4");
+
+        PersistentStorage::ValueMap_t values;
+        CPPUNIT_ASSERT(storage_m->readAll(values));
+        CPPUNIT_ASSERT_EQUAL(4, (int)values.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), values["a"]);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), values["b"]);
+        CPPUNIT_ASSERT_EQUAL(std::string("4"), values["c"]);
+        CPPUNIT_ASSERT_EQUAL(std::string("5"), values["e.log"]);
+
+        // Restored from the backend, an unknown object needs no read
+        storage_m->beginRestore();
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("b"));
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage_m->read("d", "none"));
+        storage_m->endRestore();
+        ticpp::Element status("persistence");
+        storage_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("backend"), status.GetAttribute("restored-from"));
+    }
+
+    void testSnapshotRestore()
+    {
+        storage_m = createWithSnapshot("file");
+        storage_m->write("a", "1");
+        storage_m->write("b", "2");
+        delete storage_m;
+        storage_m = 0;
+        CPPUNIT_ASSERT(fileExists("/tmp/linknx_unittest_persist.snap"));
+
+        // Changed behind the back of the storage, the snapshot wins
+        CPPUNIT_ASSERT(system("echo -n 9 > /tmp/linknx_unittest_persist/a") != -1);
+        storage_m = createWithSnapshot("file");
+        storage_m->beginRestore();
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), storage_m->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("b"));
+        // Not in the snapshot, read from the backend
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage_m->read("c", "none"));
+        storage_m->endRestore();
+        ticpp::Element status("persistence");
+        storage_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("snapshot"), status.GetAttribute("restored-from"));
+
+        // The first stored value makes the snapshot stale
+        storage_m->write("a", "5");
+        storage_m->flush();
+        CPPUNIT_ASSERT(!fileExists("/tmp/linknx_unittest_persist.snap"));
+        delete storage_m;
+        storage_m = 0;
+        CPPUNIT_ASSERT(fileExists("/tmp/linknx_unittest_persist.snap"));
+
+        storage_m = createWithSnapshot("file");
+        storage_m->beginRestore();
+        CPPUNIT_ASSERT_EQUAL(std::string("5"), storage_m->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("b"));
+        storage_m->endRestore();
+    }
+
+    void testSnapshotOtherSource()
+    {
+        storage_m = createWithSnapshot("file");
+        storage_m->write("a", "1");
+        delete storage_m;
+        storage_m = 0;
+        CPPUNIT_ASSERT(fileExists("/tmp/linknx_unittest_persist.snap"));
+
+        storage_m = createWithSnapshot("lsm");
+        storage_m->beginRestore();
+        CPPUNIT_ASSERT_EQUAL(std::string(""), storage_m->read("a"));
+        storage_m->endRestore();
+        ticpp::Element status("persistence");
+        storage_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("backend"), status.GetAttribute("restored-from"));
+    }
+
+    void testImportRestore()
+    {
+        ticpp::Element pSvcConfig("services");
+        ticpp::Element pPersistenceConfig("persistence");
+        pPersistenceConfig.SetAttribute("type", "lsm");
+        pPersistenceConfig.SetAttribute("path", "/tmp/linknx_unittest_persist");
+        pSvcConfig.LinkEndChild(&pPersistenceConfig);
+        Services::instance()->importXml(&pSvcConfig);
+        PersistentStorage* storage = Services::instance()->getPersistentStorage();
+        storage->write("persist_sw", "on");
+        storage->write("persist_num", "42");
+        storage->flush();
+
+        ticpp::Element pObjects("objects");
+        ticpp::Element pSw("object");
+        pSw.SetAttribute("id", "persist_sw");
+        pSw.SetAttribute("init", "persist");
+        pObjects.InsertEndChild(pSw);
+        ticpp::Element pNum("object");
+        pNum.SetAttribute("id", "persist_num");
+        pNum.SetAttribute("type", "5.xxx");
+        pNum.SetAttribute("init", "persist");
+        pObjects.InsertEndChild(pNum);
+        ObjectController::instance()->importXml(&pObjects);
+
+        Object* sw = ObjectController::instance()->getObject("persist_sw");
+        Object* num = ObjectController::instance()->getObject("persist_num");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), sw->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("42"), num->getValue());
+        sw->decRefCount();
+        num->decRefCount();
+        ticpp::Element status("persistence");
+        storage->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("backend"), status.GetAttribute("restored-from"));
+    }
+
+    void testRetry()
+    {
+        FlakyStorage* storage = new FlakyStorage();
+        storage_m = storage;
+        storage->down_m = true;
+        storage->write("a", "1");
+        storage->writelog("a", "1");
+        storage->flush();
+        // Kept in the queue until the backend is back
+        CPPUNIT_ASSERT_EQUAL(2, storage->getQueuedCount());
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), storage->read("a"));
+        storage->write("a", "2");
+        storage->writelog("a", "2");
+        storage->flush();
+        CPPUNIT_ASSERT_EQUAL(3, storage->getQueuedCount());
+
+        ticpp::Element status("persistence");
+        storage->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status.GetAttribute("retries"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status.GetAttribute("batches"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), status.GetAttribute("errors"));
+
+        storage->down_m = false;
+        storage->flush();
+        CPPUNIT_ASSERT_EQUAL(0, storage->getQueuedCount());
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage->stored_m["a"]);
+        CPPUNIT_ASSERT_EQUAL(2, storage->samples_m);
+        ticpp::Element status2("persistence");
+        storage->statusXml(&status2);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status2.GetAttribute("batches"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), status2.GetAttribute("written-samples"));
+    }
+
+    void testShutdownWhileDown()
+    {
+        FlakyStorage* storage = new FlakyStorage();
+        storage->down_m = true;
+        storage->write("a", "1");
+        storage->writelog("a", "1");
+        // Gives up instead of retrying forever
+        delete storage;
+    }
+
+    void testHistoryNotSupported()
+    {
+        storage_m = createStorage(60000);
+        storage_m->writelog("a", "1");
+        PersistentStorage::SampleList_t samples;
+        CPPUNIT_ASSERT(!storage_m->readHistory("a", 0, Clock::now(), samples));
+    }
+
+#ifdef HAVE_SQLITE
+    PersistentStorage* createSqlite()
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", "sqlite");
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_persist/linknx.db");
+        pConfig.SetAttribute("flush-delay", 60000);
+        return PersistentStorage::create(&pConfig);
+    }
+
+    void testSqliteReopen()
+    {
+        storage_m = createSqlite();
+        storage_m->write("a", "1");
+        storage_m->write("b", "it's \"quoted\"");
+        storage_m->write("a", "2");
+        storage_m->flush();
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("a"));
+        delete storage_m;
+        storage_m = 0;
+
+        storage_m = createSqlite();
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("it's \"quoted\""), storage_m->read("b"));
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage_m->read("c", "none"));
+        PersistentStorage::ValueMap_t values;
+        CPPUNIT_ASSERT(storage_m->readAll(values));
+        CPPUNIT_ASSERT_EQUAL(2, (int)values.size());
+
+        ticpp::Element pExport("persistence");
+        storage_m->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("sqlite"), pExport.GetAttribute("type"));
+        CPPUNIT_ASSERT_EQUAL(std::string("/tmp/linknx_unittest_persist/linknx.db"), pExport.GetAttribute("path"));
+    }
+
+    void testSqliteHistory()
+    {
+        VirtualClock* clock = new VirtualClock(1350000000000LL);
+        Clock::set(clock);
+        storage_m = createSqlite();
+        for (int i = 0; i < 5; i++)
+        {
+            std::stringstream value;
+            value << i;
+            storage_m->writelog("a", value.str());
+            storage_m->writelog("b", "x");
+            clock->advance(1000);
+        }
+        storage_m->flush();
+        // Not stored yet
+        storage_m->writelog("a", "5");
+
+        PersistentStorage::SampleList_t samples;
+        CPPUNIT_ASSERT(storage_m->readHistory("a", 0, Clock::now(), samples));
+        CPPUNIT_ASSERT_EQUAL(6, (int)samples.size());
+        for (int i = 0; i < 6; i++)
+        {
+            CPPUNIT_ASSERT_EQUAL(std::string("a"), samples[i].id);
+            CPPUNIT_ASSERT_EQUAL((time_t)1350000000 + i, samples[i].time);
+        }
+        CPPUNIT_ASSERT_EQUAL(std::string("5"), samples[5].value);
+
+        CPPUNIT_ASSERT(storage_m->readHistory("a", 1350000001, 1350000002, samples));
+        CPPUNIT_ASSERT_EQUAL(2, (int)samples.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), samples[0].value);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), samples[1].value);
+
+        CPPUNIT_ASSERT(storage_m->readHistory("a", 1350000003, Clock::now(), samples, 2));
+        CPPUNIT_ASSERT_EQUAL(2, (int)samples.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), samples[0].value);
+        CPPUNIT_ASSERT_EQUAL(std::string("4"), samples[1].value);
+
+        CPPUNIT_ASSERT(storage_m->readHistory("b", 0, Clock::now(), samples));
+        CPPUNIT_ASSERT_EQUAL(5, (int)samples.size());
+        CPPUNIT_ASSERT(storage_m->readHistory("c", 0, Clock::now(), samples));
+        CPPUNIT_ASSERT_EQUAL(0, (int)samples.size());
+        delete storage_m;
+        storage_m = 0;
+    }
+#endif
+
+#ifdef HAVE_MYSQL
+    // The MySQL tests need a server and are skipped unless the database is
+    // given in LINKNX_TEST_MYSQL_DB, along with LINKNX_TEST_MYSQL_HOST,
+    // LINKNX_TEST_MYSQL_USER and LINKNX_TEST_MYSQL_PASS. They recreate the
+    // tables linknx_unittest_values and linknx_unittest_log.
+    std::string getEnv(const char* name)
+    {
+        const char* value = getenv(name);
+        return value ? value : "";
+    }
+
+    bool hasMysql()
+    {
+        return getEnv("LINKNX_TEST_MYSQL_DB") != "";
+    }
+
+    // Runs the statement on a connection of its own, returns the number
+    // of rows of its result if any
+    int mysqlQuery(const std::string& query)
+    {
+        MYSQL con;
+        CPPUNIT_ASSERT(mysql_init(&con) != NULL);
+        if (!mysql_real_connect(&con, getEnv("LINKNX_TEST_MYSQL_HOST").c_str(), getEnv("LINKNX_TEST_MYSQL_USER").c_str(),
+                                getEnv("LINKNX_TEST_MYSQL_PASS").c_str(), getEnv("LINKNX_TEST_MYSQL_DB").c_str(), 0, NULL, 0))
+        {
+            std::string error = mysql_error(&con);
+            mysql_close(&con);
+            CPPUNIT_FAIL("Unable to connect: " + error);
+        }
+        int rows = 0;
+        bool ok = mysql_real_query(&con, query.c_str(), query.length()) == 0;
+        std::string error = mysql_error(&con);
+        if (ok)
+        {
+            MYSQL_RES* result = mysql_store_result(&con);
+            if (result)
+            {
+                rows = mysql_num_rows(result);
+                mysql_free_result(result);
+            }
+        }
+        mysql_close(&con);
+        CPPUNIT_ASSERT_MESSAGE(query + ": " + error, ok);
+        return rows;
+    }
+
+    // The rows with the value 'bad' are refused by the server
+    void createMysqlTables()
+    {
+        mysqlQuery("DROP TABLE IF EXISTS linknx_unittest_values");
+        mysqlQuery("DROP TABLE IF EXISTS linknx_unittest_log");
+        mysqlQuery("CREATE TABLE linknx_unittest_values (`object` VARCHAR(64) NOT NULL PRIMARY KEY, "
+                   "`value` VARCHAR(255), CHECK (`value` <> 'bad')) ENGINE=InnoDB");
+        mysqlQuery("CREATE TABLE linknx_unittest_log (ts DATETIME NOT NULL, object VARCHAR(64) NOT NULL, "
+                   "value VARCHAR(255), CHECK (value <> 'bad')) ENGINE=InnoDB");
+    }
+
+    PersistentStorage* createMysql(int batchRows = MysqlPersistentStorage::DefaultBatchRows)
+    {
+        ticpp::Element pConfig("persistence");
+        pConfig.SetAttribute("type", "mysql");
+        pConfig.SetAttribute("host", getEnv("LINKNX_TEST_MYSQL_HOST"));
+        pConfig.SetAttribute("user", getEnv("LINKNX_TEST_MYSQL_USER"));
+        pConfig.SetAttribute("pass", getEnv("LINKNX_TEST_MYSQL_PASS"));
+        pConfig.SetAttribute("db", getEnv("LINKNX_TEST_MYSQL_DB"));
+        pConfig.SetAttribute("table", "linknx_unittest_values");
+        pConfig.SetAttribute("logtable", "linknx_unittest_log");
+        pConfig.SetAttribute("flush-delay", 60000);
+        pConfig.SetAttribute("batch-rows", batchRows);
+        return PersistentStorage::create(&pConfig);
+    }
+
+    void testMysqlReopen()
+    {
+        if (!hasMysql())
+            return;
+        createMysqlTables();
+        storage_m = createMysql(2);
+        storage_m->write("a", "1");
+        storage_m->write("b", "it's \"quoted\"");
+        storage_m->write("c", "3");
+        storage_m->write("a", "2");
+        storage_m->writelog("a", "1");
+        storage_m->writelog("a", "2");
+        storage_m->writelog("c", "3");
+        storage_m->flush();
+        delete storage_m;
+        storage_m = 0;
+
+        storage_m = createMysql();
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), storage_m->read("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("it's \"quoted\""), storage_m->read("b"));
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage_m->read("d", "none"));
+        PersistentStorage::ValueMap_t values;
+        CPPUNIT_ASSERT(storage_m->readAll(values));
+        CPPUNIT_ASSERT_EQUAL(3, (int)values.size());
+        CPPUNIT_ASSERT_EQUAL(3, mysqlQuery("SELECT * FROM linknx_unittest_log"));
+    }
+
+    void testMysqlBadRow()
+    {
+        if (!hasMysql())
+            return;
+        createMysqlTables();
+        storage_m = createMysql();
+        storage_m->write("a", "1");
+        storage_m->write("b", "bad");
+        storage_m->write("c", "3");
+        storage_m->writelog("a", "1");
+        storage_m->writelog("b", "bad");
+        storage_m->writelog("c", "3");
+        storage_m->flush();
+
+        // Only the refused rows are lost
+        CPPUNIT_ASSERT_EQUAL(2, mysqlQuery("SELECT * FROM linknx_unittest_values"));
+        CPPUNIT_ASSERT_EQUAL(2, mysqlQuery("SELECT * FROM linknx_unittest_log"));
+        CPPUNIT_ASSERT_EQUAL(std::string("none"), storage_m->read("b", "none"));
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), storage_m->read("c"));
+        ticpp::Element status("persistence");
+        storage_m->statusXml(&status);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), status.GetAttribute("errors"));
+
+        // The connection is still usable
+        storage_m->write("b", "2");
+        storage_m->flush();
+        CPPUNIT_ASSERT_EQUAL(3, mysqlQuery("SELECT * FROM linknx_unittest_values"));
+    }
+
+    void testMysqlExportXml()
+    {
+        if (!hasMysql())
+            return;
+        createMysqlTables();
+        storage_m = createMysql(10);
+        ticpp::Element pExport("persistence");
+        storage_m->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("mysql"), pExport.GetAttribute("type"));
+        CPPUNIT_ASSERT_EQUAL(std::string("linknx_unittest_values"), pExport.GetAttribute("table"));
+        CPPUNIT_ASSERT_EQUAL(std::string("linknx_unittest_log"), pExport.GetAttribute("logtable"));
+        CPPUNIT_ASSERT_EQUAL(std::string("10"), pExport.GetAttribute("batch-rows"));
+    }
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( PersistentStorageTest );
@@ -0,0 +1,258 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "processmanager.h"
+#include "ruleserver.h"
+#include "objectcontroller.h"
+#include "services.h"
+#include "clock.h"
+#include <unistd.h>
+
+class RecordingProcess : public ChildProcess
+{
+public:
+    RecordingProcess(const std::string& cmd, int* exited, int timeout = 0)
+        : ChildProcess(cmd, timeout, true), exited_m(exited) {}
+
+    virtual void onExit(int status, const std::string& output)
+    {
+        status_m = status;
+        output_m = output;
+        (*exited_m)++;
+    }
+
+    static int status_m;
+    static std::string output_m;
+
+private:
+    int* exited_m;
+};
+
+int RecordingProcess::status_m;
+std::string RecordingProcess::output_m;
+
+class ProcessManagerTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( ProcessManagerTest );
+    CPPUNIT_TEST( testSplitCommand );
+    CPPUNIT_TEST( testDirectOutput );
+    CPPUNIT_TEST( testShellStatus );
+    CPPUNIT_TEST( testTimeout );
+    CPPUNIT_TEST( testTimeoutClock );
+    CPPUNIT_TEST( testMaxRunning );
+    CPPUNIT_TEST( testShellCommandAction );
+    CPPUNIT_TEST( testShellCommandActionPending );
+    CPPUNIT_TEST( testShellCommandActionCancel );
+    CPPUNIT_TEST( testShellCommandActionFinishedSem );
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+        RecordingProcess::status_m = -1;
+        RecordingProcess::output_m = "";
+    }
+
+    void tearDown()
+    {
+        ProcessManager::reset();
+        ObjectController::reset();
+        Services::reset();
+        Clock::reset();
+    }
+
+    // Waits at most 5s for count processes to exit
+    bool waitFor(int* exited, int count)
+    {
+        for (int i = 0; i < 500 && *exited < count; i++)
+            pth_usleep(10000);
+        return *exited >= count;
+    }
+
+    void testSplitCommand()
+    {
+        std::vector<std::string> args;
+        CPPUNIT_ASSERT(ProcessManager::splitCommand("  /usr/bin/logger -t linknx\tstarted ", args));
+        CPPUNIT_ASSERT_EQUAL(4, (int)args.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("/usr/bin/logger"), args[0]);
+        CPPUNIT_ASSERT_EQUAL(std::string("-t"), args[1]);
+        CPPUNIT_ASSERT_EQUAL(std::string("started"), args[3]);
+
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("echo hello > /tmp/out", args));
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("echo 'hello world'", args));
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("echo $HOME", args));
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("ls *.log", args));
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("a; b", args));
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("VAR=1 cmd", args));
+        CPPUNIT_ASSERT(!ProcessManager::splitCommand("   ", args));
+    }
+
+    void testDirectOutput()
+    {
+        int exited = 0;
+        ProcessManager::instance()->launch(new RecordingProcess("echo hello  world", &exited));
+        CPPUNIT_ASSERT(waitFor(&exited, 1));
+        CPPUNIT_ASSERT_EQUAL(0, RecordingProcess::status_m);
+        CPPUNIT_ASSERT_EQUAL(std::string("hello world\n"), RecordingProcess::output_m);
+        CPPUNIT_ASSERT_EQUAL(0, ProcessManager::instance()->getRunningCount());
+    }
+
+    void testShellStatus()
+    {
+        int exited = 0;
+        ProcessManager::instance()->launch(new RecordingProcess("echo partial; exit 3", &exited));
+        CPPUNIT_ASSERT(waitFor(&exited, 1));
+        CPPUNIT_ASSERT_EQUAL(3, RecordingProcess::status_m);
+        CPPUNIT_ASSERT_EQUAL(std::string("partial\n"), RecordingProcess::output_m);
+
+        ProcessManager::instance()->launch(new RecordingProcess("/nonexistent/command", &exited));
+        CPPUNIT_ASSERT(waitFor(&exited, 2));
+        CPPUNIT_ASSERT_EQUAL(127, RecordingProcess::status_m);
+    }
+
+    void testTimeout()
+    {
+        int exited = 0;
+        time_t start = time(0);
+        ProcessManager::instance()->launch(new RecordingProcess("sleep 5; echo late", &exited, 1));
+        CPPUNIT_ASSERT(waitFor(&exited, 1));
+        CPPUNIT_ASSERT(time(0) - start < 4);
+        CPPUNIT_ASSERT_EQUAL(128 + SIGKILL, RecordingProcess::status_m);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), RecordingProcess::output_m);
+    }
+
+    void testTimeoutClock()
+    {
+        VirtualClock* clock = new VirtualClock(1000000000000LL);
+        Clock::set(clock);
+        int exited = 0;
+        ProcessManager::instance()->launch(new RecordingProcess("sleep 5", &exited, 60));
+        clock->advance(59000);
+        pth_usleep(50000);
+        CPPUNIT_ASSERT_EQUAL(0, exited);
+        clock->advance(1000);
+        CPPUNIT_ASSERT(waitFor(&exited, 1));
+        CPPUNIT_ASSERT_EQUAL(128 + SIGKILL, RecordingProcess::status_m);
+    }
+
+    void testMaxRunning()
+    {
+        // Only saved when not the default
+        ticpp::Element pServices("services");
+        Services::instance()->exportXml(&pServices);
+        CPPUNIT_ASSERT(pServices.FirstChildElement("processes", false) == 0);
+
+        ticpp::Element pConfig("processes");
+        pConfig.SetAttribute("max-running", 2);
+        ProcessManager::instance()->importXml(&pConfig);
+
+        int exited = 0;
+        for (int i = 0; i < 5; i++)
+            ProcessManager::instance()->launch(new RecordingProcess("sleep 0.2", &exited));
+        CPPUNIT_ASSERT_EQUAL(2, ProcessManager::instance()->getRunningCount());
+        CPPUNIT_ASSERT_EQUAL(3, ProcessManager::instance()->getQueuedCount());
+        CPPUNIT_ASSERT(waitFor(&exited, 5));
+        CPPUNIT_ASSERT_EQUAL(0, ProcessManager::instance()->getQueuedCount());
+
+        ticpp::Element pExport("processes");
+        ProcessManager::instance()->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pExport.GetAttribute("max-running"));
+        ticpp::Element pServices2("services");
+        Services::instance()->exportXml(&pServices2);
+        CPPUNIT_ASSERT(pServices2.FirstChildElement("processes", false) != 0);
+    }
+
+    void testShellCommandAction()
+    {
+        ticpp::Element pConfig;
+        pConfig.SetAttribute("id", "cmd_status");
+        pConfig.SetAttribute("type", "5.xxx");
+        Object *status = Object::create(&pConfig);
+        ObjectController::instance()->addObject(status);
+        pConfig.SetAttribute("id", "cmd_output");
+        pConfig.SetAttribute("type", "28.001");
+        Object *output = Object::create(&pConfig);
+        ObjectController::instance()->addObject(output);
+
+        ticpp::Element pAction("action");
+        pAction.SetAttribute("type", "shell-cmd");
+        pAction.SetAttribute("cmd", "printf 'line1\\nline2\\n'; exit 4");
+        pAction.SetAttribute("timeout", 10);
+        pAction.SetAttribute("status-object", "cmd_status");
+        pAction.SetAttribute("output-object", "cmd_output");
+        Action* action = Action::create(&pAction);
+
+        ticpp::Element pExport("action");
+        action->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("10"), pExport.GetAttribute("timeout"));
+        CPPUNIT_ASSERT_EQUAL(std::string("cmd_status"), pExport.GetAttribute("status-object"));
+        CPPUNIT_ASSERT_EQUAL(std::string("cmd_output"), pExport.GetAttribute("output-object"));
+
+        action->execute();
+        for (int i = 0; i < 500 && status->getValue() != "4"; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(std::string("4"), status->getValue());
+        CPPUNIT_ASSERT_EQUAL(std::string("line1\nline2"), output->getValue());
+        delete action;
+    }
+
+    Action* createShellAction(const char* cmd)
+    {
+        ticpp::Element pAction("action");
+        pAction.SetAttribute("type", "shell-cmd");
+        pAction.SetAttribute("cmd", cmd);
+        return Action::create(&pAction);
+    }
+
+    void testShellCommandActionPending()
+    {
+        Action* action = createShellAction("sleep 0.2; touch /tmp/linknx_unittest_cmd");
+        unlink("/tmp/linknx_unittest_cmd");
+        action->execute();
+        pth_usleep(50000);
+        // Not finished before the command exits
+        CPPUNIT_ASSERT(!action->isFinished());
+        for (int i = 0; i < 500 && !action->isFinished(); i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT(action->isFinished());
+        CPPUNIT_ASSERT(access("/tmp/linknx_unittest_cmd", F_OK) == 0);
+        unlink("/tmp/linknx_unittest_cmd");
+        delete action;
+    }
+
+    void testShellCommandActionCancel()
+    {
+        Action* action = createShellAction("sleep 0.2");
+        action->execute();
+        pth_usleep(50000);
+        action->cancel();
+        CPPUNIT_ASSERT(action->isFinished());
+        delete action;
+        // The command still runs to completion
+        CPPUNIT_ASSERT_EQUAL(1, ProcessManager::instance()->getRunningCount());
+        for (int i = 0; i < 500 && ProcessManager::instance()->getRunningCount() > 0; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(0, ProcessManager::instance()->getRunningCount());
+    }
+
+    void testShellCommandActionFinishedSem()
+    {
+        pth_sem_t finished;
+        pth_sem_init(&finished);
+        Action* action = createShellAction("sleep 0.2");
+        action->setFinishedSem(&finished);
+        action->execute();
+        action->execute();
+        pth_usleep(50000);
+        unsigned int value;
+        pth_sem_get_value(&finished, &value);
+        CPPUNIT_ASSERT_EQUAL(0u, value);
+        CPPUNIT_ASSERT_EQUAL(2, ProcessManager::instance()->getRunningCount());
+        // Once per command
+        for (int i = 0; i < 500 && !action->isFinished(); i++)
+            pth_usleep(10000);
+        pth_sem_get_value(&finished, &value);
+        CPPUNIT_ASSERT_EQUAL(2u, value);
+        action->release();
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( ProcessManagerTest );
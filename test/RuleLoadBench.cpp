@@ -0,0 +1,97 @@
+#include "bench.h"
+#include "ruleserver.h"
+#include "services.h"
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+
+/*
+ * Loads synthetic configurations of 1k, 10k and 50k rules (with 2 objects
+ * per rule) and reports the time spent parsing the XML, importing objects
+ * and importing rules, as well as the resident memory growth.
+ */
+
+namespace
+{
+    long getRssKb()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "VmRSS:") == 0)
+                return atol(line.c_str() + 6);
+        }
+        return 0;
+    }
+
+    std::string generateConfig(int nbRules)
+    {
+        int nbObjects = nbRules * 2;
+        std::stringstream xml;
+        xml << "<config><objects>";
+        for (int i = 0; i < nbObjects; i++)
+            xml << "<object id='obj" << i << "' type='1.001' gad='" << ((i / 2048) % 32) << "/"
+                << ((i / 256) % 8) << "/" << (i % 256) << "'>Object " << i << "</object>";
+        xml << "</objects><rules>";
+        for (int i = 0; i < nbRules; i++)
+        {
+            // Reference objects spread over the whole id range
+            unsigned int o1 = (i * 7919u) % nbObjects, o2 = (i * 104729u + 1) % nbObjects, o3 = (i * 2u + 1) % nbObjects;
+            xml << "<rule id='rule" << i << "' init='false'><condition type='and'>"
+                << "<condition type='object' id='obj" << o1 << "' value='on' trigger='true'/>"
+                << "<condition type='object' id='obj" << o2 << "' value='off'/></condition>"
+                << "<actionlist><action type='set-value' id='obj" << o3 << "' value='on'/></actionlist>"
+                << "<actionlist type='on-false'><action type='copy-value' from='obj" << o1 << "' to='obj" << o3 << "'/></actionlist>"
+                << "</rule>";
+        }
+        xml << "</rules></config>";
+        return xml.str();
+    }
+
+    void loadConfig(int nbRules)
+    {
+        std::string xml = generateConfig(nbRules);
+        long rss0 = getRssKb();
+
+        double start = Benchmark::now();
+        ticpp::Document doc;
+        doc.LoadFromString(xml);
+        double parsed = Benchmark::now();
+        long rss1 = getRssKb();
+
+        ticpp::Element* pConfig = doc.FirstChildElement();
+        ObjectController::instance()->importXml(pConfig->FirstChildElement("objects"));
+        double objectsLoaded = Benchmark::now();
+        RuleServer::instance()->importXml(pConfig->FirstChildElement("rules"));
+        double rulesLoaded = Benchmark::now();
+        long rss2 = getRssKb();
+
+        double lookupStart = Benchmark::now();
+        for (int i = 0; i < nbRules; i++)
+        {
+            std::stringstream id;
+            id << "rule" << (i * 7) % nbRules;
+            RuleServer::instance()->getRule(id.str().c_str());
+        }
+        double lookups = Benchmark::now() - lookupStart;
+
+        std::cout << nbRules << " rules:" << std::endl;
+        std::cout << "  parse " << (parsed - start) << " s, objects " << (objectsLoaded - parsed)
+                  << " s, rules " << (rulesLoaded - objectsLoaded) << " s, " << nbRules << " lookups "
+                  << lookups << " s" << std::endl;
+        std::cout << "  RSS: document " << (rss1 - rss0) << " kB, objects and rules " << (rss2 - rss1) << " kB ("
+                  << ((rss2 - rss1) * 1024 / nbRules) << " bytes per rule)" << std::endl;
+
+        RuleServer::reset();
+        ObjectController::reset();
+        Services::reset();
+    }
+}
+
+BENCHMARK(RuleLoad)
+{
+    loadConfig(1000);
+    loadConfig(10000);
+    loadConfig(50000);
+}
@@ -0,0 +1,156 @@
+#include "bench.h"
+#include "rulepartitioner.h"
+#include "ruleshardexecutor.h"
+#include "services.h"
+#include <sstream>
+#include <unistd.h>
+
+/*
+ * Synthetic home configuration: 20000 rules organized in groups (rooms,
+ * scenes) of 1 to 40 rules sharing a handful of objects. Some groups are
+ * chained together through a shared object, and a few rules use Lua-like
+ * opaque dependencies. The benchmark measures the partitioning itself,
+ * then triggers every rule as an object change would and times the
+ * evaluation rounds of RuleShardExecutor with 1/2/4/8 threads against the
+ * inline evaluation. The speed-up is bounded by the number of CPUs.
+ */
+
+namespace
+{
+    const int nbRules = 20000;
+    const int nbEvalLoops = 20;
+
+    unsigned int seed = 12345;
+    int nextRandom(int max)
+    {
+        seed = seed * 1103515245 + 12345;
+        return (seed / 65536) % max;
+    }
+
+    class OpaqueCondition : public Condition
+    {
+    public:
+        virtual bool evaluate() { return false; }
+        virtual void importXml(ticpp::Element* pConfig) {}
+        virtual void exportXml(ticpp::Element* pConfig) {}
+        virtual void statusXml(ticpp::Element* pStatus) {}
+    };
+
+    class OpaqueRule : public Rule
+    {
+    public:
+        void makeOpaque() { setCondition(new OpaqueCondition()); }
+    };
+
+    void addObject(const std::string& id)
+    {
+        ticpp::Element pConfig("object");
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", "1.001");
+        ObjectController::instance()->addObject(Object::create(&pConfig));
+    }
+
+    std::string objectId(int i)
+    {
+        std::stringstream id;
+        id << "obj" << i;
+        return id.str();
+    }
+
+    // Conditions never become true, actions are imported but not executed
+    Rule* createRule(int index, int firstObj, int nbObjs, bool opaque)
+    {
+        std::stringstream xml;
+        xml << "<rule id='rule" << index << "' init='false'><condition type='and'>"
+            << "<condition type='object' id='" << objectId(firstObj + nextRandom(nbObjs)) << "' value='on' trigger='true'/>"
+            << "<condition type='object' id='" << objectId(firstObj + nextRandom(nbObjs)) << "' value='on'/>"
+            << "</condition><actionlist type='if-true'>"
+            << "<action type='set-value' id='" << objectId(firstObj + nextRandom(nbObjs)) << "' value='on'/>"
+            << "</actionlist></rule>";
+        ticpp::Document doc;
+        doc.LoadFromString(xml.str());
+        OpaqueRule* rule = new OpaqueRule();
+        rule->importXml(doc.FirstChildElement());
+        if (opaque)
+            rule->makeOpaque();
+        return rule;
+    }
+
+    double evaluateInline(const std::vector<Rule*>& rules)
+    {
+        double start = Benchmark::now();
+        for (int loop = 0; loop < nbEvalLoops; loop++)
+            for (std::vector<Rule*>::const_iterator it = rules.begin(); it != rules.end(); it++)
+                (*it)->onChange(0);
+        return Benchmark::now() - start;
+    }
+
+    // One round per loop, every rule is waiting in its shard inbox
+    double evaluateThreaded(const std::vector<Rule*>& rules, int threads)
+    {
+        RuleShardExecutor executor(threads);
+        executor.build(rules);
+        double start = Benchmark::now();
+        for (int loop = 0; loop < nbEvalLoops; loop++)
+        {
+            for (std::vector<Rule*>::const_iterator it = rules.begin(); it != rules.end(); it++)
+                (*it)->onChange(0);
+            executor.flush();
+        }
+        return Benchmark::now() - start;
+    }
+}
+
+BENCHMARK(RulePartitionScaling)
+{
+    std::vector<Rule*> rules;
+    int nbObjs = 0;
+    double start = Benchmark::now();
+    while ((int)rules.size() < nbRules)
+    {
+        int groupSize = 1 + nextRandom(40);
+        int groupObjs = 2 + groupSize / 4;
+        int firstObj = nbObjs;
+        // 5% of the groups share an object with the previous group
+        if (nbObjs > 0 && nextRandom(20) == 0)
+            firstObj--;
+        for (int i = nbObjs; i < firstObj + groupObjs; i++)
+            addObject(objectId(i));
+        nbObjs = firstObj + groupObjs;
+        for (int i = 0; i < groupSize && (int)rules.size() < nbRules; i++)
+            rules.push_back(createRule(rules.size(), firstObj, groupObjs, nextRandom(1000) == 0));
+    }
+    std::cout << "Created " << rules.size() << " rules and " << nbObjs << " objects in "
+              << (Benchmark::now() - start) << " s" << std::endl;
+
+    start = Benchmark::now();
+    RulePartitioner partitioner;
+    for (std::vector<Rule*>::iterator it = rules.begin(); it != rules.end(); it++)
+        partitioner.addRule(*it);
+    RulePartitioner::PartitionList_t partitions;
+    partitioner.compute(partitions);
+    std::cout << "Partitioned into " << partitions.size() << " partitions in "
+              << (Benchmark::now() - start) << " s (largest has " << partitions.front().rules_m.size()
+              << " rules, shared has " << (partitions.back().shared_m ? partitions.back().rules_m.size() : 0)
+              << " rules)" << std::endl;
+
+    std::cout << "Evaluating all rules " << nbEvalLoops << " times on " << sysconf(_SC_NPROCESSORS_ONLN)
+              << " CPU(s)" << std::endl;
+    double inlineTime = evaluateInline(rules);
+    std::cout << "  inline: " << inlineTime << " s" << std::endl;
+    int threads[] = { 1, 2, 4, 8 };
+    double base = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        double time = evaluateThreaded(rules, threads[i]);
+        if (i == 0)
+            base = time;
+        std::cout << "  " << threads[i] << " thread(s): " << time << " s, speed-up x" << (base / time)
+                  << " (x" << (inlineTime / time) << " against inline)" << std::endl;
+    }
+
+    for (std::vector<Rule*>::iterator it = rules.begin(); it != rules.end(); it++)
+        delete (*it);
+    ObjectController::reset();
+    Services::reset();
+}
@@ -0,0 +1,177 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "rulepartitioner.h"
+#include "services.h"
+
+class OpaqueCondition : public Condition
+{
+public:
+    virtual bool evaluate() { return false; }
+    virtual void importXml(ticpp::Element* pConfig) {}
+    virtual void exportXml(ticpp::Element* pConfig) {}
+    virtual void statusXml(ticpp::Element* pStatus) {}
+};
+
+class OpaqueRule : public Rule
+{
+public:
+    void makeOpaque() { setCondition(new OpaqueCondition()); }
+};
+
+class RulePartitionerTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( RulePartitionerTest );
+    CPPUNIT_TEST( testComponents );
+    CPPUNIT_TEST( testRuleReference );
+    CPPUNIT_TEST( testVarString );
+    CPPUNIT_TEST( testOpaqueRule );
+    CPPUNIT_TEST( testExportXml );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    std::list<Rule*> rules_m;
+    RulePartitioner* partitioner_m;
+
+    Rule* importRule(const std::string& xml, Rule* rule)
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(xml);
+        rule->importXml(doc.FirstChildElement());
+        rules_m.push_back(rule);
+        return rule;
+    }
+
+    Rule* addRule(const std::string& xml)
+    {
+        Rule* rule = importRule(xml, new Rule());
+        partitioner_m->addRule(rule);
+        return rule;
+    }
+
+    void addObject(const char* id, const char* type)
+    {
+        ticpp::Element pConfig("object");
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", type);
+        Object* obj = Object::create(&pConfig);
+        ObjectController::instance()->addObject(obj);
+    }
+
+    bool contains(const RulePartitioner::Partition& partition, Rule* rule)
+    {
+        for (std::vector<Rule*>::const_iterator it = partition.rules_m.begin(); it != partition.rules_m.end(); it++)
+            if (*it == rule)
+                return true;
+        return false;
+    }
+
+public:
+    void setUp()
+    {
+        partitioner_m = new RulePartitioner();
+        addObject("a", "1.001");
+        addObject("b", "1.001");
+        addObject("c", "1.001");
+        addObject("d", "1.001");
+        addObject("e", "1.001");
+        addObject("f", "16.001");
+    }
+
+    void tearDown()
+    {
+        delete partitioner_m;
+        for (std::list<Rule*>::iterator it = rules_m.begin(); it != rules_m.end(); it++)
+            delete (*it);
+        rules_m.clear();
+        ObjectController::reset();
+        Services::reset();
+    }
+
+    void testComponents()
+    {
+        Rule* r1 = addRule("<rule id='r1'><condition type='object' id='a' value='on' trigger='true'/>"
+                           "<actionlist><action type='set-value' id='b' value='on'/></actionlist></rule>");
+        Rule* r2 = addRule("<rule id='r2'><condition type='object' id='b' value='on' trigger='true'/>"
+                           "<actionlist><action type='set-value' id='c' value='on'/></actionlist></rule>");
+        Rule* r3 = addRule("<rule id='r3'><condition type='object' id='d' value='on'/><actionlist/></rule>");
+
+        RulePartitioner::PartitionList_t partitions;
+        partitioner_m->compute(partitions);
+        CPPUNIT_ASSERT_EQUAL(2, (int)partitions.size());
+        CPPUNIT_ASSERT_EQUAL(2, (int)partitions[0].rules_m.size());
+        CPPUNIT_ASSERT_EQUAL(3, (int)partitions[0].objects_m.size());
+        CPPUNIT_ASSERT(contains(partitions[0], r1));
+        CPPUNIT_ASSERT(contains(partitions[0], r2));
+        CPPUNIT_ASSERT(!partitions[0].shared_m);
+        CPPUNIT_ASSERT(contains(partitions[1], r3));
+        CPPUNIT_ASSERT_EQUAL(1, (int)partitions[1].objects_m.size());
+    }
+
+    void testRuleReference()
+    {
+        Rule* r1 = addRule("<rule id='r1'><condition type='object' id='a' value='on'/><actionlist/></rule>");
+        Rule* r2 = addRule("<rule id='r2'><condition type='object' id='b' value='on'/>"
+                           "<actionlist><action type='cancel' rule-id='r1'/></actionlist></rule>");
+        addRule("<rule id='r3'><condition type='object' id='c' value='on'/><actionlist/></rule>");
+
+        RulePartitioner::PartitionList_t partitions;
+        partitioner_m->compute(partitions);
+        CPPUNIT_ASSERT_EQUAL(2, (int)partitions.size());
+        CPPUNIT_ASSERT(contains(partitions[0], r1));
+        CPPUNIT_ASSERT(contains(partitions[0], r2));
+    }
+
+    void testVarString()
+    {
+        Rule* r1 = addRule("<rule id='r1'><condition type='object' id='a' value='on'/><actionlist/></rule>");
+        Rule* r2 = addRule("<rule id='r2'><condition type='object' id='b' value='on'/>"
+                           "<actionlist><action type='set-string' id='f' value='a is ${a}, $${c} is not'/></actionlist></rule>");
+
+        RulePartitioner::PartitionList_t partitions;
+        partitioner_m->compute(partitions);
+        CPPUNIT_ASSERT_EQUAL(1, (int)partitions.size());
+        CPPUNIT_ASSERT(contains(partitions[0], r1));
+        CPPUNIT_ASSERT(contains(partitions[0], r2));
+        CPPUNIT_ASSERT_EQUAL(3, (int)partitions[0].objects_m.size());
+    }
+
+    void testOpaqueRule()
+    {
+        OpaqueRule* r1 = new OpaqueRule();
+        importRule("<rule id='r1'><condition type='object' id='a' value='on'/><actionlist/></rule>", r1);
+        r1->makeOpaque();
+        partitioner_m->addRule(r1);
+        Rule* r2 = addRule("<rule id='r2'><condition type='object' id='b' value='on'/>"
+                           "<actionlist><action type='set-rule-active' rule-id='r1' active='off'/></actionlist></rule>");
+        Rule* r3 = addRule("<rule id='r3'><condition type='object' id='a' value='on'/><actionlist/></rule>");
+
+        RulePartitioner::PartitionList_t partitions;
+        partitioner_m->compute(partitions);
+        CPPUNIT_ASSERT_EQUAL(2, (int)partitions.size());
+        CPPUNIT_ASSERT(contains(partitions[0], r3));
+        CPPUNIT_ASSERT(!partitions[0].shared_m);
+        CPPUNIT_ASSERT(partitions[1].shared_m);
+        CPPUNIT_ASSERT_EQUAL(2, (int)partitions[1].rules_m.size());
+        CPPUNIT_ASSERT(contains(partitions[1], r1));
+        CPPUNIT_ASSERT(contains(partitions[1], r2));
+    }
+
+    void testExportXml()
+    {
+        addRule("<rule id='r1'><condition type='and'><condition type='object' id='a' value='on'/>"
+                "<condition type='object' id='b' value='on'/></condition><actionlist/></rule>");
+        addRule("<rule id='r2'><condition type='object' id='c' value='on'/><actionlist/></rule>");
+        addRule("<rule id='r3'><condition type='object' id='d' value='on'/><actionlist/></rule>");
+
+        ticpp::Element pStatus("partitions");
+        partitioner_m->exportXml(&pStatus);
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), pStatus.GetAttribute("count"));
+        CPPUNIT_ASSERT_EQUAL(std::string("3"), pStatus.GetAttribute("rules"));
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pStatus.GetAttribute("shared"));
+        ticpp::Element* pPartition = pStatus.FirstChildElement("partition");
+        CPPUNIT_ASSERT_EQUAL(std::string("0"), pPartition->GetAttribute("id"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pPartition->GetAttribute("objects"));
+        CPPUNIT_ASSERT_EQUAL(std::string("r1"), pPartition->FirstChildElement("rule")->GetAttribute("id"));
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( RulePartitionerTest );
@@ -0,0 +1,274 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "ruleshardexecutor.h"
+#include "services.h"
+#include <sstream>
+
+namespace
+{
+    // Keeps the default Condition::isThreadSafe()
+    class MainThreadCondition : public Condition
+    {
+    public:
+        virtual bool evaluate() { return true; }
+        virtual void importXml(ticpp::Element* pConfig) {}
+        virtual void exportXml(ticpp::Element* pConfig) {}
+        virtual void statusXml(ticpp::Element* pStatus) {}
+    };
+
+    class MainThreadRule : public Rule
+    {
+    public:
+        MainThreadRule() { setCondition(new MainThreadCondition()); }
+    };
+}
+
+class RuleShardExecutorTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( RuleShardExecutorTest );
+    CPPUNIT_TEST( testBuild );
+    CPPUNIT_TEST( testEvaluate );
+    CPPUNIT_TEST( testCoalesce );
+    CPPUNIT_TEST( testInactive );
+    CPPUNIT_TEST( testEdgeTriggered );
+    CPPUNIT_TEST( testImportExport );
+    CPPUNIT_TEST( testDeletePending );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void addObject(const std::string& id)
+    {
+        ticpp::Element pConfig("object");
+        pConfig.SetAttribute("id", id);
+        pConfig.SetAttribute("type", "1.001");
+        ObjectController::instance()->addObject(Object::create(&pConfig));
+    }
+
+    void importRules(const std::string& xml)
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(xml);
+        RuleServer::instance()->importXml(doc.FirstChildElement());
+    }
+
+    std::string copyRule(int i)
+    {
+        std::stringstream xml;
+        xml << "<rule id='r" << i << "'><condition type='object' id='in" << i << "' value='on' trigger='true'/>"
+            << "<actionlist type='if-true'><action type='set-value' id='out" << i << "' value='on'/></actionlist></rule>";
+        return xml.str();
+    }
+
+    void setValue(const std::string& id, const std::string& value)
+    {
+        Object* object = ObjectController::instance()->getObject(id);
+        object->setValue(value);
+        object->decRefCount();
+    }
+
+    std::string getValue(const std::string& id)
+    {
+        Object* object = ObjectController::instance()->getObject(id);
+        std::string value = object->getValue();
+        object->decRefCount();
+        return value;
+    }
+
+    // Lets the set-value actions run
+    void waitForValue(const std::string& id, const std::string& value)
+    {
+        for (int i = 0; i < 100 && getValue(id) != value; i++)
+            pth_usleep(10000);
+    }
+
+    ticpp::Element* getShard(ticpp::Element& pStatus, int index)
+    {
+        ticpp::Iterator<ticpp::Element> child("shard");
+        for (child = pStatus.FirstChildElement("shard", false); child != child.end(); child++)
+        {
+            int id;
+            child->GetAttribute("id", &id);
+            if (id == index)
+                return &(*child);
+        }
+        return 0;
+    }
+
+public:
+    void setUp()
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            std::stringstream id;
+            id << i;
+            addObject("in" + id.str());
+            addObject("out" + id.str());
+        }
+    }
+
+    void tearDown()
+    {
+        RuleServer::reset();
+        ObjectController::reset();
+        Services::reset();
+    }
+
+    void testBuild()
+    {
+        std::vector<Rule*> rules;
+        for (int i = 0; i < 3; i++)
+        {
+            ticpp::Document doc;
+            doc.LoadFromString(copyRule(i));
+            Rule* rule = new Rule();
+            rule->importXml(doc.FirstChildElement());
+            rules.push_back(rule);
+        }
+        Rule* mainThreadRule = new MainThreadRule();
+        rules.push_back(mainThreadRule);
+
+        RuleShardExecutor* executor = new RuleShardExecutor(2);
+        executor->build(rules);
+        CPPUNIT_ASSERT(rules[0]->getShard() != 0);
+        CPPUNIT_ASSERT(rules[1]->getShard() != 0);
+        CPPUNIT_ASSERT(rules[2]->getShard() != 0);
+        CPPUNIT_ASSERT(rules[0]->getShard() != rules[1]->getShard());
+        CPPUNIT_ASSERT(mainThreadRule->getShard() == 0);
+
+        ticpp::Element pStatus("partitions");
+        executor->statusXml(&pStatus);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pStatus.GetAttribute("threads"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), getShard(pStatus, 0)->GetAttribute("rules"));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), getShard(pStatus, 1)->GetAttribute("rules"));
+        // Only the objects read by the conditions
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), getShard(pStatus, 0)->GetAttribute("objects"));
+
+        delete executor;
+        CPPUNIT_ASSERT(rules[0]->getShard() == 0);
+        for (std::vector<Rule*>::iterator it = rules.begin(); it != rules.end(); it++)
+            delete (*it);
+    }
+
+    void testEvaluate()
+    {
+        importRules("<rules threads='3'>" + copyRule(0) + copyRule(1) + copyRule(2) + "</rules>");
+        Rule* rule = RuleServer::instance()->getRule("r0");
+        CPPUNIT_ASSERT(rule->getShard() != 0);
+
+        setValue("in0", "on");
+        setValue("in1", "on");
+        setValue("in2", "on");
+        // Nothing evaluated until the next round
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), getValue("out0"));
+        RuleServer::instance()->flush();
+        waitForValue("out0", "on");
+        waitForValue("out1", "on");
+        waitForValue("out2", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out0"));
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out1"));
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out2"));
+
+        ticpp::Element pStatus("partitions");
+        RuleServer::instance()->partitionXml(&pStatus);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pStatus.GetAttribute("rounds"));
+        for (int i = 0; i < 3; i++)
+            CPPUNIT_ASSERT_EQUAL(std::string("1"), getShard(pStatus, i)->GetAttribute("evaluations"));
+
+        // The dispatcher thread runs the rounds on its own
+        setValue("in0", "off");
+        setValue("out0", "off");
+        pth_usleep(20000);
+        setValue("in0", "on");
+        waitForValue("out0", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out0"));
+    }
+
+    void testCoalesce()
+    {
+        importRules("<rules threads='2'>" + copyRule(0) + copyRule(1) + "</rules>");
+        setValue("in0", "on");
+        setValue("in0", "off");
+        setValue("in0", "on");
+        RuleServer::instance()->flush();
+
+        ticpp::Element pStatus("partitions");
+        RuleServer::instance()->partitionXml(&pStatus);
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), pStatus.GetAttribute("rounds"));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), getShard(pStatus, 0)->GetAttribute("evaluations"));
+        waitForValue("out0", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out0"));
+    }
+
+    void testInactive()
+    {
+        importRules("<rules threads='2'>" + copyRule(0) + "</rules>");
+        RuleServer::instance()->getRule("r0")->setActive(false);
+        setValue("in0", "on");
+        RuleServer::instance()->flush();
+        pth_usleep(20000);
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), getValue("out0"));
+    }
+
+    void testEdgeTriggered()
+    {
+        importRules("<rules threads='2'><rule id='r0'><condition type='object' id='in0' value='on' trigger='true'/>"
+                    "<actionlist type='on-true'><action type='set-value' id='out0' value='on'/></actionlist>"
+                    "<actionlist type='on-false'><action type='set-value' id='out1' value='on'/></actionlist></rule></rules>");
+        CPPUNIT_ASSERT(RuleServer::instance()->getRule("r0")->getShard() == 0);
+
+        // Every transition runs its action list, none is coalesced
+        setValue("in0", "on");
+        setValue("in0", "off");
+        setValue("in0", "on");
+        waitForValue("out0", "on");
+        waitForValue("out1", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out0"));
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out1"));
+    }
+
+    void testImportExport()
+    {
+        importRules("<rules threads='2'>" + copyRule(0) + "</rules>");
+        CPPUNIT_ASSERT_EQUAL(2, RuleServer::instance()->getThreads());
+
+        // Partial updates keep the mode, new rules get a shard
+        importRules("<rules>" + copyRule(1) + "</rules>");
+        CPPUNIT_ASSERT_EQUAL(2, RuleServer::instance()->getThreads());
+        CPPUNIT_ASSERT(RuleServer::instance()->getRule("r1")->getShard() != 0);
+
+        ticpp::Element pConfig("rules");
+        RuleServer::instance()->exportXml(&pConfig);
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pConfig.GetAttribute("threads"));
+
+        CPPUNIT_ASSERT_THROW(importRules("<rules threads='-1'/>"), ticpp::Exception);
+        CPPUNIT_ASSERT_EQUAL(2, RuleServer::instance()->getThreads());
+
+        importRules("<rules threads='0'/>");
+        CPPUNIT_ASSERT_EQUAL(0, RuleServer::instance()->getThreads());
+        CPPUNIT_ASSERT(RuleServer::instance()->getRule("r0")->getShard() == 0);
+        ticpp::Element pConfig2("rules");
+        RuleServer::instance()->exportXml(&pConfig2);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), pConfig2.GetAttribute("threads"));
+
+        // Back to inline evaluation
+        setValue("in0", "on");
+        waitForValue("out0", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out0"));
+    }
+
+    void testDeletePending()
+    {
+        importRules("<rules threads='2'>" + copyRule(0) + copyRule(1) + "</rules>");
+        setValue("in0", "on");
+        setValue("in1", "on");
+        // The pending rules are evaluated before the deletion
+        importRules("<rules><rule id='r0' delete='true'/></rules>");
+        CPPUNIT_ASSERT(RuleServer::instance()->getRule("r0") == 0);
+        RuleServer::instance()->flush();
+        waitForValue("out0", "on");
+        waitForValue("out1", "on");
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out0"));
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), getValue("out1"));
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( RuleShardExecutorTest );
@@ -0,0 +1,221 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "clock.h"
+#include "services.h"
+#include "ruleserver.h"
+#include "objectcontroller.h"
+#include <vector>
+
+/*
+ * Runs a month of a home configuration on a VirtualClock: daily timers,
+ * sunrise/sunset timers with exception days, and a motion detector whose
+ * telegrams are replayed at their recorded times. Runs in a few seconds
+ * (`make check` builds it as simmain).
+ */
+
+namespace
+{
+    const char* simulationConfig =
+        "<config>"
+        " <services>"
+        "  <location lon='4.35' lat='50.85'/>"
+        "  <exceptiondays><date day='15' month='10' year='2012'/></exceptiondays>"
+        " </services>"
+        " <objects>"
+        "  <object id='kitchen' type='1.001' init='off'/>"
+        "  <object id='shutters' type='1.001' init='off'/>"
+        "  <object id='motion' type='1.001' init='off'/>"
+        "  <object id='hall' type='1.001' init='off'/>"
+        " </objects>"
+        " <rules>"
+        "  <rule id='morning'>"
+        "   <condition type='timer' trigger='true'>"
+        "    <at hour='7' min='0' wdays='12345' exception='no'/>"
+        "    <until hour='8' min='30'/>"
+        "   </condition>"
+        "   <actionlist><action type='set-value' id='kitchen' value='on'/></actionlist>"
+        "   <actionlist type='on-false'><action type='set-value' id='kitchen' value='off'/></actionlist>"
+        "  </rule>"
+        "  <rule id='shutters'>"
+        "   <condition type='timer' trigger='true'>"
+        "    <at type='sunrise' offset='15m'/>"
+        "    <until type='sunset'/>"
+        "   </condition>"
+        "   <actionlist><action type='set-value' id='shutters' value='on'/></actionlist>"
+        "   <actionlist type='on-false'><action type='set-value' id='shutters' value='off'/></actionlist>"
+        "  </rule>"
+        "  <rule id='hall'>"
+        "   <condition type='object' id='motion' value='on' trigger='true'/>"
+        "   <actionlist>"
+        "    <action type='set-value' id='hall' value='on'/>"
+        "    <action type='set-value' id='hall' value='off' delay='3m'/>"
+        "   </actionlist>"
+        "  </rule>"
+        " </rules>"
+        "</config>";
+
+    time_t localTime(int mday, int hour, int min)
+    {
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_year = 112;
+        timeinfo.tm_mon = 9;
+        timeinfo.tm_mday = mday;
+        timeinfo.tm_hour = hour;
+        timeinfo.tm_min = min;
+        timeinfo.tm_isdst = -1;
+        return mktime(&timeinfo);
+    }
+}
+
+class SimulationTest : public CppUnit::TestFixture, public ChangeListener
+{
+    CPPUNIT_TEST_SUITE( SimulationTest );
+    CPPUNIT_TEST( testMonth );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    struct Change
+    {
+        std::string id;
+        bool on;
+        time_t time;
+    };
+    struct Telegram
+    {
+        time_t time;
+        const char* id;
+        const char* value;
+    };
+    std::vector<Change> changes_m;
+    VirtualClock* clock_m;
+
+    // Transitions of object id to value, in order
+    std::vector<time_t> getChanges(const std::string& id, bool on)
+    {
+        std::vector<time_t> times;
+        for (std::vector<Change>::iterator it = changes_m.begin(); it != changes_m.end(); it++)
+            if (it->id == id && it->on == on)
+                times.push_back(it->time);
+        return times;
+    }
+
+public:
+    virtual void onChange(Object* object)
+    {
+        bool on = object->getValue() == "on";
+        for (std::vector<Change>::reverse_iterator it = changes_m.rbegin(); it != changes_m.rend(); it++)
+        {
+            if (it->id == object->getID())
+            {
+                if (it->on == on)
+                    return;
+                break;
+            }
+        }
+        if (!on && changes_m.empty())
+            return;
+        Change change;
+        change.id = object->getID();
+        change.on = on;
+        change.time = Clock::now();
+        changes_m.push_back(change);
+    }
+
+    void setUp()
+    {
+        clock_m = new VirtualClock((int64_t)localTime(1, 0, 0) * 1000);
+        Clock::set(clock_m);
+        changes_m.clear();
+    }
+
+    void tearDown()
+    {
+        Services::instance()->stop();
+        RuleServer::reset();
+        ObjectController::reset();
+        Services::reset();
+        Clock::reset();
+    }
+
+    void testMonth()
+    {
+        ticpp::Document doc;
+        doc.LoadFromString(simulationConfig);
+        ticpp::Element* pConfig = doc.FirstChildElement();
+        Services::instance()->importXml(pConfig->FirstChildElement("services"));
+        ObjectController::instance()->importXml(pConfig->FirstChildElement("objects"));
+        const char* ids[] = {"kitchen", "shutters", "hall"};
+        for (int i = 0; i < 3; i++)
+        {
+            Object* object = ObjectController::instance()->getObject(ids[i]);
+            object->addChangeListener(this);
+            object->decRefCount();
+        }
+        RuleServer::instance()->importXml(pConfig->FirstChildElement("rules"));
+        Services::instance()->getTimerManager()->startManager();
+
+        // Motion telegrams recorded every weekday evening
+        std::vector<Telegram> telegrams;
+        for (int mday = 1; mday <= 31; mday++)
+        {
+            struct tm timeinfo;
+            time_t day = localTime(mday, 12, 0);
+            localtime_r(&day, &timeinfo);
+            if (timeinfo.tm_wday == 0 || timeinfo.tm_wday == 6)
+                continue;
+            Telegram on = {localTime(mday, 18, 30), "motion", "on"};
+            Telegram off = {localTime(mday, 18, 31), "motion", "off"};
+            telegrams.push_back(on);
+            telegrams.push_back(off);
+        }
+        for (std::vector<Telegram>::iterator it = telegrams.begin(); it != telegrams.end(); it++)
+        {
+            clock_m->advanceTo((int64_t)it->time * 1000);
+            Object* object = ObjectController::instance()->getObject(it->id);
+            object->setValue(it->value);
+            object->decRefCount();
+            clock_m->settle();
+        }
+        clock_m->advanceTo((int64_t)localTime(32, 0, 0) * 1000);
+
+        // 23 weekdays in October 2012, the 15th is an exception day
+        std::vector<time_t> kitchenOn = getChanges("kitchen", true);
+        std::vector<time_t> kitchenOff = getChanges("kitchen", false);
+        CPPUNIT_ASSERT_EQUAL(22, (int)kitchenOn.size());
+        CPPUNIT_ASSERT_EQUAL(22, (int)kitchenOff.size());
+        for (int i = 0; i < 22; i++)
+        {
+            struct tm timeinfo;
+            localtime_r(&kitchenOn[i], &timeinfo);
+            CPPUNIT_ASSERT_EQUAL(7, timeinfo.tm_hour);
+            CPPUNIT_ASSERT_EQUAL(0, timeinfo.tm_min);
+            CPPUNIT_ASSERT(timeinfo.tm_mday != 15);
+            CPPUNIT_ASSERT_EQUAL(90 * 60, (int)(kitchenOff[i] - kitchenOn[i]));
+        }
+
+        std::vector<time_t> shuttersOn = getChanges("shutters", true);
+        std::vector<time_t> shuttersOff = getChanges("shutters", false);
+        CPPUNIT_ASSERT_EQUAL(31, (int)shuttersOn.size());
+        CPPUNIT_ASSERT_EQUAL(31, (int)shuttersOff.size());
+        for (int i = 0; i < 31; i++)
+        {
+            struct tm timeinfo;
+            localtime_r(&shuttersOn[i], &timeinfo);
+            CPPUNIT_ASSERT_EQUAL(i + 1, timeinfo.tm_mday);
+            CPPUNIT_ASSERT(timeinfo.tm_hour >= 7 && timeinfo.tm_hour <= 8);
+            CPPUNIT_ASSERT(shuttersOff[i] - shuttersOn[i] > 9 * 3600);
+        }
+
+        std::vector<time_t> hallOn = getChanges("hall", true);
+        std::vector<time_t> hallOff = getChanges("hall", false);
+        CPPUNIT_ASSERT_EQUAL(23, (int)hallOn.size());
+        CPPUNIT_ASSERT_EQUAL(23, (int)hallOff.size());
+        for (int i = 0; i < 23; i++)
+        {
+            CPPUNIT_ASSERT_EQUAL(telegrams[2 * i].time, hallOn[i]);
+            CPPUNIT_ASSERT_EQUAL(180, (int)(hallOff[i] - hallOn[i]));
+        }
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( SimulationTest );
@@ -0,0 +1,79 @@
+#include "bench.h"
+#include "suncalc.h"
+#include "timermanager.h"
+#include "services.h"
+
+/*
+ * Schedules a year of daily sunrise/sunset timers with several offsets, as
+ * a config with many solar rules does, and compares the sunrise/sunset
+ * table lookups with the direct computation.
+ */
+
+namespace
+{
+    class SolarBenchTask : public PeriodicTask
+    {
+    public:
+        SolarBenchTask() : PeriodicTask(0) {};
+        time_t callFindNext(time_t start, TimeSpec* next) { return findNext(start, next); };
+    };
+}
+
+BENCHMARK(SolarEphemeris)
+{
+    LocationInfo* location = Services::instance()->getLocationInfo();
+    ticpp::Element pConfig("location");
+    pConfig.SetAttribute("lon", 4.35);
+    pConfig.SetAttribute("lat", 50.85);
+    location->importXml(&pConfig);
+
+    int daysInMonth[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int lookups = 0;
+    double rise, set, sum = 0;
+    double computeStart = Benchmark::now();
+    for (int rep = 0; rep < 500; rep++)
+        for (int mon = 0; mon < 12; mon++)
+            for (int mday = 1; mday <= daysInMonth[mon]; mday++, lookups++)
+            {
+                LocationInfo::computeSunRiseSet(116, mon, mday, 4.35, 50.85, &rise, &set);
+                sum += rise;
+            }
+    double computeTime = Benchmark::now() - computeStart;
+    double lookupStart = Benchmark::now();
+    for (int rep = 0; rep < 500; rep++)
+        for (int mon = 0; mon < 12; mon++)
+            for (int mday = 1; mday <= daysInMonth[mon]; mday++)
+            {
+                location->getSunRiseSet(116, mon, mday, &rise, &set);
+                sum -= rise;
+            }
+    double lookupTime = Benchmark::now() - lookupStart;
+
+    // Sunrise and sunset with 8 different offsets each, over a year
+    struct tm timeinfo;
+    memset(&timeinfo, 0, sizeof(timeinfo));
+    timeinfo.tm_year = 116;
+    timeinfo.tm_mday = 1;
+    timeinfo.tm_isdst = -1;
+    time_t start = mktime(&timeinfo);
+    time_t end = start + 365 * 86400;
+    SolarBenchTask task;
+    int occurrences = 0;
+    double findStart = Benchmark::now();
+    for (int i = 0; i < 16; i++)
+    {
+        ticpp::Element pSpec("at");
+        pSpec.SetAttribute("type", (i % 2) ? "sunset" : "sunrise");
+        pSpec.SetAttribute("offset", (i / 2) * 300 - 1200);
+        TimeSpec* spec = TimeSpec::create(&pSpec, 0);
+        for (time_t t = task.callFindNext(start, spec); t != 0 && t < end; t = task.callFindNext(t, spec))
+            occurrences++;
+        delete spec;
+    }
+    double findTime = Benchmark::now() - findStart;
+
+    std::cout << "  " << lookups << " computations " << computeTime << " s, lookups " << lookupTime
+              << " s (" << sum << ")" << std::endl;
+    std::cout << "  " << occurrences << " solar occurrences " << findTime << " s" << std::endl;
+    Services::reset();
+}
@@ -0,0 +1,150 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "suncalc.h"
+#include "services.h"
+#include "clock.h"
+
+class CacheLocationInfo : public LocationInfo
+{
+public:
+    bool isCached(int year) { return ephemeris_m.find(year) != ephemeris_m.end(); }
+};
+
+class SunCalcTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( SunCalcTest );
+    CPPUNIT_TEST( testEphemerisEquivalence );
+    CPPUNIT_TEST( testLocationChange );
+    CPPUNIT_TEST( testSolarInfo );
+    CPPUNIT_TEST( testSolarNoon );
+    CPPUNIT_TEST( testEvictLeastRecentlyUsed );
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+    }
+
+    void tearDown()
+    {
+        Clock::reset();
+        Services::reset();
+    }
+
+    void importLocation(LocationInfo* location, double lon, double lat)
+    {
+        ticpp::Element pConfig("location");
+        pConfig.SetAttribute("lon", lon);
+        pConfig.SetAttribute("lat", lat);
+        location->importXml(&pConfig);
+    }
+
+    void testEphemerisEquivalence()
+    {
+        // Brussels, Tromso (polar day and night), Sydney, Honolulu
+        double coords[][2] = {{4.35, 50.85}, {18.96, 69.65}, {151.21, -33.87}, {-157.86, 21.31}};
+        int daysInMonth[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        for (unsigned i = 0; i < sizeof(coords) / sizeof(coords[0]); i++)
+        {
+            LocationInfo location;
+            importLocation(&location, coords[i][0], coords[i][1]);
+            // More years than the table keeps, to go through the eviction
+            for (int year = 111; year < 118; year++)
+            {
+                for (int mon = 0; mon < 12; mon++)
+                {
+                    int last = daysInMonth[mon];
+                    if (mon == 1 && year % 4 != 0)
+                        last = 28;
+                    for (int mday = 1; mday <= last; mday++)
+                    {
+                        double rise, set, expRise, expSet;
+                        int expRs = LocationInfo::computeSunRiseSet(year, mon, mday, coords[i][0], coords[i][1], &expRise, &expSet);
+                        int rs = location.getSunRiseSet(year, mon, mday, &rise, &set);
+                        CPPUNIT_ASSERT_EQUAL(expRs, rs);
+                        CPPUNIT_ASSERT_EQUAL(expRise, rise);
+                        CPPUNIT_ASSERT_EQUAL(expSet, set);
+                    }
+                }
+            }
+        }
+    }
+
+    void testLocationChange()
+    {
+        LocationInfo location;
+        double rise, set, rise2, set2;
+        importLocation(&location, 4.35, 50.85);
+        CPPUNIT_ASSERT_EQUAL(0, location.getSunRiseSet(112, 5, 21, &rise, &set));
+        importLocation(&location, 18.96, 69.65);
+        CPPUNIT_ASSERT_EQUAL(1, location.getSunRiseSet(112, 5, 21, &rise2, &set2));
+        importLocation(&location, 4.35, 50.85);
+        CPPUNIT_ASSERT_EQUAL(0, location.getSunRiseSet(112, 5, 21, &rise2, &set2));
+        CPPUNIT_ASSERT_EQUAL(rise, rise2);
+        CPPUNIT_ASSERT_EQUAL(set, set2);
+    }
+
+    void testSolarInfo()
+    {
+        importLocation(Services::instance()->getLocationInfo(), 4.35, 50.85);
+        struct tm timeinfo;
+        memset(&timeinfo, 0, sizeof(timeinfo));
+        timeinfo.tm_hour = 12;
+        timeinfo.tm_mday = 27;
+        timeinfo.tm_mon = 9;
+        timeinfo.tm_year = 112;
+        timeinfo.tm_isdst = -1;
+        mktime(&timeinfo);
+
+        int min, hour;
+        SolarInfo info(&timeinfo);
+        CPPUNIT_ASSERT(info.getSunrise(&min, &hour));
+        CPPUNIT_ASSERT_EQUAL(8, hour);
+        CPPUNIT_ASSERT_EQUAL(26, min);
+        CPPUNIT_ASSERT(info.getSunset(&min, &hour));
+        CPPUNIT_ASSERT_EQUAL(18, hour);
+        CPPUNIT_ASSERT_EQUAL(26, min);
+        CPPUNIT_ASSERT(info.getNoon(&min, &hour));
+        CPPUNIT_ASSERT_EQUAL(13, hour);
+        CPPUNIT_ASSERT_EQUAL(26, min);
+    }
+
+    void testSolarNoon()
+    {
+        LocationInfo location;
+        importLocation(&location, 18.96, 69.65);
+        double rise, set, noon, expRise, expSet;
+        // Cached and computed, also for polar day
+        for (int year = 111; year < 113; year++)
+        {
+            CPPUNIT_ASSERT_EQUAL(1, location.getSunRiseSet(year, 5, 21, &rise, &set, &noon));
+            LocationInfo::computeSunRiseSet(year, 5, 21, 18.96, 69.65, &expRise, &expSet);
+            CPPUNIT_ASSERT_EQUAL((expRise+expSet)/2.0, noon);
+        }
+        CPPUNIT_ASSERT_EQUAL(0, location.getSunRiseSet(112, 8, 21, &rise, &set, &noon));
+        CPPUNIT_ASSERT(noon > rise && noon < set);
+    }
+
+    void testEvictLeastRecentlyUsed()
+    {
+        // October 2012
+        Clock::set(new VirtualClock(1350000000000LL));
+        CacheLocationInfo location;
+        importLocation(&location, 4.35, 50.85);
+        CPPUNIT_ASSERT(location.isCached(112));
+        double rise, set;
+        for (int year = 113; year < 112 + (int)LocationInfo::MaxCachedYears; year++)
+            location.getSunRiseSet(year, 0, 1, &rise, &set);
+        CPPUNIT_ASSERT(location.isCached(112));
+        CPPUNIT_ASSERT(location.isCached(113));
+
+        // 112 is used again, 113 is the least recently used one
+        location.getSunRiseSet(112, 5, 21, &rise, &set);
+        location.getSunRiseSet(120, 0, 1, &rise, &set);
+        CPPUNIT_ASSERT(location.isCached(120));
+        CPPUNIT_ASSERT(location.isCached(112));
+        CPPUNIT_ASSERT(!location.isCached(113));
+        CPPUNIT_ASSERT(location.isCached(114));
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( SunCalcTest );
@@ -0,0 +1,67 @@
+#include "bench.h"
+#include "timermanager.h"
+#include <cstdlib>
+
+/*
+ * Schedules 100k timer tasks in the TimerManager, then moves, cancels and
+ * fires them, and reports the time spent in each step.
+ */
+
+namespace
+{
+    class BenchTask : public TimerTask
+    {
+    public:
+        BenchTask() : execTime_m(0), fired_m(false) {};
+        virtual void onTimer(time_t time) { fired_m = true; };
+        virtual void reschedule(time_t from = 0) {};
+        virtual time_t getExecTime() { return execTime_m / 1000; };
+        virtual int64_t getExecTimeMs() { return execTime_m; };
+        virtual void statusXml(ticpp::Element* pStatus) {};
+
+        int64_t execTime_m;
+        bool fired_m;
+    };
+
+    void runTimers(int nbTasks)
+    {
+        TimerManager manager;
+        std::vector<BenchTask> tasks(nbTasks);
+        int64_t ref = TimerManager::nowMs();
+        srand(42);
+
+        double start = Benchmark::now();
+        for (int i = 0; i < nbTasks; i++)
+        {
+            // Deadlines within the next day, with millisecond resolution
+            tasks[i].execTime_m = ref + rand() % 86400000;
+            manager.addTask(&tasks[i]);
+        }
+        double added = Benchmark::now();
+        for (int i = 0; i < nbTasks; i++)
+        {
+            tasks[i].execTime_m += rand() % 60000;
+            manager.addTask(&tasks[i]);
+        }
+        double moved = Benchmark::now();
+        for (int i = 0; i < nbTasks; i += 2)
+            manager.removeTask(&tasks[i]);
+        double removed = Benchmark::now();
+        int fired = 0;
+        while (manager.checkTaskListMs(ref + 86400000 + 60000) == TimerManager::Immediate)
+            fired++;
+        double done = Benchmark::now();
+
+        std::cout << nbTasks << " tasks:" << std::endl;
+        std::cout << "  add " << (added - start) << " s, move " << (moved - added)
+                  << " s, cancel " << (nbTasks + 1) / 2 << " " << (removed - moved)
+                  << " s, fire " << fired << " " << (done - removed) << " s" << std::endl;
+    }
+}
+
+BENCHMARK(Timers)
+{
+    runTimers(1000);
+    runTimers(10000);
+    runTimers(100000);
+}
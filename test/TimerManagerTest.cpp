@@ -13,6 +13,21 @@ public:
     virtual void statusXml(ticpp::Element* pStatus) {};
 };
 
+class StubMsTimerTask : public TimerTask
+{
+public:
+    int64_t execTimeMs_m;
+    int64_t calledAt_m;
+    std::vector<int>* order_m;
+    int id_m;
+    StubMsTimerTask() : execTimeMs_m(0), calledAt_m(-1), order_m(0), id_m(0) {};
+    virtual void onTimer(time_t time) { calledAt_m = TimerManager::nowMs(); if (order_m) order_m->push_back(id_m); };
+    virtual void reschedule(time_t from = 0) {};
+    virtual time_t getExecTime() { return execTimeMs_m / 1000; };
+    virtual int64_t getExecTimeMs() { return execTimeMs_m; };
+    virtual void statusXml(ticpp::Element* pStatus) {};
+};
+
 class TimerManagerTest : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE( TimerManagerTest );
@@ -23,6 +38,10 @@ class TimerManagerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testTwoTasksOrdered );
     CPPUNIT_TEST( testTwoTasksReversed );
     CPPUNIT_TEST( testAddRemove );
+    CPPUNIT_TEST( testAddTwice );
+    CPPUNIT_TEST( testMilliseconds );
+    CPPUNIT_TEST( testManyTasks );
+    CPPUNIT_TEST( testPreciseWakeUp );
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -176,6 +195,85 @@ public:
         CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref3_m) == TimerManager::Long);
     }
 
+
+    void testAddTwice()
+    {
+        task1_m.execTime_m = timeref1_m + 5;
+        task2_m.execTime_m = timeref1_m + 10;
+        timermanager_m->addTask(&task1_m);
+        timermanager_m->addTask(&task2_m);
+        task1_m.execTime_m = timeref1_m + 15;
+        timermanager_m->addTask(&task1_m);
+        CPPUNIT_ASSERT_EQUAL(2, timermanager_m->getTaskCount());
+        CPPUNIT_ASSERT(timermanager_m->getNextExecTimeMs() == (int64_t)(timeref1_m + 10) * 1000);
+
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref2_m) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == false);
+        CPPUNIT_ASSERT(task2_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref2_m) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1_m.isOnTimerCalled_m == true);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskList(timeref2_m) == TimerManager::Long);
+        CPPUNIT_ASSERT(!task1_m.isScheduled());
+    }
+
+    void testMilliseconds()
+    {
+        int64_t ref = (int64_t)timeref1_m * 1000;
+        StubMsTimerTask task1, task2;
+        task1.execTimeMs_m = ref + 250;
+        task2.execTimeMs_m = ref + 100;
+        timermanager_m->addTask(&task1);
+        timermanager_m->addTask(&task2);
+
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 99) == TimerManager::Short);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 100) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task2.calledAt_m != -1);
+        CPPUNIT_ASSERT(task1.calledAt_m == -1);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 249) == TimerManager::Short);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 250) == TimerManager::Immediate);
+        CPPUNIT_ASSERT(task1.calledAt_m != -1);
+        CPPUNIT_ASSERT(timermanager_m->checkTaskListMs(ref + 250) == TimerManager::Long);
+    }
+
+    void testManyTasks()
+    {
+        int64_t ref = (int64_t)timeref1_m * 1000;
+        std::vector<StubMsTimerTask> tasks(500);
+        std::vector<int> order;
+        for (int i = 0; i < 500; i++)
+        {
+            tasks[i].id_m = i;
+            tasks[i].order_m = &order;
+            // Spread over 500 distinct times, in a scrambled insertion order
+            tasks[i].execTimeMs_m = ref + (i * 137) % 500;
+            timermanager_m->addTask(&tasks[i]);
+        }
+        for (int i = 0; i < 500; i += 3)
+            timermanager_m->removeTask(&tasks[i]);
+        CPPUNIT_ASSERT_EQUAL(333, timermanager_m->getTaskCount());
+
+        while (timermanager_m->checkTaskListMs(ref + 1000) == TimerManager::Immediate) {}
+        CPPUNIT_ASSERT_EQUAL(333, (int)order.size());
+        for (int i = 1; i < (int)order.size(); i++)
+            CPPUNIT_ASSERT(tasks[order[i-1]].execTimeMs_m < tasks[order[i]].execTimeMs_m);
+        CPPUNIT_ASSERT_EQUAL(0, timermanager_m->getTaskCount());
+    }
+
+    void testPreciseWakeUp()
+    {
+        StubMsTimerTask task;
+        timermanager_m->startManager();
+        // Let the loop go to sleep on the empty list first
+        pth_usleep(20000);
+        int64_t start = TimerManager::nowMs();
+        task.execTimeMs_m = start + 150;
+        timermanager_m->addTask(&task);
+        for (int i = 0; i < 100 && task.calledAt_m == -1; i++)
+            pth_usleep(10000);
+        timermanager_m->stopManager();
+        CPPUNIT_ASSERT(task.calledAt_m >= start + 150);
+        CPPUNIT_ASSERT(task.calledAt_m < start + 400);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( TimerManagerTest );
@@ -0,0 +1,275 @@
+#include <cppunit/extensions/HelperMacros.h>
+#include "ruleserver.h"
+#include "objectcontroller.h"
+#include "services.h"
+#include "clock.h"
+#include <cstdio>
+#include <unistd.h>
+
+class SnapshotRule : public Rule
+{
+public:
+    TimerTask* getTimer() { return dynamic_cast<TimerTask*>(getCondition()); }
+};
+
+class TimerSnapshotTest : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE( TimerSnapshotTest );
+    CPPUNIT_TEST( testRestoreTimer );
+    CPPUNIT_TEST( testConfigChanged );
+    CPPUNIT_TEST( testMissedDeadline );
+    CPPUNIT_TEST( testCorruptFile );
+    CPPUNIT_TEST( testTimeCounter );
+    CPPUNIT_TEST( testExceptionDaysChanged );
+    CPPUNIT_TEST( testTimeObjectChanged );
+    CPPUNIT_TEST( testRestoredRuleValue );
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    VirtualClock* clock_m;
+    std::string path_m;
+
+public:
+    void setUp()
+    {
+        clock_m = new VirtualClock(1350000000000LL);
+        Clock::set(clock_m);
+        path_m = "/tmp/linknx_timersnapshot_test";
+        unlink(path_m.c_str());
+        ticpp::Element pConfig("timer-snapshot");
+        pConfig.SetAttribute("path", path_m);
+        Services::instance()->getTimerSnapshot()->importXml(&pConfig);
+    }
+
+    void tearDown()
+    {
+        Services::reset();
+        ObjectController::reset();
+        Clock::reset();
+        unlink(path_m.c_str());
+    }
+
+    SnapshotRule* createRule(const std::string& every)
+    {
+        ticpp::Element pConfig("rule");
+        pConfig.SetAttribute("id", "snapshot_rule");
+        ticpp::Element pCondition("condition");
+        pCondition.SetAttribute("type", "timer");
+        pCondition.SetAttribute("trigger", "true");
+        ticpp::Element pEvery("every");
+        pEvery.SetText(every);
+        pCondition.InsertEndChild(pEvery);
+        ticpp::Element pDuring("during");
+        pDuring.SetText("10m");
+        pCondition.InsertEndChild(pDuring);
+        pConfig.InsertEndChild(pCondition);
+        ticpp::Element pActions("actionlist");
+        pConfig.InsertEndChild(pActions);
+        SnapshotRule* rule = new SnapshotRule();
+        rule->importXml(&pConfig);
+        return rule;
+    }
+
+    SnapshotRule* createVariableRule()
+    {
+        ticpp::Document doc;
+        doc.LoadFromString("<rule id='snapshot_variable'><condition type='timer' trigger='true'>"
+                           "<at type='variable' time='snapshot_time'/></condition><actionlist/></rule>");
+        SnapshotRule* rule = new SnapshotRule();
+        rule->importXml(doc.FirstChildElement());
+        return rule;
+    }
+
+    // Saves the snapshot, then deletes the rule and reloads the file as
+    // a restart would do
+    void restart(Rule* rule)
+    {
+        TimerSnapshot* snapshot = Services::instance()->getTimerSnapshot();
+        CPPUNIT_ASSERT(snapshot->save());
+        delete rule;
+        CPPUNIT_ASSERT_EQUAL(0, snapshot->getTimerCount());
+        CPPUNIT_ASSERT(snapshot->load());
+    }
+
+    void testRestoreTimer()
+    {
+        SnapshotRule* rule = createRule("1h");
+        time_t execTime = rule->getTimer()->getExecTime();
+        CPPUNIT_ASSERT(execTime > Clock::now());
+        CPPUNIT_ASSERT_EQUAL(1, Services::instance()->getTimerSnapshot()->getTimerCount());
+
+        restart(rule);
+        clock_m->advanceTo(1350000000000LL + 300000);
+        rule = createRule("1h");
+        // A recompute would have moved the deadline by 5 minutes
+        CPPUNIT_ASSERT_EQUAL(execTime, rule->getTimer()->getExecTime());
+        CPPUNIT_ASSERT_EQUAL(0, Services::instance()->getTimerSnapshot()->getLoadedCount());
+        delete rule;
+    }
+
+    void testConfigChanged()
+    {
+        SnapshotRule* rule = createRule("1h");
+        time_t execTime = rule->getTimer()->getExecTime();
+        restart(rule);
+        clock_m->advanceTo(1350000000000LL + 300000);
+        rule = createRule("2h");
+        CPPUNIT_ASSERT(rule->getTimer()->getExecTime() != execTime);
+        CPPUNIT_ASSERT(rule->getTimer()->getExecTime() > Clock::now());
+        delete rule;
+    }
+
+    void testMissedDeadline()
+    {
+        SnapshotRule* rule = createRule("1h");
+        time_t execTime = rule->getTimer()->getExecTime();
+        restart(rule);
+        clock_m->advanceTo((int64_t)(execTime + 60) * 1000);
+        rule = createRule("1h");
+        CPPUNIT_ASSERT(rule->getTimer()->getExecTime() > Clock::now());
+        delete rule;
+    }
+
+    void testCorruptFile()
+    {
+        SnapshotRule* rule = createRule("1h");
+        TimerSnapshot* snapshot = Services::instance()->getTimerSnapshot();
+        CPPUNIT_ASSERT(snapshot->save());
+        delete rule;
+
+        FILE* fp = fopen(path_m.c_str(), "r+b");
+        CPPUNIT_ASSERT(fp != 0);
+        fseek(fp, 20, SEEK_SET);
+        fputc('X', fp);
+        fclose(fp);
+        CPPUNIT_ASSERT(!snapshot->load());
+        CPPUNIT_ASSERT_EQUAL(0, snapshot->getLoadedCount());
+
+        fp = fopen(path_m.c_str(), "wb");
+        fputs("LKTS", fp);
+        fclose(fp);
+        CPPUNIT_ASSERT(!snapshot->load());
+    }
+
+    void testTimeCounter()
+    {
+        ticpp::Element pObject;
+        pObject.SetAttribute("id", "snapshot_presence");
+        pObject.SetAttribute("type", "1.001");
+        Object* object = Object::create(&pObject);
+        ObjectController::instance()->addObject(object);
+
+        ticpp::Element pConfig("rule");
+        pConfig.SetAttribute("id", "snapshot_counter");
+        ticpp::Element pCondition("condition");
+        pCondition.SetAttribute("type", "time-counter");
+        pCondition.SetAttribute("threshold", "1h");
+        pCondition.SetAttribute("reset-delay", "1m");
+        ticpp::Element pInner("condition");
+        pInner.SetAttribute("type", "object");
+        pInner.SetAttribute("id", "snapshot_presence");
+        pInner.SetAttribute("value", "on");
+        pCondition.InsertEndChild(pInner);
+        pConfig.InsertEndChild(pCondition);
+        ticpp::Element pActions("actionlist");
+        pConfig.InsertEndChild(pActions);
+
+        SnapshotRule* rule = new SnapshotRule();
+        rule->importXml(&pConfig);
+        object->setValue("on");
+        rule->evaluate();
+        clock_m->advanceTo(1350000000000LL + 600000);
+        rule->evaluate();
+
+        TimerState state;
+        rule->getTimer()->saveState(&state);
+        CPPUNIT_ASSERT_EQUAL(600, (int)state.counter);
+
+        restart(rule);
+        // The time spent stopped is not counted
+        clock_m->advanceTo(1350000000000LL + 3600000);
+        rule = new SnapshotRule();
+        rule->importXml(&pConfig);
+        rule->getTimer()->saveState(&state);
+        CPPUNIT_ASSERT_EQUAL(600, (int)state.counter);
+        CPPUNIT_ASSERT_EQUAL((int64_t)Clock::now(), state.lastTime);
+        delete rule;
+    }
+
+    void testExceptionDaysChanged()
+    {
+        SnapshotRule* rule = createRule("1h");
+        time_t execTime = rule->getTimer()->getExecTime();
+        restart(rule);
+        clock_m->advanceTo(1350000000000LL + 300000);
+
+        ticpp::Document doc;
+        doc.LoadFromString("<exceptiondays><date day='25' month='12'/></exceptiondays>");
+        Services::instance()->getExceptionDays()->importXml(doc.FirstChildElement());
+        rule = createRule("1h");
+        CPPUNIT_ASSERT(rule->getTimer()->getExecTime() != execTime);
+        CPPUNIT_ASSERT_EQUAL(0, Services::instance()->getTimerSnapshot()->getLoadedCount());
+        delete rule;
+    }
+
+    void testTimeObjectChanged()
+    {
+        ticpp::Element pObject;
+        pObject.SetAttribute("id", "snapshot_time");
+        pObject.SetAttribute("type", "10.001");
+        Object* object = Object::create(&pObject);
+        ObjectController::instance()->addObject(object);
+        object->setValue("10:00:00");
+
+        SnapshotRule* rule = createVariableRule();
+        time_t execTime = rule->getTimer()->getExecTime();
+        restart(rule);
+        rule = createVariableRule();
+        CPPUNIT_ASSERT_EQUAL(execTime, rule->getTimer()->getExecTime());
+
+        // The saved state applies to the value at the time of the save
+        object->setValue("11:00:00");
+        restart(rule);
+        rule = createVariableRule();
+        CPPUNIT_ASSERT_EQUAL(execTime + 3600, rule->getTimer()->getExecTime());
+        restart(rule);
+        object->setValue("12:00:00");
+        rule = createVariableRule();
+        CPPUNIT_ASSERT_EQUAL(execTime + 7200, rule->getTimer()->getExecTime());
+        delete rule;
+    }
+
+    void testRestoredRuleValue()
+    {
+        ticpp::Element pObject;
+        pObject.SetAttribute("id", "snapshot_light");
+        pObject.SetAttribute("type", "1.001");
+        Object* object = Object::create(&pObject);
+        ObjectController::instance()->addObject(object);
+
+        ticpp::Document doc;
+        doc.LoadFromString("<rule id='snapshot_rule'><condition type='timer' trigger='true'><every>1h</every><during>10m</during></condition>"
+                           "<actionlist><action type='set-value' id='snapshot_light' value='on'/></actionlist></rule>");
+        SnapshotRule* rule = new SnapshotRule();
+        rule->importXml(doc.FirstChildElement());
+        rule->initialize();
+        // Started at the beginning of the 10 minutes
+        rule->evaluate();
+        clock_m->settle();
+        CPPUNIT_ASSERT_EQUAL(std::string("on"), object->getValue());
+
+        object->setValue("off");
+        restart(rule);
+        clock_m->advance(60000);
+        rule = new SnapshotRule();
+        rule->importXml(doc.FirstChildElement());
+        rule->initialize();
+        // Still in the 10 minutes, the rule was already true
+        rule->evaluate();
+        clock_m->settle();
+        CPPUNIT_ASSERT_EQUAL(std::string("off"), object->getValue());
+        delete rule;
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TimerSnapshotTest );
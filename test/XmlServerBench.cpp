@@ -0,0 +1,560 @@
+#include "bench.h"
+#include "xmlserver.h"
+#include "objectcontroller.h"
+#include "binaryclient.h"
+#include "ruleserver.h"
+#include "configcache.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Opens 1000 idle and 100 active clients on a local XML server. Each
+ * active client sends reads and writes one request at a time, and the
+ * throughput and worst latency are reported.
+ *
+ * XmlRequestParsing handles the common requests on a single connection,
+ * through the fast path and through the DOM path.
+ *
+ * DeltaRead polls 10000 objects of which 10 changed between the polls,
+ * with a full <read><objects/> and with a delta read.
+ *
+ * BinaryVsXml reads 10 objects at a time, reads one object and writes one
+ * object from a client process, once with the XML protocol and once with
+ * the binary protocol, and reports the requests per second of each.
+ *
+ * SubscriptionFanOut has 200 listeners following all of 2000 objects and
+ * 200 more following a tenth of them by pattern. It compares adding them
+ * to the listener list of each object with the subscription index.
+ *
+ * ConfigRead reads the config of 5000 objects and 500 rules, building
+ * the DOM for each request as before, then through the cached sections.
+ */
+
+namespace
+{
+    const char* socketPath = "/tmp/linknx_bench_sock";
+
+    int connectClient()
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_LOCAL;
+        strcpy(addr.sun_path, socketPath);
+        int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+        if (pth_connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    class BenchClient : public Thread
+    {
+    public:
+        BenchClient(int id, int requests)
+            : id_m(id), requests_m(requests), done_m(0), errors_m(0), maxLatency_m(0) {};
+
+        int id_m;
+        int requests_m;
+        int done_m;
+        int errors_m;
+        double maxLatency_m;
+
+    protected:
+        bool request(int fd, const std::string& msg)
+        {
+            if (pth_write(fd, msg.c_str(), msg.size()) != (ssize_t)msg.size())
+                return false;
+            char buf[256];
+            ssize_t len;
+            while ((len = pth_read(fd, buf, sizeof(buf))) > 0)
+            {
+                if (buf[len - 1] == '\004')
+                    return std::string(buf, len).find("success") != std::string::npos;
+            }
+            return false;
+        }
+
+        virtual void Run(pth_sem_t * stop)
+        {
+            int fd = connectClient();
+            if (fd == -1)
+            {
+                errors_m = requests_m;
+                return;
+            }
+            std::stringstream id;
+            id << "bench_obj" << (id_m % 10);
+            std::string read = "<read><object id='" + id.str() + "'/></read>\004";
+            std::string write = "<write><object id='" + id.str() + "' value='on'/></write>\004";
+            for (int i = 0; i < requests_m; i++)
+            {
+                double start = Benchmark::now();
+                if (request(fd, (i % 4 == 0) ? write : read))
+                    done_m++;
+                else
+                    errors_m++;
+                double latency = Benchmark::now() - start;
+                if (latency > maxLatency_m)
+                    maxLatency_m = latency;
+            }
+            close(fd);
+        }
+    };
+}
+
+BENCHMARK(XmlServerLoad)
+{
+    const int idle = 1000, active = 100, requests = 200;
+    ticpp::Element pConfig("xmlserver");
+    pConfig.SetAttribute("type", "unix");
+    pConfig.SetAttribute("path", socketPath);
+    XmlServer* server = XmlServer::create(&pConfig);
+    for (int i = 0; i < 10; i++)
+    {
+        ticpp::Element pObject;
+        std::stringstream id;
+        id << "bench_obj" << i;
+        pObject.SetAttribute("id", id.str());
+        pObject.SetAttribute("type", "1.001");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+
+    double start = Benchmark::now();
+    std::vector<int> idleFds;
+    for (int i = 0; i < idle; i++)
+    {
+        int fd = connectClient();
+        if (fd != -1)
+            idleFds.push_back(fd);
+    }
+    while (server->getConnectionCount() < (int)idleFds.size())
+        pth_yield(NULL);
+    double connected = Benchmark::now();
+
+    std::vector<BenchClient*> clients;
+    for (int i = 0; i < active; i++)
+    {
+        clients.push_back(new BenchClient(i, requests));
+        clients.back()->Start();
+    }
+    int done = 0, errors = 0;
+    double maxLatency = 0;
+    for (int i = 0; i < active; i++)
+    {
+        clients[i]->Stop();
+        done += clients[i]->done_m;
+        errors += clients[i]->errors_m;
+        if (clients[i]->maxLatency_m > maxLatency)
+            maxLatency = clients[i]->maxLatency_m;
+        delete clients[i];
+    }
+    double finished = Benchmark::now();
+
+    std::cout << idleFds.size() << " idle connections opened in " << (connected - start) << " s" << std::endl;
+    std::cout << active << " active clients: " << done << " requests in " << (finished - connected) << " s ("
+              << (int)(done / (finished - connected)) << " req/s), " << errors << " errors, max latency "
+              << maxLatency * 1000 << " ms" << std::endl;
+
+    for (std::vector<int>::iterator it = idleFds.begin(); it != idleFds.end(); it++)
+        close(*it);
+    delete server;
+    ObjectController::reset();
+    unlink(socketPath);
+}
+
+namespace
+{
+    double handleRequests(ClientConnection* con, int peer, const std::string& request, int count)
+    {
+        char buf[65536];
+        double start = Benchmark::now();
+        for (int i = 0; i < count; i++)
+        {
+            con->msg_m = request;
+            con->handleMessage();
+            while (read(peer, buf, sizeof(buf)) > 0)
+                ;
+        }
+        return Benchmark::now() - start;
+    }
+}
+
+BENCHMARK(XmlRequestParsing)
+{
+    const int count = 100000;
+    for (int i = 0; i < 50; i++)
+    {
+        ticpp::Element pObject;
+        std::stringstream id;
+        id << "bench_obj" << i;
+        pObject.SetAttribute("id", id.str());
+        pObject.SetAttribute("type", "5.xxx");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+    int fds[2];
+    socketpair(AF_LOCAL, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    ClientConnection* con = new ClientConnection(0, fds[0]);
+
+    const char* requests[][2] = {
+        { "read object", "<read><object id='bench_obj7'/></read>" },
+        { "write object", "<write><object id='bench_obj7' value='42'/></write>" },
+        { "read 10 objects", "<read><objects><object id='bench_obj0'/><object id='bench_obj1'/><object id='bench_obj2'/>"
+          "<object id='bench_obj3'/><object id='bench_obj4'/><object id='bench_obj5'/><object id='bench_obj6'/>"
+          "<object id='bench_obj7'/><object id='bench_obj8'/><object id='bench_obj9'/></objects></read>" } };
+    for (unsigned i = 0; i < sizeof(requests) / sizeof(requests[0]); i++)
+    {
+        // A CR in the request sends it to the DOM path
+        double fast = handleRequests(con, fds[1], requests[i][1], count);
+        double dom = handleRequests(con, fds[1], std::string("\r\n") + requests[i][1], count);
+        std::cout << "  " << requests[i][0] << ": " << count << " requests, fast path " << fast
+                  << " s, DOM " << dom << " s" << std::endl;
+    }
+    delete con;
+    close(fds[1]);
+    ObjectController::reset();
+}
+
+BENCHMARK(DeltaRead)
+{
+    const int objects = 10000, polls = 100;
+    for (int i = 0; i < objects; i++)
+    {
+        ticpp::Element pObject;
+        std::stringstream id;
+        id << "bench_obj" << i;
+        pObject.SetAttribute("id", id.str());
+        pObject.SetAttribute("type", "5.xxx");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+    int fds[2];
+    socketpair(AF_LOCAL, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    ClientConnection* con = new ClientConnection(0, fds[0]);
+
+    double full = 0, delta = 0;
+    for (int i = 0; i < polls; i++)
+    {
+        uint64_t seq = ObjectController::instance()->getChangeSeq();
+        for (int j = 0; j < 10; j++)
+        {
+            std::stringstream id;
+            id << "bench_obj" << (i * 97 + j * 1009) % objects;
+            Object* object = ObjectController::instance()->getObject(id.str());
+            object->setFloatValue((i + j) % 256);
+            object->decRefCount();
+        }
+        std::stringstream request;
+        request << "<read><objects since='" << seq << "'/></read>";
+        full += handleRequests(con, fds[1], "<read><objects/></read>", 1);
+        delta += handleRequests(con, fds[1], request.str(), 1);
+    }
+    std::cout << "  " << objects << " objects, 10 changes per poll, " << polls << " polls: full read "
+              << full << " s, delta read " << delta << " s" << std::endl;
+    delete con;
+    close(fds[1]);
+    ObjectController::reset();
+}
+
+namespace
+{
+    const char* binarySocketPath = "/tmp/linknx_bench_binsock";
+
+    // Blocking XML request, for the client processes
+    bool xmlRequest(int fd, const std::string& msg, std::string& reply)
+    {
+        if (write(fd, msg.data(), msg.size()) != (ssize_t)msg.size())
+            return false;
+        reply.clear();
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+        {
+            reply.append(buf, len);
+            if (buf[len - 1] == '\004')
+                return reply.find("success") != std::string::npos;
+        }
+        return false;
+    }
+
+    // Runs count requests of the given kind (0: read 10, 1: read 1,
+    // 2: write 1) and returns the time taken, or -1 on error
+    double runXmlClient(int kind, int count)
+    {
+        int fd = connectClient();
+        if (fd == -1)
+            return -1;
+        std::string request;
+        if (kind == 0)
+        {
+            request = "<read><objects>";
+            for (int i = 0; i < 10; i++)
+            {
+                std::stringstream id;
+                id << "bench_obj" << i;
+                request += "<object id='" + id.str() + "'/>";
+            }
+            request += "</objects></read>\004";
+        }
+        else if (kind == 1)
+            request = "<read><object id='bench_obj0'/></read>\004";
+        else
+            request = "<write><object id='bench_obj0' value='42'/></write>\004";
+        std::string reply;
+        double start = Benchmark::now();
+        for (int i = 0; i < count; i++)
+        {
+            if (!xmlRequest(fd, request, reply))
+                return -1;
+        }
+        double elapsed = Benchmark::now() - start;
+        close(fd);
+        return elapsed;
+    }
+
+    double runBinaryClient(int kind, int count)
+    {
+        BinaryClient client;
+        if (!client.connectUnix(binarySocketPath))
+            return -1;
+        std::vector<std::string> ids;
+        for (int i = 0; i < (kind == 0 ? 10 : 1); i++)
+        {
+            std::stringstream id;
+            id << "bench_obj" << i;
+            ids.push_back(id.str());
+        }
+        std::vector<uint32_t> handles;
+        std::vector<BinaryValue> values(1, BinaryValue::fromInt(42));
+        if (!client.resolve(ids, handles))
+            return -1;
+        double start = Benchmark::now();
+        for (int i = 0; i < count; i++)
+        {
+            bool ok = (kind == 2) ? client.write(handles, values) : client.read(handles, values);
+            if (!ok)
+                return -1;
+        }
+        return Benchmark::now() - start;
+    }
+
+    // The clients block, they run in a child process while this one
+    // serves them
+    double runClientProcess(bool binary, int kind, int count)
+    {
+        int fds[2];
+        if (pipe(fds) == -1)
+            return -1;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            double elapsed = binary ? runBinaryClient(kind, count) : runXmlClient(kind, count);
+            ssize_t len = write(fds[1], &elapsed, sizeof(elapsed));
+            _exit(len == sizeof(elapsed) ? 0 : 1);
+        }
+        close(fds[1]);
+        double elapsed = -1;
+        int status;
+        while (pth_waitpid(pid, &status, WNOHANG) == 0)
+            pth_usleep(1000);
+        if (read(fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+            elapsed = -1;
+        close(fds[0]);
+        return elapsed;
+    }
+}
+
+BENCHMARK(BinaryVsXml)
+{
+    const int count = 20000;
+    ticpp::Element pConfig("xmlserver");
+    pConfig.SetAttribute("type", "unix");
+    pConfig.SetAttribute("path", socketPath);
+    XmlServer* xmlServer = XmlServer::create(&pConfig);
+    pConfig.SetAttribute("path", binarySocketPath);
+    XmlServer* binaryServer = XmlServer::create(&pConfig, XmlServer::Binary);
+    for (int i = 0; i < 10; i++)
+    {
+        ticpp::Element pObject;
+        std::stringstream id;
+        id << "bench_obj" << i;
+        pObject.SetAttribute("id", id.str());
+        pObject.SetAttribute("type", "9.xxx");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+
+    const char* kinds[] = { "read 10 objects", "read 1 object", "write 1 object" };
+    for (int kind = 0; kind < 3; kind++)
+    {
+        double xml = runClientProcess(false, kind, count);
+        double binary = runClientProcess(true, kind, count);
+        std::cout << "  " << kinds[kind] << ": " << count << " requests, XML " << xml << " s ("
+                  << (int)(count / xml) << " req/s), binary " << binary << " s ("
+                  << (int)(count / binary) << " req/s)" << std::endl;
+    }
+
+    delete xmlServer;
+    delete binaryServer;
+    ObjectController::reset();
+    unlink(socketPath);
+    unlink(binarySocketPath);
+}
+
+namespace
+{
+    class NullListener : public ChangeListener
+    {
+    public:
+        NullListener() : count_m(0) {};
+        virtual void onChange(Object* object) { count_m++; };
+        int count_m;
+    };
+
+    double updateAll(std::vector<Object*>& objects, int rounds)
+    {
+        double start = Benchmark::now();
+        for (int i = 0; i < rounds; i++)
+        {
+            for (std::vector<Object*>::iterator it = objects.begin(); it != objects.end(); it++)
+                (*it)->setFloatValue(i % 256);
+        }
+        return Benchmark::now() - start;
+    }
+}
+
+BENCHMARK(SubscriptionFanOut)
+{
+    const int count = 2000, listeners = 200, rounds = 20;
+    std::vector<Object*> objects;
+    for (int i = 0; i < count; i++)
+    {
+        ticpp::Element pObject;
+        std::stringstream id;
+        id << "bench_obj" << i;
+        pObject.SetAttribute("id", id.str());
+        pObject.SetAttribute("type", "5.xxx");
+        Object* object = Object::create(&pObject);
+        ObjectController::instance()->addObject(object);
+        objects.push_back(object);
+    }
+    std::vector<NullListener> all(listeners), some(listeners);
+
+    double start = Benchmark::now();
+    for (int l = 0; l < listeners; l++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            objects[i]->addChangeListener(&all[l]);
+            if (i % 10 == 3)
+                objects[i]->addChangeListener(&some[l]);
+        }
+    }
+    double subscribeLists = Benchmark::now() - start;
+    double updateLists = updateAll(objects, rounds);
+    start = Benchmark::now();
+    for (int l = 0; l < listeners; l++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            objects[i]->removeChangeListener(&all[l]);
+            if (i % 10 == 3)
+                objects[i]->removeChangeListener(&some[l]);
+        }
+    }
+    double unsubscribeLists = Benchmark::now() - start;
+
+    SubscriptionIndex* index = ObjectController::instance()->getSubscriptions();
+    ticpp::Element pFilter("register");
+    pFilter.SetAttribute("pattern", "bench_obj*3");
+    SubscriptionFilter filter;
+    filter.importXml(&pFilter);
+    start = Benchmark::now();
+    for (int l = 0; l < listeners; l++)
+    {
+        index->subscribe(&all[l], SubscriptionFilter());
+        index->subscribe(&some[l], filter);
+    }
+    double subscribeIndex = Benchmark::now() - start;
+    double updateIndex = updateAll(objects, rounds);
+    start = Benchmark::now();
+    for (int l = 0; l < listeners; l++)
+    {
+        index->unsubscribeAll(&all[l]);
+        index->unsubscribeAll(&some[l]);
+    }
+    double unsubscribeIndex = Benchmark::now() - start;
+
+    std::cout << "  " << count << " objects, " << rounds << " updates of each" << std::endl;
+    std::cout << "  listener lists: subscribe " << subscribeLists << " s, updates " << updateLists
+              << " s, unsubscribe " << unsubscribeLists << " s" << std::endl;
+    std::cout << "  subscription index: subscribe " << subscribeIndex << " s, updates " << updateIndex
+              << " s, unsubscribe " << unsubscribeIndex << " s" << std::endl;
+    ObjectController::reset();
+}
+
+BENCHMARK(ConfigRead)
+{
+    const int objects = 5000, rules = 500, count = 20;
+    for (int i = 0; i < objects; i++)
+    {
+        ticpp::Element pObject;
+        std::stringstream id;
+        id << "bench_obj" << i;
+        pObject.SetAttribute("id", id.str());
+        pObject.SetAttribute("type", "5.xxx");
+        pObject.SetAttribute("init", "12");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+    ticpp::Element pRules("rules");
+    for (int i = 0; i < rules; i++)
+    {
+        std::stringstream rule;
+        rule << "<rule id='bench_rule" << i << "'><condition type='object' id='bench_obj" << i
+             << "' value='1'/><actionlist><action type='set-value' id='bench_obj" << (i + 1)
+             << "' value='2'/></actionlist></rule>";
+        ticpp::Document doc;
+        doc.LoadFromString(rule.str());
+        pRules.InsertEndChild(*doc.FirstChildElement());
+    }
+    RuleServer::instance()->importXml(&pRules);
+
+    double start = Benchmark::now();
+    std::string::size_type size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ticpp::Document doc;
+        ticpp::Element pRead("read");
+        ticpp::Element pConfig("config");
+        ticpp::Element pObjects("objects");
+        ObjectController::instance()->exportXml(&pObjects);
+        pConfig.LinkEndChild(&pObjects);
+        ticpp::Element pRuleList("rules");
+        RuleServer::instance()->exportXml(&pRuleList);
+        pConfig.LinkEndChild(&pRuleList);
+        pRead.LinkEndChild(&pConfig);
+        doc.LinkEndChild(&pRead);
+        size = doc.GetAsString().size();
+    }
+    double dom = Benchmark::now() - start;
+
+    start = Benchmark::now();
+    for (int i = 0; i < count; i++)
+    {
+        std::string msg;
+        ConfigCache::instance()->append(msg, ConfigCache::ObjectsSection, 2);
+        ConfigCache::instance()->append(msg, ConfigCache::RulesSection, 2);
+    }
+    double cached = Benchmark::now() - start;
+    std::cout << "  " << objects << " objects, " << rules << " rules (" << size << " bytes), " << count
+              << " reads: DOM " << dom << " s, cached " << cached << " s" << std::endl;
+    RuleServer::reset();
+    ObjectController::reset();
+}
@@ -1,9 +1,17 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "xmlserver.h"
+#include "objectcontroller.h"
+#include "services.h"
+#include "ruleserver.h"
+#include "configcache.h"
+#include "clock.h"
+#include "persistentstorage.h"
 extern "C"
 {
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <unistd.h>
 }
@@ -16,16 +24,35 @@ class XmlServerTest : public CppUnit::TestFixture
     CPPUNIT_TEST( testReadUnterminatedMessage );
     CPPUNIT_TEST( testReadMultipleMessage );
     CPPUNIT_TEST( testReadLongMessage );
+    CPPUNIT_TEST( testServerRequests );
+    CPPUNIT_TEST( testReadHistory );
+    CPPUNIT_TEST( testServerSplitAndPipelined );
+    CPPUNIT_TEST( testServerNotification );
+    CPPUNIT_TEST( testServerNotificationPattern );
+    CPPUNIT_TEST( testServerExecute );
+    CPPUNIT_TEST( testServerExecuteCancel );
+    CPPUNIT_TEST( testServerExecuteTimeout );
+    CPPUNIT_TEST( testServerReconfigure );
+    CPPUNIT_TEST( testNotifyCoalesce );
+    CPPUNIT_TEST( testNotifyDropOldest );
+    CPPUNIT_TEST( testNotifyDisconnect );
+    CPPUNIT_TEST( testTokenizer );
+    CPPUNIT_TEST( testFastPathMatchesDom );
+    CPPUNIT_TEST( testFastWriteAllOrNothing );
+    CPPUNIT_TEST( testDeltaRead );
+    CPPUNIT_TEST( testConfigCache );
 //    CPPUNIT_TEST(  );
     
     CPPUNIT_TEST_SUITE_END();
 
 private:
     ClientConnection* cc_m;
+    XmlServer* server_m;
 public:
     void setUp()
     {
         cc_m = 0; 
+        server_m = 0;
         if (system ("rm -rf /tmp/linknx_unittest_tmp") != 0)
         {
             CPPUNIT_FAIL("Test fixture setup failed.");
@@ -36,6 +63,10 @@ public:
     {
         if (cc_m)
             delete(cc_m);
+        if (server_m)
+            delete(server_m);
+        ObjectController::reset();
+        Clock::reset();
     }
 
     int createMsgFd(const char *msg)
@@ -49,49 +80,593 @@ public:
     
     void testReadEmptyMessage()
     {
-        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd(""));
-        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage());
     }
 
     void testReadMessage()
     {
-        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd("test\004"));
-        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage());
         CPPUNIT_ASSERT(cc_m->msg_m == "test");
-        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage());
     }
 
     void testReadUnterminatedMessage()
     {
-        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd("a message without ending ascii 0x04"));
-        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage());
     }
 
     void testReadMultipleMessage()
     {
-        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd("test\004second message\004"));
-        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage());
         CPPUNIT_ASSERT(cc_m->msg_m == "test");
-        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage());
         CPPUNIT_ASSERT(cc_m->msg_m == "second message");
-        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage());
     }
 
     void testReadLongMessage()
     {
         const char *msg = "first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 bytes long, first part must be at least 256 byte, and this is second part\004";
-        pth_event_t stop = pth_event(PTH_EVENT_TIME, pth_timeout(1,0));
         cc_m = new ClientConnection(NULL, createMsgFd(msg));
-        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(1, cc_m->readmessage());
         cc_m->msg_m.push_back('\004');
         CPPUNIT_ASSERT(cc_m->msg_m == msg);
-        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage(stop));
+        CPPUNIT_ASSERT_EQUAL(-1, cc_m->readmessage());
     }
 
+
+    void startServer(int maxQueued = 0, const std::string& overflow = "")
+    {
+        ticpp::Element pConfig("xmlserver");
+        pConfig.SetAttribute("type", "unix");
+        pConfig.SetAttribute("path", "/tmp/linknx_unittest_sock");
+        if (maxQueued)
+            pConfig.SetAttribute("notify-queue", maxQueued);
+        if (overflow != "")
+            pConfig.SetAttribute("notify-overflow", overflow);
+        server_m = XmlServer::create(&pConfig);
+
+        ticpp::Element pObject;
+        pObject.SetAttribute("id", "xml_sw");
+        pObject.SetAttribute("type", "1.001");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+        pObject.SetAttribute("id", "xml_num");
+        pObject.SetAttribute("type", "5.xxx");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+    }
+
+    // Registers listener for both objects, then writes all values in a
+    // single request so that the notifications pile up before the server
+    // loop can send them
+    void writeBurst(int listener, int writer, const char* values[], int count)
+    {
+        sendRaw(listener, "<admin><notification><register id='xml_num'/><register id='xml_sw'/></notification></admin>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='success'/>\n"), receive(listener));
+        std::string msg = "<write>";
+        for (int i = 0; i < count; i++)
+            msg += values[i];
+        msg += "</write>\004";
+        sendRaw(writer, msg);
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(writer));
+    }
+
+    std::string notification(const std::string& id, const std::string& value)
+    {
+        return "<notify id='" + id + "'>" + value + "</notify>\n";
+    }
+
+    int connectClient()
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_LOCAL;
+        strcpy(addr.sun_path, "/tmp/linknx_unittest_sock");
+        int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+        CPPUNIT_ASSERT(pth_connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+        return fd;
+    }
+
+    void sendRaw(int fd, const std::string& data)
+    {
+        CPPUNIT_ASSERT_EQUAL((ssize_t)data.size(), pth_write(fd, data.c_str(), data.size()));
+    }
+
+    // Reads the next message from the server, waiting at most 5s
+    std::string receive(int fd)
+    {
+        std::string msg;
+        char c;
+        pth_event_t timeout = pth_event(PTH_EVENT_TIME, pth_timeout(5, 0));
+        while (pth_read_ev(fd, &c, 1, timeout) == 1 && c != '\004')
+            msg.push_back(c);
+        pth_event_free(timeout, PTH_FREE_THIS);
+        return msg;
+    }
+
+    void testServerRequests()
+    {
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<write><object id='xml_sw' value='on'/></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(fd));
+        sendRaw(fd, "<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>on</read>\n"), receive(fd));
+        sendRaw(fd, "<read><object id='unknown'/></read>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        CPPUNIT_ASSERT_EQUAL(1, server_m->getConnectionCount());
+
+        close(fd);
+        for (int i = 0; i < 100 && server_m->getConnectionCount() > 0; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(0, server_m->getConnectionCount());
+    }
+
+    void testReadHistory()
+    {
+        startServer();
+        int fd = connectClient();
+        // No persistence configured
+        sendRaw(fd, "<read><history id='xml_num'/></read>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+#ifdef HAVE_SQLITE
+        CPPUNIT_ASSERT(system("rm -f /tmp/linknx_unittest_history.db*") != -1);
+        // Samples ahead of the wall time: the default end is the clock time
+        Clock::set(new VirtualClock(4102444800000LL));
+        ticpp::Element pSvcConfig("services");
+        ticpp::Element pPersistenceConfig("persistence");
+        pPersistenceConfig.SetAttribute("type", "sqlite");
+        pPersistenceConfig.SetAttribute("path", "/tmp/linknx_unittest_history.db");
+        pSvcConfig.LinkEndChild(&pPersistenceConfig);
+        Services::instance()->importXml(&pSvcConfig);
+        PersistentStorage* storage = Services::instance()->getPersistentStorage();
+        storage->writelog("xml_num", "12");
+        storage->flush();
+        storage->writelog("xml_num", "13");
+
+        sendRaw(fd, "<read><history id='xml_num' start='0'/></read>\004");
+        std::string reply = receive(fd);
+        CPPUNIT_ASSERT(reply.find("status=\"success\"") != std::string::npos);
+        std::string::size_type first = reply.find("value=\"12\"");
+        std::string::size_type second = reply.find("value=\"13\"");
+        CPPUNIT_ASSERT(first != std::string::npos);
+        CPPUNIT_ASSERT(second != std::string::npos);
+        CPPUNIT_ASSERT(first < second);
+
+        sendRaw(fd, "<read><history id='xml_num' limit='1'/></read>\004");
+        reply = receive(fd);
+        CPPUNIT_ASSERT(reply.find("value=\"12\"") != std::string::npos);
+        CPPUNIT_ASSERT(reply.find("value=\"13\"") == std::string::npos);
+        Services::reset();
+#endif
+        close(fd);
+    }
+
+    void testServerSplitAndPipelined()
+    {
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<read><object id=");
+        pth_usleep(20000);
+        sendRaw(fd, "'xml_sw'/></read>\004<write><object id='xml_sw' value='on'/></write>\004<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n"), receive(fd));
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(fd));
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>on</read>\n"), receive(fd));
+        close(fd);
+    }
+
+    void testServerNotification()
+    {
+        startServer();
+        int listener = connectClient();
+        int writer = connectClient();
+        sendRaw(listener, "<admin><notification><register id='xml_sw'/></notification></admin>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='success'/>\n"), receive(listener));
+        sendRaw(writer, "<write><object id='xml_sw' value='on'/></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(writer));
+        CPPUNIT_ASSERT_EQUAL(std::string("<notify id='xml_sw'>on</notify>\n"), receive(listener));
+        close(listener);
+        close(writer);
+    }
+
+    void testServerNotificationPattern()
+    {
+        startServer();
+        int listener = connectClient();
+        int writer = connectClient();
+        sendRaw(listener, "<admin><notification><register pattern='xml_*'/><register type='5.*'/></notification></admin>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='success'/>\n"), receive(listener));
+        sendRaw(writer, "<write><object id='xml_num' value='12'/></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(writer));
+        CPPUNIT_ASSERT_EQUAL(notification("xml_num", "12"), receive(listener));
+
+        sendRaw(listener, "<admin><notification><unregister pattern='xml_*'/></notification></admin>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='success'/>\n"), receive(listener));
+        sendRaw(writer, "<write><object id='xml_sw' value='on'/><object id='xml_num' value='13'/></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(writer));
+        CPPUNIT_ASSERT_EQUAL(notification("xml_num", "13"), receive(listener));
+
+        sendRaw(listener, "<admin><notification><register/></notification></admin>\004");
+        CPPUNIT_ASSERT(receive(listener).find("status='error'") != std::string::npos);
+        sendRaw(listener, "<admin><notification><register id='unknown'/></notification></admin>\004");
+        CPPUNIT_ASSERT(receive(listener).find("status='error'") != std::string::npos);
+        CPPUNIT_ASSERT_EQUAL(1, ObjectController::instance()->getSubscriptions()->getSubscriptionCount());
+
+        close(listener);
+        for (int i = 0; i < 100 && server_m->getConnectionCount() > 1; i++)
+            pth_usleep(10000);
+        CPPUNIT_ASSERT_EQUAL(0, ObjectController::instance()->getSubscriptions()->getSubscriptionCount());
+        close(writer);
+    }
+
+    void testServerExecute()
+    {
+        startServer();
+        int fd = connectClient();
+        int other = connectClient();
+        int64_t start = Clock::nowMs();
+        sendRaw(fd, "<execute><action type='set-value' id='xml_sw' value='on' delay='1'/></execute>\004<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='ongoing' id='1'/>\n"), receive(fd));
+        // The next requests are handled while the actions run
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n"), receive(fd));
+        sendRaw(other, "<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n"), receive(other));
+        // The completion is sent as soon as the action is done
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='success' id='1'/>\n"), receive(fd));
+        CPPUNIT_ASSERT(Clock::nowMs() - start < 1500);
+        sendRaw(fd, "<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>on</read>\n"), receive(fd));
+        close(fd);
+        close(other);
+    }
+
+    void testServerExecuteTimeout()
+    {
+        VirtualClock* clock = new VirtualClock(1350000000000LL);
+        Clock::set(clock);
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<execute timeout='60'><action type='set-value' id='xml_sw' value='on' delay='120'/></execute>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='ongoing' id='1'/>\n"), receive(fd));
+        // The timeout follows the clock, not the wall time
+        clock->advance(59000);
+        sendRaw(fd, "<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n"), receive(fd));
+        clock->advance(1000);
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='timeout' id='1'/>\n"), receive(fd));
+
+        // A request that would time out at once is rejected
+        sendRaw(fd, "<execute timeout='0'><action type='set-value' id='xml_num' value='5'/></execute>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        sendRaw(fd, "<execute timeout='-1'><action type='set-value' id='xml_num' value='5'/></execute>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        sendRaw(fd, "<read><object id='xml_num'/></read>\004");
+        CPPUNIT_ASSERT(receive(fd) != "<read status='success'>5</read>\n");
+        close(fd);
+    }
+
+    void testServerExecuteCancel()
+    {
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<execute><action type='set-value' id='xml_sw' value='on' delay='10'/></execute>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='ongoing' id='1'/>\n"), receive(fd));
+        sendRaw(fd, "<execute timeout='1'><action type='set-value' id='xml_num' value='5' delay='10'/></execute>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='ongoing' id='2'/>\n"), receive(fd));
+
+        sendRaw(fd, "<execute><cancel id='7'/></execute>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        sendRaw(fd, "<execute><cancel id='1'/></execute>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='success'/>\n"), receive(fd));
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='cancelled' id='1'/>\n"), receive(fd));
+        CPPUNIT_ASSERT_EQUAL(std::string("<execute status='timeout' id='2'/>\n"), receive(fd));
+        sendRaw(fd, "<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n"), receive(fd));
+
+        // Nothing is executed if an element is invalid
+        sendRaw(fd, "<execute><action type='set-value' id='xml_sw' value='on'/><unknown/></execute>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        pth_usleep(10000);
+        sendRaw(fd, "<read><object id='xml_sw'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<read status='success'>off</read>\n"), receive(fd));
+        close(fd);
+    }
+
+    void testServerReconfigure()
+    {
+        ticpp::Element pServices("services");
+        ticpp::Element pXmlServer("xmlserver");
+        pXmlServer.SetAttribute("type", "unix");
+        pXmlServer.SetAttribute("path", "/tmp/linknx_unittest_sock");
+        pServices.InsertEndChild(pXmlServer);
+        Services::instance()->importXml(&pServices);
+
+        // The client replaces the server it is connected to
+        int fd = connectClient();
+        sendRaw(fd, "<write><config><services><xmlserver type='unix' path='/tmp/linknx_unittest_sock'/></services></config></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(fd));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), receive(fd));
+        close(fd);
+
+        fd = connectClient();
+        sendRaw(fd, "<read><version/></read>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status=\"success\"") != std::string::npos);
+        close(fd);
+        Services::reset();
+    }
+
+    void testNotifyCoalesce()
+    {
+        startServer(4);
+        int listener = connectClient();
+        int writer = connectClient();
+        const char* values[] = {
+            "<object id='xml_num' value='1'/>", "<object id='xml_num' value='2'/>",
+            "<object id='xml_num' value='3'/>", "<object id='xml_num' value='4'/>",
+            "<object id='xml_num' value='5'/>", "<object id='xml_sw' value='on'/>" };
+        writeBurst(listener, writer, values, 6);
+
+        // The queue of 4 is reduced to the latest value when it overflows
+        CPPUNIT_ASSERT_EQUAL(notification("xml_num", "4"), receive(listener));
+        CPPUNIT_ASSERT_EQUAL(notification("xml_num", "5"), receive(listener));
+        CPPUNIT_ASSERT_EQUAL(notification("xml_sw", "on"), receive(listener));
+
+        sendRaw(writer, "<read><status><connections/></status></read>\004");
+        std::string status = receive(writer);
+        CPPUNIT_ASSERT(status.find("coalesced=\"3\"") != std::string::npos);
+        CPPUNIT_ASSERT(status.find("max-queued=\"4\"") != std::string::npos);
+        close(listener);
+        close(writer);
+    }
+
+    void testNotifyDropOldest()
+    {
+        startServer(2, "drop-oldest");
+        ticpp::Element pExport("xmlserver");
+        server_m->exportXml(&pExport);
+        CPPUNIT_ASSERT_EQUAL(std::string("drop-oldest"), pExport.GetAttribute("notify-overflow"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), pExport.GetAttribute("notify-queue"));
+
+        int listener = connectClient();
+        int writer = connectClient();
+        const char* values[] = {
+            "<object id='xml_num' value='1'/>", "<object id='xml_num' value='2'/>",
+            "<object id='xml_num' value='3'/>" };
+        writeBurst(listener, writer, values, 3);
+        CPPUNIT_ASSERT_EQUAL(notification("xml_num", "2"), receive(listener));
+        CPPUNIT_ASSERT_EQUAL(notification("xml_num", "3"), receive(listener));
+
+        sendRaw(writer, "<read><status><connections/></status></read>\004");
+        CPPUNIT_ASSERT(receive(writer).find("dropped=\"1\"") != std::string::npos);
+        close(listener);
+        close(writer);
+    }
+
+    void testNotifyDisconnect()
+    {
+        startServer(2, "disconnect");
+        int listener = connectClient();
+        int writer = connectClient();
+        const char* values[] = {
+            "<object id='xml_num' value='1'/>", "<object id='xml_num' value='2'/>",
+            "<object id='xml_num' value='3'/>" };
+        writeBurst(listener, writer, values, 3);
+        CPPUNIT_ASSERT_EQUAL(std::string(""), receive(listener));
+        CPPUNIT_ASSERT_EQUAL(1, server_m->getConnectionCount());
+        close(listener);
+        close(writer);
+    }
+
+    void testTokenizer()
+    {
+        XmlTokenizer::Slice value;
+        std::string msg = " <write>\n\t<object id='a' value=\"1 '2'\"/><object  id = 'b' value=''></object></write> ";
+        XmlTokenizer tokenizer(msg);
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::StartTag, tokenizer.next());
+        CPPUNIT_ASSERT(tokenizer.getName() == "write");
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::StartTag, tokenizer.next());
+        CPPUNIT_ASSERT(tokenizer.getName() == "object");
+        CPPUNIT_ASSERT_EQUAL(2, tokenizer.getAttributeCount());
+        CPPUNIT_ASSERT(tokenizer.getAttribute("value", &value));
+        CPPUNIT_ASSERT_EQUAL(std::string("1 '2'"), value.str());
+        CPPUNIT_ASSERT(!tokenizer.getAttribute("other", &value));
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::EndTag, tokenizer.next());
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::StartTag, tokenizer.next());
+        CPPUNIT_ASSERT(tokenizer.getAttribute("id", &value));
+        CPPUNIT_ASSERT_EQUAL(std::string("b"), value.str());
+        CPPUNIT_ASSERT(tokenizer.getAttribute("value", &value));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), value.str());
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::EndTag, tokenizer.next());
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::EndTag, tokenizer.next());
+        CPPUNIT_ASSERT(tokenizer.getName() == "write");
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::End, tokenizer.next());
+
+        const char* unsupported[] = {
+            "<?xml version='1.0'?><read/>", "<!-- c --><read/>", "<read><object id='&amp;'/></read>",
+            "<read></write>", "<read>", "<read id=a/>", "<read id='a/>", "<read>\r\n</read>" };
+        for (unsigned i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+        {
+            msg = unsupported[i];
+            XmlTokenizer bad(msg);
+            XmlTokenizer::Token token;
+            while ((token = bad.next()) == XmlTokenizer::StartTag || token == XmlTokenizer::EndTag)
+                ;
+            CPPUNIT_ASSERT_EQUAL_MESSAGE(unsupported[i], XmlTokenizer::Unsupported, token);
+        }
+        msg = "<read>text</read>";
+        XmlTokenizer text(msg);
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::StartTag, text.next());
+        CPPUNIT_ASSERT_EQUAL(XmlTokenizer::Text, text.next());
+    }
+
+    void testFastPathMatchesDom()
+    {
+        startServer();
+        ticpp::Element pObject;
+        pObject.SetAttribute("id", "xml_str");
+        pObject.SetAttribute("type", "28.001");
+        ObjectController::instance()->addObject(Object::create(&pObject));
+        ObjectController::instance()->getObject("xml_str")->setValue("a<b>&\"c'\td&#x41;");
+        ObjectController::instance()->getObject("xml_str")->decRefCount();
+
+        // A CR makes the server use the DOM path
+        const char* requests[] = {
+            "<read><object id='xml_sw'/></read>",
+            "<read><objects><object id='xml_num'/><object id=\"xml_str\"/></objects></read>",
+            "<read><objects/></read>",
+            "<read><objects><object id='unknown'/></objects></read>",
+            "<read><objects since='0'/></read>",
+            "<read><objects since='3'/></read>",
+            "<read><objects since='4'/></read>",
+            "<read><objects since='x'/></read>",
+            "<read><objects since='3' epoch='1'/></read>",
+            "<read><objects epoch='1' since='3'/></read>",
+            "<write><object id='xml_num' value='42'/><object id='xml_sw' value='on'/></write>",
+            "<write><object id='unknown' value='1'/></write>",
+            "<write><object id='xml_num' value='not a number'/></write>" };
+        int fd = connectClient();
+        for (unsigned i = 0; i < sizeof(requests) / sizeof(requests[0]); i++)
+        {
+            sendRaw(fd, std::string(requests[i]) + "\004");
+            std::string fast = receive(fd);
+            sendRaw(fd, std::string("\r\n") + requests[i] + "\004");
+            std::string dom = receive(fd);
+            CPPUNIT_ASSERT_EQUAL_MESSAGE(requests[i], dom, fast);
+        }
+        close(fd);
+    }
+
+    void testFastWriteAllOrNothing()
+    {
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<write><object id='xml_num' value='7'/><object id='xml_sw' value='bogus'/></write>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        sendRaw(fd, "<write><object id='xml_num' value='8'/><object id='unknown' value='1'/></write>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+        close(fd);
+
+        Object* obj = ObjectController::instance()->getObject("xml_num");
+        CPPUNIT_ASSERT(obj->getValue() != "7");
+        CPPUNIT_ASSERT(obj->getValue() != "8");
+        obj->decRefCount();
+    }
+
+    // Reply of <read><config/> built through the DOM like before the cache
+    std::string readConfigDom()
+    {
+        ticpp::Document doc;
+        ticpp::Element pRead("read");
+        pRead.SetAttribute("status", "success");
+        ticpp::Element pConfig("config");
+        ticpp::Element objects("objects");
+        ObjectController::instance()->exportXml(&objects);
+        pConfig.LinkEndChild(&objects);
+        ticpp::Element rules("rules");
+        RuleServer::instance()->exportXml(&rules);
+        pConfig.LinkEndChild(&rules);
+        ticpp::Element services("services");
+        Services::instance()->exportXml(&services);
+        pConfig.LinkEndChild(&services);
+        ticpp::Element logging("logging");
+        Logging::instance()->exportXml(&logging);
+        pConfig.LinkEndChild(&logging);
+        pRead.LinkEndChild(&pConfig);
+        doc.LinkEndChild(&pRead);
+        return doc.GetAsString();
+    }
+
+    void testConfigCache()
+    {
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<write><config><rules><rule id='r1'><condition type='object' id='xml_sw' value='on'/>"
+                    "<actionlist><action type='send-email' to='a@b.c' subject='s'><![CDATA[line 1\n  line 2\n]]></action>"
+                    "</actionlist></rule></rules></config></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(fd));
+
+        sendRaw(fd, "<read><config/></read>\004");
+        CPPUNIT_ASSERT_EQUAL(readConfigDom(), receive(fd));
+        ConfigCache* cache = ConfigCache::instance();
+        CPPUNIT_ASSERT(cache->isValid(ConfigCache::ObjectsSection));
+        CPPUNIT_ASSERT(cache->isValid(ConfigCache::RulesSection));
+
+        // Importing a section invalidates only that section
+        sendRaw(fd, "<write><config><objects><object id='xml_new' type='1.001' gad='1/1/1'/></objects></config></write>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<write status='success'/>\n"), receive(fd));
+        CPPUNIT_ASSERT(!cache->isValid(ConfigCache::ObjectsSection));
+        CPPUNIT_ASSERT(cache->isValid(ConfigCache::RulesSection));
+        sendRaw(fd, "<read><config/></read>\004");
+        std::string reply = receive(fd);
+        CPPUNIT_ASSERT_EQUAL(readConfigDom(), reply);
+        CPPUNIT_ASSERT(reply.find("xml_new") != std::string::npos);
+
+        RuleServer::instance()->getRule("r1")->setActive(false);
+        CPPUNIT_ASSERT(!cache->isValid(ConfigCache::RulesSection));
+        sendRaw(fd, "<read><config><rules/></config></read>\004");
+        reply = receive(fd);
+        CPPUNIT_ASSERT(reply.find("active=\"no\"") != std::string::npos);
+        CPPUNIT_ASSERT(reply.find("xml_new") == std::string::npos);
+        sendRaw(fd, "<read><config><unknown/></config></read>\004");
+        CPPUNIT_ASSERT(receive(fd).find("status='error'") != std::string::npos);
+
+        // The saved file holds the same config
+        unlink("/tmp/linknx_unittest_config.xml");
+        sendRaw(fd, "<admin><save file='/tmp/linknx_unittest_config.xml'/></admin>\004");
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='ongoing' id='1'/>\n"), receive(fd));
+        CPPUNIT_ASSERT_EQUAL(std::string("<admin status='success' id='1'/>\n"), receive(fd));
+        ticpp::Document saved;
+        saved.LoadFile("/tmp/linknx_unittest_config.xml");
+        ticpp::Element* pSaved = saved.FirstChildElement("config");
+        ticpp::Element* pRules = pSaved->FirstChildElement("rules");
+        ticpp::Element* pAction = pRules->FirstChildElement("rule")->FirstChildElement("actionlist")->FirstChildElement("action");
+        CPPUNIT_ASSERT_EQUAL(std::string("line 1\n  line 2\n"), pAction->GetText());
+        CPPUNIT_ASSERT_EQUAL(std::string("no"), pRules->FirstChildElement("rule")->GetAttribute("active"));
+        CPPUNIT_ASSERT(pSaved->FirstChildElement("objects")->FirstChildElement("object")->GetAttribute("id") == "xml_new");
+        unlink("/tmp/linknx_unittest_config.xml");
+
+        close(fd);
+        RuleServer::reset();
+    }
+
+    void testDeltaRead()
+    {
+        startServer();
+        int fd = connectClient();
+        sendRaw(fd, "<read><objects since='0'/></read>\004");
+        std::string reply = receive(fd);
+        CPPUNIT_ASSERT(reply.find("seq=\"2\"") != std::string::npos);
+        CPPUNIT_ASSERT(reply.find("xml_sw") != std::string::npos);
+        CPPUNIT_ASSERT(reply.find("xml_num") != std::string::npos);
+
+        sendRaw(fd, "<write><object id='xml_num' value='7'/></write>\004");
+        receive(fd);
+        std::stringstream epoch;
+        epoch << ObjectController::instance()->getEpoch();
+        sendRaw(fd, "<read><objects since='2'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL("<read status=\"success\">\n\t<objects since=\"2\" seq=\"3\" epoch=\"" + epoch.str() + "\">\n"
+                             "\t\t<object id=\"xml_num\" value=\"7\" />\n\t</objects>\n</read>\n", receive(fd));
+        sendRaw(fd, "<read><objects since='3' epoch='" + epoch.str() + "'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL("<read status=\"success\">\n\t<objects since=\"3\" seq=\"3\" epoch=\"" + epoch.str() + "\" />\n</read>\n", receive(fd));
+
+        // Deleted objects are reported until the client catches up
+        sendRaw(fd, "<write><config><objects><object id='xml_num' delete='true'/></objects></config></write>\004");
+        receive(fd);
+        sendRaw(fd, "<read><objects since='3' epoch='" + epoch.str() + "'/></read>\004");
+        CPPUNIT_ASSERT_EQUAL("<read status=\"success\">\n\t<objects since=\"3\" seq=\"4\" epoch=\"" + epoch.str() + "\">\n"
+                             "\t\t<object id=\"xml_num\" deleted=\"true\" />\n\t</objects>\n</read>\n", receive(fd));
+
+        // A sequence number of a previous run gets everything again
+        sendRaw(fd, "<read><objects since='3' epoch='1'/></read>\004");
+        reply = receive(fd);
+        CPPUNIT_ASSERT(reply.find("full=\"true\"") != std::string::npos);
+        CPPUNIT_ASSERT(reply.find("xml_sw") != std::string::npos);
+        CPPUNIT_ASSERT(reply.find("deleted") == std::string::npos);
+        close(fd);
+    }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION( XmlServerTest );
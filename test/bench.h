@@ -0,0 +1,63 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sys/time.h>
+
+/*
+ * Minimal benchmark registry for benchmain (`make bench` in test/).
+ * Benchmarks are free functions registered with BENCHMARK(name) and
+ * print their own results on std::cout.
+ */
+class Benchmark
+{
+public:
+    typedef void (*BenchFunc_t)();
+
+    Benchmark(const char* name, BenchFunc_t func)
+    {
+        getList().push_back(Entry(name, func));
+    };
+
+    // Runs all benchmarks whose name contains filter (all if filter is empty)
+    static int runAll(const std::string& filter)
+    {
+        int count = 0;
+        std::vector<Entry>& list = getList();
+        for (std::vector<Entry>::iterator it = list.begin(); it != list.end(); it++)
+        {
+            if (filter != "" && it->first.find(filter) == std::string::npos)
+                continue;
+            std::cout << "== " << it->first << std::endl;
+            double start = now();
+            it->second();
+            std::cout << "== " << it->first << " done in " << (now() - start) << " s" << std::endl << std::endl;
+            count++;
+        }
+        return count;
+    };
+
+    static double now()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return tv.tv_sec + tv.tv_usec / 1000000.0;
+    };
+
+private:
+    typedef std::pair<std::string, BenchFunc_t> Entry;
+    static std::vector<Entry>& getList()
+    {
+        static std::vector<Entry> list;
+        return list;
+    };
+};
+
+#define BENCHMARK(name) \
+    static void name(); \
+    static Benchmark name##_bench(#name, &name); \
+    static void name()
+
+#endif
@@ -0,0 +1,22 @@
+#include <pthsem.h>
+#include "bench.h"
+#include <logger.h>
+
+int main( int argc, char **argv)
+{
+  pth_init();
+  // Keep the daemon quiet, benchmarks are about to create thousands of objects and rules
+  ticpp::Element logging("logging");
+  logging.SetAttribute("level", "ERROR");
+  Logging::instance()->importXml(&logging);
+  try
+  {
+    int count = Benchmark::runAll(argc > 1 ? argv[1] : "");
+    return count > 0 ? 0 : -1;
+  }
+  catch (ticpp::Exception& ex)
+  {
+    std::cerr << "Benchmark failed: " << ex.m_details << std::endl;
+    return -1;
+  }
+}